@@ -91,6 +91,8 @@ static struct opts {
     int o_fastcgi;
     int o_ignore_arguments;
     int o_local;
+    int o_mixer_binary;
+    int o_mixer_socket;
     int o_no_randomize;
     int o_no_tty;
     int o_output_format;
@@ -123,6 +125,8 @@ static struct option long_opts[] = {
     { "local", no_argument, &opts.o_local, 1 },
     { "junoscript", no_argument, NULL, 'J' },
     { "mixer", required_argument, NULL, 'M' },
+    { "mixer-binary", no_argument, &opts.o_mixer_binary, 1 },
+    { "mixer-socket", required_argument, &opts.o_mixer_socket, 1 },
     { "no-randomize", no_argument, &opts.o_no_randomize, 1 },
     { "no-tty", no_argument, &opts.o_no_tty, 1 },
     { "op", no_argument, NULL, 'O' },
@@ -1794,6 +1798,8 @@ print_help (void)
 "\t--load OR -l: load commit script changes in test mode\n"
 "\t--lib <dir> OR -L <dir>: search directory for extension libraries\n"
 "\t--mixer OR -M: use mixer connection (if available)\n"
+"\t--mixer-binary: use compact binary headers with the mixer\n"
+"\t--mixer-socket <path>: talk to a running mixer server (\"mixer --server\") over its socket\n"
 "\t--no-randomize: do not initialize the random number generator\n"
 "\t--param <name> <value> OR -a <name> <value>: pass parameters\n"
 "\t--protocol <name> OR -P <name>: use the given API protocol\n"
@@ -2044,6 +2050,12 @@ main (int argc UNUSED, char **argv, char **envp)
 		} else if (opts.o_local) {
 		    opt_local = TRUE;
 
+		} else if (opts.o_mixer_binary) {
+		    jsio_flags |= JSIO_MIXER_BINARY;
+
+		} else if (opts.o_mixer_socket) {
+		    jsio_set_mixer_socket(check_arg("mixer socket"));
+
 		} else if (opts.o_no_randomize) {
 		    randomize = 0;
 
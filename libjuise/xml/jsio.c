@@ -78,6 +78,11 @@ static patroot js_session_root;
 static char *js_default_server;
 static char *js_default_user;
 static char *js_mixer;
+static char *js_mixer_socket;	/* Mixer server's socket, to talk to directly */
+static int js_mixer_sock = -1;	/* Our connection to it, shared by sessions */
+static unsigned js_mixer_users;	/* Number of sessions sharing js_mixer_sock */
+static unsigned long js_mixer_last_muxid; /* Last muxid handed out */
+static js_mx_buffer_t *js_mixer_rbuf; /* Input not yet sorted to sessions */
 static session_type_t js_default_stype = ST_JUNOSCRIPT;
 static int js_auth_muxer_id;
 static int js_auth_websocket_id;
@@ -104,6 +109,38 @@ typedef struct mx_header_s {
     char mh_trailer[];
 } mx_header_t;
 
+/*
+ * Version 2 headers are binary; numbers are in network byte order.
+ * Attributes (NUL-terminated) follow the header, then the payload.
+ */
+typedef struct mx_header2_s {
+    char mh2_pound;		/* Leader: pound sign */
+    char mh2_version[2];	/* MX_HEADER_VERSION (2) */
+    unsigned char mh2_op;	/* Operation code (MX_OPC_*) */
+    unsigned char mh2_len[4];	/* Total data length (including header) */
+    unsigned char mh2_muxid[4];	/* Muxer ID */
+    unsigned char mh2_reqid[4];	/* Request ID (or zero) */
+    unsigned char mh2_flags[2];	/* Flags */
+    unsigned char mh2_alen[2];	/* Length of attributes (including NUL) */
+} mx_header2_t;
+
+static const char *js_mixer_opnames[MX_OPC_MAX] = {
+    [MX_OPC_COMPLETE] = MX_OP_COMPLETE,
+    [MX_OPC_ERROR] = MX_OP_ERROR,
+    [MX_OPC_REPLY] = MX_OP_REPLY,
+    [MX_OPC_RPC] = MX_OP_RPC,
+};
+
+/*
+ * What we learn from a mixer header, in either version
+ */
+typedef struct js_mixer_header_info_s {
+    unsigned long jmh_len;	/* Total length (including header) */
+    unsigned long jmh_hlen;	/* Length of header and attributes */
+    unsigned long jmh_muxid;	/* Muxer ID */
+    char jmh_operation[sizeof(((mx_header_t *) 0)->mh_operation) + 1];
+} js_mixer_header_info_t;
+
 static unsigned long
 strntoul (const char *buf, size_t bufsiz)
 {
@@ -267,6 +304,100 @@ js_mixer_header_build (mx_header_t *mhp, int len, const char *operation,
     js_mixer_header_format_int(mhp->mh_muxid, sizeof(mhp->mh_muxid), muxid);
 }
 
+static unsigned long
+js_mixer_get32 (const unsigned char *cp)
+{
+    return ((unsigned long) cp[0] << 24) | (cp[1] << 16) | (cp[2] << 8) | cp[3];
+}
+
+static void
+js_mixer_put32 (unsigned char *cp, unsigned long value)
+{
+    cp[0] = value >> 24;
+    cp[1] = value >> 16;
+    cp[2] = value >> 8;
+    cp[3] = value;
+}
+
+static void
+js_mixer_header2_build (mx_header2_t *mh2p, int len, const char *operation,
+	unsigned muxid, int alen)
+{
+    unsigned op;
+
+    for (op = 1; op < MX_OPC_MAX; op++) {
+	if (js_mixer_opnames[op] && streq(js_mixer_opnames[op], operation)) {
+	    break;
+	}
+    }
+
+    memset(mh2p, 0, sizeof(*mh2p));
+    mh2p->mh2_pound = '#';
+    mh2p->mh2_version[0] = MX_HEADER_VERSION_0;
+    mh2p->mh2_version[1] = MX_HEADER_VERSION_2;
+    mh2p->mh2_op = (op < MX_OPC_MAX) ? op : 0;
+    js_mixer_put32(mh2p->mh2_len, len);
+    js_mixer_put32(mh2p->mh2_muxid, muxid);
+    mh2p->mh2_alen[0] = alen >> 8;
+    mh2p->mh2_alen[1] = alen;
+}
+
+/*
+ * A session on the shared mixer socket uses its own muxid, so its
+ * replies can be told from those of other sessions.
+ */
+static unsigned long
+js_mixer_muxid (js_session_t *jsp)
+{
+    return jsp->js_muxid ?: (unsigned long) js_auth_muxer_id;
+}
+
+/*
+ * Write a whole message, since a partial one would garble the
+ * framing for every session sharing the socket.
+ */
+static int
+js_mixer_write (js_session_t *jsp, const char *buf, int len)
+{
+    int rc;
+
+    while (len > 0) {
+	rc = write(jsp->js_stdout, buf, len);
+	if (rc < 0) {
+	    if (errno == EINTR)
+		continue;
+	    jsio_trace("write to mixer failed: %m");
+	    return FALSE;
+	}
+
+	buf += rc;
+	len -= rc;
+    }
+
+    return TRUE;
+}
+
+/*
+ * Send a version 2 message; the attributes carry their NUL with them
+ */
+static int
+js_mixer_send_binary (js_session_t *jsp, const char *opname, const char *attrs,
+	const char *data)
+{
+    int dlen = strlen(data);
+    int hlen = sizeof(mx_header2_t);
+    int alen = *attrs ? strlen(attrs) + 1 : 0;
+    int len = hlen + alen + dlen;
+    char buf[len + 1];
+
+    js_mixer_header2_build((mx_header2_t *) buf, len, opname,
+	    js_mixer_muxid(jsp), alen);
+    memcpy(buf + hlen, attrs, alen);
+    memcpy(buf + hlen + alen, data, dlen + 1);
+
+    return js_mixer_write(jsp, buf, len);
+}
+
 static int
 js_mixer_send_simple (js_session_t *jsp, const char *opname, const char *attrs,
 	const char *data)
@@ -284,8 +415,11 @@ js_mixer_send_simple (js_session_t *jsp, const char *opname, const char *attrs,
     if (opname == NULL || attrs == NULL || data == NULL)
         return -1;
 
+    if (jsio_flags & JSIO_MIXER_BINARY)
+	return js_mixer_send_binary(jsp, opname, attrs, data);
+
     mx_header_t *mhp = (mx_header_t *) buf;
-    js_mixer_header_build(mhp, len, opname, js_auth_muxer_id);
+    js_mixer_header_build(mhp, len, opname, js_mixer_muxid(jsp));
 
     if (attrs) {
 	memcpy(buf + hlen, attrs, alen);
@@ -294,7 +428,7 @@ js_mixer_send_simple (js_session_t *jsp, const char *opname, const char *attrs,
     buf[hlen + alen] = '\n';
     memcpy(buf + hlen + alen + 1, data, dlen + 1);
 
-    return write(jsp->js_stdout, buf, len) > 0;
+    return js_mixer_write(jsp, buf, len);
 }
 
 static void
@@ -547,31 +681,65 @@ js_buffer_find_reset (js_session_t *jsp, char *bp, int blen)
 }
 
 /*
- * This function assumes that the buffer is populated with at least one
- * completely framed mixer message.  Decode the first one and bubble it back
- * to libxml.
+ * Parse the mixer header at the front of the buffer, in either
+ * version.  Returns 1 if we have the whole header, 0 if we need more
+ * data, and -1 if it's garbage.
  */
 static int
-js_mixer_message_parse (js_session_t *jsp, char *buf, int bufsiz)
+js_mixer_header_parse (js_mx_buffer_t *jmbp, js_mixer_header_info_t *jmhp)
 {
-    mx_header_t *mhp;
-    js_mx_buffer_t *jmbp = jsp->js_mx_buffer;
     char *cp = jmbp->jmb_data + jmbp->jmb_start;
-    char *ep = jmbp->jmb_data + jmbp->jmb_start + jmbp->jmb_len;
+    char *ep = cp + jmbp->jmb_len;
+
+    memset(jmhp, 0, sizeof(*jmhp));
+
+    if (jmbp->jmb_len < sizeof(mx_header2_t)) {	/* The shorter one */
+	return 0;
+    }
 
-    mhp = (mx_header_t *) cp;
+    if (cp[0] != '#' || cp[1] != MX_HEADER_VERSION_0) {
+	return -1;
+    }
 
-    if (mhp->mh_pound != '#' || mhp->mh_version[0] != MX_HEADER_VERSION_0
-	    || mhp->mh_version[1] != MX_HEADER_VERSION_1
-	    || mhp->mh_dot1 != '.' || mhp->mh_dot2 != '.'
+    if (cp[2] == MX_HEADER_VERSION_2) {
+	mx_header2_t *mh2p = (mx_header2_t *) cp;
+
+	jmhp->jmh_len = js_mixer_get32(mh2p->mh2_len);
+	jmhp->jmh_muxid = js_mixer_get32(mh2p->mh2_muxid);
+	jmhp->jmh_hlen = sizeof(*mh2p)
+	    + ((mh2p->mh2_alen[0] << 8) | mh2p->mh2_alen[1]);
+	if (mh2p->mh2_op < MX_OPC_MAX && js_mixer_opnames[mh2p->mh2_op]) {
+	    strncpy(jmhp->jmh_operation, js_mixer_opnames[mh2p->mh2_op],
+		    sizeof(jmhp->jmh_operation) - 1);
+	}
+
+	if (jmhp->jmh_hlen > jmhp->jmh_len) {
+	    return -1;
+	}
+
+	return (jmbp->jmb_len >= jmhp->jmh_hlen) ? 1 : 0;
+    }
+
+    mx_header_t *mhp = (mx_header_t *) cp;
+
+    if (cp[2] != MX_HEADER_VERSION_1) {
+	return -1;
+    }
+
+    if (jmbp->jmb_len <= sizeof(*mhp)) {
+	return 0;
+    }
+
+    if (mhp->mh_dot1 != '.' || mhp->mh_dot2 != '.'
 	    || mhp->mh_dot3 != '.' || mhp->mh_dot4 != '.') {
-	jsio_trace("mixer parse request fails (%c)", *cp);
-	goto fatal;
+	return -1;
     }
 
-    unsigned long len = strntoul(mhp->mh_len, sizeof(mhp->mh_len));
-    unsigned long muxid = strntoul(mhp->mh_muxid, sizeof(mhp->mh_muxid));
-    char *operation = mhp->mh_operation;
+    jmhp->jmh_len = strntoul(mhp->mh_len, sizeof(mhp->mh_len));
+    jmhp->jmh_muxid = strntoul(mhp->mh_muxid, sizeof(mhp->mh_muxid));
+
+    char *operation = jmhp->jmh_operation;
+    memcpy(operation, mhp->mh_operation, sizeof(mhp->mh_operation));
     for (cp = operation + sizeof(mhp->mh_operation) - 1;
 	    cp >= operation; cp--) {
 	if (*cp != ' ') {
@@ -580,29 +748,55 @@ js_mixer_message_parse (js_session_t *jsp, char *buf, int bufsiz)
     }
     *++cp = '\0';
 
-    if (jmbp->jmb_len < len) {
-	goto fatal;
-    }
-
-    cp = mhp->mh_trailer;
-    for (; cp < ep; cp++) {
+    for (cp = mhp->mh_trailer; cp < ep; cp++) {
 	if (*cp == '\n') {
 	    break;
 	}
     }
     if (cp >= ep) {
+	return 0;
+    }
+
+    jmhp->jmh_hlen = cp + 1 - (char *) mhp;
+    if (jmhp->jmh_hlen > jmhp->jmh_len) {
+	return -1;
+    }
+
+    return 1;
+}
+
+/*
+ * This function assumes that the buffer is populated with at least one
+ * completely framed mixer message.  Decode the first one and bubble it back
+ * to libxml.
+ */
+static int
+js_mixer_message_parse (js_session_t *jsp, char *buf, int bufsiz)
+{
+    js_mixer_header_info_t jmh;
+    js_mx_buffer_t *jmbp = jsp->js_mx_buffer;
+
+    if (js_mixer_header_parse(jmbp, &jmh) <= 0) {
+	jsio_trace("mixer parse request fails (%c)",
+		jmbp->jmb_data[jmbp->jmb_start]);
+	goto fatal;
+    }
+
+    unsigned long len = jmh.jmh_len;
+    unsigned long muxid = jmh.jmh_muxid;
+    char *operation = jmh.jmh_operation;
+
+    if (jmbp->jmb_len < len) {
 	goto fatal;
     }
-    *cp++ = '\0';		/* Skip over '\n' */
 
     /*
      * Mark the header data as consumed.  The rest of the payload
      * may be used during the request.
      */
-    int delta = cp - (jmbp->jmb_data + jmbp->jmb_start);
-    jmbp->jmb_start += delta; 
-    jmbp->jmb_len -= delta;
-    len -= delta;
+    jmbp->jmb_start += jmh.jmh_hlen;
+    jmbp->jmb_len -= jmh.jmh_hlen;
+    len -= jmh.jmh_hlen;
 
     size_t sent_size = 0;
     if (len > (unsigned long)bufsiz) {
@@ -650,6 +844,135 @@ fatal:
     return -1;
 }
 
+/*
+ * Make room for "want" more bytes at the end of a buffer, growing it
+ * if needed.  The buffer may move, so we're given a pointer to it.
+ */
+static int
+js_mx_buffer_fit (js_mx_buffer_t **jmbpp, unsigned long want)
+{
+    js_mx_buffer_t *jmbp = *jmbpp;
+    unsigned long size;
+
+    if (jmbp->jmb_start + jmbp->jmb_len + want <= jmbp->jmb_size)
+	return 0;
+
+    if (jmbp->jmb_start) {
+	memmove(jmbp->jmb_data, jmbp->jmb_data + jmbp->jmb_start,
+		jmbp->jmb_len);
+	jmbp->jmb_start = 0;
+	if (jmbp->jmb_len + want <= jmbp->jmb_size)
+	    return 0;
+    }
+
+    size = MAX(jmbp->jmb_size * 2, jmbp->jmb_len + want);
+    jmbp = realloc(jmbp, sizeof(*jmbp) + size);
+    if (jmbp == NULL) {
+	jsio_trace("could not grow mixer buffer to %lu bytes", size);
+	return -1;
+    }
+
+    jmbp->jmb_size = size;
+    *jmbpp = jmbp;
+
+    return 0;
+}
+
+/*
+ * Find the session using a muxid on the shared mixer socket
+ */
+static js_session_t *
+js_mixer_session_find (unsigned long muxid)
+{
+    patnode_t *pnp = NULL;
+    js_session_t *jsp;
+
+    while ((pnp = patricia_find_next(&js_session_root, pnp)) != NULL) {
+	jsp = (js_session_t *) pnp;
+	if (jsp->js_muxid && jsp->js_muxid == muxid)
+	    return jsp;
+    }
+
+    return NULL;
+}
+
+/*
+ * Sessions opened with jsio_set_mixer_socket share one connection to
+ * the mixer.  When a session needs input, we read from that
+ * connection and hand each whole message to the session whose muxid
+ * it carries, until one arrives for this session.  Messages for other
+ * sessions wait in their buffers until they ask.  Returns 1 when the
+ * session has a message, 0 on EOF, and -1 on error.
+ */
+static int
+js_mixer_demux (js_session_t *jsp)
+{
+    js_mixer_header_info_t jmh;
+    js_mx_buffer_t *jmbp;
+    js_session_t *owner;
+    int rc, found = FALSE;
+
+    for (;;) {
+	jmbp = js_mixer_rbuf;
+
+	while ((rc = js_mixer_header_parse(jmbp, &jmh)) > 0
+	       && jmbp->jmb_len >= jmh.jmh_len) {
+	    owner = js_mixer_session_find(jmh.jmh_muxid);
+	    if (owner == NULL) {
+		jsio_trace("mixer message for unknown muxid %lu dropped",
+			   jmh.jmh_muxid);
+	    } else {
+		if (owner->js_mx_buffer == NULL)
+		    owner->js_mx_buffer = js_mx_buffer_create();
+		if (owner->js_mx_buffer == NULL
+		        || js_mx_buffer_fit(&owner->js_mx_buffer, jmh.jmh_len))
+		    return -1;
+
+		js_mx_buffer_t *obp = owner->js_mx_buffer;
+		memcpy(obp->jmb_data + obp->jmb_start + obp->jmb_len,
+		       jmbp->jmb_data + jmbp->jmb_start, jmh.jmh_len);
+		obp->jmb_len += jmh.jmh_len;
+
+		if (owner == jsp)
+		    found = TRUE;
+	    }
+
+	    jmbp->jmb_start += jmh.jmh_len;
+	    jmbp->jmb_len -= jmh.jmh_len;
+	}
+
+	if (rc < 0) {
+	    jsio_trace("mixer parse request failed");
+	    return -1;
+	}
+
+	if (jmbp->jmb_len == 0)
+	    jmbp->jmb_start = 0;
+
+	if (found)
+	    return 1;
+
+	if (js_mx_buffer_fit(&js_mixer_rbuf, BUFSIZ))
+	    return -1;
+	jmbp = js_mixer_rbuf;
+
+	int recvlen = recv(js_mixer_sock,
+		jmbp->jmb_data + jmbp->jmb_start + jmbp->jmb_len,
+		jmbp->jmb_size - (jmbp->jmb_start + jmbp->jmb_len), 0);
+	if (recvlen < 0) {
+	    if (errno == EINTR)
+		continue;
+	    jsio_trace("reading from mixer failed");
+	    return -1;
+	} else if (recvlen == 0) {
+	    jsio_trace("unexpected disconnect from mixer");
+	    return 0;
+	}
+
+	jmbp->jmb_len += recvlen;
+    }
+}
+
 /*
  * The data from mixer is framed using our own rolled framing protocol.  We
  * need to read a single message from mixer, de-framize it, and then pass it
@@ -663,7 +986,7 @@ js_mixer_read (void *context, char *buf, int bufsiz)
     js_session_t *jsp = context;
     js_mx_buffer_t *jmbp = jsp->js_mx_buffer;
     int size_to_read = jmbp->jmb_size - (jmbp->jmb_start + jmbp->jmb_len);
-    mx_header_t *mhp = (mx_header_t *)(jmbp->jmb_data + jmbp->jmb_start);
+    js_mixer_header_info_t jmh;
     js_boolean_t need_more = FALSE;
 
     /*
@@ -698,28 +1021,29 @@ js_mixer_read (void *context, char *buf, int bufsiz)
     if (jmbp->jmb_len == 0) {
 	need_more = TRUE;
     } else {
-	if (jmbp->jmb_len < sizeof(*mhp)) {
-	    need_more = TRUE;
-	} else if (mhp->mh_pound != '#' || mhp->mh_version[0] != MX_HEADER_VERSION_0
-		|| mhp->mh_version[1] != MX_HEADER_VERSION_1
-		|| mhp->mh_dot1 != '.' || mhp->mh_dot2 != '.'
-		|| mhp->mh_dot3 != '.' || mhp->mh_dot4 != '.') {
+	int rc = js_mixer_header_parse(jmbp, &jmh);
+
+	if (rc < 0) {
 	    jsio_trace("mixer parse request failed");
 	    return -1;
 	}
 
-	unsigned long len = strntoul(mhp->mh_len, sizeof(mhp->mh_len));
-
-	if (jmbp->jmb_len < len) {
+	if (rc == 0 || jmbp->jmb_len < jmh.jmh_len) {
 	    need_more = TRUE;
 	}
     }
 
-    if (need_more) {
+    if (need_more && jsp->js_muxid) {
+	int rc = js_mixer_demux(jsp);
+	if (rc <= 0)
+	    return rc;
+
+    } else if (need_more) {
 	/*
 	 * Read some more data from mixer
 	 */
-	int recvlen = recv(jsp->js_stdin, jmbp->jmb_data + jmbp->jmb_start,
+	int recvlen = recv(jsp->js_stdin,
+		jmbp->jmb_data + jmbp->jmb_start + jmbp->jmb_len,
 		size_to_read, 0);
 	if (recvlen < 0) {
 	    jsio_trace("reading from mixer failed");
@@ -913,7 +1237,9 @@ js_buffer_create (js_session_t *jsp, xmlCharEncoding enc)
     if (ret != NULL) {
         ret->context = (void *) jsp;
 	if (jsp->js_key.jss_type == ST_MIXER) {
-	    jsp->js_mx_buffer = js_mx_buffer_create();
+	    /* A shared-socket session may already have input waiting */
+	    if (jsp->js_mx_buffer == NULL)
+		jsp->js_mx_buffer = js_mx_buffer_create();
 	    ret->readcallback = js_mixer_read;
 	} else {
 	    ret->readcallback = js_buffer_read;
@@ -1535,6 +1861,109 @@ js_session_kill (js_session_t *jsp)
     }
 }
 
+/*
+ * Connect to the mixer server's socket, unless we already are.
+ * Unlike "mixer --client", we don't start the server if it isn't
+ * running; we can't know the options it should run with, and a
+ * server we start would outlive us.  So it has to be started first.
+ */
+static int
+js_mixer_connect (void)
+{
+    struct sockaddr_un sun;
+    int sock;
+
+    if (js_mixer_sock >= 0)
+	return 0;
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+	jsio_trace("could not create mixer socket: %m");
+	return -1;
+    }
+
+    bzero(&sun, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+#ifdef HAVE_SUN_LEN
+    sun.sun_len = sizeof(sun);
+#endif /* HAVE_SUN_LEN */
+    strlcpy(sun.sun_path, js_mixer_socket, sizeof(sun.sun_path));
+
+    if (connect(sock, (struct sockaddr *) &sun, sizeof(sun)) < 0) {
+	jsio_trace("could not connect to mixer at %s: %m "
+		   "(is \"mixer --server\" running?)", js_mixer_socket);
+	close(sock);
+	return -1;
+    }
+
+    js_mixer_rbuf = js_mx_buffer_create();
+    if (js_mixer_rbuf == NULL) {
+	close(sock);
+	return -1;
+    }
+
+    jsio_trace("connected to mixer at %s (fd %d)", js_mixer_socket, sock);
+    js_mixer_sock = sock;
+
+    return 0;
+}
+
+/*
+ * A session is done with the shared mixer socket; the last one out
+ * closes it.
+ */
+static void
+js_mixer_release (void)
+{
+    if (js_mixer_users == 0 || --js_mixer_users > 0)
+	return;
+
+    jsio_trace("closing mixer connection (fd %d)", js_mixer_sock);
+    close(js_mixer_sock);
+    js_mixer_sock = -1;
+
+    free(js_mixer_rbuf);
+    js_mixer_rbuf = NULL;
+}
+
+/*
+ * Make a session that talks to the mixer over the shared socket,
+ * rather than thru a mixer process of its own.  Like a spawned mixer
+ * session, it doesn't reach the device until its first RPC.
+ */
+static js_session_t *
+js_mixer_session_create (const char *session_name)
+{
+    js_session_t *jsp;
+
+    if (js_mixer_connect())
+	return NULL;
+
+    /* A NULL session name means the localhost session */
+    const char *name = session_name ?: "";
+    size_t namelen = strlen(name) + 1;
+    jsp = malloc(sizeof(*jsp) + namelen);
+    if (jsp == NULL)
+	return NULL;
+
+    bzero(jsp, sizeof(*jsp));
+    jsp->js_pid = -1;
+    jsp->js_stdin = js_mixer_sock;
+    jsp->js_stdout = js_mixer_sock;
+    jsp->js_stderr = -1;
+    jsp->js_target = strdup(name);
+    jsp->js_muxid = ++js_mixer_last_muxid;
+    js_mixer_users += 1;
+
+    jsp->js_key.jss_type = ST_MIXER;
+    memcpy(jsp->js_key.jss_name, name, namelen);
+    patricia_node_init_length(&jsp->js_node, sizeof(js_skey_t) + namelen);
+
+    jsio_trace("mixer session '%s' uses muxid %lu", name, jsp->js_muxid);
+
+    return jsp;
+}
+
 static void
 js_session_free (js_session_t *jsp)
 {
@@ -1549,10 +1978,19 @@ js_session_free (js_session_t *jsp)
     if (jsp->js_passphrase)
 	free(jsp->js_passphrase);
 
-    close(jsp->js_stdin);
-    close(jsp->js_stdout);
-    close(jsp->js_stderr);
-    fclose(jsp->js_fpout);
+    if (jsp->js_muxid) {
+	js_mixer_release();
+    } else {
+	close(jsp->js_stdin);
+	close(jsp->js_stdout);
+	close(jsp->js_stderr);
+	fclose(jsp->js_fpout);
+    }
+
+    if (jsp->js_mx_buffer) {
+	free(jsp->js_mx_buffer->jmb_leftover);
+	free(jsp->js_mx_buffer);
+    }
 
     if (jsp->js_hello)
 	xmlFreeNode(jsp->js_hello);
@@ -1980,6 +2418,25 @@ jsio_set_mixer (const char *mixer)
     js_mixer = mixer ? strdup(mixer) : NULL;
 }
 
+/*
+ * Talk to the mixer server directly over its socket, rather than
+ * running a mixer process (jsio_set_mixer) for each session.  All
+ * sessions share one connection.  The server must already be
+ * running (see js_mixer_connect).
+ */
+void
+jsio_set_mixer_socket (const char *path)
+{
+    if (js_mixer_socket)
+	free(js_mixer_socket);
+
+    if (path) {
+	jsio_set_default_session_type(ST_MIXER);
+    }
+
+    js_mixer_socket = path ? strdup(path) : NULL;
+}
+
 #define JSIO_SSH_OPTIONS_MAX 16
 static int jsio_ssh_options_count;
 static char *jsio_ssh_options[JSIO_SSH_OPTIONS_MAX];
@@ -2160,7 +2617,7 @@ js_session_open (js_session_opts_t *jsop, int flags)
     if (flags & JSF_JUNOS_NETCONF)
 	jsop->jso_stype = ST_JUNOS_NETCONF;
 
-    if (js_mixer) {
+    if (js_mixer || js_mixer_socket) {
 	jsop->jso_stype = ST_MIXER;
     }
 
@@ -2178,6 +2635,22 @@ js_session_open (js_session_opts_t *jsop, int flags)
     if (jsp)
 	return jsp;
 
+    if (js_mixer_socket) {
+	jsp = js_mixer_session_create(name);
+	if (jsp == NULL)
+	    return NULL;
+
+	if (!js_session_add(jsp)) {
+	    js_session_release(jsp);
+	    return NULL;
+	}
+
+	if (jsop->jso_passphrase)
+	    jsp->js_passphrase = strdup(jsop->jso_passphrase);
+
+	return jsp;
+    }
+
     /*
      * If we are using a mixer connection, we need to fork a mixer binary to
      * handle this, rather than an SSH binary.  Mixer speaks its own framing
@@ -74,6 +74,7 @@ typedef struct js_session_s {
     char *js_passphrase;	/* Passphrase */
     char *js_target;		/* Target name */
     js_mx_buffer_t *js_mx_buffer; /* Mixer receive buffer */
+    unsigned long js_muxid;	/* Muxid on the shared mixer socket (or 0) */
 
     /* NOTICE: js_key _MUST_ _BE_ the _LAST_ member of this struct */
     js_skey_t js_key;		/* js_session key (MUST BE LAST) */
@@ -81,11 +82,19 @@ typedef struct js_session_s {
 
 #define MX_HEADER_VERSION_0 '0'
 #define MX_HEADER_VERSION_1 '1'
+#define MX_HEADER_VERSION_2 '2'
 #define MX_OP_REPLY	"reply"
 #define MX_OP_RPC	"rpc"
 #define MX_OP_COMPLETE	"complete"
 #define MX_OP_ERROR	"error"
 
+/* Operation codes for version 2 headers (as in mixer/websocket.h) */
+#define MX_OPC_COMPLETE	1
+#define MX_OPC_ERROR	2
+#define MX_OPC_REPLY	6
+#define MX_OPC_RPC	7
+#define MX_OPC_MAX	11
+
 #define SESSION_NAME_DELTA	\
 	    (offsetof(struct js_session_s, js_key) \
 		- (offsetof(struct js_session_s, js_node) + \
@@ -242,6 +251,9 @@ jsio_set_default_user (const char *user);
 void
 jsio_set_mixer (const char *mixer);
 
+void
+jsio_set_mixer_socket (const char *path);
+
 void
 jsio_add_ssh_options (const char *opts);
 
@@ -260,6 +272,7 @@ jsio_set_auth_div_id (char *divid);
 void
 jsio_init (unsigned flags);
 #define JSIO_MEMDUMP	(1<<0)	/* memdump() traffic */
+#define JSIO_MIXER_BINARY (1<<1) /* Use binary (version 2) mixer headers */
 void
 jsio_cleanup (void);
 void
@@ -15,19 +15,98 @@
 #include "local.h"
 #include "buffer.h"
 
+/*
+ * Buffers come from pools, one per size class, so the hot path
+ * (read buffers, reply chains, framing copies) isn't forever going
+ * back to malloc.  A request is rounded up to the smallest class
+ * that fits; anything bigger than the largest class comes straight
+ * from malloc.
+ *
+ * The free lists are per-thread, so there's no locking.  A buffer
+ * handed to another thread (worker.c) goes on the list of the thread
+ * that frees it.  Each list is capped, so a thread that mostly frees
+ * doesn't hoard memory.  The statistics are shared, and kept with
+ * atomic operations.
+ */
+#define MX_BUFFER_CLASSES	4 /* Number of size classes */
+#define MX_BUFFER_FREE_MAX	64 /* Most free buffers kept per class */
+
+static const unsigned mx_buffer_class_size[MX_BUFFER_CLASSES] = {
+    256, 1024, BUFFER_DEFAULT_SIZE, 16 * 1024,
+};
+
+typedef struct mx_buffer_pool_s {
+    mx_buffer_t *mbp_free;	/* Free buffers (chained by mb_next) */
+    unsigned mbp_count;		/* Number of free buffers */
+} mx_buffer_pool_t;
+
+typedef struct mx_buffer_stats_s {
+    unsigned long mbs_inuse;	/* Buffers allocated and not freed */
+    unsigned long mbs_highwater; /* Most ever in use */
+    unsigned long mbs_allocs;	/* Number of allocations */
+    unsigned long mbs_misses;	/* Allocations that went to malloc */
+} mx_buffer_stats_t;
+
+static MX_THREAD_LOCAL mx_buffer_pool_t mx_buffer_pools[MX_BUFFER_CLASSES];
+
+/* One more for buffers too big for any class */
+static mx_buffer_stats_t mx_buffer_stats[MX_BUFFER_CLASSES + 1];
+
+/*
+ * Return the size class for a buffer size, or MX_BUFFER_CLASSES if
+ * it's too big to pool
+ */
+static inline unsigned
+mx_buffer_class (unsigned size)
+{
+    unsigned i;
+
+    for (i = 0; i < MX_BUFFER_CLASSES; i++)
+	if (size <= mx_buffer_class_size[i])
+	    break;
+
+    return i;
+}
+
 mx_buffer_t *
 mx_buffer_create (unsigned size)
 {
+    mx_buffer_stats_t *mbsp;
+    mx_buffer_pool_t *pool = NULL;
+    mx_buffer_t *mbp = NULL;
+    unsigned class, inuse;
+
     if (size == 0)
 	size = BUFFER_DEFAULT_SIZE;
 
-    mx_buffer_t *mbp = malloc(sizeof(*mbp) + size);
-    if (mbp == NULL)
-	return NULL;
+    class = mx_buffer_class(size);
+    mbsp = &mx_buffer_stats[class];
+
+    if (class < MX_BUFFER_CLASSES) {
+	size = mx_buffer_class_size[class];
+	pool = &mx_buffer_pools[class];
+	mbp = pool->mbp_free;
+    }
+
+    if (mbp) {
+	pool->mbp_free = mbp->mb_next;
+	pool->mbp_count -= 1;
+
+    } else {
+	mbp = malloc(sizeof(*mbp) + size);
+	if (mbp == NULL)
+	    return NULL;
+	__sync_add_and_fetch(&mbsp->mbs_misses, 1);
+    }
 
     bzero(mbp, sizeof(*mbp));
     mbp->mb_size = size;
 
+    __sync_add_and_fetch(&mbsp->mbs_allocs, 1);
+    inuse = __sync_add_and_fetch(&mbsp->mbs_inuse, 1);
+    if (inuse > mbsp->mbs_highwater)
+	mbsp->mbs_highwater = inuse; /* Close enough under a race */
+
     return mbp;
 }
 
@@ -53,10 +132,50 @@ mx_buffer_reset (mx_buffer_t *mbp)
 void
 mx_buffer_free (mx_buffer_t *mbp)
 {
+    mx_buffer_pool_t *pool;
     mx_buffer_t *next;
-    do {
+    unsigned class;
+
+    for ( ; mbp; mbp = next) {
 	next = mbp->mb_next;
+
+	class = mx_buffer_class(mbp->mb_size);
+	__sync_sub_and_fetch(&mx_buffer_stats[class].mbs_inuse, 1);
+
+	if (class < MX_BUFFER_CLASSES) {
+	    pool = &mx_buffer_pools[class];
+	    if (pool->mbp_count < MX_BUFFER_FREE_MAX) {
+		mbp->mb_next = pool->mbp_free;
+		pool->mbp_free = mbp;
+		pool->mbp_count += 1;
+		continue;
+	    }
+	}
+
 	free(mbp);
-	mbp = next;
-    } while (next);
+    }
+}
+
+void
+mx_buffer_print (int indent, const char *prefix)
+{
+    mx_buffer_stats_t *mbsp;
+    unsigned i;
+
+    mx_log("%*s%sbuffers (this thread keeps %u/%u/%u/%u free):", indent, "",
+	   prefix, mx_buffer_pools[0].mbp_count, mx_buffer_pools[1].mbp_count,
+	   mx_buffer_pools[2].mbp_count, mx_buffer_pools[3].mbp_count);
+
+    for (i = 0; i <= MX_BUFFER_CLASSES; i++) {
+	mbsp = &mx_buffer_stats[i];
+	if (i < MX_BUFFER_CLASSES)
+	    mx_log("%*s%s%6u: in use %lu (high %lu), allocs %lu, misses %lu",
+		   indent + INDENT, "", prefix, mx_buffer_class_size[i],
+		   mbsp->mbs_inuse, mbsp->mbs_highwater,
+		   mbsp->mbs_allocs, mbsp->mbs_misses);
+	else
+	    mx_log("%*s%s larger: in use %lu (high %lu), allocs %lu",
+		   indent + INDENT, "", prefix, mbsp->mbs_inuse,
+		   mbsp->mbs_highwater, mbsp->mbs_allocs);
+    }
 }
@@ -20,3 +20,6 @@ mx_buffer_free (mx_buffer_t *mbp);
 
 void
 mx_buffer_reset (mx_buffer_t *mbp);
+
+void
+mx_buffer_print (int indent, const char *prefix);
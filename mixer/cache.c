@@ -0,0 +1,668 @@
+/*
+ * $Id$
+ *
+ * Copyright (c) 2013, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * Reply cache.  CLIRA views tend to re-issue the same read-only RPCs
+ * (get-software-information, say) within seconds of each other, so
+ * we can keep their replies and answer the repeats without going to
+ * the device.  Nothing is cached unless a --cache-ttl rule names the
+ * RPC (a trailing "*" matches a prefix, like "get-*"), and an entry
+ * lives for the rule's TTL.
+ *
+ * Entries are keyed by the full target (user@host:port), the reply
+ * format and the RPC text, with its whitespace normalized.  They're
+ * kept on an LRU list, and the least recently used go when the total
+ * passes opt_cache_max bytes.  Replies holding an <rpc-error> aren't
+ * kept.
+ *
+ * A commit, load or lock RPC drops every entry for its device (every
+ * user's, since they all see the same configuration), both when it
+ * starts and when it finishes.  A reply that was being
+ * collected while the cache was invalidated may be stale, so it's
+ * not stored either.
+ *
+ * The cache is shared by all event loops (see worker.c), and guarded
+ * by mx_cache_lock.  A hit is copied out under the lock, so an entry
+ * can be evicted as soon as it's unlocked.
+ *
+ * The --coalesce rules live here too, since they match RPCs the same
+ * way; they pick the RPCs that concurrent clients may share while
+ * they're still in flight (see mx_request_coalesce).
+ */
+
+#include <pthread.h>
+
+#include "local.h"
+#include "cache.h"
+#include "buffer.h"
+
+#define MX_CACHE_BUCKETS	256	/* Size of the hash table */
+#define MX_CACHE_ENTRY_SHARE	4	/* Entries hold at most 1/n of the cache */
+#define MX_CACHE_FILL_SIZE	4096	/* Starting size of a reply buffer */
+#define MX_CACHE_ERROR		"<rpc-error"
+
+struct mx_cache_entry_s;
+typedef TAILQ_ENTRY(mx_cache_entry_s) mx_cache_link_t;
+typedef TAILQ_HEAD(mx_cache_list_s, mx_cache_entry_s) mx_cache_list_t;
+
+typedef struct mx_cache_entry_s {
+    mx_cache_link_t mce_link;	/* LRU list (most recent first) */
+    mx_cache_link_t mce_hash_link; /* Hash bucket */
+    char *mce_key;		/* Target, format and normalized RPC */
+    unsigned mce_target_len;	/* Length of the target part of the key */
+    unsigned mce_hash;		/* Hash of mce_key */
+    char *mce_data;		/* The reply */
+    unsigned long mce_len;	/* Length of the reply */
+    unsigned long mce_size;	/* Size of mce_data */
+    unsigned long long mce_expires; /* When we drop it (mx_time_ms) */
+    unsigned mce_ttl;		/* Seconds to keep it */
+    unsigned long mce_generation; /* mx_cache_generation when started */
+    unsigned long mce_hits;	/* Times it's been served */
+} mx_cache_entry_t;
+
+/* Rules (--cache-ttl, --coalesce); set before any threads start */
+typedef struct mx_cache_rule_s {
+    struct mx_cache_rule_s *mcr_next; /* Next rule */
+    char *mcr_name;		/* RPC name (or prefix) */
+    unsigned mcr_len;		/* Length to match */
+    int mcr_prefix;		/* Name ended in "*" */
+    unsigned mcr_ttl;		/* Seconds to keep the reply (--cache-ttl) */
+} mx_cache_rule_t;
+
+typedef struct mx_cache_stats_s {
+    unsigned long mcs_hits;	/* Replies we served */
+    unsigned long mcs_misses;	/* Cacheable RPCs we sent to the device */
+    unsigned long mcs_stores;	/* Replies we kept */
+    unsigned long mcs_evictions; /* Entries dropped for room */
+    unsigned long mcs_expired;	/* Entries dropped for age */
+    unsigned long mcs_invalidations; /* Entries dropped for a commit et al */
+    unsigned long mcs_uncacheable; /* Replies too big or holding errors */
+    unsigned long long mcs_bytes_served; /* Reply bytes from hits */
+} mx_cache_stats_t;
+
+/* RPCs that change (or lock) a target's configuration */
+static const char *mx_cache_invalidators[] = {
+    "commit", "commit-configuration",
+    "load-configuration", "edit-config", "copy-config",
+    "lock", "lock-configuration",
+    NULL
+};
+
+static mx_cache_rule_t *mx_cache_rules;
+static mx_cache_rule_t *mx_coalesce_rules; /* --coalesce */
+
+static pthread_mutex_t mx_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static mx_cache_list_t mx_cache_lru;
+static mx_cache_list_t mx_cache_table[MX_CACHE_BUCKETS];
+static unsigned long mx_cache_bytes;	/* Memory held by entries */
+static unsigned long mx_cache_count;	/* Number of entries */
+static unsigned long mx_cache_generation; /* Bumped by each invalidation */
+static mx_cache_stats_t mx_cache_stats;
+
+/*
+ * Add a rule to a list, keeping them in order (first match wins)
+ */
+static mx_cache_rule_t *
+mx_cache_rule_append (mx_cache_rule_t **last, const char *name, unsigned len)
+{
+    mx_cache_rule_t *mcrp;
+
+    if (len == 0)
+	return NULL;
+
+    mcrp = calloc(1, sizeof(*mcrp));
+    if (mcrp == NULL)
+	return NULL;
+
+    mcrp->mcr_name = strndup(name, len);
+    if (mcrp->mcr_name == NULL) {
+	free(mcrp);
+	return NULL;
+    }
+
+    mcrp->mcr_len = len;
+    if (mcrp->mcr_name[len - 1] == '*') {
+	mcrp->mcr_prefix = TRUE;
+	mcrp->mcr_len -= 1;
+    }
+
+    while (*last)
+	last = &(*last)->mcr_next;
+    *last = mcrp;
+
+    return mcrp;
+}
+
+static mx_cache_rule_t *
+mx_cache_rule_find (mx_cache_rule_t *mcrp, const char *name, unsigned len)
+{
+    for ( ; mcrp; mcrp = mcrp->mcr_next) {
+	if (mcrp->mcr_prefix) {
+	    if (len >= mcrp->mcr_len
+		    && strncmp(name, mcrp->mcr_name, mcrp->mcr_len) == 0)
+		return mcrp;
+	} else if (len == mcrp->mcr_len
+		   && strncmp(name, mcrp->mcr_name, len) == 0)
+	    return mcrp;
+    }
+
+    return NULL;
+}
+
+/*
+ * Add a TTL rule: "<rpc-name>=<secs>".  Returns FALSE if it doesn't
+ * parse.
+ */
+int
+mx_cache_rule_add (const char *spec)
+{
+    mx_cache_rule_t *mcrp;
+    const char *eq = strchr(spec, '=');
+    char *ep;
+    long ttl;
+
+    if (eq == NULL)
+	return FALSE;
+
+    ttl = strtol(eq + 1, &ep, 10);
+    if (ep == eq + 1 || *ep != '\0' || ttl <= 0)
+	return FALSE;
+
+    mcrp = mx_cache_rule_append(&mx_cache_rules, spec, eq - spec);
+    if (mcrp == NULL)
+	return FALSE;
+
+    mcrp->mcr_ttl = ttl;
+    return TRUE;
+}
+
+/*
+ * Add a coalescing rule: the name of an RPC (or a prefix, ending in
+ * "*") that concurrent clients may share.
+ */
+int
+mx_coalesce_rule_add (const char *name)
+{
+    return (mx_cache_rule_append(&mx_coalesce_rules, name,
+				 strlen(name)) != NULL);
+}
+
+static int
+mx_cache_is_invalidator (const char *name, unsigned len)
+{
+    const char **cpp;
+
+    for (cpp = mx_cache_invalidators; *cpp; cpp++)
+	if (strlen(*cpp) == len && strncmp(name, *cpp, len) == 0)
+	    return TRUE;
+
+    return FALSE;
+}
+
+/*
+ * Find the name of the RPC's top element.  Returns its length, or
+ * zero if there isn't one.
+ */
+static unsigned
+mx_cache_rpc_name (const char *cp, const char *ep, const char **namep)
+{
+    const char *start;
+
+    while (cp < ep && isspace((int) *cp))
+	cp += 1;
+
+    if (cp >= ep || *cp != '<')
+	return 0;
+
+    for (start = ++cp; cp < ep; cp++)
+	if (isspace((int) *cp) || *cp == '/' || *cp == '>')
+	    break;
+
+    *namep = start;
+    return cp - start;
+}
+
+/*
+ * Build an entry's key: "<target>\n<format>\n<rpc>".  Whitespace in
+ * the RPC is squeezed to a single space, and dropped next to markup,
+ * so the same RPC in different clothes finds the same entry.
+ */
+static char *
+mx_cache_key (mx_request_t *mrp, const char *cp, const char *ep)
+{
+    size_t tlen = strlen(mrp->mr_fulltarget);
+    char *key, *dp, last = '>';
+    int space = FALSE;
+
+    key = malloc(tlen + 6 + (ep - cp) + 1);
+    if (key == NULL)
+	return NULL;
+
+    memcpy(key, mrp->mr_fulltarget, tlen);
+    dp = key + tlen;
+    memcpy(dp, (mrp->mr_flags & MRF_HTML) ? "\nhtml\n" : "\nxml\n",
+	   (mrp->mr_flags & MRF_HTML) ? 6 : 5);
+    dp += (mrp->mr_flags & MRF_HTML) ? 6 : 5;
+
+    for ( ; cp < ep && *cp; cp++) {
+	if (isspace((int) *cp)) {
+	    space = TRUE;
+	    continue;
+	}
+
+	if (space && last != '>' && last != '<' && *cp != '<'
+		&& *cp != '>' && *cp != '/')
+	    *dp++ = ' ';
+	space = FALSE;
+	*dp++ = last = *cp;
+    }
+
+    *dp = '\0';
+    return key;
+}
+
+static unsigned
+mx_cache_hash (const char *key)
+{
+    unsigned hash = 5381;
+
+    while (*key)
+	hash = hash * 33 + (unsigned char) *key++;
+
+    return hash;
+}
+
+static inline unsigned long
+mx_cache_entry_bytes (mx_cache_entry_t *mcep)
+{
+    return sizeof(*mcep) + strlen(mcep->mce_key) + 1 + mcep->mce_size;
+}
+
+static void
+mx_cache_entry_free (mx_cache_entry_t *mcep)
+{
+    free(mcep->mce_key);
+    free(mcep->mce_data);
+    free(mcep);
+}
+
+/* Called with mx_cache_lock held */
+static void
+mx_cache_remove (mx_cache_entry_t *mcep)
+{
+    TAILQ_REMOVE(&mx_cache_lru, mcep, mce_link);
+    TAILQ_REMOVE(&mx_cache_table[mcep->mce_hash % MX_CACHE_BUCKETS],
+		 mcep, mce_hash_link);
+
+    mx_cache_bytes -= mx_cache_entry_bytes(mcep);
+    mx_cache_count -= 1;
+    mx_cache_entry_free(mcep);
+}
+
+/* Called with mx_cache_lock held */
+static mx_cache_entry_t *
+mx_cache_find (const char *key, unsigned hash)
+{
+    mx_cache_entry_t *mcep;
+
+    TAILQ_FOREACH(mcep, &mx_cache_table[hash % MX_CACHE_BUCKETS],
+		  mce_hash_link) {
+	if (mcep->mce_hash == hash && streq(mcep->mce_key, key))
+	    return mcep;
+    }
+
+    return NULL;
+}
+
+/*
+ * Find the device ("host:port") part of a full target (user@host:port).
+ * A host name can't hold an '@', so it follows the last one.
+ */
+static const char *
+mx_cache_target_host (const char *target, size_t len, size_t *hlenp)
+{
+    const char *cp = memrchr(target, '@', len);
+
+    cp = cp ? cp + 1 : target;
+    *hlenp = len - (cp - target);
+    return cp;
+}
+
+/*
+ * Drop every entry for a target's device, whoever they belong to;
+ * a commit by one user changes what every user would see.  Called
+ * with mx_cache_lock held.
+ */
+static void
+mx_cache_invalidate_locked (const char *target)
+{
+    mx_cache_entry_t *mcep, *next;
+    const char *host, *ehost;
+    size_t hlen, ehlen;
+    unsigned long count = 0;
+
+    host = mx_cache_target_host(target, strlen(target), &hlen);
+
+    mx_cache_generation += 1;
+
+    TAILQ_FOREACH_SAFE(mcep, &mx_cache_lru, mce_link, next) {
+	ehost = mx_cache_target_host(mcep->mce_key, mcep->mce_target_len,
+				     &ehlen);
+	if (ehlen == hlen && strncmp(ehost, host, hlen) == 0) {
+	    mx_cache_remove(mcep);
+	    count += 1;
+	}
+    }
+
+    mx_cache_stats.mcs_invalidations += count;
+}
+
+/*
+ * Look for a cached reply to a request's RPC.  On a hit, returns a
+ * copy of it, with "headroom" bytes left in front for the caller's
+ * header.  On a miss, if the RPC is cacheable, the request is set up
+ * to collect its reply (see mx_cache_collect).  A commit, load or
+ * lock empties the entries for its device.
+ */
+mx_buffer_t *
+mx_cache_lookup (mx_request_t *mrp, unsigned headroom)
+{
+    mx_buffer_t *rpc = mrp->mr_rpc, *mbp = NULL;
+    mx_cache_entry_t *mcep;
+    const char *name, *cp, *ep;
+    unsigned len, ttl, hash;
+    char *key;
+
+    if (opt_cache_max <= 0 || mx_cache_rules == NULL || rpc == NULL
+	    || mrp->mr_fulltarget == NULL || (mrp->mr_flags & MRF_STREAM))
+	return NULL;
+
+    cp = rpc->mb_data + rpc->mb_start;
+    ep = cp + rpc->mb_len;
+
+    len = mx_cache_rpc_name(cp, ep, &name);
+    if (len == 0)
+	return NULL;
+
+    if (mx_cache_is_invalidator(name, len)) {
+	mx_log("R%u cache: %.*s invalidates %s",
+	       mrp->mr_id, (int) len, name, mrp->mr_fulltarget);
+	mrp->mr_flags |= MRF_INVALIDATE;
+	mx_cache_invalidate(mrp->mr_fulltarget);
+	return NULL;
+    }
+
+    mx_cache_rule_t *mcrp = mx_cache_rule_find(mx_cache_rules, name, len);
+    if (mcrp == NULL)
+	return NULL;
+    ttl = mcrp->mcr_ttl;
+
+    key = mx_cache_key(mrp, cp, ep);
+    if (key == NULL)
+	return NULL;
+    hash = mx_cache_hash(key);
+
+    pthread_mutex_lock(&mx_cache_lock);
+
+    mcep = mx_cache_find(key, hash);
+    if (mcep && mcep->mce_expires <= mx_time_ms()) {
+	mx_cache_remove(mcep);
+	mx_cache_stats.mcs_expired += 1;
+	mcep = NULL;
+    }
+
+    if (mcep) {
+	mbp = mx_buffer_create(headroom + mcep->mce_len);
+	if (mbp) {
+	    mbp->mb_start = headroom;
+	    mbp->mb_len = mcep->mce_len;
+	    memcpy(mbp->mb_data + headroom, mcep->mce_data, mcep->mce_len);
+
+	    TAILQ_REMOVE(&mx_cache_lru, mcep, mce_link);
+	    TAILQ_INSERT_HEAD(&mx_cache_lru, mcep, mce_link);
+	    mcep->mce_hits += 1;
+	    mx_cache_stats.mcs_hits += 1;
+	    mx_cache_stats.mcs_bytes_served += mcep->mce_len;
+	}
+    } else {
+	mx_cache_stats.mcs_misses += 1;
+    }
+
+    /* Record the generation, so we know if we're invalidated meanwhile */
+    unsigned long generation = mx_cache_generation;
+
+    pthread_mutex_unlock(&mx_cache_lock);
+
+    if (mbp) {
+	mx_log("R%u cache hit: %.*s (%lu bytes)",
+	       mrp->mr_id, (int) len, name, mbp->mb_len);
+	free(key);
+	return mbp;
+    }
+
+    mcep = calloc(1, sizeof(*mcep));
+    if (mcep == NULL) {
+	free(key);
+	return NULL;
+    }
+
+    mcep->mce_key = key;
+    mcep->mce_target_len = strlen(mrp->mr_fulltarget);
+    mcep->mce_hash = hash;
+    mcep->mce_ttl = ttl;
+    mcep->mce_generation = generation;
+
+    mx_cache_end(mrp);
+    mrp->mr_cache = mcep;
+
+    mx_log("R%u cache miss: %.*s", mrp->mr_id, (int) len, name);
+    return NULL;
+}
+
+/*
+ * If a request's RPC may share its reply with others for the same
+ * target (see mx_request_coalesce), return the key that finds them.
+ * The caller frees it.
+ */
+char *
+mx_coalesce_key (mx_request_t *mrp)
+{
+    mx_buffer_t *rpc = mrp->mr_rpc;
+    const char *name, *cp, *ep;
+    unsigned len;
+
+    if (opt_coalesce_window <= 0 || mx_coalesce_rules == NULL || rpc == NULL
+	    || mrp->mr_fulltarget == NULL || (mrp->mr_flags & MRF_STREAM))
+	return NULL;
+
+    cp = rpc->mb_data + rpc->mb_start;
+    ep = cp + rpc->mb_len;
+
+    len = mx_cache_rpc_name(cp, ep, &name);
+    if (len == 0 || mx_cache_is_invalidator(name, len)
+	    || mx_cache_rule_find(mx_coalesce_rules, name, len) == NULL)
+	return NULL;
+
+    return mx_cache_key(mrp, cp, ep);
+}
+
+/*
+ * Add a chunk of reply to what a request is collecting.  If the
+ * reply gets too big for the cache, we give up on it.
+ */
+void
+mx_cache_collect (mx_request_t *mrp, const char *data, unsigned long len)
+{
+    mx_cache_entry_t *mcep = mrp->mr_cache;
+    unsigned long size, limit = opt_cache_max / MX_CACHE_ENTRY_SHARE;
+    char *cp;
+
+    if (mcep == NULL || len == 0)
+	return;
+
+    if (mcep->mce_len + len > limit)
+	goto drop;
+
+    if (mcep->mce_len + len > mcep->mce_size) {
+	size = mcep->mce_size ?: MX_CACHE_FILL_SIZE;
+	while (size < mcep->mce_len + len)
+	    size *= 2;
+	if (size > limit)
+	    size = limit;
+
+	cp = realloc(mcep->mce_data, size);
+	if (cp == NULL)
+	    goto drop;
+
+	mcep->mce_data = cp;
+	mcep->mce_size = size;
+    }
+
+    memcpy(mcep->mce_data + mcep->mce_len, data, len);
+    mcep->mce_len += len;
+    return;
+
+ drop:
+    mx_log("R%u cache: reply is too big to keep", mrp->mr_id);
+    __sync_add_and_fetch(&mx_cache_stats.mcs_uncacheable, 1);
+    mx_cache_end(mrp);
+}
+
+/*
+ * A request's reply is complete; keep it, if we can, making room
+ * by evicting the least recently used entries.
+ */
+void
+mx_cache_store (mx_request_t *mrp)
+{
+    mx_cache_entry_t *mcep = mrp->mr_cache, *old;
+    unsigned long bytes;
+
+    if (mcep == NULL)
+	return;
+
+    mrp->mr_cache = NULL;
+
+    if (mrp->mr_state == MSS_ERROR || mrp->mr_state == MSS_FAILED
+	    || mcep->mce_len == 0
+	    || memmem(mcep->mce_data, mcep->mce_len, MX_CACHE_ERROR,
+		      sizeof(MX_CACHE_ERROR) - 1) != NULL) {
+	__sync_add_and_fetch(&mx_cache_stats.mcs_uncacheable, 1);
+	mx_cache_entry_free(mcep);
+	return;
+    }
+
+    /* Give back the slack; we won't be adding to it */
+    if (mcep->mce_size > mcep->mce_len) {
+	char *cp = realloc(mcep->mce_data, mcep->mce_len);
+	if (cp) {
+	    mcep->mce_data = cp;
+	    mcep->mce_size = mcep->mce_len;
+	}
+    }
+
+    mcep->mce_expires = mx_time_ms() + mcep->mce_ttl * 1000ULL;
+    bytes = mx_cache_entry_bytes(mcep);
+
+    pthread_mutex_lock(&mx_cache_lock);
+
+    if (mcep->mce_generation != mx_cache_generation) {
+	pthread_mutex_unlock(&mx_cache_lock);
+	mx_log("R%u cache: invalidated while collecting reply", mrp->mr_id);
+	mx_cache_entry_free(mcep);
+	return;
+    }
+
+    /* Someone beat us to it; the newer reply wins */
+    old = mx_cache_find(mcep->mce_key, mcep->mce_hash);
+    if (old)
+	mx_cache_remove(old);
+
+    while (mx_cache_bytes + bytes > (unsigned long) opt_cache_max
+	   && !TAILQ_EMPTY(&mx_cache_lru)) {
+	mx_cache_remove(TAILQ_LAST(&mx_cache_lru, mx_cache_list_s));
+	mx_cache_stats.mcs_evictions += 1;
+    }
+
+    TAILQ_INSERT_HEAD(&mx_cache_lru, mcep, mce_link);
+    TAILQ_INSERT_HEAD(&mx_cache_table[mcep->mce_hash % MX_CACHE_BUCKETS],
+		      mcep, mce_hash_link);
+    mx_cache_bytes += bytes;
+    mx_cache_count += 1;
+    mx_cache_stats.mcs_stores += 1;
+
+    pthread_mutex_unlock(&mx_cache_lock);
+
+    mx_log("R%u cache: kept %lu byte reply for %u seconds",
+	   mrp->mr_id, mcep->mce_len, mcep->mce_ttl);
+}
+
+/*
+ * A request is going away.  Drop any reply it was collecting, and
+ * if it was a commit (or a load or lock), invalidate its target
+ * again, since the configuration may have changed while it ran.
+ */
+void
+mx_cache_end (mx_request_t *mrp)
+{
+    if (mrp->mr_cache) {
+	mx_cache_entry_free(mrp->mr_cache);
+	mrp->mr_cache = NULL;
+    }
+
+    if ((mrp->mr_flags & MRF_INVALIDATE) && mrp->mr_fulltarget) {
+	mrp->mr_flags &= ~MRF_INVALIDATE;
+	mx_cache_invalidate(mrp->mr_fulltarget);
+    }
+}
+
+void
+mx_cache_invalidate (const char *target)
+{
+    pthread_mutex_lock(&mx_cache_lock);
+    mx_cache_invalidate_locked(target);
+    pthread_mutex_unlock(&mx_cache_lock);
+}
+
+void
+mx_cache_print (int indent, const char *prefix)
+{
+    mx_cache_stats_t *mcsp = &mx_cache_stats;
+
+    if (mx_cache_rules == NULL || opt_cache_max <= 0)
+	return;
+
+    pthread_mutex_lock(&mx_cache_lock);
+
+    mx_log("%*s%scache: %lu entries, %lu/%d bytes; %lu hits, %lu misses "
+	   "(%.1f%% hit rate), %llu bytes served",
+	   indent, "", prefix, mx_cache_count, mx_cache_bytes, opt_cache_max,
+	   mcsp->mcs_hits, mcsp->mcs_misses,
+	   (mcsp->mcs_hits + mcsp->mcs_misses)
+	   ? 100.0 * mcsp->mcs_hits / (mcsp->mcs_hits + mcsp->mcs_misses)
+	   : 0.0,
+	   mcsp->mcs_bytes_served);
+    mx_log("%*s%s%lu stored, %lu evicted, %lu expired, %lu invalidated, "
+	   "%lu uncacheable",
+	   indent + INDENT, "", prefix, mcsp->mcs_stores,
+	   mcsp->mcs_evictions, mcsp->mcs_expired,
+	   mcsp->mcs_invalidations, mcsp->mcs_uncacheable);
+
+    pthread_mutex_unlock(&mx_cache_lock);
+}
+
+void
+mx_cache_init (void)
+{
+    unsigned i;
+
+    TAILQ_INIT(&mx_cache_lru);
+    for (i = 0; i < MX_CACHE_BUCKETS; i++)
+	TAILQ_INIT(&mx_cache_table[i]);
+}
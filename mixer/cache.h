@@ -0,0 +1,40 @@
+/*
+ * $Id$
+ *
+ * Copyright (c) 2013, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ */
+
+int
+mx_cache_rule_add (const char *spec);
+
+int
+mx_coalesce_rule_add (const char *name);
+
+char *
+mx_coalesce_key (mx_request_t *mrp);
+
+mx_buffer_t *
+mx_cache_lookup (mx_request_t *mrp, unsigned headroom);
+
+void
+mx_cache_collect (mx_request_t *mrp, const char *data, unsigned long len);
+
+void
+mx_cache_store (mx_request_t *mrp);
+
+void
+mx_cache_end (mx_request_t *mrp);
+
+void
+mx_cache_invalidate (const char *target);
+
+void
+mx_cache_print (int indent, const char *prefix);
+
+void
+mx_cache_init (void);
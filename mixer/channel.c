@@ -14,13 +14,12 @@
 #include "channel.h"
 #include "netconf.h"
 #include "request.h"
+#include "timer.h"
 #include <ctype.h>
 
 static unsigned mx_channel_id; /* Monotonically increasing ID number */
 
-#define NETCONF_MARKER "]]>]]>"
-const char mx_netconf_marker[] = NETCONF_MARKER;
-unsigned mx_netconf_marker_len = sizeof(mx_netconf_marker) - 1;
+#define MX_CHANNEL_POOL_RETRY 30 /* Seconds to wait after a pool failure */
 
 static int
 mx_channel_read (mx_channel_t *mcp, char *buf, unsigned long bufsiz)
@@ -31,6 +30,13 @@ mx_channel_read (mx_channel_t *mcp, char *buf, unsigned long bufsiz)
 
     DBG_POLL("C%u read %d", mcp->mc_id, len);
     if (len > 0) {
+	mcp->mc_reads += 1;
+	mcp->mc_read_bytes += len;
+	if (mcp->mc_session) {
+	    mcp->mc_session->mss_reads += 1;
+	    mcp->mc_session->mss_read_bytes += len;
+	}
+
 	if (opt_debug & DBG_FLAG_DUMP)
 	    slaxMemDump("chread: ", buf, len, ">", 0);
     } else {
@@ -58,6 +64,48 @@ mx_channel_write (mx_channel_t *mcp, const char *buf, unsigned long bufsiz)
     return len;
 }
 
+/*
+ * Replace an empty read buffer with one of a different size.  Large
+ * replies fill the buffer on every read, so we double it (up to
+ * opt_read_buffer_max) to move more data per trip thru the poll loop;
+ * idle channels go back to the default size.
+ */
+static void
+mx_channel_resize_buffer (mx_channel_t *mcp, unsigned size)
+{
+    mx_buffer_t *mbp = mcp->mc_rbufp, *newp;
+
+    if (mbp->mb_len || mbp->mb_next || mcp->mc_next_len
+	    || mbp->mb_size == size)
+	return;
+
+    newp = mx_buffer_create(size);
+    if (newp == NULL)
+	return;			/* Keep what we've got */
+
+    DBG_POLL("C%u read buffer %lu -> %lu",
+	     mcp->mc_id, mbp->mb_size, newp->mb_size);
+
+    mx_buffer_free(mbp);
+    mcp->mc_rbufp = newp;
+}
+
+/*
+ * Open the session channel, using the window and packet sizes from
+ * the command line.  A bigger window lets the server keep sending
+ * while we're busy writing the last read to our client.
+ */
+static LIBSSH2_CHANNEL *
+mx_channel_open (mx_sock_session_t *mssp)
+{
+    static const char type[] = "session";
+    unsigned window = opt_ssh_window_size ?: LIBSSH2_CHANNEL_WINDOW_DEFAULT;
+    unsigned packet = opt_ssh_packet_size ?: LIBSSH2_CHANNEL_PACKET_DEFAULT;
+
+    return libssh2_channel_open_ex(mssp->mss_session, type, sizeof(type) - 1,
+				   window, packet, NULL, 0);
+}
+
 mx_channel_t *
 mx_channel_create (mx_sock_session_t *session,
 		   mx_sock_t *client, LIBSSH2_CHANNEL *channel)
@@ -67,12 +115,13 @@ mx_channel_create (mx_sock_session_t *session,
 	return NULL;
 
     bzero(mcp, sizeof(*mcp));
-    mcp->mc_id = ++mx_channel_id;
+    mcp->mc_id = mx_next_id(mx_channel_id);
     mcp->mc_session = session;
     mcp->mc_channel = channel;
     mcp->mc_rbufp = mx_buffer_create(0);
 
-    if (mx_mti(client)->mti_set_channel)
+    /* Channels opened for the idle pool have no client */
+    if (client && mx_mti(client)->mti_set_channel)
 	mx_mti(client)->mti_set_channel(client, session, mcp);
     mcp->mc_client = client;
 
@@ -80,7 +129,7 @@ mx_channel_create (mx_sock_session_t *session,
 
     MX_LOG("C%u: new channel, S%u, channel %p, client S%u",
 	   mcp->mc_id, mcp->mc_session->mss_base.ms_id,
-	   mcp->mc_channel, mcp->mc_client->ms_id);
+	   mcp->mc_channel, client ? client->ms_id : 0);
 
     return mcp;
 }
@@ -116,119 +165,123 @@ mx_channel_direct_tcpip (mx_sock_session_t *session, mx_sock_t *client,
     return mcp;
 }
 
-static int
-mx_channel_netconf_send_hello (mx_channel_t *mcp)
-{
-    const char hello[] = "<?xml version=\"1.0\"?>\n"
-	"<hello xmlns=\"urn:ietf:params:xml:ns:netconf:base:1.0\">"
-	  "<capabilities>\n"
-	  "<capability>urn:ietf:params:netconf:base:1.0</capability>\n"
-	  "</capabilities>"
-	"</hello>\n" NETCONF_MARKER "\n";
-    int len, hlen = sizeof(hello) - 1;
+#define MX_NETCONF_HELLO(_caps) "<?xml version=\"1.0\"?>\n" \
+    "<hello xmlns=\"urn:ietf:params:xml:ns:netconf:base:1.0\">" \
+      "<capabilities>\n" _caps "</capabilities>" \
+    "</hello>\n" NETCONF_MARKER "\n"
 
-    len = mx_channel_write(mcp, hello, hlen);
-    mx_log("C%u sent hello (%d)%s", mcp->mc_id, len,
-	   (len == hlen) ? " complete" : " short");
+#define MX_NETCONF_CAPABILITY(_cap) "<capability>" _cap "</capability>\n"
 
-    return 0;
+static const char mx_netconf_hello[]
+    = MX_NETCONF_HELLO(MX_NETCONF_CAPABILITY(NETCONF_BASE_1_0));
+static const char mx_netconf_hello_11[]
+    = MX_NETCONF_HELLO(MX_NETCONF_CAPABILITY(NETCONF_BASE_1_0)
+		       MX_NETCONF_CAPABILITY(NETCONF_BASE_1_1));
+
+/*
+ * Do we offer NETCONF 1.1 (chunked framing)?  Not in xml-mode, which
+ * only knows the end-of-message marker; that's why channels try the
+ * netconf subsystem first (see mx_channel_netconf_continue).
+ */
+static int
+mx_channel_netconf_offers_11 (mx_channel_t *mcp)
+{
+    return !opt_no_chunked_framing && !mcf_is_xml_mode(mcp);
 }
 
 /*
- * Detect if we have the NETCONF end-of-frame marker at the end
- * of our input stream.
+ * Send our hello, picking up where we left off if an earlier
+ * attempt would have blocked.  Returns TRUE when it's all sent.
  */
 static int
-mx_channel_netconf_has_marker (mx_channel_t *mcp)
+mx_channel_netconf_send_hello (mx_channel_t *mcp)
 {
-    char *cp;
-    char *zp;
-    const char *czp;
-    mx_buffer_t *prev = NULL, *cur = mcp->mc_rbufp;
+    const char *hello = mx_netconf_hello;
+    unsigned hlen = sizeof(mx_netconf_hello) - 1;
+    int len;
 
-    /* Find the previous buffer, if there is one */
-    while (cur->mb_next != NULL) {
-	prev = cur;
-	cur = cur->mb_next;
+    if (mx_channel_netconf_offers_11(mcp)) {
+	hello = mx_netconf_hello_11;
+	hlen = sizeof(mx_netconf_hello_11) - 1;
     }
 
-    for (;;) {
-	for (cp = cur->mb_data + cur->mb_start + cur->mb_len - 1;
-	     cp > cur->mb_data + cur->mb_start; cp--)
-	    if (!isspace((int) *cp))
-		goto found_end;
-	if (prev == NULL)
+    while (mcp->mc_hello_sent < hlen) {
+	len = mx_channel_write(mcp, hello + mcp->mc_hello_sent,
+			       hlen - mcp->mc_hello_sent);
+	if (len == LIBSSH2_ERROR_EAGAIN)
+	    return FALSE;
+
+	if (len < 0) {
+	    mx_log("C%u hello write failed (%d)", mcp->mc_id, len);
+	    mcp->mc_state = MSS_FAILED;
 	    return FALSE;
+	}
 
-	cur = prev;
-	prev = NULL;
+	mcp->mc_hello_sent += len;
     }
 
-    found_end:
+    mx_log("C%u sent hello (%u)", mcp->mc_id, hlen);
 
-    /*
-     * We've found the last trailing non-ws char, so we need
-     * to see if the previous bytes are the NETCONF framing
-     * marker.  The marker might span the last buffer and
-     * the previous one, which is annoy to handle.
-     */
+    return TRUE;
+}
 
-    if (cp - (cur->mb_data + cur->mb_start) > mx_netconf_marker_len) {
-	zp = cp + 1 - mx_netconf_marker_len;
-	if (0) mx_log("[%.*s] [%.*s]", mx_netconf_marker_len, zp,
-		      mx_netconf_marker_len, mx_netconf_marker);
-	if (memcmp(zp, mx_netconf_marker, mx_netconf_marker_len) == 0) {
-	    /*
-	     * Mark the new end of the string, discarding the
-	     * marker and and trailing whitespace.
-	     */
-	    *zp = '\0';	/* Shouldn't matter, but ... */
-	    cur->mb_len = zp - (cur->mb_data + cur->mb_start);
-	    if (cur->mb_next) {
-		/* If the next buffer is empty, free it */
-		mx_buffer_free(cur->mb_next);
-		cur->mb_next = NULL;
-	    }
-	    return TRUE;
-	}
+/*
+ * Does the server's hello offer NETCONF 1.1?  The hello may be spread
+ * over a chain of buffers, so if it is, we gather it up first.
+ */
+static int
+mx_channel_netconf_hello_has_11 (mx_channel_t *mcp)
+{
+    mx_buffer_t *mbp = mcp->mc_rbufp, *cur;
+    unsigned long len = 0;
+    int rc;
 
-    } else {
+    for (cur = mbp; cur; cur = cur->mb_next)
+	len += cur->mb_len;
 
-	int left = cp - (cur->mb_data + cur->mb_start);
-	czp = mx_netconf_marker + mx_netconf_marker_len - left;
-	if (memcmp(cp, czp, left) == 0) {
-	    if (prev) {
-		left = mx_netconf_marker_len - left;
-		if (memcmp(prev->mb_data + prev->mb_start
-			   + prev->mb_len - left,
-			   mx_netconf_marker, left) == 0) {
-		    prev->mb_len -= left;
-		    /* Shouldn't matter, but ... */
-		    prev->mb_data[prev->mb_start + prev->mb_len] = '\0';
-
-		    prev->mb_next = NULL;
-		    mx_buffer_free(cur);
-		    return TRUE;
-		}
-	    }
+    if (mbp->mb_next) {
+	mbp = mx_buffer_create(len);
+	if (mbp == NULL)
+	    return FALSE;
+
+	for (cur = mcp->mc_rbufp; cur; cur = cur->mb_next) {
+	    memcpy(mbp->mb_data + mbp->mb_len,
+		   cur->mb_data + cur->mb_start, cur->mb_len);
+	    mbp->mb_len += cur->mb_len;
 	}
     }
 
-    return FALSE;
+    rc = (memmem(mbp->mb_data + mbp->mb_start, mbp->mb_len, NETCONF_BASE_1_1,
+		 sizeof(NETCONF_BASE_1_1) - 1) != NULL);
+
+    if (mbp != mcp->mc_rbufp)
+	mx_buffer_free(mbp);
+
+    return rc;
 }
 
+/*
+ * Read the server's hello, which we discard, after noting whether
+ * we'll be using chunked framing.  Returns TRUE when we've seen the
+ * end of it; FALSE if we need to wait for more.
+ */
 static int
 mx_channel_netconf_read_hello (mx_channel_t *mcp)
 {
     mx_buffer_t *mbp = mcp->mc_rbufp;
+    long end;
     int len;
 
+    while (mbp->mb_next)
+	mbp = mbp->mb_next;
+
     for (;;) {
 	if (mbp->mb_start + mbp->mb_len == mbp->mb_size) {
 	    mx_buffer_t *newp = mx_buffer_create(0);
 	    if (newp == NULL) {
 		mx_log("C%u cannot extend buffer", mcp->mc_id);
-		return TRUE;
+		mcp->mc_state = MSS_FAILED;
+		return FALSE;
 	    }
 
 	    mbp->mb_next = newp;
@@ -238,47 +291,435 @@ mx_channel_netconf_read_hello (mx_channel_t *mcp)
 	len = mx_channel_read(mcp, mbp->mb_data + mbp->mb_start + mbp->mb_len,
 			       mbp->mb_size - (mbp->mb_start + mbp->mb_len));
 
-	if (libssh2_channel_eof(mcp->mc_channel)) {
-	    DBG_POLL("C%u eof during read_hello", mcp->mc_id);
+	if (len == LIBSSH2_ERROR_EAGAIN) {
+	    /* Nothing to read yet; the session poller will be back */
+	    DBG_POLL("C%u is drained", mcp->mc_id);
 	    return FALSE;
 	}
 
-	if (len == LIBSSH2_ERROR_EAGAIN) {
-	    /* Nothing to read, nothing to write; move on */
-	    DBG_POLL("C%u is drained", mcp->mc_id);
-#if 0
-	    break;
-#else
-	    sleep(1);
-	    continue;
-#endif
+	if (len < 0 || libssh2_channel_eof(mcp->mc_channel)) {
+	    mx_log("C%u %s during read_hello", mcp->mc_id,
+		   (len < 0) ? "error" : "eof");
+	    mcp->mc_state = MSS_FAILED;
+	    return FALSE;
 	}
 
-	if (len < 0)
-	    return TRUE;
+	DBG_POLL("C%u read %d", mcp->mc_id, len);
 
+	/* Only the new bytes need looking at */
+	end = mx_netconf_marker_match(&mcp->mc_marker_seen, mbp->mb_data
+				      + mbp->mb_start + mbp->mb_len, len);
 	mbp->mb_len += len;
-	DBG_POLL("C%u read %d", mcp->mc_id, len);
+	if (end < 0)
+	    continue;
+
+	/* Both ends must offer 1.1 to use it (RFC 6242) */
+	if (mx_channel_netconf_offers_11(mcp)
+		&& mx_channel_netconf_hello_has_11(mcp)) {
+	    mx_log("C%u using netconf 1.1 chunked framing", mcp->mc_id);
+	    mcf_set_chunked(mcp);
+	}
+
+	mbp = mcp->mc_rbufp;
+	mx_log("C%u found end-of-frame; len %lu, discarding",
+	       mcp->mc_id, mbp->mb_len);
+	mbp->mb_len = mbp->mb_start = 0;
+	if (mbp->mb_next) {
+	    mx_buffer_free(mbp->mb_next);
+	    mbp->mb_next = NULL;
+	}
+	return TRUE;
+    }
+}
+
+/*
+ * Is the channel still being opened?
+ */
+int
+mx_channel_is_opening (mx_channel_t *mcp)
+{
+    switch (mcp->mc_state) {
+    case MSS_CHANNEL_OPEN:
+    case MSS_CHANNEL_STARTUP:
+    case MSS_HELLO_WRITE:
+    case MSS_HELLO_READ:
+	return TRUE;
+    }
+
+    return FALSE;
+}
+
+/*
+ * Move a netconf channel thru its startup states: open the channel,
+ * start the netconf subsystem (or xml-mode), send our hello, and
+ * read theirs.  Each step may return LIBSSH2_ERROR_EAGAIN, in which
+ * case we stay in the current state and mx_session_poller() calls
+ * us again when the session's socket is ready.
+ *
+ * Returns TRUE if the channel failed and has been closed.
+ */
+int
+mx_channel_netconf_continue (mx_channel_t *mcp)
+{
+    mx_sock_session_t *mssp = mcp->mc_session;
+    static const char command[] = "xml-mode netconf need-trailer";
+    int rc;
+
+    switch (mcp->mc_state) {
+    case MSS_CHANNEL_OPEN:
+	mcp->mc_channel = mx_channel_open(mssp);
+	if (mcp->mc_channel == NULL) {
+	    if (libssh2_session_last_errno(mssp->mss_session)
+		    == LIBSSH2_ERROR_EAGAIN)
+		return FALSE;
+
+	    mx_log("%s could not open netconf channel",
+		   mx_sock_title(&mssp->mss_base));
+	    goto failed;
+	}
 
-	if (mx_channel_netconf_has_marker(mcp)) {
-	    mx_log("C%u found end-of-frame; len %lu, discarding",
-		   mcp->mc_id, mcp->mc_rbufp->mb_len);
-	    mbp->mb_len = mbp->mb_start = 0;
-	    if (mbp->mb_next) {
-		mx_buffer_free(mbp->mb_next);
-		mbp->mb_next = NULL;
+	mcp->mc_state = MSS_CHANNEL_STARTUP;
+	/* fallthru */
+
+    case MSS_CHANNEL_STARTUP:
+	if (!mcf_is_xml_mode(mcp)) {
+	    rc = libssh2_channel_subsystem(mcp->mc_channel, "netconf");
+	    if (rc == LIBSSH2_ERROR_EAGAIN)
+		return FALSE;
+
+	    if (rc == 0) {
+		mx_log("%s opened netconf subsystem channel to %s",
+		       mx_sock_title(&mssp->mss_base), mssp->mss_target);
+	    } else {
+		/* Don't ask again; later channels go straight to xml-mode */
+		mx_log("%s could not open netconf subsystem; using xml-mode",
+		       mx_sock_title(&mssp->mss_base));
+		mssp->mss_xml_mode = TRUE;
+		mcf_set_xml_mode(mcp);
+	    }
+	}
+
+	if (mcf_is_xml_mode(mcp)) {
+	    rc = libssh2_channel_process_startup(mcp->mc_channel,
+						 "exec", sizeof("exec") - 1,
+						 command, strlen(command));
+	    if (rc == LIBSSH2_ERROR_EAGAIN)
+		return FALSE;
+
+	    if (rc != 0) {
+		mx_log("%s could not open netconf xml-mode",
+		       mx_sock_title(&mssp->mss_base));
+		goto failed;
 	    }
-	    return TRUE;
+
+	    mx_log("%s opened netconf xml-mode channel to %s",
+		   mx_sock_title(&mssp->mss_base), mssp->mss_target);
 	}
+
+	mcp->mc_state = MSS_HELLO_WRITE;
+	mcp->mc_hello_sent = 0;
+	/* fallthru */
+
+    case MSS_HELLO_WRITE:
+	if (!mx_channel_netconf_send_hello(mcp)) {
+	    if (mcp->mc_state == MSS_FAILED)
+		goto failed;
+	    return FALSE;
+	}
+
+	mcp->mc_state = MSS_HELLO_READ;
+	/* fallthru */
+
+    case MSS_HELLO_READ:
+	if (!mx_channel_netconf_read_hello(mcp)) {
+	    if (mcp->mc_state == MSS_FAILED)
+		goto failed;
+	    return FALSE;
+	}
+
+	mcp->mc_state = MSS_RPC_INITIAL;
+	mx_log("C%u netconf channel is ready", mcp->mc_id);
+
+	/* If requests have been waiting for us, let them go */
+	if (mcp->mc_pipe_count)
+	    mx_request_channel_ready(mcp);
+	else if (mcp->mc_client == NULL)
+	    mx_channel_release(mcp); /* Into the idle pool */
+	break;
     }
 
     return FALSE;
+
+ failed:
+    mx_log("C%u netconf channel startup failed", mcp->mc_id);
+
+    /* Don't keep trying to fill the pool if the device won't have it */
+    if (mcp->mc_client == NULL && mcp->mc_pipe_count == 0)
+	mssp->mss_pool_retry = time(NULL) + MX_CHANNEL_POOL_RETRY;
+
+    if (mcp->mc_pipe_count)
+	mx_request_channel_failed(mcp, "could not open netconf channel");
+
+    TAILQ_REMOVE(&mssp->mss_channels, mcp, mc_link);
+    mx_channel_close(mcp);
+
+    return TRUE;
 }
 
+/*
+ * Add a request to the channel's pipeline; its reply will follow
+ * those of the requests already there.  Returns FALSE if the
+ * pipeline is full.
+ */
+int
+mx_channel_pipeline_push (mx_channel_t *mcp, mx_request_t *mrp)
+{
+    unsigned slot;
+
+    if (mcp->mc_pipe_count >= MX_PIPELINE_MAX)
+	return FALSE;
+
+    slot = (mcp->mc_pipe_first + mcp->mc_pipe_count) % MX_PIPELINE_MAX;
+    mcp->mc_pipeline[slot] = mrp->mr_id;
+    if (mcp->mc_pipe_count++ == 0)
+	mcp->mc_request = mrp;
+
+    mrp->mr_channel = mcp;
+    return TRUE;
+}
+
+/*
+ * Remove the head of the channel's pipeline, returning its request
+ * ID (or zero if the pipeline is empty).  mc_request becomes the
+ * next request, which is NULL if that request has been freed.
+ */
+unsigned
+mx_channel_pipeline_shift (mx_channel_t *mcp)
+{
+    mx_request_t *mrp;
+    unsigned id;
+
+    mcp->mc_request = NULL;
+    if (mcp->mc_pipe_count == 0)
+	return 0;
+
+    id = mcp->mc_pipeline[mcp->mc_pipe_first];
+
+    /* The request (if it's still around) is done with us */
+    mrp = mx_request_find(0, id);
+    if (mrp && mrp->mr_channel == mcp)
+	mrp->mr_channel = NULL;
+    mcp->mc_pipe_first = (mcp->mc_pipe_first + 1) % MX_PIPELINE_MAX;
+    mcp->mc_pipe_count -= 1;
+
+    if (mcp->mc_pipe_count)
+	mcp->mc_request = mx_request_find(0,
+				mcp->mc_pipeline[mcp->mc_pipe_first]);
+
+    return id;
+}
+
+/*
+ * A reply is complete; start on the next one.  Returns TRUE if
+ * more replies are expected on this channel.
+ */
+static int
+mx_channel_pipeline_next (mx_channel_t *mcp)
+{
+    mx_channel_pipeline_shift(mcp);
+    if (mcp->mc_pipe_count == 0)
+	return FALSE;
+
+    mx_log("C%u next reply is for R%u (%u outstanding)", mcp->mc_id,
+	   mcp->mc_pipeline[mcp->mc_pipe_first], mcp->mc_pipe_count);
+
+    mcp->mc_state = MSS_RPC_INITIAL;
+    return TRUE;
+}
+
+/*
+ * A streamed RPC holds its channel until the body is all written, so
+ * nothing can be pipelined behind it.  Since nothing goes in after
+ * it, it's always the newest entry.
+ */
+static int
+mx_channel_is_streaming (mx_channel_t *mcp)
+{
+    mx_request_t *mrp;
+    unsigned slot;
+
+    if (mcf_is_upload(mcp))
+	return TRUE;
+    if (mcp->mc_pipe_count == 0)
+	return FALSE;
+
+    slot = (mcp->mc_pipe_first + mcp->mc_pipe_count - 1) % MX_PIPELINE_MAX;
+    mrp = mx_request_find(0, mcp->mc_pipeline[slot]);
+
+    return (mrp && (mrp->mr_flags & MRF_STREAM));
+}
+
+/*
+ * Find a channel that's already running RPCs for this client and
+ * has room in its pipeline for another.
+ */
+mx_channel_t *
+mx_channel_pipeline_find (mx_sock_session_t *mssp, mx_sock_t *client)
+{
+    mx_channel_t *mcp;
+    unsigned max = opt_pipeline_max;
+
+    if (max > MX_PIPELINE_MAX)
+	max = MX_PIPELINE_MAX;
+    if (max <= 1 || client == NULL)
+	return NULL;
+
+    TAILQ_FOREACH(mcp, &mssp->mss_channels, mc_link) {
+	if (mcp->mc_client != client || mcp->mc_state == MSS_FAILED
+		|| mcf_is_hold_channel(mcp) || mx_channel_is_streaming(mcp)
+		|| mcp->mc_sendq)
+	    continue;
+
+	if (mcp->mc_pipe_count != 0 && mcp->mc_pipe_count < max)
+	    return mcp;
+    }
+
+    return NULL;
+}
+
+/*
+ * Count the channels that are carrying RPCs (or opening to carry
+ * them).  Idle channels, and those opening for the pool, don't count.
+ */
+unsigned
+mx_channel_busy_count (mx_sock_session_t *mssp)
+{
+    mx_channel_t *mcp;
+    unsigned count = 0;
+
+    TAILQ_FOREACH(mcp, &mssp->mss_channels, mc_link) {
+	if (mcp->mc_client || mcp->mc_pipe_count)
+	    count += 1;
+    }
+
+    return count;
+}
+
+/*
+ * A request is going away.  If its reply is still to come, we'll
+ * read and discard it when it arrives.
+ */
+void
+mx_channel_forget_request (mx_channel_t *mcp, mx_request_t *mrp)
+{
+    if (mcp && mcp->mc_request == mrp)
+	mcp->mc_request = NULL;
+}
+
+/*
+ * Close a channel whose replies nobody wants, so the device stops
+ * producing them.  We can't know where the device was in its output,
+ * so the channel can't go back into the pool.
+ */
+static void
+mx_channel_kill (mx_channel_t *mcp)
+{
+    mx_sock_session_t *mssp = mcp->mc_session;
+
+    mx_log("C%u closing to stop %u unwanted replies",
+	   mcp->mc_id, mcp->mc_pipe_count);
+
+    while (mx_channel_pipeline_shift(mcp) != 0)
+	continue;
+
+    mssp->mss_cancelled += 1;
+    TAILQ_REMOVE(&mssp->mss_channels, mcp, mc_link);
+    mx_channel_close(mcp);
+}
+
+/*
+ * A request on this channel has been cancelled.  If no other request
+ * on the channel still wants its reply, we close the channel.
+ * Otherwise the cancelled reply is read and discarded when its turn
+ * comes, since closing would take the others down with it.
+ */
+void
+mx_channel_cancel (mx_channel_t *mcp, mx_request_t *mrp)
+{
+    mx_request_t *other;
+    unsigned i, id;
+    int found = FALSE;
+
+    mx_channel_forget_request(mcp, mrp);
+
+    /* If the RPC hasn't been sent, mx_request_channel_ready skips it */
+    if (mx_channel_is_opening(mcp))
+	return;
+
+    /* Half an RPC can't be taken back */
+    if (mcf_is_upload(mcp) || mcp->mc_sendq) {
+	mx_channel_kill(mcp);
+	return;
+    }
+
+    for (i = 0; i < mcp->mc_pipe_count; i++) {
+	id = mcp->mc_pipeline[(mcp->mc_pipe_first + i) % MX_PIPELINE_MAX];
+	if (id == mrp->mr_id) {
+	    found = TRUE;
+	    continue;
+	}
+
+	other = mx_request_find(0, id);
+	if (other && other->mr_client && other->mr_state != MSS_FAILED
+		&& other->mr_state != MSS_ERROR) {
+	    mx_log("C%u R%u cancelled; discarding its reply for R%u's sake",
+		   mcp->mc_id, mrp->mr_id, other->mr_id);
+	    return;
+	}
+    }
+
+    if (found)
+	mx_channel_kill(mcp);
+}
+
+/*
+ * The channel's client has gone away.  If replies are still coming,
+ * we close the channel rather than read them.  A channel that's
+ * still opening goes into the idle pool once it's ready.
+ */
+void
+mx_channel_detach_client (mx_channel_t *mcp, mx_sock_t *client)
+{
+    if (mcp == NULL || mcp->mc_client != client)
+	return;
+
+    if (mcp->mc_pipe_count == 0) {
+	mx_channel_release(mcp);
+	return;
+    }
+
+    if (!mx_channel_is_opening(mcp)) {
+	mx_channel_kill(mcp);
+	return;
+    }
+
+    mx_log("C%u still opening for departed client S%u",
+	   mcp->mc_id, client->ms_id);
+
+    if (mx_mti(client)->mti_set_channel)
+	mx_mti(client)->mti_set_channel(client, NULL, NULL);
+    mcp->mc_client = NULL;
+    mcp->mc_request = NULL;
+}
+
+/*
+ * Find or make a netconf channel for a client.  A new channel is
+ * returned in the MSS_CHANNEL_OPEN state and will finish opening in
+ * the background; use mx_channel_is_opening() to tell.
+ */
 mx_channel_t *
 mx_channel_netconf (mx_sock_session_t *mssp, mx_sock_t *client, int xml_mode)
 {
-    LIBSSH2_CHANNEL *channel;
     mx_channel_t *mcp;
 
     mcp = TAILQ_FIRST(&mssp->mss_released);
@@ -298,57 +739,47 @@ mx_channel_netconf (mx_sock_session_t *mssp, mx_sock_t *client, int xml_mode)
 	return mcp;
     }
 
-    /* Must use blocking IO for channel creation */
-    libssh2_session_set_blocking(mssp->mss_session, 1);
-
-    channel = libssh2_channel_open_session(mssp->mss_session);
-    if (channel == NULL) {
-	mx_log("%s could not open netconf channel",
-               mx_sock_title(&mssp->mss_base));
-	return NULL;
+    /* Next best is to pipeline behind this client's other RPCs */
+    mcp = mx_channel_pipeline_find(mssp, client);
+    if (mcp) {
+	mx_log("%s pipelining on channel C%u for client S%u (%u outstanding)",
+               mx_sock_title(&mssp->mss_base),
+	       mcp->mc_id, client->ms_id, mcp->mc_pipe_count);
+	return mcp;
     }
 
-    if (!xml_mode) {
-	if (libssh2_channel_subsystem(channel, "netconf") != 0) {
-	    mx_log("%s could not open netconf subsystem",
-		   mx_sock_title(&mssp->mss_base));
-	    goto try_xml_mode;
-	}
-	mx_log("%s opened netconf subsystem channel to %s",
-	       mx_sock_title(&mssp->mss_base), mssp->mss_target);
-    } else {
-	static const char command[] = "xml-mode netconf need-trailer";
-
-    try_xml_mode:
-	if (libssh2_channel_process_startup(channel,
-					    "exec", sizeof("exec") - 1,
-					    command, strlen(command)) != 0) {
-	    mx_log("%s could not open netconf xml-mode",
-		   mx_sock_title(&mssp->mss_base));
-	    libssh2_channel_free(channel);
-	    channel = NULL;
-	} else {
-	    mx_log("%s opened netconf xml-mode channel to %s",
-		   mx_sock_title(&mssp->mss_base), mssp->mss_target);
-	}
+    /* A channel that's opening for the pool is better than nothing */
+    TAILQ_FOREACH(mcp, &mssp->mss_channels, mc_link) {
+	if (mcp->mc_client == NULL && mcp->mc_pipe_count == 0
+		&& mx_channel_is_opening(mcp))
+	    break;
     }
 
-    libssh2_session_set_blocking(mssp->mss_session, 0);
+    if (mcp) {
+	mx_log("%s claiming opening channel C%u for client S%u",
+               mx_sock_title(&mssp->mss_base),
+	       mcp->mc_id, client->ms_id);
 
-    if (channel == NULL) {
-	mx_log("%s could not open netconf channel",
-               mx_sock_title(&mssp->mss_base));
-	return NULL;
+	mcp->mc_client = client;
+	if (mx_mti(client)->mti_set_channel)
+	    mx_mti(client)->mti_set_channel(client, mcp->mc_session, mcp);
+
+	return mcp;
     }
 
-    mcp = mx_channel_create(mssp, client, channel);
+    mcp = mx_channel_create(mssp, client, NULL);
     if (mcp == NULL) {
-	/* XXX fail */
+	mx_log("%s could not create netconf channel",
+               mx_sock_title(&mssp->mss_base));
 	return NULL;
     }
 
-    mx_channel_netconf_send_hello(mcp);
-    mx_channel_netconf_read_hello(mcp);
+    mcp->mc_state = MSS_CHANNEL_OPEN;
+    if (xml_mode || mssp->mss_xml_mode)
+	mcf_set_xml_mode(mcp);
+
+    if (mx_channel_netconf_continue(mcp))
+	return NULL;
 
     return mcp;
 }
@@ -365,8 +796,12 @@ mx_channel_close (mx_channel_t *mcp)
 	    mx_mti(msp)->mti_set_channel(msp, NULL, NULL);
     }
 
-    libssh2_channel_free(mcp->mc_channel);
+    if (mcp->mc_channel)
+	libssh2_channel_free(mcp->mc_channel);
     mcp->mc_channel = NULL;
+    mx_buffer_free(mcp->mc_rbufp);
+    if (mcp->mc_sendq)
+	mx_buffer_free(mcp->mc_sendq);
     free(mcp);
 }
 
@@ -395,74 +830,449 @@ mx_channel_write_buffer (mx_channel_t *mcp, mx_buffer_t *mbp)
     return slen;
 }
 
+/*
+ * Add pieces to the channel's send queue, skipping the first "skip"
+ * bytes (which have been written).  The queue is a single buffer,
+ * regrown as needed; it only holds the unwritten tail of an RPC or
+ * two, so copying it is cheap.
+ */
 static int
-mx_channel_netconf_detect_marker (mx_channel_t *mcp UNUSED,
-				  mx_buffer_t *mbp UNUSED)
-{
-    mx_offset_t len;
-    char *sp, *cp, *ep, *zp;
-
-    if (mcp->mc_marker_seen) {
-	mx_log("C%u netconf: checking for marker at beginning (%lu/%lu)",
-	       mcp->mc_id, mcp->mc_marker_seen, mbp->mb_len);
-
-	len = mx_netconf_marker_len - mcp->mc_marker_seen;
-	if (len > mbp->mb_len)
-	    len = mbp->mb_len;
-
-	cp = mbp->mb_data + mbp->mb_start;
-	if (memcmp(cp, mx_netconf_marker + mcp->mc_marker_seen, len) == 0) {
-	    if (len != mx_netconf_marker_len - mcp->mc_marker_seen) {
-		mx_log("C%u netconf marker more found (%lu/%lu)",
-		       mcp->mc_id, mcp->mc_marker_seen, mbp->mb_len);
-		mcp->mc_marker_seen += len;
-		mbp->mb_start = mbp->mb_len = 0;
-		return FALSE;
+mx_channel_sendq_append (mx_channel_t *mcp, const struct iovec *iov,
+			 int iovcnt, unsigned long skip)
+{
+    mx_buffer_t *old = mcp->mc_sendq, *mbp;
+    unsigned long len = old ? old->mb_len : 0;
+    int i;
+
+    for (i = 0; i < iovcnt; i++)
+	len += iov[i].iov_len;
+    len -= skip;
+
+    mbp = mx_buffer_create(len);
+    if (mbp == NULL)
+	return FALSE;
+
+    if (old) {
+	memcpy(mbp->mb_data, old->mb_data + old->mb_start, old->mb_len);
+	mbp->mb_len = old->mb_len;
+	mx_buffer_free(old);
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+	unsigned long ilen = iov[i].iov_len;
+	const char *base = iov[i].iov_base;
+
+	if (skip >= ilen) {
+	    skip -= ilen;
+	    continue;
+	}
+
+	memcpy(mbp->mb_data + mbp->mb_len, base + skip, ilen - skip);
+	mbp->mb_len += ilen - skip;
+	skip = 0;
+    }
+
+    mcp->mc_sendq = mbp;
+    return TRUE;
+}
+
+/*
+ * Write whatever the send queue holds.  Returns 1 when it's empty,
+ * 0 if the channel is full, and -1 on error.  The session poller
+ * calls this on every pass until the queue drains.
+ */
+int
+mx_channel_send_flush (mx_channel_t *mcp)
+{
+    mx_buffer_t *mbp = mcp->mc_sendq;
+    int rc;
+
+    while (mbp && mbp->mb_len) {
+	rc = mx_channel_write(mcp, mbp->mb_data + mbp->mb_start, mbp->mb_len);
+	if (rc == LIBSSH2_ERROR_EAGAIN)
+	    return 0;
+	if (rc < 0) {
+	    mx_log("C%u write failed %d", mcp->mc_id, rc);
+	    return -1;
+	}
+
+	mbp->mb_start += rc;
+	mbp->mb_len -= rc;
+    }
+
+    if (mbp) {
+	mx_log("C%u send queue drained", mcp->mc_id);
+	mx_buffer_free(mbp);
+	mcp->mc_sendq = NULL;
+    }
+
+    return 1;
+}
+
+/*
+ * Write a set of pieces to the channel, in order.  libssh2 has no
+ * vectored write, but this saves our callers from gluing the pieces
+ * together in a fresh buffer first.
+ *
+ * A non-blocking write can take part of an RPC and then stall, and
+ * we can't drop the rest, or the device would see half an RPC (with
+ * the next one glued on).  So whatever isn't taken goes on the send
+ * queue, which mx_channel_send_flush writes as the channel opens up;
+ * while anything is queued, later pieces queue behind it.  Returns
+ * the number of bytes taken (written or queued), or the error.
+ */
+int
+mx_channel_writev (mx_channel_t *mcp, const struct iovec *iov, int iovcnt)
+{
+    const char *buf;
+    int i, len, rc, total = 0;
+
+    if (mcp->mc_sendq && mx_channel_send_flush(mcp) < 0)
+	return -1;
+
+    for (i = 0; i < iovcnt && mcp->mc_sendq == NULL; i++) {
+	buf = iov[i].iov_base;
+	len = iov[i].iov_len;
+
+	while (len > 0) {
+	    rc = mx_channel_write(mcp, buf, len);
+	    if (rc == LIBSSH2_ERROR_EAGAIN)
+		goto queue;
+	    if (rc < 0) {
+		mx_log("C%u write failed %d", mcp->mc_id, rc);
+		return rc;
 	    }
 
-	    mx_log("C%u netconf marker found at beginning (%lu/%lu)",
-		   mcp->mc_id, mcp->mc_marker_seen, mbp->mb_len);
-	    mcf_set_seen_eoframe(mcp);
-	    mx_buffer_reset(mbp);
-	    return TRUE;
+	    buf += rc;
+	    len -= rc;
+	    total += rc;
 	}
     }
 
-    sp = mbp->mb_data + mbp->mb_start;
-    zp = mbp->mb_data + mbp->mb_start + mbp->mb_len;
+    if (i == iovcnt)
+	return total;
+
+ queue:
+    for (len = 0, i = 0; i < iovcnt; i++)
+	len += iov[i].iov_len;
+
+    /* The first "total" bytes made it out; queue the rest */
+    if (!mx_channel_sendq_append(mcp, iov, iovcnt, total)) {
+	mx_log("C%u cannot queue %d bytes", mcp->mc_id, len - total);
+	return -1;
+    }
+
+    DBG_POLL("C%u channel full; queued %d bytes", mcp->mc_id, len - total);
+    return len;
+}
+
+/*
+ * A large RPC can be streamed to the device as its body arrives from
+ * the client, instead of being buffered whole.  The framing around
+ * the body (and, for 1.1, each chunk header) is staged in
+ * mc_upload_frame, since a non-blocking write may take only part of
+ * it; staged bytes always go out before any more of the body.
+ */
+static void
+mx_channel_upload_stage (mx_channel_t *mcp, const char *fmt, ...)
+{
+    va_list vap;
+
+    va_start(vap, fmt);
+    mcp->mc_upload_flen = vsnprintf(mcp->mc_upload_frame,
+				    sizeof(mcp->mc_upload_frame), fmt, vap);
+    mcp->mc_upload_fstart = 0;
+    va_end(vap);
+}
 
-    for (ep = zp - 1; ep >= sp; ep--)
-	if (!isspace((int) *ep))  /* skip trailing white space */
+/*
+ * Write whatever framing is staged.  Returns 1 when it's all out, 0
+ * if the channel is full, and -1 on error.
+ */
+static int
+mx_channel_upload_flush (mx_channel_t *mcp)
+{
+    int rc;
+
+    /* RPCs ahead of us on the channel go first */
+    if (mcp->mc_sendq) {
+	rc = mx_channel_send_flush(mcp);
+	if (rc <= 0)
+	    return rc;
+    }
+
+    while (mcp->mc_upload_fstart < mcp->mc_upload_flen) {
+	rc = mx_channel_write(mcp,
+			      mcp->mc_upload_frame + mcp->mc_upload_fstart,
+			      mcp->mc_upload_flen - mcp->mc_upload_fstart);
+	if (rc == LIBSSH2_ERROR_EAGAIN)
+	    return 0;
+	if (rc < 0) {
+	    mx_log("C%u upload write failed %d", mcp->mc_id, rc);
+	    return -1;
+	}
+
+	mcp->mc_upload_fstart += rc;
+    }
+
+    return 1;
+}
+
+/*
+ * Start streaming an RPC, staging its opening framing.  The channel
+ * carries nothing else until mx_channel_upload_finish is done.
+ */
+void
+mx_channel_upload_start (mx_channel_t *mcp, const char *prefix)
+{
+    mcf_set_upload(mcp);
+    mcf_clear_upload_end(mcp);
+    mcp->mc_upload_owed = 0;
+
+    if (mcf_is_chunked(mcp))
+	mx_channel_upload_stage(mcp, "\n#%lu\n%s",
+				(unsigned long) strlen(prefix), prefix);
+    else
+	mx_channel_upload_stage(mcp, "%s", prefix);
+}
+
+/*
+ * Write some of an RPC body.  Returns the number of bytes taken
+ * (zero if the channel is full) or -1 on error.  With chunked
+ * framing, each burst of data becomes a chunk of its own.
+ */
+int
+mx_channel_upload (mx_channel_t *mcp, const char *buf, unsigned long len)
+{
+    unsigned long want;
+    int rc, total = 0;
+
+    rc = mx_channel_upload_flush(mcp);
+    if (rc <= 0)
+	return rc;
+
+    while (len > 0) {
+	if (mcf_is_chunked(mcp) && mcp->mc_upload_owed == 0) {
+	    mcp->mc_upload_owed = len;
+	    mx_channel_upload_stage(mcp, "\n#%lu\n", len);
+
+	    rc = mx_channel_upload_flush(mcp);
+	    if (rc < 0)
+		return rc;
+	    if (rc == 0)
+		break;
+	}
+
+	want = len;
+	if (mcf_is_chunked(mcp) && want > mcp->mc_upload_owed)
+	    want = mcp->mc_upload_owed;
+
+	rc = mx_channel_write(mcp, buf, want);
+	if (rc == LIBSSH2_ERROR_EAGAIN)
 	    break;
-    ep += 1;
+	if (rc < 0) {
+	    mx_log("C%u upload write failed %d", mcp->mc_id, rc);
+	    return -1;
+	}
+
+	if (mcf_is_chunked(mcp))
+	    mcp->mc_upload_owed -= rc;
+	buf += rc;
+	len -= rc;
+	total += rc;
+    }
+
+    return total;
+}
+
+/*
+ * The body is all written; send the closing framing.  Returns 1 when
+ * the RPC is complete, 0 if we need to be called again when the
+ * channel has room, and -1 on error.
+ */
+int
+mx_channel_upload_finish (mx_channel_t *mcp, const char *suffix)
+{
+    int rc;
+
+    rc = mx_channel_upload_flush(mcp);
+    if (rc <= 0)
+	return rc;
+
+    if (!mcf_is_upload_end(mcp)) {
+	if (mcf_is_chunked(mcp))
+	    mx_channel_upload_stage(mcp, "\n#%lu\n%s%s",
+				    (unsigned long) strlen(suffix), suffix,
+				    NETCONF_CHUNK_END);
+	else
+	    mx_channel_upload_stage(mcp, "%s%s", suffix, NETCONF_MARKER);
+	mcf_set_upload_end(mcp);
+
+	rc = mx_channel_upload_flush(mcp);
+	if (rc <= 0)
+	    return rc;
+    }
 
-    cp = ep - mx_netconf_marker_len;
-    for ( ; cp >= sp && cp < ep; cp++) {
-	if (memcmp(cp, mx_netconf_marker, ep - cp) == 0)
-	    goto found;
-	if (ep != zp - 1)	/* If there was trailing whitespace */
+    mcf_clear_upload(mcp);
+    mcf_clear_upload_end(mcp);
+    return 1;
+}
+
+/*
+ * With pipelined RPCs, the next reply can follow the end-of-frame
+ * marker in the same read.  Record where it starts (skipping the
+ * white space between replies) so mx_channel_handle_input can pick
+ * it up once this reply is complete.
+ */
+static void
+mx_channel_netconf_save_next (mx_channel_t *mcp, mx_buffer_t *mbp,
+			      char *cp, char *zp)
+{
+    for ( ; cp < zp; cp++)
+	if (!isspace((int) *cp))
 	    break;
+
+    if (cp < zp) {
+	mcp->mc_next_start = cp - mbp->mb_data;
+	mcp->mc_next_len = zp - cp;
+	mx_log("C%u netconf: %lu bytes of next reply follow marker",
+	       mcp->mc_id, mcp->mc_next_len);
     }
+}
+
+static int
+mx_channel_netconf_detect_marker (mx_channel_t *mcp, mx_buffer_t *mbp)
+{
+    char *ep = mbp->mb_data + mbp->mb_start + mbp->mb_len;
+    long end;
 
-    return FALSE;		/* Nothing interesting */
+    end = mx_netconf_marker_detect(&mcp->mc_marker_seen, mbp);
+    if (end < 0)
+	return FALSE;
 
- found:
-    /*
-     * We've found part of the end-of-frame marker.  If we found the whole
-     * thing, then life is good.  We set the start to done.
-     */
-    mbp->mb_len -= zp - cp;
+    mx_log("C%u netconf marker found", mcp->mc_id);
+    mcf_set_seen_eoframe(mcp);
+    mx_channel_netconf_save_next(mcp, mbp, mbp->mb_data + end, ep);
+    return TRUE;
+}
 
-    if (ep - cp == mx_netconf_marker_len) {
-	mx_log("C%u netconf marker found", mcp->mc_id);
-	mcf_set_seen_eoframe(mcp);
-	return TRUE;
+/*
+ * NETCONF 1.1 replies come in chunks (RFC 6242):
+ *
+ *   \n#<chunk-size>\n<chunk-data>...\n##\n
+ *
+ * We look at the framing a byte at a time, but chunk data is skipped
+ * by its length, never scanned.  The buffer is trimmed to the run of
+ * chunk data at its front, and whatever follows is saved in
+ * mc_next_start/mc_next_len, to be decoded once the data has been
+ * written.  On the end-of-chunks, we set the seen-eoframe flag.
+ * Returns -1 if the framing is bad.
+ */
+#define MCH_LF		0	/* Want the newline starting a chunk */
+#define MCH_HASH	1	/* Want the '#' */
+#define MCH_SIZE_FIRST	2	/* Want the first digit of the size (or '#') */
+#define MCH_SIZE	3	/* Want more digits, or the newline */
+#define MCH_END		4	/* Want the newline ending end-of-chunks */
+#define MCH_DATA	5	/* In chunk data */
+
+static int
+mx_channel_netconf_decode_chunks (mx_channel_t *mcp, mx_buffer_t *mbp)
+{
+    char *cp = mbp->mb_data + mbp->mb_start;
+    char *zp = cp + mbp->mb_len;
+    unsigned long len;
+
+    for ( ; cp < zp; cp++) {
+	switch (mcp->mc_chunk_state) {
+	case MCH_DATA:
+	    len = MIN(mcp->mc_chunk_left, (unsigned long) (zp - cp));
+	    mcp->mc_chunk_left -= len;
+	    if (mcp->mc_chunk_left == 0)
+		mcp->mc_chunk_state = MCH_LF;
+
+	    mbp->mb_start = cp - mbp->mb_data;
+	    mbp->mb_len = len;
+	    cp += len;
+	    goto done;
+
+	case MCH_LF:
+	    if (*cp != '\n')
+		goto bad;
+	    mcp->mc_chunk_state = MCH_HASH;
+	    break;
+
+	case MCH_HASH:
+	    if (*cp != '#')
+		goto bad;
+	    mcp->mc_chunk_state = MCH_SIZE_FIRST;
+	    break;
+
+	case MCH_SIZE_FIRST:
+	    if (*cp == '#') {
+		mcp->mc_chunk_state = MCH_END;
+		break;
+	    }
+
+	    if (*cp < '1' || *cp > '9')
+		goto bad;
+	    mcp->mc_chunk_left = *cp - '0';
+	    mcp->mc_chunk_state = MCH_SIZE;
+	    break;
+
+	case MCH_SIZE:
+	    if (*cp == '\n') {
+		mcp->mc_chunk_state = MCH_DATA;
+		break;
+	    }
+
+	    if (!isdigit((int) *cp)
+		    || mcp->mc_chunk_left > (NETCONF_CHUNK_MAX - 9) / 10)
+		goto bad;
+	    mcp->mc_chunk_left = mcp->mc_chunk_left * 10 + (*cp - '0');
+	    break;
+
+	case MCH_END:
+	    if (*cp != '\n')
+		goto bad;
+
+	    mcp->mc_chunk_state = MCH_LF;
+	    mcf_set_seen_eoframe(mcp);
+	    mbp->mb_len = 0;
+	    cp += 1;
+	    goto done;
+	}
     }
 
-    mx_log("C%u netconf marker partial found (%ld/%lu)",
-	   mcp->mc_id, ep - cp, mbp->mb_len);
-    mcp->mc_marker_seen = ep - cp;
-    return FALSE;
+    /* Nothing but framing */
+    mbp->mb_len = 0;
+    return 0;
+
+ done:
+    /* The rest is the next chunk, or the next reply */
+    if (cp < zp) {
+	mcp->mc_next_start = cp - mbp->mb_data;
+	mcp->mc_next_len = zp - cp;
+    }
+
+    return 0;
+
+ bad:
+    mx_log("C%u netconf: bad chunk framing (state %u, char 0x%02x)",
+	   mcp->mc_id, mcp->mc_chunk_state, (unsigned char) *cp);
+    return -1;
+}
+
+/*
+ * Frame the data we've been handed, as the channel's framing requires
+ */
+static int
+mx_channel_netconf_frame_input (mx_channel_t *mcp, mx_buffer_t *mbp)
+{
+    if (mcf_is_chunked(mcp))
+	return mx_channel_netconf_decode_chunks(mcp, mbp);
+
+    mx_channel_netconf_detect_marker(mcp, mbp);
+    return 0;
 }
 
 void
@@ -476,30 +1286,158 @@ mx_channel_release (mx_channel_t *mcp)
 
     MX_LOG("C%u: release channel, S%u, channel %p, client %s",
 	   mcp->mc_id, session->mss_base.ms_id,
-	   mcp->mc_channel, mx_sock_title(client));
+	   mcp->mc_channel, client ? mx_sock_title(client) : "none");
 
     if (client && mx_mti(client)->mti_set_channel)
 	mx_mti(client)->mti_set_channel(client, NULL, NULL);
     mcp->mc_client = NULL;
     mcp->mc_request = NULL;
+    mcp->mc_pipe_count = 0;
+    mcp->mc_next_len = 0;
+    mcp->mc_idle_since = time(NULL);
+
+    /* Don't let an idle channel sit on a big buffer */
+    mcf_clear_read_full(mcp);
+    mcf_clear_upload(mcp);
+    mcf_clear_upload_end(mcp);
+    mx_channel_resize_buffer(mcp, BUFFER_DEFAULT_SIZE);
 
     TAILQ_REMOVE(&session->mss_channels, mcp, mc_link);
     TAILQ_INSERT_HEAD(&session->mss_released, mcp, mc_link);
 }
 
+static void
+mx_channel_pool_timeout (mx_timer_t *mtp UNUSED, void *arg)
+{
+    mx_channel_pool_check(arg);
+}
+
+/*
+ * Keep a session's idle channel pool between opt_idle_channels_min
+ * and opt_idle_channels_max, so bursts of requests start on warm
+ * channels.  Channels opening for the pool count as idle.  Channels
+ * that sit idle for opt_idle_channel_timeout are closed, as long as
+ * that leaves the minimum.
+ */
+void
+mx_channel_pool_check (mx_sock_session_t *mssp)
+{
+    mx_channel_t *mcp, *prev;
+    unsigned idle = 0, opening = 0;
+    time_t now = time(NULL);
+
+    TAILQ_FOREACH(mcp, &mssp->mss_released, mc_link)
+	idle += 1;
+
+    TAILQ_FOREACH(mcp, &mssp->mss_channels, mc_link) {
+	if (mcp->mc_client == NULL && mcp->mc_pipe_count == 0
+		&& mx_channel_is_opening(mcp))
+	    opening += 1;
+    }
+
+    /*
+     * The released list has the most recently released at the head,
+     * so we trim from the tail.
+     */
+    for (mcp = TAILQ_LAST(&mssp->mss_released, mx_channel_list_s);
+	 mcp; mcp = prev) {
+	prev = TAILQ_PREV(mcp, mx_channel_list_s, mc_link);
+
+	if (idle + opening <= (unsigned) opt_idle_channels_min)
+	    break;
+
+	if (idle <= (unsigned) opt_idle_channels_max
+		&& (opt_idle_channel_timeout <= 0
+		    || now - mcp->mc_idle_since < opt_idle_channel_timeout))
+	    break;
+
+	mx_log("C%u closing idle channel (idle %lds)",
+	       mcp->mc_id, (long) (now - mcp->mc_idle_since));
+	TAILQ_REMOVE(&mssp->mss_released, mcp, mc_link);
+	mx_channel_close(mcp);
+	mssp->mss_pool_trimmed += 1;
+	idle -= 1;
+    }
+
+    /* Wake up when the oldest extra channel has been idle too long */
+    mcp = TAILQ_LAST(&mssp->mss_released, mx_channel_list_s);
+    if (mcp && opt_idle_channel_timeout > 0
+	    && idle + opening > (unsigned) opt_idle_channels_min
+	    && !mx_timer_pending(&mssp->mss_pool_timer)) {
+	time_t left = mcp->mc_idle_since + opt_idle_channel_timeout - now;
+
+	mx_timer_set(&mssp->mss_pool_timer,
+		     (left > 0) ? left * 1000UL : 0,
+		     mx_channel_pool_timeout, mssp);
+    }
+
+    if (mssp->mss_pool_retry > now)
+	return;
+
+    while (idle + opening < (unsigned) opt_idle_channels_min) {
+	mcp = mx_channel_create(mssp, NULL, NULL);
+	if (mcp == NULL)
+	    break;
+
+	mx_log("C%u opening for the idle pool of %s",
+	       mcp->mc_id, mx_sock_title(&mssp->mss_base));
+	mcp->mc_state = MSS_CHANNEL_OPEN;
+	if (mssp->mss_xml_mode)
+	    mcf_set_xml_mode(mcp);
+	mssp->mss_pool_opened += 1;
+	opening += 1;
+
+	if (mx_channel_netconf_continue(mcp))
+	    break;		/* Failed; we've set mss_pool_retry */
+    }
+}
+
 void
 mx_channel_print (mx_channel_t *mcp, int indent, const char *prefix)
 {
     mx_buffer_t *mbp = mcp->mc_rbufp;
     unsigned long read_avail = 0;
 
-    libssh2_channel_window_read_ex(mcp->mc_channel, &read_avail, NULL);
+    if (mcp->mc_channel)
+	libssh2_channel_window_read_ex(mcp->mc_channel, &read_avail, NULL);
 
-    mx_log("%*s%sC%u: S%u, channel %p, client S%u, rb %lu/%lu, avail %lu",
-	   indent + INDENT, "", prefix,
-	   mcp->mc_id, mcp->mc_session->mss_base.ms_id,
+    mx_log("%*s%sC%u: S%u, channel %p, client S%u, state %u, rb %lu/%lu/%lu, "
+	   "avail %lu, pipeline %u, netconf %s, %lu bytes/read",
+	   indent + INDENT, "", prefix, mcp->mc_id,
+	   mcp->mc_session->mss_base.ms_id,
 	   mcp->mc_channel, mcp->mc_client ? mcp->mc_client->ms_id : 0,
-	   mbp->mb_start, mbp->mb_len, read_avail);
+	   mcp->mc_state, mbp->mb_start, mbp->mb_len, mbp->mb_size,
+	   read_avail, mcp->mc_pipe_count, mcf_is_chunked(mcp) ? "1.1" : "1.0",
+	   mcp->mc_reads ? mcp->mc_read_bytes / mcp->mc_reads : 0);
+}
+
+/*
+ * Is the reply we're reading for a client (or request) that has gone
+ * away?  If so, we discard it.
+ */
+static int
+mx_channel_is_vaporized (mx_channel_t *mcp)
+{
+    return (mcp->mc_client == NULL
+	    || (mcp->mc_pipe_count != 0 && mcp->mc_request == NULL));
+}
+
+/*
+ * Is our client's output backed up?  If so, we leave the reply where
+ * it is, which stops the SSH window from opening and so stops the
+ * server from sending more.
+ */
+int
+mx_channel_is_blocked (mx_channel_t *mcp)
+{
+    mx_sock_t *client = mcp->mc_client;
+
+    if (client && mx_mti(client)->mti_is_blocked
+	    && mx_mti(client)->mti_is_blocked(client))
+	return TRUE;
+
+    /* A reply shared by several clients goes at the slowest one's pace */
+    return (mcp->mc_request && mx_request_followers_blocked(mcp->mc_request));
 }
 
 int
@@ -507,10 +1445,30 @@ mx_channel_handle_input (mx_channel_t *mcp)
 {
     mx_buffer_t *mbp = mcp->mc_rbufp;
     int len = mbp->mb_len;
+    int fresh = FALSE;
+
+    /*
+     * Read if nothing's buffered, unless a chunked reply has ended
+     * (or has more to decode) and we've not caught up with it yet.
+     */
+    if (len == 0 && !mcf_is_seen_eoframe(mcp) && mcp->mc_next_len == 0) {
+	if (mx_channel_is_blocked(mcp)) {
+	    DBG_POLL("C%u is blocked on its client", mcp->mc_id);
+	    return 1;
+	}
+
+	/* The last read filled the buffer, so there's more coming */
+	if (mcf_is_read_full(mcp)
+		&& mbp->mb_size < (unsigned) opt_read_buffer_max) {
+	    mx_channel_resize_buffer(mcp, MIN(mbp->mb_size * 2,
+					      (unsigned) opt_read_buffer_max));
+	    mbp = mcp->mc_rbufp;
+	}
 
-    if (len == 0) { /* Nothing buffered */
-	mbp->mb_start = 0;
-	len = mx_channel_read(mcp, mbp->mb_data, mbp->mb_size);
+	/* Leave room in front for our client's header (websocket.c) */
+	mbp->mb_start = BUFFER_HEADROOM;
+	len = mx_channel_read(mcp, mbp->mb_data + mbp->mb_start,
+			      mbp->mb_size - mbp->mb_start);
 	if (len == LIBSSH2_ERROR_EAGAIN) {
 	    /* Nothing to read, nothing to write; move on */
 	    DBG_POLL("C%u is drained", mcp->mc_id);
@@ -525,19 +1483,28 @@ mx_channel_handle_input (mx_channel_t *mcp)
 
 	} else {
 	    mbp->mb_len = len;
+	    fresh = TRUE;
+	    if ((unsigned) len == mbp->mb_size - mbp->mb_start)
+		mcf_set_read_full(mcp);
+	    else
+		mcf_clear_read_full(mcp);
 	}
     }
 
-    mx_channel_netconf_detect_marker(mcp, mbp);
+    /* Input is framed once, as it arrives */
+    if (fresh && mx_channel_netconf_frame_input(mcp, mbp) < 0)
+	goto bad_framing;
 
     /*
      * If the write call would block (returns TRUE), then
      * we move on.
      */
-    if (mcp->mc_client == NULL) {
-	/* The client has vaporized */
-	mbp->mb_start += len;
-	mbp->mb_len -= len;
+    if (mx_channel_is_vaporized(mcp)) {
+	/* The client (or the request) has vaporized */
+	mx_buffer_reset(mbp);
+
+    } else if (mbp->mb_len == 0) {
+	/* Only framing; nothing to write */
 
     } else if (mx_mti(mcp->mc_client)->mti_write(mcp->mc_client, mcp, mbp))
 	return 1;
@@ -557,20 +1524,47 @@ mx_channel_handle_input (mx_channel_t *mcp)
 	 * The RPC is complete, so we can detach the channel from the
 	 * websocket, allowing us to reuse it.
 	 */
-	if (mcp->mc_client == NULL) {
-	    /* Client has vaporized */
-	    if (mcp->mc_request) {
-		mx_log("C%u complete (vaporized) R%u",
-		       mcp->mc_id, mcp->mc_request->mr_id);
+	if (mx_channel_is_vaporized(mcp)) {
+	    /* Client (or request) has vaporized */
+	    if (mcp->mc_pipe_count) {
+		mx_log("C%u complete (vaporized) R%u", mcp->mc_id,
+		       mcp->mc_pipeline[mcp->mc_pipe_first]);
 	    }
 
 	} else if (mx_mti(mcp->mc_client)->mti_write_complete)
 	    mx_mti(mcp->mc_client)->mti_write_complete(mcp->mc_client, mcp);
-	
-	mx_channel_release(mcp);
+
+	/* Keep the channel while pipelined replies are still to come */
+	if (mcp->mc_pipe_count == 0 || !mx_channel_pipeline_next(mcp))
+	    mx_channel_release(mcp);
+    }
+
+    /*
+     * Pick up the next reply (or chunk), if it arrived with the end
+     * of this one
+     */
+    if (mbp->mb_len == 0 && mcp->mc_next_len && !mcf_is_seen_eoframe(mcp)) {
+	mbp->mb_start = mcp->mc_next_start;
+	mbp->mb_len = mcp->mc_next_len;
+	mcp->mc_next_len = 0;
+
+	if (mx_channel_netconf_frame_input(mcp, mbp) < 0)
+	    goto bad_framing;
     }
 
     return 0;
+
+ bad_framing:
+    /* We've lost our place in the stream, so the channel is no good */
+    mx_buffer_reset(mbp);
+    mcp->mc_next_len = 0;
+    if (mcp->mc_client && mx_mti(mcp->mc_client)->mti_set_channel)
+	mx_mti(mcp->mc_client)->mti_set_channel(mcp->mc_client, NULL, NULL);
+    mcp->mc_client = NULL;
+    mcp->mc_request = NULL;
+    mx_request_channel_failed(mcp, "bad netconf framing from device");
+    mcp->mc_state = MSS_FAILED;
+    return -1;
 }
 
 int
@@ -582,6 +1576,7 @@ mx_channel_sock (mx_channel_t *mcp)
 int
 mx_channel_has_buffered (mx_channel_t *mcp)
 {
-    return (mcp->mc_rbufp->mb_len != 0);
+    return (mcp->mc_rbufp->mb_len != 0 || mcp->mc_next_len != 0
+	    || mcf_is_seen_eoframe(mcp));
 }
 
@@ -20,6 +20,15 @@ mx_channel_direct_tcpip (mx_sock_session_t *session, mx_sock_t *client,
 mx_channel_t *
 mx_channel_netconf (mx_sock_session_t *mssp, mx_sock_t *client, int xml_mode);
 
+int
+mx_channel_is_opening (mx_channel_t *mcp);
+
+int
+mx_channel_netconf_continue (mx_channel_t *mcp);
+
+int
+mx_channel_is_blocked (mx_channel_t *mcp);
+
 int
 mx_channel_handle_input (mx_channel_t *mcp);
 
@@ -29,6 +38,21 @@ mx_channel_close (mx_channel_t *mcp);
 int
 mx_channel_write_buffer (mx_channel_t *mcp, mx_buffer_t *mbp);
 
+int
+mx_channel_writev (mx_channel_t *mcp, const struct iovec *iov, int iovcnt);
+
+int
+mx_channel_send_flush (mx_channel_t *mcp);
+
+void
+mx_channel_upload_start (mx_channel_t *mcp, const char *prefix);
+
+int
+mx_channel_upload (mx_channel_t *mcp, const char *buf, unsigned long len);
+
+int
+mx_channel_upload_finish (mx_channel_t *mcp, const char *suffix);
+
 int
 mx_channel_sock (mx_channel_t *mcp);
 
@@ -40,3 +64,27 @@ mx_channel_print (mx_channel_t *mcp, int indent, const char *prefix);
 
 void
 mx_channel_release (mx_channel_t *mcp);
+
+void
+mx_channel_pool_check (mx_sock_session_t *mssp);
+
+int
+mx_channel_pipeline_push (mx_channel_t *mcp, mx_request_t *mrp);
+
+unsigned
+mx_channel_pipeline_shift (mx_channel_t *mcp);
+
+mx_channel_t *
+mx_channel_pipeline_find (mx_sock_session_t *mssp, mx_sock_t *client);
+
+void
+mx_channel_forget_request (mx_channel_t *mcp, mx_request_t *mrp);
+
+void
+mx_channel_cancel (mx_channel_t *mcp, mx_request_t *mrp);
+
+void
+mx_channel_detach_client (mx_channel_t *mcp, mx_sock_t *client);
+
+unsigned
+mx_channel_busy_count (mx_sock_session_t *mssp);
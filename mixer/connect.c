@@ -0,0 +1,202 @@
+/*
+ * $Id$
+ *
+ * Copyright (c) 2013, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * Outgoing TCP connection attempts.  A session may have several of
+ * these racing each other (RFC 6555/8305 "Happy Eyeballs"); the first
+ * to connect hands its socket to the session, which cancels the rest.
+ */
+
+#include <netdb.h>
+
+#include "local.h"
+#include "connect.h"
+#include "event.h"
+#include "session.h"
+
+static void
+mx_connect_print (MX_TYPE_PRINT_ARGS)
+{
+    mx_sock_connect_t *mscp = mx_sock(msp, MST_CONNECT);
+
+    mx_log("%*s%sconnecting for S%u, %s", indent, "", prefix,
+	   mscp->msc_session ? mscp->msc_session->mss_base.ms_id : 0,
+	   mx_sock_name(msp));
+}
+
+/*
+ * Start a non-blocking connect() to the given address.  Returns
+ * TRUE if the attempt is in progress.
+ */
+int
+mx_connect_start (mx_sock_session_t *mssp, struct addrinfo *aip)
+{
+    mx_sock_connect_t *mscp;
+    int sock;
+
+    sock = socket(aip->ai_family, aip->ai_socktype, aip->ai_protocol);
+    if (sock < 0) {
+	mx_log("%s connect: socket: %s", mx_sock_title(&mssp->mss_base),
+	       strerror(errno));
+	return FALSE;
+    }
+
+    mx_nonblocking(sock);
+
+    if (connect(sock, aip->ai_addr, aip->ai_addrlen) < 0
+	    && errno != EINPROGRESS) {
+	mx_log("%s connect: %s", mx_sock_title(&mssp->mss_base),
+	       strerror(errno));
+	close(sock);
+	return FALSE;
+    }
+
+    mscp = calloc(1, sizeof(*mscp));
+    if (mscp == NULL) {
+	close(sock);
+	return FALSE;
+    }
+
+    mscp->msc_base.ms_id = mx_next_id(mx_sock_id);
+    mscp->msc_base.ms_type = MST_CONNECT;
+    mscp->msc_base.ms_sock = sock;
+    mscp->msc_session = mssp;
+    mscp->msc_addr = aip;
+
+    switch (aip->ai_family) {
+    case AF_INET:
+	if (aip->ai_addrlen <= sizeof(mscp->msc_base.ms_sin))
+	    memcpy(&mscp->msc_base.ms_sin, aip->ai_addr, aip->ai_addrlen);
+	break;
+
+    case AF_INET6:
+	if (aip->ai_addrlen <= sizeof(mscp->msc_base.ms_sin6))
+	    memcpy(&mscp->msc_base.ms_sin6, aip->ai_addr, aip->ai_addrlen);
+	break;
+    }
+
+    TAILQ_INSERT_HEAD(&mx_sock_list, &mscp->msc_base, ms_link);
+    mx_sock_count += 1;
+    mssp->mss_attempts += 1;
+
+    MX_LOG("%s new %s for S%u, fd %u, %s",
+	   mx_sock_title(&mscp->msc_base), mx_sock_type(&mscp->msc_base),
+	   mssp->mss_base.ms_id, sock, mx_sock_name(&mscp->msc_base));
+
+    return TRUE;
+}
+
+/*
+ * Abandon all of a session's attempts.  They're closed by main_loop.
+ */
+void
+mx_connect_cancel (mx_sock_session_t *mssp)
+{
+    mx_sock_t *msp;
+    mx_sock_connect_t *mscp;
+
+    TAILQ_FOREACH(msp, &mx_sock_list, ms_link) {
+	if (msp->ms_type != MST_CONNECT)
+	    continue;
+
+	mscp = mx_sock(msp, MST_CONNECT);
+	if (mscp->msc_session != mssp)
+	    continue;
+
+	mscp->msc_session = NULL;
+	msp->ms_state = MSS_FAILED;
+    }
+
+    mssp->mss_attempts = 0;
+}
+
+static int
+mx_connect_prep (MX_TYPE_PREP_ARGS)
+{
+    mx_sock_connect_t *mscp = mx_sock(msp, MST_CONNECT);
+
+    if (mscp->msc_session == NULL) {
+	msp->ms_state = MSS_FAILED;
+	return FALSE;
+    }
+
+    pollp->fd = msp->ms_sock;
+    pollp->events = POLLOUT;
+
+    return TRUE;
+}
+
+static int
+mx_connect_poller (MX_TYPE_POLLER_ARGS)
+{
+    mx_sock_connect_t *mscp = mx_sock(msp, MST_CONNECT);
+    mx_sock_session_t *mssp = mscp->msc_session;
+    int sock = msp->ms_sock;
+    int err = 0;
+    socklen_t errlen = sizeof(err);
+
+    if (mssp == NULL)
+	return TRUE;
+
+    if (pollp == NULL || pollp->revents == 0)
+	return FALSE;
+
+    if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0)
+	err = errno;
+
+    mscp->msc_session = NULL;
+    msp->ms_state = MSS_FAILED;
+
+    if (err) {
+	mx_log("%s connect to %s failed: %s", mx_sock_title(msp),
+	       mx_sock_name(msp), strerror(err));
+	mx_session_connect_failed(mssp);
+	return FALSE;
+    }
+
+    /* Hand the socket to the session; it's no longer ours */
+    mx_event_forget(msp);
+    msp->ms_sock = -1;
+
+    /* The session may free the address along with its lookup */
+    mx_session_connected(mssp, sock, mscp->msc_addr);
+    mscp->msc_addr = NULL;
+
+    return FALSE;
+}
+
+static void
+mx_connect_close (MX_TYPE_CLOSE_ARGS)
+{
+    mx_sock_connect_t *mscp = mx_sock(msp, MST_CONNECT);
+
+    if (mscp->msc_session && mscp->msc_session->mss_attempts)
+	mscp->msc_session->mss_attempts -= 1;
+
+    if ((int) msp->ms_sock >= 0) {
+	close(msp->ms_sock);
+	msp->ms_sock = -1;
+    }
+}
+
+void
+mx_connect_init (void)
+{
+    static mx_type_info_t mti = {
+	.mti_type = MST_CONNECT,
+	.mti_name = "connect",
+	.mti_letter = "T",
+	.mti_print = mx_connect_print,
+	.mti_prep = mx_connect_prep,
+	.mti_poller = mx_connect_poller,
+	.mti_close = mx_connect_close,
+    };
+
+    mx_type_info_register(MX_TYPE_INFO_VERSION, &mti);
+}
@@ -0,0 +1,19 @@
+/*
+ * $Id$
+ *
+ * Copyright (c) 2013, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ */
+
+int
+mx_connect_start (mx_sock_session_t *mssp, struct addrinfo *aip);
+
+void
+mx_connect_cancel (mx_sock_session_t *mssp);
+
+void
+mx_connect_init (void);
@@ -13,6 +13,12 @@
 #include "debug.h"
 #include "console.h"
 #include "request.h"
+#include "event.h"
+#include "worker.h"
+#include "timer.h"
+#include "buffer.h"
+#include "deflate.h"
+#include "cache.h"
 
 static FILE *console_fp;
 
@@ -24,7 +30,7 @@ mx_console_build (int state, int fd)
 	return NULL;
 
     bzero(msp, sizeof(*msp));
-    msp->ms_id = ++mx_sock_id;
+    msp->ms_id = mx_next_id(mx_sock_id);
     msp->ms_type = MST_CONSOLE;
     msp->ms_sock = fd;
     msp->ms_state = state;
@@ -124,6 +130,12 @@ mx_console_list (const char **argv UNUSED)
     }
 
     mx_request_print_all(0, "");
+    mx_event_print(0, "");
+    mx_timer_print(0, "");
+    mx_buffer_print(0, "");
+    mx_deflate_print(0, "");
+    mx_cache_print(0, "");
+    mx_worker_print(0, "");
 }
 
 static int
@@ -10,6 +10,7 @@
  */
 
 #include <pwd.h>
+#include <pthread.h>
 #include <uuid/uuid.h>
 
 #include "local.h"
@@ -60,6 +61,12 @@
 static sqlite3 *mx_db_handle;
 static char *mx_db_passphrase;
 
+/*
+ * Worker threads (worker.c) share the database, so the public
+ * functions below serialize access with mx_db_lock.
+ */
+static pthread_mutex_t mx_db_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /*
  * Check the hostkey database for this session's hostkey.
  *
@@ -68,8 +75,8 @@ static char *mx_db_passphrase;
  * return DB_CHECK_HOSTKEY_MISMATCH if hostkey is in database but does not
  *     match
  */
-int
-mx_db_check_hostkey (mx_sock_session_t *mssp, mx_request_t *mrp)
+static int
+mx_db_check_hostkey_locked (mx_sock_session_t *mssp, mx_request_t *mrp)
 {
     sqlite3_stmt *stmt;
     const char *hostkey;
@@ -150,8 +157,8 @@ cleanup:
 /*
  * Save hostkey to db
  */
-void
-mx_db_save_hostkey (mx_sock_session_t *mssp, mx_request_t *mrp)
+static void
+mx_db_save_hostkey_locked (mx_sock_session_t *mssp, mx_request_t *mrp)
 {
     int type, rc;
     char keyname[BUFSIZ];
@@ -245,12 +252,12 @@ cleanup:
 /*
  * Get the stored passphrase from the db.  If none stored, return NULL
  */
-const char *
-mx_db_get_passphrase (void)
+static const char *
+mx_db_get_passphrase_locked (void)
 {
     int rc;
     sqlite3_stmt *stmt;
-    static char *db_passphrase = NULL;
+    static MX_THREAD_LOCAL char *db_passphrase = NULL;
 
      if (opt_no_db)
 	return mx_db_passphrase;
@@ -272,8 +279,8 @@ mx_db_get_passphrase (void)
 /*
  * Save the passphrase to the db if save_passphrase is set to 1
  */
-void
-mx_db_save_passphrase (const char *passphrase)
+static void
+mx_db_save_passphrase_locked (const char *passphrase)
 {
     int rc;
     sqlite3_stmt *stmt;
@@ -321,8 +328,8 @@ cleanup:
 /*
  * Save the password to the record if save_password is set to 1
  */
-void
-mx_db_save_password (mx_request_t *mrp, const char *password)
+static void
+mx_db_save_password_locked (mx_request_t *mrp, const char *password)
 {
     sqlite3_stmt *stmt;
     int save_password = 0, row_id = -1;
@@ -390,8 +397,8 @@ cleanup:
  * Return FALSE if could not lookup target or target does not exist
  * Return TRUE if target looked up successfully
  */
-mx_boolean_t
-mx_db_target_lookup (const char *target, mx_request_t *mrp)
+static mx_boolean_t
+mx_db_target_lookup_locked (const char *target, mx_request_t *mrp)
 {
     int rc, retval = FALSE, port = -1;
     sqlite3_stmt *stmt;
@@ -487,6 +494,70 @@ cleanup:
  * Return FALSE if could not upgrade (too new a db for this ver of mixer, etc)
  * Return TRUE if upgrade suceeded/not necessary
  */
+int
+mx_db_check_hostkey (mx_sock_session_t *mssp, mx_request_t *mrp)
+{
+    int rc;
+
+    pthread_mutex_lock(&mx_db_lock);
+    rc = mx_db_check_hostkey_locked(mssp, mrp);
+    pthread_mutex_unlock(&mx_db_lock);
+
+    return rc;
+}
+
+void
+mx_db_save_hostkey (mx_sock_session_t *mssp, mx_request_t *mrp)
+{
+    pthread_mutex_lock(&mx_db_lock);
+    mx_db_save_hostkey_locked(mssp, mrp);
+    pthread_mutex_unlock(&mx_db_lock);
+}
+
+/*
+ * The returned passphrase belongs to the calling thread and is
+ * good until its next call.
+ */
+const char *
+mx_db_get_passphrase (void)
+{
+    const char *passphrase;
+
+    pthread_mutex_lock(&mx_db_lock);
+    passphrase = mx_db_get_passphrase_locked();
+    pthread_mutex_unlock(&mx_db_lock);
+
+    return passphrase;
+}
+
+void
+mx_db_save_passphrase (const char *passphrase)
+{
+    pthread_mutex_lock(&mx_db_lock);
+    mx_db_save_passphrase_locked(passphrase);
+    pthread_mutex_unlock(&mx_db_lock);
+}
+
+void
+mx_db_save_password (mx_request_t *mrp, const char *password)
+{
+    pthread_mutex_lock(&mx_db_lock);
+    mx_db_save_password_locked(mrp, password);
+    pthread_mutex_unlock(&mx_db_lock);
+}
+
+mx_boolean_t
+mx_db_target_lookup (const char *target, mx_request_t *mrp)
+{
+    mx_boolean_t rc;
+
+    pthread_mutex_lock(&mx_db_lock);
+    rc = mx_db_target_lookup_locked(target, mrp);
+    pthread_mutex_unlock(&mx_db_lock);
+
+    return rc;
+}
+
 static mx_boolean_t
 mx_db_upgrade (int version)
 {
@@ -0,0 +1,152 @@
+/*
+ * $Id$
+ *
+ * Copyright (c) 2013, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * Compressed replies.  A websocket client that asks for them (with
+ * compress="deflate" on its authinit) gets its replies deflated.
+ * Each request keeps a zlib stream for the life of its reply, so
+ * later chunks are compressed against what came before.  Each chunk
+ * is sync-flushed, so the client can inflate it as soon as it
+ * arrives, and the last one finishes the stream.
+ *
+ * The websocket carries text, so the compressed data is base64
+ * encoded.  That costs a third, but XML replies deflate by ten
+ * times or more, so it's still well worth it.
+ */
+
+#define ZLIB_CONST		/* next_in is const, as our input is */
+#include <zlib.h>
+
+#include "local.h"
+#include "deflate.h"
+#include "buffer.h"
+#include "util.h"
+
+#define MX_DEFLATE_SLOP	64	/* Room for a sync flush beyond deflateBound */
+
+typedef struct mx_deflate_stats_s {
+    unsigned long mds_replies;	/* Replies compressed */
+    unsigned long mds_bytes_in;	/* Reply bytes we were given */
+    unsigned long mds_bytes_out; /* Bytes we sent instead */
+    unsigned long mds_failures;	/* Times zlib failed us */
+} mx_deflate_stats_t;
+
+static mx_deflate_stats_t mx_deflate_stats;
+
+static z_stream *
+mx_deflate_start (mx_request_t *mrp)
+{
+    z_stream *zp = calloc(1, sizeof(*zp));
+
+    if (zp == NULL)
+	return NULL;
+
+    if (deflateInit(zp, opt_compress_level) != Z_OK) {
+	mx_log("R%u deflateInit failed: %s", mrp->mr_id,
+	       zp->msg ?: "unknown error");
+	free(zp);
+	return NULL;
+    }
+
+    mrp->mr_zstream = zp;
+    __sync_add_and_fetch(&mx_deflate_stats.mds_replies, 1);
+
+    return zp;
+}
+
+/*
+ * Compress a chunk of reply for a request, starting its stream if
+ * needed.  With "finish", the stream is ended (len can be zero).
+ * Returns a buffer holding the encoded result, with "headroom" bytes
+ * left in front for the caller's header, or NULL on failure.
+ */
+mx_buffer_t *
+mx_deflate (mx_request_t *mrp, const char *data, unsigned long len,
+	    int finish, unsigned headroom)
+{
+    z_stream *zp = mrp->mr_zstream;
+    unsigned char *zbuf;
+    unsigned long zlen, zsize;
+    mx_buffer_t *mbp = NULL;
+    int rc;
+
+    if (zp == NULL) {
+	zp = mx_deflate_start(mrp);
+	if (zp == NULL)
+	    goto fail;
+    }
+
+    zsize = deflateBound(zp, len) + MX_DEFLATE_SLOP;
+    zbuf = malloc(zsize);
+    if (zbuf == NULL)
+	goto fail;
+
+    zp->next_in = (const Bytef *) data;
+    zp->avail_in = len;
+    zp->next_out = zbuf;
+    zp->avail_out = zsize;
+
+    rc = deflate(zp, finish ? Z_FINISH : Z_SYNC_FLUSH);
+    if (rc == Z_STREAM_ERROR || zp->avail_in != 0 || zp->avail_out == 0
+	    || (finish && rc != Z_STREAM_END)) {
+	mx_log("R%u deflate failed (%d): %s", mrp->mr_id, rc,
+	       zp->msg ?: "out of room");
+	free(zbuf);
+	goto fail;
+    }
+
+    zlen = zsize - zp->avail_out;
+
+    mbp = mx_buffer_create(headroom + ((zlen + 2) / 3) * 4);
+    if (mbp) {
+	mbp->mb_start = headroom;
+	mbp->mb_len = mx_base64_encode(mbp->mb_data + headroom, zbuf, zlen);
+
+	__sync_add_and_fetch(&mx_deflate_stats.mds_bytes_in, len);
+	__sync_add_and_fetch(&mx_deflate_stats.mds_bytes_out, mbp->mb_len);
+    }
+
+    free(zbuf);
+    return mbp;
+
+ fail:
+    __sync_add_and_fetch(&mx_deflate_stats.mds_failures, 1);
+    return NULL;
+}
+
+void
+mx_deflate_end (mx_request_t *mrp)
+{
+    if (mrp->mr_zstream == NULL)
+	return;
+
+    deflateEnd(mrp->mr_zstream);
+    free(mrp->mr_zstream);
+    mrp->mr_zstream = NULL;
+}
+
+void
+mx_deflate_print (int indent, const char *prefix)
+{
+    mx_deflate_stats_t *mdsp = &mx_deflate_stats;
+    unsigned long saved = 0;
+
+    if (mdsp->mds_replies == 0)
+	return;
+
+    if (mdsp->mds_bytes_in > mdsp->mds_bytes_out)
+	saved = mdsp->mds_bytes_in - mdsp->mds_bytes_out;
+
+    mx_log("%*s%sdeflate: %lu replies, %lu bytes in, %lu out "
+	   "(ratio %.1f:1, %lu bytes saved), %lu failures",
+	   indent, "", prefix, mdsp->mds_replies, mdsp->mds_bytes_in,
+	   mdsp->mds_bytes_out, mdsp->mds_bytes_out
+	   ? (double) mdsp->mds_bytes_in / mdsp->mds_bytes_out : 0.0,
+	   saved, mdsp->mds_failures);
+}
@@ -0,0 +1,26 @@
+/*
+ * $Id$
+ *
+ * Copyright (c) 2013, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ */
+
+mx_buffer_t *
+mx_deflate (mx_request_t *mrp, const char *data, unsigned long len,
+	    int finish, unsigned headroom);
+
+static inline int
+mx_deflate_started (mx_request_t *mrp)
+{
+    return (mrp->mr_zstream != NULL) ? TRUE : FALSE;
+}
+
+void
+mx_deflate_end (mx_request_t *mrp);
+
+void
+mx_deflate_print (int indent, const char *prefix);
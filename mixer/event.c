@@ -0,0 +1,607 @@
+/*
+ * $Id$
+ *
+ * Copyright (c) 2013, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * Event backends for the main loop.  Each pass thru main_loop calls
+ * the mti_prep function for each socket, and hands the resulting
+ * poll() information to the backend via mx_event_want() (or
+ * mx_event_ignore() if the prep function declined to poll).  The
+ * backend then waits for events and builds a list of sockets whose
+ * mti_poller needs to be called, which main_loop walks using
+ * mx_event_next().
+ *
+ * The "poll" backend rebuilds a pollfd array on every pass and
+ * dispatches every socket, which is the traditional behavior.
+ *
+ * The "epoll" backend keeps interest registered in the kernel,
+ * touching it only when a socket's prep results change, and
+ * dispatches only the sockets that are ready (plus those that
+ * declined to poll, since they have buffered work to do).
+ *
+ * Each event loop (see worker.c) has its own backend state.
+ */
+
+#include <sys/stat.h>
+
+#include "local.h"
+#include "event.h"
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif /* HAVE_SYS_EPOLL_H */
+
+typedef struct mx_event_s {
+    mx_sock_t *me_sock;		/* Socket to dispatch (NULL if closed) */
+    int me_index;		/* Index into mx_event_pollfd (or -1) */
+    struct pollfd me_poll;	/* Poll data handed to mti_poller */
+} mx_event_t;
+
+typedef struct mx_event_backend_s {
+    const char *meb_name;	/* Name of the backend */
+    int (*meb_init)(void);	/* Initialize the backend */
+    void (*meb_cleanup)(void);	/* Release backend resources */
+    void (*meb_want)(mx_sock_t *, struct pollfd *); /* Record interest */
+    void (*meb_ignore)(mx_sock_t *); /* Socket is not polling */
+    int (*meb_wait)(int);	/* Wait for events */
+    void (*meb_forget)(mx_sock_t *); /* Socket is being closed */
+} mx_event_backend_t;
+
+static MX_THREAD_LOCAL mx_event_backend_t *mx_event_backend;
+
+/* The list of sockets to be dispatched during this pass */
+static MX_THREAD_LOCAL mx_event_t *mx_event_list;
+static MX_THREAD_LOCAL unsigned mx_event_count;	/* Number of entries in use */
+static MX_THREAD_LOCAL unsigned mx_event_size;	/* Number of entries allocated */
+static MX_THREAD_LOCAL unsigned mx_event_cursor; /* Next to dispatch */
+static MX_THREAD_LOCAL unsigned mx_event_nwant; /* Number wanting events */
+
+/* Statistics */
+static MX_THREAD_LOCAL unsigned long mx_event_stat_passes;
+static MX_THREAD_LOCAL unsigned long mx_event_stat_dispatched;
+static MX_THREAD_LOCAL unsigned long mx_event_stat_changes;
+
+static mx_event_t *
+mx_event_add (mx_sock_t *msp)
+{
+    if (mx_event_count >= mx_event_size) {
+	unsigned size = mx_event_size ? mx_event_size * 2 : 64;
+	mx_event_t *list = realloc(mx_event_list, size * sizeof(*list));
+	if (list == NULL) {
+	    mx_log("event: cannot extend dispatch list (%u)", size);
+	    return NULL;
+	}
+
+	mx_event_list = list;
+	mx_event_size = size;
+    }
+
+    mx_event_t *mep = &mx_event_list[mx_event_count++];
+    bzero(mep, sizeof(*mep));
+    mep->me_sock = msp;
+    mep->me_index = -1;
+
+    return mep;
+}
+
+/*
+ * The poll() backend: rebuild the pollfd array on every pass.
+ */
+static MX_THREAD_LOCAL struct pollfd *mx_event_pollfd;
+static MX_THREAD_LOCAL unsigned mx_event_pollfd_size;
+
+static int
+mx_event_poll_init (void)
+{
+    return TRUE;
+}
+
+static void
+mx_event_poll_cleanup (void)
+{
+    free(mx_event_pollfd);
+    mx_event_pollfd = NULL;
+    mx_event_pollfd_size = 0;
+}
+
+static void
+mx_event_poll_want (mx_sock_t *msp, struct pollfd *pollp)
+{
+    if (mx_event_nwant >= mx_event_pollfd_size) {
+	unsigned size = mx_event_pollfd_size ? mx_event_pollfd_size * 2 : 64;
+	struct pollfd *pfd = realloc(mx_event_pollfd, size * sizeof(*pfd));
+	if (pfd == NULL) {
+	    mx_log("event: cannot extend poll list (%u)", size);
+	    return;
+	}
+
+	mx_event_pollfd = pfd;
+	mx_event_pollfd_size = size;
+    }
+
+    mx_event_t *mep = mx_event_add(msp);
+    if (mep == NULL)
+	return;
+
+    mep->me_index = mx_event_nwant++;
+    mx_event_pollfd[mep->me_index] = *pollp;
+    mx_event_pollfd[mep->me_index].revents = 0;
+}
+
+static void
+mx_event_poll_ignore (mx_sock_t *msp)
+{
+    mx_event_add(msp);
+}
+
+static int
+mx_event_poll_wait (int timeout)
+{
+    unsigned i;
+    int rc;
+
+    rc = poll(mx_event_pollfd, mx_event_nwant, timeout);
+    if (rc < 0)
+	return rc;
+
+    for (i = 0; i < mx_event_count; i++) {
+	mx_event_t *mep = &mx_event_list[i];
+	if (mep->me_index >= 0)
+	    mep->me_poll = mx_event_pollfd[mep->me_index];
+    }
+
+    return rc;
+}
+
+static void
+mx_event_poll_forget (mx_sock_t *msp UNUSED)
+{
+    return;
+}
+
+static mx_event_backend_t mx_event_backend_poll = {
+    .meb_name = "poll",
+    .meb_init = mx_event_poll_init,
+    .meb_cleanup = mx_event_poll_cleanup,
+    .meb_want = mx_event_poll_want,
+    .meb_ignore = mx_event_poll_ignore,
+    .meb_wait = mx_event_poll_wait,
+    .meb_forget = mx_event_poll_forget,
+};
+
+#ifdef HAVE_SYS_EPOLL_H
+/*
+ * The epoll() backend: interest stays registered with the kernel, so
+ * an idle socket costs nothing beyond its prep call.
+ */
+static MX_THREAD_LOCAL int mx_epoll_fd = -1;
+static MX_THREAD_LOCAL struct epoll_event *mx_epoll_events;
+static MX_THREAD_LOCAL unsigned mx_epoll_events_size;
+
+static unsigned
+mx_event_epoll_events (short events)
+{
+    unsigned rc = 0;
+
+    if (events & POLLIN)
+	rc |= EPOLLIN;
+    if (events & POLLOUT)
+	rc |= EPOLLOUT;
+    if (events & POLLPRI)
+	rc |= EPOLLPRI;
+
+    return rc;
+}
+
+static short
+mx_event_epoll_revents (unsigned events)
+{
+    short rc = 0;
+
+    if (events & EPOLLIN)
+	rc |= POLLIN;
+    if (events & EPOLLOUT)
+	rc |= POLLOUT;
+    if (events & EPOLLPRI)
+	rc |= POLLPRI;
+    if (events & EPOLLERR)
+	rc |= POLLERR;
+    if (events & EPOLLHUP)
+	rc |= POLLHUP;
+
+    return rc;
+}
+
+static int
+mx_event_epoll_init (void)
+{
+    mx_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (mx_epoll_fd < 0) {
+	mx_log("event: epoll_create: %s", strerror(errno));
+	return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void
+mx_event_epoll_cleanup (void)
+{
+    if (mx_epoll_fd >= 0)
+	close(mx_epoll_fd);
+    mx_epoll_fd = -1;
+
+    free(mx_epoll_events);
+    mx_epoll_events = NULL;
+    mx_epoll_events_size = 0;
+}
+
+static void
+mx_event_epoll_del (mx_sock_t *msp)
+{
+    mx_event_reg_t *merp = &msp->ms_event;
+
+    if (!(merp->mer_flags & MERF_REGISTERED))
+	return;
+
+    /*
+     * If the underlaying fd has already been closed, the kernel has
+     * dropped the registration for us, so ENOENT/EBADF are expected.
+     */
+    if (epoll_ctl(mx_epoll_fd, EPOLL_CTL_DEL, merp->mer_fd, NULL) < 0
+	    && errno != ENOENT && errno != EBADF)
+	mx_log("%s event: epoll del fd %d: %s", mx_sock_title(msp),
+	       merp->mer_fd, strerror(errno));
+
+    if (merp->mer_flags & MERF_DUP)
+	close(merp->mer_fd);
+
+    bzero(merp, sizeof(*merp));
+    mx_event_stat_changes += 1;
+}
+
+/*
+ * Is a dup()'d registration still for the file the prep function
+ * is asking about?  The fd number alone isn't enough, since the
+ * owner may have closed it and the number been reused.
+ */
+static int
+mx_event_epoll_same (mx_event_reg_t *merp, int fd)
+{
+    struct stat st;
+
+    if (!(merp->mer_flags & MERF_DUP))
+	return TRUE;
+
+    if (fstat(fd, &st) < 0)
+	return FALSE;
+
+    return (st.st_dev == merp->mer_dev && st.st_ino == merp->mer_ino);
+}
+
+static void
+mx_event_epoll_want (mx_sock_t *msp, struct pollfd *pollp)
+{
+    mx_event_reg_t *merp = &msp->ms_event;
+    struct epoll_event ev;
+    int op;
+
+    mx_event_nwant += 1;
+
+    if (merp->mer_flags & MERF_REGISTERED) {
+	if (merp->mer_src == pollp->fd
+		&& mx_event_epoll_same(merp, pollp->fd)) {
+	    if (merp->mer_events == pollp->events)
+		return;		/* Nothing changed */
+	    op = EPOLL_CTL_MOD;
+
+	} else {
+	    mx_event_epoll_del(msp);
+	    op = EPOLL_CTL_ADD;
+	}
+    } else
+	op = EPOLL_CTL_ADD;
+
+    if (op == EPOLL_CTL_ADD) {
+	merp->mer_src = merp->mer_fd = pollp->fd;
+
+	/*
+	 * epoll allows an fd only once per instance, but a prep
+	 * function is free to poll on another socket's fd (e.g. a
+	 * forwarder waiting on its session).  We register a dup()
+	 * of the fd, which epoll treats as distinct.
+	 */
+	if (pollp->fd != (int) msp->ms_sock) {
+	    struct stat st;
+
+	    merp->mer_fd = (fstat(pollp->fd, &st) < 0) ? -1 : dup(pollp->fd);
+	    if (merp->mer_fd < 0) {
+		mx_log("%s event: dup fd %d: %s", mx_sock_title(msp),
+		       pollp->fd, strerror(errno));
+		bzero(merp, sizeof(*merp));
+		mx_event_add(msp);
+		return;
+	    }
+	    merp->mer_flags |= MERF_DUP;
+	    merp->mer_dev = st.st_dev;
+	    merp->mer_ino = st.st_ino;
+	}
+    }
+
+    bzero(&ev, sizeof(ev));
+    ev.events = mx_event_epoll_events(pollp->events);
+    ev.data.ptr = msp;
+
+    if (epoll_ctl(mx_epoll_fd, op, merp->mer_fd, &ev) < 0) {
+	mx_log("%s event: epoll %s fd %d: %s", mx_sock_title(msp),
+	       (op == EPOLL_CTL_ADD) ? "add" : "mod", merp->mer_fd,
+	       strerror(errno));
+	if (merp->mer_flags & MERF_DUP)
+	    close(merp->mer_fd);
+	bzero(merp, sizeof(*merp));
+
+	/* Let the poller see the problem */
+	mx_event_t *mep = mx_event_add(msp);
+	if (mep) {
+	    mep->me_index = 0;
+	    mep->me_poll = *pollp;
+	    mep->me_poll.revents = POLLNVAL;
+	}
+	return;
+    }
+
+    merp->mer_flags |= MERF_REGISTERED;
+    merp->mer_events = pollp->events;
+    mx_event_stat_changes += 1;
+}
+
+static void
+mx_event_epoll_ignore (mx_sock_t *msp)
+{
+    /*
+     * A socket that declines to poll has work buffered, so we
+     * drop its interest (to avoid a wakeup for every byte of input
+     * we aren't going to read) and dispatch it unconditionally.
+     */
+    mx_event_epoll_del(msp);
+    mx_event_add(msp);
+}
+
+static int
+mx_event_epoll_wait (int timeout)
+{
+    int rc, i;
+
+    if (mx_epoll_events_size < (unsigned) mx_sock_count + 1) {
+	unsigned size = mx_sock_count + 64;
+	struct epoll_event *evp = realloc(mx_epoll_events,
+					  size * sizeof(*evp));
+	if (evp == NULL) {
+	    mx_log("event: cannot extend epoll list (%u)", size);
+	    if (mx_epoll_events == NULL)
+		return -1;
+	} else {
+	    mx_epoll_events = evp;
+	    mx_epoll_events_size = size;
+	}
+    }
+
+    rc = epoll_wait(mx_epoll_fd, mx_epoll_events,
+		    mx_epoll_events_size, timeout);
+    if (rc < 0)
+	return rc;
+
+    for (i = 0; i < rc; i++) {
+	mx_sock_t *msp = mx_epoll_events[i].data.ptr;
+	mx_event_t *mep = mx_event_add(msp);
+	if (mep == NULL)
+	    break;
+
+	mep->me_index = i;
+	mep->me_poll.fd = msp->ms_event.mer_src;
+	mep->me_poll.events = msp->ms_event.mer_events;
+	mep->me_poll.revents
+	    = mx_event_epoll_revents(mx_epoll_events[i].events);
+    }
+
+    return rc;
+}
+
+/*
+ * Besides its own registration, a closing socket takes any dup()s
+ * other sockets made of its fd, so they don't hold the file (and
+ * its peer) open after we've closed it.  Those sockets register
+ * afresh on their next prep, if they still want to.
+ */
+static void
+mx_event_epoll_forget (mx_sock_t *msp)
+{
+    mx_sock_t *other;
+
+    mx_event_epoll_del(msp);
+
+    if ((int) msp->ms_sock < 0)
+	return;
+
+    TAILQ_FOREACH(other, &mx_sock_list, ms_link) {
+	if ((other->ms_event.mer_flags & MERF_DUP)
+		&& other->ms_event.mer_src == (int) msp->ms_sock)
+	    mx_event_epoll_del(other);
+    }
+}
+
+static mx_event_backend_t mx_event_backend_epoll = {
+    .meb_name = "epoll",
+    .meb_init = mx_event_epoll_init,
+    .meb_cleanup = mx_event_epoll_cleanup,
+    .meb_want = mx_event_epoll_want,
+    .meb_ignore = mx_event_epoll_ignore,
+    .meb_wait = mx_event_epoll_wait,
+    .meb_forget = mx_event_epoll_forget,
+};
+#endif /* HAVE_SYS_EPOLL_H */
+
+static mx_event_backend_t *mx_event_backends[] = {
+#ifdef HAVE_SYS_EPOLL_H
+    &mx_event_backend_epoll,
+#endif /* HAVE_SYS_EPOLL_H */
+    &mx_event_backend_poll,
+    NULL
+};
+
+/*
+ * Select and initialize an event backend.  A NULL name picks the
+ * first (best) one available on this platform.
+ */
+int
+mx_event_init (const char *name)
+{
+    mx_event_backend_t **mebp;
+
+    for (mebp = mx_event_backends; *mebp; mebp++) {
+	if (name == NULL || streq(name, (*mebp)->meb_name))
+	    break;
+    }
+
+    if (*mebp == NULL) {
+	mx_log("event: unknown backend '%s'", name);
+	return FALSE;
+    }
+
+    if (!(*mebp)->meb_init())
+	return FALSE;
+
+    mx_event_backend = *mebp;
+    mx_log("event: using %s backend", mx_event_backend->meb_name);
+
+    return TRUE;
+}
+
+void
+mx_event_cleanup (void)
+{
+    if (mx_event_backend)
+	mx_event_backend->meb_cleanup();
+    mx_event_backend = NULL;
+
+    free(mx_event_list);
+    mx_event_list = NULL;
+    mx_event_size = mx_event_count = mx_event_cursor = 0;
+}
+
+const char *
+mx_event_backend_name (void)
+{
+    return mx_event_backend ? mx_event_backend->meb_name : "none";
+}
+
+/*
+ * Start a new pass thru the main loop
+ */
+void
+mx_event_begin (void)
+{
+    mx_event_count = mx_event_cursor = mx_event_nwant = 0;
+    mx_event_stat_passes += 1;
+}
+
+void
+mx_event_want (mx_sock_t *msp, struct pollfd *pollp)
+{
+    if (opt_debug & DBG_FLAG_POLL)
+	mx_log("  prep: fd %d %s %s %x (%s%s)",
+	       pollp->fd, mx_sock_title(msp), mx_sock_type(msp),
+	       pollp->events,
+	       (pollp->events & POLLIN) ? " pollin" : "",
+	       (pollp->events & POLLOUT) ? " pollout" : "");
+
+    mx_event_backend->meb_want(msp, pollp);
+}
+
+void
+mx_event_ignore (mx_sock_t *msp)
+{
+    mx_event_backend->meb_ignore(msp);
+}
+
+int
+mx_event_wanted (void)
+{
+    return mx_event_nwant;
+}
+
+int
+mx_event_wait (int timeout)
+{
+    int rc = mx_event_backend->meb_wait(timeout);
+
+    if (rc >= 0 && (opt_debug & DBG_FLAG_POLL)) {
+	unsigned i;
+
+	for (i = 0; i < mx_event_count; i++) {
+	    mx_event_t *mep = &mx_event_list[i];
+	    if (mep->me_index < 0)
+		continue;
+	    mx_log("  post %u: fd %d %s %x (%s%s%s)", i, mep->me_poll.fd,
+		   mx_sock_title(mep->me_sock), mep->me_poll.revents,
+		   (mep->me_poll.revents & POLLIN) ? " pollin" : "",
+		   (mep->me_poll.revents & POLLOUT) ? " pollout" : "",
+		   (mep->me_poll.revents & POLLERR) ? " pollerr" : "");
+	}
+    }
+
+    return rc;
+}
+
+/*
+ * Return the next socket to be dispatched, along with its poll
+ * data (or NULL if it didn't poll).
+ */
+mx_sock_t *
+mx_event_next (struct pollfd **pollpp)
+{
+    while (mx_event_cursor < mx_event_count) {
+	mx_event_t *mep = &mx_event_list[mx_event_cursor++];
+
+	if (mep->me_sock == NULL) /* Closed during this pass */
+	    continue;
+
+	mx_event_stat_dispatched += 1;
+	*pollpp = (mep->me_index >= 0) ? &mep->me_poll : NULL;
+	return mep->me_sock;
+    }
+
+    *pollpp = NULL;
+    return NULL;
+}
+
+/*
+ * A socket is being closed; drop any registration and make sure
+ * we don't dispatch it later in this pass.
+ */
+void
+mx_event_forget (mx_sock_t *msp)
+{
+    unsigned i;
+
+    if (mx_event_backend)
+	mx_event_backend->meb_forget(msp);
+
+    for (i = mx_event_cursor; i < mx_event_count; i++)
+	if (mx_event_list[i].me_sock == msp)
+	    mx_event_list[i].me_sock = NULL;
+}
+
+void
+mx_event_print (int indent, const char *prefix)
+{
+    mx_log("%*s%sevent backend %s: passes %lu, dispatched %lu, changes %lu",
+	   indent, "", prefix, mx_event_backend_name(),
+	   mx_event_stat_passes, mx_event_stat_dispatched,
+	   mx_event_stat_changes);
+}
@@ -0,0 +1,43 @@
+/*
+ * $Id$
+ *
+ * Copyright (c) 2013, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ */
+
+int
+mx_event_init (const char *name);
+
+void
+mx_event_cleanup (void);
+
+const char *
+mx_event_backend_name (void);
+
+void
+mx_event_begin (void);
+
+void
+mx_event_want (mx_sock_t *msp, struct pollfd *pollp);
+
+void
+mx_event_ignore (mx_sock_t *msp);
+
+int
+mx_event_wanted (void);
+
+int
+mx_event_wait (int timeout);
+
+mx_sock_t *
+mx_event_next (struct pollfd **pollpp);
+
+void
+mx_event_forget (mx_sock_t *msp);
+
+void
+mx_event_print (int indent, const char *prefix);
@@ -35,7 +35,7 @@ mx_forwarder_spawn (MX_TYPE_SPAWN_ARGS)
 	return NULL;
 
     bzero(msfp, sizeof(*msfp));
-    msfp->msf_base.ms_id = ++mx_sock_id;
+    msfp->msf_base.ms_id = mx_next_id(mx_sock_id);
     msfp->msf_base.ms_type = MST_FORWARDER;
     msfp->msf_base.ms_sock = sock;
     msfp->msf_base.ms_sun = *sun;
@@ -52,6 +52,21 @@ mx_forwarder_spawn (MX_TYPE_SPAWN_ARGS)
 	return NULL;
     }
 
+    /*
+     * Sessions are set up in the background, so the first connection
+     * may arrive before we're ready to open a channel.  Turn it away;
+     * later connections will find the session established.
+     */
+    if (mssp->mss_base.ms_state != MSS_ESTABLISHED) {
+	mx_log("%s session S%u is not established (state %u)",
+	       mx_sock_title(&msfp->msf_base), mssp->mss_base.ms_id,
+	       mssp->mss_base.ms_state);
+	mslp->msl_request->mr_client = NULL;
+	mx_buffer_free(msfp->msf_rbufp);
+	free(msfp);
+	return NULL;
+    }
+
     mx_request_t *mrp = mslp->msl_request;
     mx_channel_t *mcp;
     mcp = mx_channel_direct_tcpip(mssp, &msfp->msf_base,
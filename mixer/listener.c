@@ -18,12 +18,58 @@ mx_listener_print (MX_TYPE_PRINT_ARGS)
 {
     mx_sock_listener_t *mslp = mx_sock(msp, MST_LISTENER);
 
-    mx_log("%*s%spath %s, spawns %s to %s", indent, "", prefix,
-	   mslp->msl_base.ms_sun.sun_path,
+    mx_log("%*s%s%s, spawns %s to %s", indent, "", prefix,
+	   mx_sock_name(msp),
 	   mx_sock_type_number(mslp->msl_spawns),
 	   mslp->msl_request->mr_target);
 }
 
+/*
+ * Make a listener for a socket that's bound and listening
+ */
+static mx_sock_listener_t *
+mx_listener_create (int sock, mx_type_t type, int spawns, const char *target)
+{
+    mx_sock_listener_t *mslp = malloc(sizeof(*mslp));
+    if (mslp == NULL) {
+	close(sock);
+	return NULL;
+    }
+
+    bzero(mslp, sizeof(*mslp));
+    mslp->msl_base.ms_id = mx_next_id(mx_sock_id);
+    mslp->msl_base.ms_type = type;
+    mslp->msl_base.ms_sock = sock;
+    mslp->msl_spawns = spawns;
+
+    mslp->msl_request = calloc(1, sizeof(*mslp->msl_request));
+    if (mslp->msl_request) {
+	mslp->msl_request->mr_target = nstrdup(target);
+	mslp->msl_request->mr_hostname = nstrdup(target);
+	mslp->msl_request->mr_port = 22;
+	mslp->msl_request->mr_fulltarget = strdupf("%s@%s:%u",
+				opt_user ?: "", target ?: "", 22);
+	mslp->msl_request->mr_user = nstrdup(opt_user);
+	mslp->msl_request->mr_password = nstrdup(opt_password);
+	mslp->msl_request->mr_desthost = nstrdup(opt_desthost);
+	mslp->msl_request->mr_destport = opt_destport;
+    }
+
+    return mslp;
+}
+
+static void
+mx_listener_insert (mx_sock_listener_t *mslp)
+{
+    TAILQ_INSERT_HEAD(&mx_sock_list, &mslp->msl_base, ms_link);
+    mx_sock_count += 1;
+
+    MX_LOG("%s new listener, fd %u, spawns %s, %s...",
+	   mx_sock_title(&mslp->msl_base), mslp->msl_base.ms_sock,
+	   mx_sock_type_number(mslp->msl_spawns),
+	   mx_sock_name(&mslp->msl_base));
+}
+
 mx_sock_t *
 mx_listener (const char *path, mx_type_t type, int spawns, const char *target)
 {
@@ -57,33 +103,82 @@ mx_listener (const char *path, mx_type_t type, int spawns, const char *target)
 	return NULL;
     }
 
-    mx_sock_listener_t *mslp = malloc(sizeof(*mslp));
+    mx_sock_listener_t *mslp = mx_listener_create(sock, type, spawns, target);
     if (mslp == NULL)
 	return NULL;
 
-    bzero(mslp, sizeof(*mslp));
-    mslp->msl_base.ms_id = ++mx_sock_id;
-    mslp->msl_base.ms_type = type;
-    mslp->msl_base.ms_sock = sock;
     mslp->msl_base.ms_sun = sun;
-    mslp->msl_spawns = spawns;
+    mx_listener_insert(mslp);
 
-    mslp->msl_request = calloc(1, sizeof(*mslp->msl_request));
-    if (mslp->msl_request) {
-	mslp->msl_request->mr_target = nstrdup(target);
-	mslp->msl_request->mr_user = nstrdup(opt_user);
-	mslp->msl_request->mr_password = nstrdup(opt_password);
-	mslp->msl_request->mr_desthost = nstrdup(opt_desthost);
-	mslp->msl_request->mr_destport = opt_destport;
+    return &mslp->msl_base;
+}
+
+/*
+ * Listen on a TCP port, so browsers can reach us directly (see
+ * rfc6455.c).  The address is a numeric IPv4 or IPv6 one.
+ */
+mx_sock_t *
+mx_listener_port (const char *address, unsigned port, mx_type_t type,
+		  int spawns, const char *target)
+{
+    struct sockaddr_in sin;
+    struct sockaddr_in6 sin6;
+    struct sockaddr *sap;
+    socklen_t salen;
+    int family;
+
+    bzero(&sin, sizeof(sin));
+    bzero(&sin6, sizeof(sin6));
+
+    if (inet_pton(AF_INET, address, &sin.sin_addr) == 1) {
+	family = AF_INET;
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sap = (struct sockaddr *) &sin;
+	salen = sizeof(sin);
+    } else if (inet_pton(AF_INET6, address, &sin6.sin6_addr) == 1) {
+	family = AF_INET6;
+	sin6.sin6_family = AF_INET6;
+	sin6.sin6_port = htons(port);
+	sap = (struct sockaddr *) &sin6;
+	salen = sizeof(sin6);
+    } else {
+	mx_log("listener address %s: not a numeric address", address);
+	return NULL;
     }
 
-    TAILQ_INSERT_HEAD(&mx_sock_list, &mslp->msl_base, ms_link);
-    mx_sock_count += 1;
+    int sock = socket(family, SOCK_STREAM, 0);
+    if (sock < 0)
+	return NULL;
 
-    MX_LOG("%s new listener, fd %u, spawns %s, %s...",
-	   mx_sock_title(&mslp->msl_base), mslp->msl_base.ms_sock,
-	   mx_sock_type_number(mslp->msl_spawns),
-	   mx_sock_name(&mslp->msl_base));
+    int sockopt = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &sockopt, sizeof(sockopt));
+
+    if (bind(sock, sap, salen) < 0) {
+        mx_log("listener port %s:%u: bind: %s", address, port,
+	       strerror(errno));
+	close(sock);
+	return NULL;
+    }
+
+    if (listen(sock, 5) < 0) {
+        mx_log("listener port %s:%u: listen: %s", address, port,
+	       strerror(errno));
+	close(sock);
+	return NULL;
+    }
+
+    mx_nonblocking(sock);
+
+    mx_sock_listener_t *mslp = mx_listener_create(sock, type, spawns, target);
+    if (mslp == NULL)
+	return NULL;
+
+    if (family == AF_INET)
+	mslp->msl_base.ms_sin = sin;
+    else
+	mslp->msl_base.ms_sin6 = sin6;
+    mx_listener_insert(mslp);
 
     return &mslp->msl_base;
 }
@@ -109,8 +204,10 @@ mx_listener_accept (mx_sock_listener_t *listener)
     mx_sock_t *msp;
     msp = mx_mti_number(listener->msl_spawns)->mti_spawn(listener, sock,
 							 &sun, sunlen);
-    if (msp == NULL)
+    if (msp == NULL) {
+	close(sock);
 	return NULL;
+    }
 
     TAILQ_INSERT_HEAD(&mx_sock_list, msp, ms_link);
     mx_sock_count += 1;
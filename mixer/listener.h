@@ -12,6 +12,10 @@
 mx_sock_t *
 mx_listener (const char *path, mx_type_t type, int spawns, const char *target);
 
+mx_sock_t *
+mx_listener_port (const char *address, unsigned port, mx_type_t type,
+		  int spawns, const char *target);
+
 void
 mx_listener_init (void);
 
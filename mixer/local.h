@@ -13,6 +13,7 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
 #include <signal.h>
@@ -50,29 +51,56 @@
 
 #define LOCALHOST_ADDRESS "127.0.0.1"
 
-#define MAX_POLL	10000	/* Largest number of open sockets to poll() */
 #define MAX_ARGS	10	/* Max number of args to carve up */
 #define MAX_XML_ATTR	10	/* Max number of attributes on rpc tag */
 #define MAX_PWFAIL	3	/* Max times password can fail */
 
 #define INDENT 		4	/* Indentation increment */
 #define BUFFER_DEFAULT_SIZE (4*1024)
+#define BUFFER_HEADROOM	40	/* Room for a websocket header or held marker */
 #define POLL_TIMEOUT	30000	/* Poll() timeout */
 
 extern char keyfile1[], keyfile2[];
 
 extern unsigned mx_sock_id;   /* Monotonically increasing ID number */
 
+/*
+ * ID numbers are shared by all event loops, so bump them atomically
+ */
+#define mx_next_id(_counter) __sync_add_and_fetch(&(_counter), 1)
+
 extern char *opt_dot_dir;	/* Directory for our dot files */
 extern const char *opt_user;
 extern const char *opt_password;
 extern const char *opt_desthost;
 extern const char *opt_db;
+extern const char *opt_origin;
 extern unsigned opt_destport;
+extern int opt_no_chunked_framing;
 extern int opt_no_db;
 extern int opt_no_agent;
 extern int opt_keepalive;
+extern int opt_idle_channels_min;
+extern int opt_idle_channels_max;
+extern int opt_idle_channel_timeout;
+extern int opt_idle_session_timeout;
+extern int opt_cache_max;
+extern int opt_channels_max;
+extern int opt_coalesce_window;
+extern int opt_compress_level;
+extern int opt_connect_timeout;
+extern int opt_dns_ttl;
+extern int opt_frame_max;
 extern int opt_knownhosts;
+extern int opt_output_high_water;
+extern int opt_output_low_water;
+extern int opt_pipeline_max;
+extern int opt_read_buffer_max;
+extern int opt_request_timeout;
+extern int opt_ssh_packet_size;
+extern int opt_ssh_window_size;
+extern int opt_upload_stream_min;
+extern int opt_workers;
 
 static inline char *
 nstrdup (const char *str)
@@ -80,6 +108,18 @@ nstrdup (const char *str)
     return str ? strdup(str) : NULL;
 }
 
+/*
+ * Return the current time in milliseconds
+ */
+static inline unsigned long long
+mx_time_ms (void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000ULL + tv.tv_usec / 1000;
+}
+
 mx_password_t *
 mx_password_find (const char *target, const char *user);
 
@@ -95,6 +135,9 @@ mx_nonblocking (int sock);
 void
 mx_sock_close (mx_sock_t *msp);
 
+void
+mx_main_loop (void);
+
 /*
  * Looks like the _SAFE macros are missing from some linux distros
  */
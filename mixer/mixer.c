@@ -31,6 +31,8 @@
  * MST_CONSOLE: a debug console.
  *
  * MST_WEBSOCKET: a WebSocket connection to a browser.
+ *
+ * MST_HANDOFF: a queue of messages from another event loop (worker.c).
  */
 
 #include "local.h"
@@ -41,16 +43,41 @@
 #include "db.h"
 #include "websocket.h"
 #include "request.h"
+#include "event.h"
+#include "resolver.h"
+#include "connect.h"
+#include "worker.h"
+#include "timer.h"
+#include "rfc6455.h"
+#include "cache.h"
+#include <pthread.h>
 #include <signal.h>
 #include <err.h>
+#ifdef HAVE_SPLICE
+#include <fcntl.h>
+#endif
 #include <libjuise/io/pid_lock.h>
 
-#define READ_BUFSIZ (8*BUFSIZ)
+#define RELAY_BUFSIZ (64*1024)	/* Most we move at once in forward mode */
+
+/*
+ * One direction of a forwarding relay (see forward_data).  Where we
+ * have splice(), the data goes thru a pipe and never comes up into
+ * our address space.  Otherwise, or when an fd won't splice (a tty,
+ * say), we copy thru mrl_buf.
+ */
+typedef struct mx_relay_s {
+    const char *mrl_name;	/* Direction, for logging */
+    int mrl_pipe[2];		/* Pipe for splice(), or -1 */
+    char *mrl_buf;		/* Buffer for copying (allocated as needed) */
+    unsigned long long mrl_bytes; /* Bytes relayed */
+    unsigned long mrl_chunks;	/* Number of reads (or splices) */
+} mx_relay_t;
 
 unsigned mx_sock_id;   /* Monotonically increasing ID number */
 
-static struct pollfd mx_pollfd[MAX_POLL];
-static struct pollfd *mx_poll_owner[MAX_POLL];
+MX_THREAD_LOCAL mx_sock_list_t mx_sock_list; /* List of all sockets */
+MX_THREAD_LOCAL int mx_sock_count; /* Number of mx_sock_t in mx_sock_list */
 
 static const char keydir[] = ".ssh";
 static const char keybase1[] = "id_dsa.pub";
@@ -63,16 +90,40 @@ char keyfile1[MAXPATHLEN], keyfile2[MAXPATHLEN];
 const char *opt_db = NULL;
 const char *opt_desthost = "localhost";
 char *opt_dot_dir;		/* Directory for our dot files */
+const char *opt_origin;		/* Origin allowed to open websockets */
 const char *opt_password;
 const char *opt_user;		/* User name (if not getlogin()) */
+int opt_cache_max = 16 * 1024 * 1024; /* Memory for the reply cache */
+int opt_channels_max = 8;	/* Most channels in use per session */
+int opt_coalesce_window = 2000; /* Msecs a new client may join an rpc */
+int opt_compress_level = 6;	/* Deflate level for replies (0 for none) */
+int opt_connect_timeout = 30;	/* Seconds for each session setup step */
+int opt_dns_ttl = 60;		/* Seconds to cache hostname lookups */
+int opt_frame_max = 16 * 1024 * 1024; /* Largest websocket frame we'll hold */
+int opt_idle_channels_min = 2;	/* Idle channels to keep per session */
+int opt_idle_channels_max = 8;	/* Most idle channels to keep */
+int opt_idle_channel_timeout = 300; /* Seconds before trimming idle channels */
+int opt_idle_session_timeout;	/* Seconds before closing idle sessions */
 int opt_keepalive;
 int opt_knownhosts;
 int opt_local_console;
 int opt_no_agent;
+int opt_no_chunked_framing;	/* Only offer NETCONF 1.0 framing */
 int opt_no_db;
 int opt_no_known_hosts;
+int opt_output_high_water = 1024 * 1024; /* Client output queue limit */
+int opt_output_low_water = 256 * 1024; /* Resume reading below this */
+int opt_pipeline_max = 4;	/* Most RPCs outstanding on one channel */
+int opt_read_buffer_max = 256 * 1024; /* Largest channel read buffer */
+int opt_request_timeout;	/* Seconds before an RPC is abandoned */
+int opt_ssh_packet_size;	/* SSH channel packet size (0 for default) */
+int opt_ssh_window_size;	/* SSH channel window size (0 for default) */
+int opt_upload_stream_min = 64 * 1024; /* Stream RPCs larger than this */
 unsigned opt_destport = 22;
+int opt_workers;		/* Number of worker threads (0 for none) */
 
+static const char *opt_address = "127.0.0.1"; /* Address for --port */
+static char *opt_event_backend;
 static char *opt_home;
 static char *opt_logfile;
 static int opt_console;
@@ -83,27 +134,33 @@ static int opt_no_console;
 static int opt_no_auto_server;
 static int opt_server;
 static int opt_client;
-static unsigned opt_port = 8000;
+static unsigned opt_port;	/* Port for browsers' websockets (0 for none) */
 
-static char *path_websocket, *path_console, *path_lock;
+static char *path_websocket, *path_console, *path_lock, *path_token;
 static mx_password_t *mx_saved_passwords;
+static pthread_mutex_t mx_password_lock = PTHREAD_MUTEX_INITIALIZER;
 
 mx_password_t *
 mx_password_find (const char *target, const char *user)
 {
     mx_password_t *mpp;
 
+    /* Saved passwords are never freed, so we can hand them out */
+    pthread_mutex_lock(&mx_password_lock);
+
     for (mpp = mx_saved_passwords; mpp; mpp = mpp->mp_next) {
 	if (!streq(target, mpp->mp_target))
 	    continue;
 	if ((user == NULL && mpp->mp_user == NULL)
 	    || streq(user, mpp->mp_user)) {
 	    mpp->mp_laststamp = time(NULL);
-	    return mpp;
+	    break;
 	}
     }
 
-    return NULL;
+    pthread_mutex_unlock(&mx_password_lock);
+
+    return mpp;
 }
 
 const char *
@@ -123,8 +180,10 @@ mx_password_save (const char *target, const char *user, const char *password)
     mpp->mp_user = strdup(user);
     mpp->mp_password = strdup(password);
 
+    pthread_mutex_lock(&mx_password_lock);
     mpp->mp_next = mx_saved_passwords;
     mx_saved_passwords = mpp;
+    pthread_mutex_unlock(&mx_password_lock);
 
     return mpp;
 }
@@ -151,6 +210,8 @@ mx_sock_close (mx_sock_t *msp)
 
     mx_log("%s close (%u)", mx_sock_title(msp), msp->ms_state);
 
+    mx_event_forget(msp);
+
     if (mx_mti(msp)->mti_close)
 	mx_mti(msp)->mti_close(msp);
 
@@ -176,51 +237,51 @@ mx_sock_close (mx_sock_t *msp)
  * present.  Each socket type can define their own prep and poller
  * functions.  If the prep function returns TRUE, it should fill in
  * the poll struct and the timeout value.
+ *
+ * The actual waiting is done by an event backend (event.c), which
+ * decides which sockets need their poller called.
+ *
+ * Worker threads (worker.c) each run their own copy of this loop,
+ * over their own sockets.
  */
-static void
-main_loop (void)
+void
+mx_main_loop (void)
 {
-    mx_sock_t *msp;
+    mx_sock_t *msp, *next;
+    struct pollfd *pollp;
     int rc;
 
     for (;;) {
-	struct pollfd *pollp;
-	int nfd = 0;
-	int mindex = -1;
 	int timeout = POLL_TIMEOUT;
 
-	assert(mx_sock_count < MAX_POLL);
+	/* Fire expired timers before anyone preps */
+	mx_timer_run();
+
+	mx_event_begin();
 
-	bzero(&mx_pollfd, sizeof(mx_pollfd[0]) * mx_sock_count);
-	bzero(&mx_poll_owner, sizeof(mx_poll_owner[0]) * mx_sock_count);
+	TAILQ_FOREACH_SAFE(msp, &mx_sock_list, ms_link, next) {
+	    struct pollfd pfd;
 
-	TAILQ_FOREACH(msp, &mx_sock_list, ms_link) {
-	    mindex += 1;
+	    bzero(&pfd, sizeof(pfd));
+	    pfd.fd = msp->ms_sock;
+	    pfd.events = POLLIN;
 
 	    if (mx_mti(msp)->mti_prep == NULL
-                || mx_mti(msp)->mti_prep(msp, &mx_pollfd[nfd], &timeout)) {
-		mx_pollfd[nfd].fd = msp->ms_sock;
-		mx_pollfd[nfd].events = POLLIN;
-		mx_pollfd[nfd].revents = 0;
-		mx_poll_owner[mindex] = &mx_pollfd[nfd];
-
-                if (opt_debug & DBG_FLAG_POLL)
-                    mx_log("  prep: %d: fd %d %s %s %x (%s%s)",
-                         nfd, mx_pollfd[nfd].fd, mx_sock_title(msp),
-                         mx_sock_type(msp), mx_pollfd[nfd].events,
-                         (mx_pollfd[nfd].events & POLLIN) ? " pollin" : "",
-                         (mx_pollfd[nfd].events & POLLOUT) ? " pollout" : "");
-
-		nfd += 1;
-	    }
+                || mx_mti(msp)->mti_prep(msp, &pfd, &timeout))
+		mx_event_want(msp, &pfd);
+	    else
+		mx_event_ignore(msp);
 
 	    if (msp->ms_state == MSS_FAILED)
-		goto failure;
+		mx_sock_close(msp);
 	}
 
-        DBG_POLL("poll<: nfd %d, timeout %d", nfd, timeout);
+	/* Wake up in time for the next timer */
+	mx_timer_next(&timeout);
+
+        DBG_POLL("poll<: nfd %d, timeout %d", mx_event_wanted(), timeout);
 
-	if (nfd == 0) {
+	if (mx_event_wanted() == 0) {
 	    mx_log("mixer: nfd is zero");
 	    return;
 	}
@@ -228,7 +289,7 @@ main_loop (void)
 	struct timeval tv_begin, tv_end;
 	gettimeofday(&tv_begin, NULL);
 
-	rc = poll(mx_pollfd, nfd, timeout);
+	rc = mx_event_wait(timeout);
         if (rc < 0) {
 	    if (errno == EINTR)
 		continue;
@@ -240,62 +301,191 @@ main_loop (void)
 	unsigned long delta = (tv_end.tv_sec - tv_begin.tv_sec) * 1000;
 	delta += (tv_end.tv_usec - tv_begin.tv_usec) / 1000;
 
-	if (opt_debug & DBG_FLAG_POLL) {
-	    int i;
-	    mx_log("poll: rc %d, delta %lu%s", rc, delta,
-                   (delta > 20000) ? " long wait" : "");
-	    for (i = 0; i < nfd; i++) {
-		mx_log("  post %d: fd %d %s %x (%s%s%s)", i, mx_pollfd[i].fd,
-                       mx_sock_type(msp), mx_pollfd[i].revents,
-		       (mx_pollfd[i].revents & POLLIN) ? " pollin" : "",
-		       (mx_pollfd[i].revents & POLLOUT) ? " pollout" : "",
-		       (mx_pollfd[i].revents & POLLERR) ? " pollerr" : "");
-	    }
-	}
-
-	mindex = -1;
-	TAILQ_FOREACH(msp, &mx_sock_list, ms_link) {
-	    mindex += 1;
-
-	    pollp = mx_poll_owner[mindex];
+	DBG_POLL("poll: rc %d, delta %lu%s", rc, delta,
+		 (delta > 20000) ? " long wait" : "");
 
+	while ((msp = mx_event_next(&pollp)) != NULL) {
 	    if (pollp && pollp->revents & POLLNVAL) {
-		mx_log("invalid poll entry");
-		goto failure;
+		mx_log("%s invalid poll entry", mx_sock_title(msp));
+		mx_sock_close(msp);
+		continue;
 	    }
 
 	    if (mx_mti(msp)->mti_poller
                 && mx_mti(msp)->mti_poller(msp, pollp)) {
                 mx_log("%s poller detects failure", mx_sock_title(msp));
-                goto failure;
+		mx_sock_close(msp);
+		continue;
             }
 
 	    if (msp->ms_state == MSS_FAILED)
-		goto failure;
+		mx_sock_close(msp);
 	}
 
 	/* Look thru the requests to see what's failing */
 	mx_request_check_health();
-
-	continue;
-
-    failure:
-	mx_sock_close(msp);
     }
 
 shutdown:
-    TAILQ_FOREACH(msp, &mx_sock_list, ms_link) {
+    while ((msp = TAILQ_FIRST(&mx_sock_list)) != NULL)
 	mx_sock_close(msp);
+}
+
+static void
+relay_init (mx_relay_t *mrlp, const char *name, int splice_ok UNUSED)
+{
+    bzero(mrlp, sizeof(*mrlp));
+    mrlp->mrl_name = name;
+    mrlp->mrl_pipe[0] = mrlp->mrl_pipe[1] = -1;
+
+#ifdef HAVE_SPLICE
+    if (splice_ok && pipe(mrlp->mrl_pipe) < 0) {
+	mx_log("relay %s: pipe: %s", name, strerror(errno));
+	mrlp->mrl_pipe[0] = mrlp->mrl_pipe[1] = -1;
     }
+#endif /* HAVE_SPLICE */
+}
+
+static void
+relay_no_pipe (mx_relay_t *mrlp)
+{
+    if (mrlp->mrl_pipe[0] >= 0) {
+	close(mrlp->mrl_pipe[0]);
+	close(mrlp->mrl_pipe[1]);
+	mrlp->mrl_pipe[0] = mrlp->mrl_pipe[1] = -1;
+    }
+}
+
+static void
+relay_cleanup (mx_relay_t *mrlp, unsigned long long msecs)
+{
+    mx_log("relay %s: %llu bytes in %lu chunks, %.1f KB/s%s",
+	   mrlp->mrl_name, mrlp->mrl_bytes, mrlp->mrl_chunks,
+	   msecs ? (double) mrlp->mrl_bytes / msecs : 0.0,
+	   (mrlp->mrl_pipe[0] >= 0) ? " (splice)" : "");
+
+    relay_no_pipe(mrlp);
+    free(mrlp->mrl_buf);
+    mrlp->mrl_buf = NULL;
 }
 
+/*
+ * Write all of a buffer, since a short write isn't the end of the
+ * world.  Returns -1 on error.
+ */
 static int
-copy_data (int wr, int rd, int *eofp)
+relay_write (int wr, const char *buf, int len)
 {
-    int rc, len;
-    char buf[READ_BUFSIZ];
+    int rc;
 
-    rc = read(rd, buf, sizeof(buf));
+    while (len > 0) {
+	rc = write(wr, buf, len);
+	if (rc < 0) {
+	    if (errno == EINTR)
+		continue;
+	    mx_log("write: (%d) %s", len, strerror(errno));
+	    return -1;
+	}
+
+	buf += rc;
+	len -= rc;
+    }
+
+    return 0;
+}
+
+#ifdef HAVE_SPLICE
+/*
+ * Move a chunk from rd to wr thru our pipe.  Returns 1 if it's done,
+ * 0 if the fds won't splice (nothing was moved, and we'll copy
+ * instead), or -1 on EOF or error.
+ */
+static int
+relay_splice (mx_relay_t *mrlp, int wr, int rd)
+{
+    ssize_t rc, len;
+
+    for (;;) {
+	len = splice(rd, NULL, mrlp->mrl_pipe[1], NULL, RELAY_BUFSIZ,
+		     SPLICE_F_MOVE);
+	if (len >= 0)
+	    break;
+	if (errno == EINTR)
+	    continue;
+	if (errno == EINVAL)
+	    return 0;
+	mx_log("splice: %s", strerror(errno));
+	return -1;
+    }
+
+    if (len == 0)
+	return -1;
+
+    mrlp->mrl_bytes += len;
+    mrlp->mrl_chunks += 1;
+
+    while (len > 0) {
+	rc = splice(mrlp->mrl_pipe[0], NULL, wr, NULL, len, SPLICE_F_MOVE);
+	if (rc > 0) {
+	    len -= rc;
+	    continue;
+	}
+	if (rc < 0 && errno == EINTR)
+	    continue;
+	if (rc < 0 && errno == EINVAL)
+	    break;		/* wr won't splice; copy the rest */
+	mx_log("splice: (%zd) %s", len, strerror(errno));
+	return -1;
+    }
+
+    /* Empty the pipe by hand, so we can stop splicing */
+    while (len > 0) {
+	char buf[BUFSIZ];
+
+	rc = read(mrlp->mrl_pipe[0], buf, MIN(len, (ssize_t) sizeof(buf)));
+	if (rc <= 0) {
+	    if (rc < 0 && errno == EINTR)
+		continue;
+	    return -1;
+	}
+
+	if (relay_write(wr, buf, rc) < 0)
+	    return -1;
+	len -= rc;
+    }
+
+    return 1;
+}
+#endif /* HAVE_SPLICE */
+
+/*
+ * Relay a chunk of data from rd to wr.  With eofp, a lone ^D means
+ * the user is done (see do_console); we need to see the data for
+ * that, so we copy rather than splice.  Returns -1 on EOF or error.
+ */
+static int
+copy_data (mx_relay_t *mrlp, int wr, int rd, int *eofp)
+{
+    int rc;
+
+#ifdef HAVE_SPLICE
+    if (eofp == NULL && mrlp->mrl_pipe[0] >= 0) {
+	rc = relay_splice(mrlp, wr, rd);
+	if (rc != 0)
+	    return (rc < 0) ? -1 : 0;
+
+	mx_log("relay %s: can't splice; copying instead", mrlp->mrl_name);
+	relay_no_pipe(mrlp);
+    }
+#endif /* HAVE_SPLICE */
+
+    if (mrlp->mrl_buf == NULL) {
+	mrlp->mrl_buf = malloc(RELAY_BUFSIZ);
+	if (mrlp->mrl_buf == NULL)
+	    return -1;
+    }
+
+    rc = read(rd, mrlp->mrl_buf, RELAY_BUFSIZ);
     if (rc < 0) {
 	if (errno == EINTR)
 	    return 0;
@@ -304,19 +494,16 @@ copy_data (int wr, int rd, int *eofp)
     }
     if (rc == 0)
 	return -1;
-    
-    if (eofp && rc == 1 && buf[0] == 0x04) {
+
+    if (eofp && rc == 1 && mrlp->mrl_buf[0] == 0x04) {
 	*eofp = TRUE;
 	return 0;
     }
 
-    len = write(wr, buf, rc);
-    if (len < 0 || len != rc) {
-	mx_log("write: (%d.%d) %s", len, rc, strerror(errno));
-	return -1;
-    }
+    mrlp->mrl_bytes += rc;
+    mrlp->mrl_chunks += 1;
 
-    return 0;
+    return relay_write(wr, mrlp->mrl_buf, rc);
 }
 
 static int
@@ -358,12 +545,22 @@ connect_to_path (const char *path, const char *tag)
     return sock;
 }
 
+/*
+ * Relay data between s1 and s2 (in) and s2 and s3 (out).  With
+ * "drain", once s1 is done we tell s2 so, and relay what it has
+ * left for us.  The byte counts and rates are logged at the end.
+ */
 static void
-forward_data (int s1, int s2, int s3, int s1_check_eof)
+forward_data (int s1, int s2, int s3, int s1_check_eof, int drain)
 {
     int rc;
     int s1_eof = FALSE;
     int *s1_checker = s1_check_eof ? &s1_eof : NULL;
+    unsigned long long start = mx_time_ms();
+    mx_relay_t up, down;
+
+    relay_init(&up, "in", !s1_check_eof);
+    relay_init(&down, "out", TRUE);
 
     for (;;) {
 	struct pollfd pd[2];
@@ -388,7 +585,7 @@ forward_data (int s1, int s2, int s3, int s1_check_eof)
         }
 
 	if (!s1_eof && (pd[1].revents & POLLIN)) {
-	    if (copy_data(s2, s1, s1_checker) < 0) {
+	    if (copy_data(&up, s2, s1, s1_checker) < 0) {
 		mx_log("copy 1->2 done");
 		break;
 	    }
@@ -398,12 +595,24 @@ forward_data (int s1, int s2, int s3, int s1_check_eof)
 	}
 
 	if (pd[0].revents & POLLIN) {
-	    if (copy_data(s3, s2, FALSE) < 0) {
+	    if (copy_data(&down, s3, s2, NULL) < 0) {
 		mx_log("copy 2->1 done");
+		drain = FALSE;
 		break;
 	    }
 	}
     }
+
+    if (drain) {
+	shutdown(s2, SHUT_WR);
+
+	while (copy_data(&down, s3, s2, NULL) >= 0)
+	    continue;
+    }
+
+    start = mx_time_ms() - start;
+    relay_cleanup(&up, start);
+    relay_cleanup(&down, start);
 }
 
 static int
@@ -416,7 +625,7 @@ do_console (char **argv UNUSED)
     if (sock < 0)
 	return sock;
 
-    forward_data(0, sock, 1, TRUE);
+    forward_data(0, sock, 1, TRUE, FALSE);
 
     return 0;
 }
@@ -429,6 +638,10 @@ mx_type_info_init (void)
     mx_session_init();
     mx_console_init();
     mx_websocket_init();
+    mx_rfc6455_init();
+    mx_resolver_init();
+    mx_connect_init();
+    mx_worker_init();
 }
 
 static void
@@ -465,6 +678,10 @@ do_server (char **argv UNUSED)
 	opt_password = strdup(getpass("Password:"));
 
     mx_type_info_init();
+    mx_cache_init();
+
+    if (!mx_event_init(opt_event_backend))
+	errx(1, "event backend initialization failed");
 
     if (!opt_no_db && !mx_db_init())
 	errx(1, "mixer database initialization failed");
@@ -480,12 +697,24 @@ do_server (char **argv UNUSED)
 		    "websocket") == NULL)
 	errx(1, "initial listen failed");
 
+    if (opt_port && !mx_rfc6455_token_init(path_token))
+	errx(1, "could not make websocket token: %s", path_token);
+
+    if (opt_port && mx_listener_port(opt_address, opt_port, MST_LISTENER,
+				     MST_UPGRADE, "websocket") == NULL)
+	errx(1, "listen on port %u failed", opt_port);
+
     if (!opt_local_console && !opt_no_console)
 	if (mx_listener(path_console, MST_LISTENER, MST_CONSOLE,
 			"console") == NULL)
 	    errx(1, "initial listen failed");
 
-    main_loop();
+    if (opt_workers > 0 && !mx_worker_start(opt_workers, opt_event_backend))
+	errx(1, "worker thread initialization failed");
+
+    mx_main_loop();
+
+    mx_event_cleanup();
 
     libssh2_exit();
 
@@ -536,24 +765,7 @@ do_forward (char **argv UNUSED)
     if (sock < 0)
 	return sock;
 
-    forward_data(0, sock, 1, FALSE);
-
-    shutdown(sock, SHUT_WR);
-
-    for (;;) {
-	char buf[READ_BUFSIZ];
-	int rc = read(sock, buf, sizeof(buf));
-	if (rc < 0) {
-	    if (errno == EINTR)
-		continue;
-	    break;
-	}
-	if (rc == 0)
-	    break;
-
-	if (write(1, buf, rc) < 0)
-	    break;
-    }
+    forward_data(0, sock, 1, FALSE, TRUE);
 
     return 0;
 }
@@ -592,27 +804,55 @@ print_help (const char *opt)
 
     fprintf(stderr,
 	    "Usage: mixer [options]\n\n"
+	    "\t--address <addr>: address to listen on for --port (default 127.0.0.1)\n"
+	    "\t--cache-max <bytes>: memory for the reply cache (0 for none)\n"
+	    "\t--cache-ttl <rpc>=<secs>: cache replies to <rpc> (or \"get-*\", etc)\n"
+	    "\t--channels-max <n>: most channels in use per session\n"
 	    "\t--client: connect to an existing mixer server\n"
+	    "\t--coalesce <rpc>: let concurrent clients share one run of <rpc> (or \"get-*\", etc)\n"
+	    "\t--coalesce-window <msecs>: how long after an rpc starts others may join it (0 to never)\n"
+	    "\t--compress-level <n>: deflate level for replies to clients that ask (0 to never)\n"
+	    "\t--connect-timeout <secs>: time limit for each session setup step\n"
 	    "\t--console or -C: connect to server console\n"
 	    "\t--create-db: create mixer database and exit\n"
 	    "\t--db <dbname>: Specify mixer database file\n"
 	    "\t--debug <flag>: turn on specified debug flag\n"
+	    "\t--dns-ttl <secs>: time to cache hostname lookups\n"
 	    "\t--dot-dir <path>: directory for finding 'dot' files\n"
+	    "\t--event-backend <name>: use event backend (epoll, poll)\n"
 	    "\t--fork: force fork\n"
+	    "\t--frame-max <bytes>: largest websocket frame to hold in memory\n"
 	    "\t--help: display this message\n"
 	    "\t--home <dir>: specify home directory\n"
+	    "\t--idle-channel-timeout <secs>: idle time before closing extra channels\n"
+	    "\t--idle-channels-max <n>: most idle channels kept per session\n"
+	    "\t--idle-channels-min <n>: idle channels kept open per session\n"
+	    "\t--idle-session-timeout <secs>: idle time before closing a session\n"
 	    "\t--keep-alive <secs> OR -k <secs>: keep-alive timeout\n"
 	    "\t--local-console: enable local console for server\n"
 	    "\t--log <file>: send log message to file\n"
 	    "\t--login: require use login\n"
+	    "\t--no-chunked-framing: only offer NETCONF 1.0 (end-of-message) framing\n"
 	    "\t--no-console: do not start server console\n"
 	    "\t--no-db: do not use device database\n"
+	    "\t--origin <origin>: web page origin allowed to use --port (default: same host)\n"
+	    "\t--output-high-water <bytes>: stop reading replies for a client with this much output queued\n"
+	    "\t--output-low-water <bytes>: resume reading once queued output drains to this\n"
 	    "\t--password <xxx>: use password for device logins\n"
-	    "\t--port <n>: use alternative port for websocket\n"
+	    "\t--pipeline-max <n>: most RPCs outstanding on one channel\n"
+	    "\t--port <n>: accept websockets on this TCP port; clients pass the token\n"
+	    "\t\tin <dot-dir>/mixer.<user>.token as \"?token=\" on the URL\n"
+	    "\t\t(CLIRA: the \"Mixer Token\" preference)\n"
+	    "\t--read-buffer-max <bytes>: largest read buffer per channel\n"
+	    "\t--request-timeout <secs>: time limit for each rpc\n"
 	    "\t--server: run in server mode\n"
+	    "\t--ssh-packet-size <bytes>: SSH channel packet size\n"
+	    "\t--ssh-window-size <bytes>: SSH channel window size\n"
+	    "\t--upload-stream-min <bytes>: stream larger rpcs to the device as they arrive (0 to never)\n"
 	    "\t--use-known-hosts OR -K: use openssh .known_hosts files\n"
 	    "\t--verbose: Enable verbose logs\n"
 	    "\t--version OR -V: show version information (and exit)\n"
+	    "\t--workers <n>: run sessions in <n> worker threads\n"
 	    "\nProject juise home page: http://juise.googlecode.com\n"
 	    "\n");
 
@@ -637,12 +877,62 @@ main (int argc UNUSED, char **argv UNUSED)
 	if (*cp != '-')
 	    break;
 
-	if (streq(cp, "--client")) {
+	if (streq(cp, "--address")) {
+	    cp = *++argv;
+	    if (cp == NULL)
+		print_help(NULL);
+	    opt_address = cp;
+
+	} else if (streq(cp, "--cache-max")) {
+	    cp = *++argv;
+	    if (cp == NULL)
+		print_help(NULL);
+	    opt_cache_max = atoi(cp);
+
+	} else if (streq(cp, "--cache-ttl")) {
+	    cp = *++argv;
+	    if (cp == NULL)
+		print_help(NULL);
+	    if (!mx_cache_rule_add(cp))
+		print_help(cp);
+
+	} else if (streq(cp, "--channels-max")) {
+	    cp = *++argv;
+	    if (cp == NULL)
+		print_help(NULL);
+	    opt_channels_max = atoi(cp);
+
+	} else if (streq(cp, "--client")) {
 	    opt_client = TRUE;
 
+	} else if (streq(cp, "--coalesce")) {
+	    cp = *++argv;
+	    if (cp == NULL)
+		print_help(NULL);
+	    if (!mx_coalesce_rule_add(cp))
+		print_help(cp);
+
+	} else if (streq(cp, "--coalesce-window")) {
+	    cp = *++argv;
+	    if (cp == NULL)
+		print_help(NULL);
+	    opt_coalesce_window = atoi(cp);
+
+	} else if (streq(cp, "--compress-level")) {
+	    cp = *++argv;
+	    if (cp == NULL)
+		print_help(NULL);
+	    opt_compress_level = atoi(cp);
+
 	} else if (streq(cp, "--console") || streq(cp, "-c")) {
 	    opt_console = TRUE;
 
+	} else if (streq(cp, "--connect-timeout")) {
+	    cp = *++argv;
+	    if (cp == NULL)
+		print_help(NULL);
+	    opt_connect_timeout = atoi(cp);
+
 	} else if (streq(cp, "--create-db")) {
 	    create_db_and_exit = TRUE;
 
@@ -655,18 +945,59 @@ main (int argc UNUSED, char **argv UNUSED)
 		print_help(NULL);
 	    mx_debug_flags(TRUE, cp);
 
+	} else if (streq(cp, "--dns-ttl")) {
+	    cp = *++argv;
+	    if (cp == NULL)
+		print_help(NULL);
+	    opt_dns_ttl = atoi(cp);
+
 	} else if (streq(cp, "--dot-dir")) {
 	    opt_dot_dir = *++argv;
 
+	} else if (streq(cp, "--event-backend")) {
+	    opt_event_backend = *++argv;
+	    if (opt_event_backend == NULL)
+		print_help(NULL);
+
 	} else if (streq(cp, "--fork")) {
 	    opt_fork = TRUE;
 
+	} else if (streq(cp, "--frame-max")) {
+	    cp = *++argv;
+	    if (cp == NULL)
+		print_help(NULL);
+	    opt_frame_max = atoi(cp);
+
 	} else if (streq(cp, "--help") || streq(cp, "-h")) {
 	    print_help(NULL);
 
 	} else if (streq(cp, "--home")) {
 	    opt_home = *++argv;
 
+	} else if (streq(cp, "--idle-channels-max")) {
+	    cp = *++argv;
+	    if (cp == NULL)
+		print_help(NULL);
+	    opt_idle_channels_max = atoi(cp);
+
+	} else if (streq(cp, "--idle-channels-min")) {
+	    cp = *++argv;
+	    if (cp == NULL)
+		print_help(NULL);
+	    opt_idle_channels_min = atoi(cp);
+
+	} else if (streq(cp, "--idle-channel-timeout")) {
+	    cp = *++argv;
+	    if (cp == NULL)
+		print_help(NULL);
+	    opt_idle_channel_timeout = atoi(cp);
+
+	} else if (streq(cp, "--idle-session-timeout")) {
+	    cp = *++argv;
+	    if (cp == NULL)
+		print_help(NULL);
+	    opt_idle_session_timeout = atoi(cp);
+
 	} else if (streq(cp, "--keep-alive") || streq(cp, "-k")) {
 	    opt_keepalive = atoi(*++argv);
 
@@ -681,6 +1012,9 @@ main (int argc UNUSED, char **argv UNUSED)
 	} else if (streq(cp, "--login")) {
 	    opt_login = TRUE;
 
+	} else if (streq(cp, "--no-chunked-framing")) {
+	    opt_no_chunked_framing = TRUE;
+
 	} else if (streq(cp, "--no-console")) {
 	    opt_no_console = TRUE;
 
@@ -690,11 +1024,38 @@ main (int argc UNUSED, char **argv UNUSED)
 	} else if (streq(cp, "--no-fork")) {
 	    opt_fork = FALSE;
 
+	} else if (streq(cp, "--origin")) {
+	    cp = *++argv;
+	    if (cp == NULL)
+		print_help(NULL);
+	    opt_origin = cp;
+
+	} else if (streq(cp, "--output-high-water")) {
+	    cp = *++argv;
+	    if (cp == NULL)
+		print_help(NULL);
+	    opt_output_high_water = atoi(cp);
+
+	} else if (streq(cp, "--output-low-water")) {
+	    cp = *++argv;
+	    if (cp == NULL)
+		print_help(NULL);
+	    opt_output_low_water = atoi(cp);
+
 	} else if (streq(cp, "--password")) {
 	    opt_password = *++argv;
 
+	} else if (streq(cp, "--pipeline-max")) {
+	    cp = *++argv;
+	    if (cp == NULL)
+		print_help(NULL);
+	    opt_pipeline_max = atoi(cp);
+
 	} else if (streq(cp, "--port")) {
-	    opt_port = atoi(*++argv);
+	    cp = *++argv;
+	    if (cp == NULL)
+		print_help(NULL);
+	    opt_port = atoi(cp);
 
 	} else if (streq(cp, "--prompt-for-password") || streq(cp, "-p")) {
 	    opt_getpass = TRUE;
@@ -705,9 +1066,39 @@ main (int argc UNUSED, char **argv UNUSED)
 	} else if (streq(cp, "--no-known-hosts")) {
 	    opt_no_known_hosts = TRUE;
 
+	} else if (streq(cp, "--read-buffer-max")) {
+	    cp = *++argv;
+	    if (cp == NULL)
+		print_help(NULL);
+	    opt_read_buffer_max = atoi(cp);
+
+	} else if (streq(cp, "--request-timeout")) {
+	    cp = *++argv;
+	    if (cp == NULL)
+		print_help(NULL);
+	    opt_request_timeout = atoi(cp);
+
 	} else if (streq(cp, "--server")) {
 	    opt_server = TRUE;
 
+	} else if (streq(cp, "--ssh-packet-size")) {
+	    cp = *++argv;
+	    if (cp == NULL)
+		print_help(NULL);
+	    opt_ssh_packet_size = atoi(cp);
+
+	} else if (streq(cp, "--ssh-window-size")) {
+	    cp = *++argv;
+	    if (cp == NULL)
+		print_help(NULL);
+	    opt_ssh_window_size = atoi(cp);
+
+	} else if (streq(cp, "--upload-stream-min")) {
+	    cp = *++argv;
+	    if (cp == NULL)
+		print_help(NULL);
+	    opt_upload_stream_min = atoi(cp);
+
 	} else if (streq(cp, "--user") || streq(cp, "-u")) {
 	    opt_user = *++argv;
 
@@ -721,6 +1112,12 @@ main (int argc UNUSED, char **argv UNUSED)
 	    print_version();
 	    exit(0);
 
+	} else if (streq(cp, "--workers")) {
+	    cp = *++argv;
+	    if (cp == NULL)
+		print_help(NULL);
+	    opt_workers = atoi(cp);
+
 	} else {
 	    print_help(cp);
 	}
@@ -758,6 +1155,7 @@ main (int argc UNUSED, char **argv UNUSED)
     asprintf(&path_websocket, "%s/mixer.%s.ws", opt_dot_dir, opt_user);
     asprintf(&path_console, "%s/mixer.%s.cons", opt_dot_dir, opt_user);
     asprintf(&path_lock, "%s/mixer.%s.lock", opt_dot_dir, opt_user);
+    asprintf(&path_token, "%s/mixer.%s.token", opt_dot_dir, opt_user);
 
     sigchld_init();
 
@@ -46,8 +46,8 @@ const char *
 mx_sock_name (mx_sock_t *msp)
 {
     #define NUM_BUFS 3
-    static unsigned buf_num;
-    static char bufs[NUM_BUFS][BUFSIZ];
+    static MX_THREAD_LOCAL unsigned buf_num;
+    static MX_THREAD_LOCAL char bufs[NUM_BUFS][BUFSIZ];
 
     if (++buf_num >= NUM_BUFS)
 	buf_num = 0;
@@ -57,8 +57,12 @@ mx_sock_name (mx_sock_t *msp)
 	unsigned int sport = ntohs(msp->ms_sin.sin_port);
 	snprintf(bufs[buf_num], BUFSIZ, "inet: %s:%d", shost, sport);
     } else if (msp->ms_sin6.sin6_port) {
+	char shost[INET6_ADDRSTRLEN];
 	unsigned int sport = ntohs(msp->ms_sin6.sin6_port);
-	snprintf(bufs[buf_num], BUFSIZ, "inet6: %d", sport);
+	if (inet_ntop(AF_INET6, &msp->ms_sin6.sin6_addr,
+		      shost, sizeof(shost)) == NULL)
+	    strlcpy(shost, "?", sizeof(shost));
+	snprintf(bufs[buf_num], BUFSIZ, "inet6: [%s]:%d", shost, sport);
     } else if (msp->ms_sun.sun_path[0]) {
 	snprintf(bufs[buf_num], BUFSIZ, "unix: %s", msp->ms_sun.sun_path);
 
@@ -103,8 +107,8 @@ const char *
 mx_sock_title  (mx_sock_t *msp)
 {
     #define TMAX 8
-    static char title[TMAX][16];
-    static int tnum;
+    static MX_THREAD_LOCAL char title[TMAX][16];
+    static MX_THREAD_LOCAL int tnum;
     char *cp = title[tnum];
 
     snprintf(title[tnum], sizeof(title[tnum]), "%s%u", mx_sock_letter(msp),
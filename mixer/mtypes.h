@@ -16,8 +16,12 @@
 #define MST_SESSION	3	/* An ssh session */
 #define MST_CONSOLE	4	/* Debug console shell */
 #define MST_WEBSOCKET	5	/* Websocket client (in a browser) */
+#define MST_RESOLVER	6	/* Completion pipe from resolver threads */
+#define MST_CONNECT	7	/* Outgoing TCP connection attempt */
+#define MST_HANDOFF	8	/* Handoff queue between event loops */
+#define MST_UPGRADE	9	/* Websocket handshake (RFC 6455) */
 
-#define MST_MAX		5	/* max(MST_*) */
+#define MST_MAX		9	/* max(MST_*) */
 
 /* State values (for ms_state) */
 #define MSS_NORMAL	0	/* Normal/okay/ignore */
@@ -37,6 +41,14 @@
 #define MSS_RPC_WRITE_REPLY 14	/* Writing <rpc-reply> to client (ws) */
 #define MSS_RPC_COMPLETE 15	/* Reply is complete (end-of-frame seen) */
 #define MSS_READ_EOF	16	/* Have read EOF from websocket */
+#define MSS_RESOLVING	17	/* Resolving the target's hostname */
+#define MSS_CONNECTING	18	/* Waiting for TCP connect() to complete */
+#define MSS_HANDSHAKE	19	/* SSH handshake in progress */
+#define MSS_AUTH	20	/* SSH authentication in progress */
+#define MSS_CHANNEL_OPEN 21	/* Opening an SSH channel */
+#define MSS_CHANNEL_STARTUP 22	/* Starting netconf subsystem or xml-mode */
+#define MSS_HELLO_WRITE	23	/* Writing our NETCONF <hello> */
+#define MSS_HELLO_READ	24	/* Reading the server's NETCONF <hello> */
 
 #define DEFINE_BIT_FUNCTIONS(_test, _set, _clear, _type, _field, _bit)	\
     static inline unsigned _test (_type *ptr) { \
@@ -70,25 +82,76 @@ typedef struct mx_buffer_s {
     char mb_data[0];
 } mx_buffer_t;
 
+/*
+ * Timers live on a hashed timing wheel (timer.c); they're embedded
+ * in the objects they time, and their function is called from the
+ * main loop once they expire.
+ */
+struct mx_timer_s;
+typedef TAILQ_ENTRY(mx_timer_s) mx_timer_link_t;
+typedef TAILQ_HEAD(mx_timer_list_s, mx_timer_s) mx_timer_list_t;
+typedef void (*mx_timer_func_t)(struct mx_timer_s *, void *);
+
+typedef struct mx_timer_s {
+    mx_timer_link_t mt_link;	/* Slot on the wheel */
+    unsigned long long mt_expires; /* Time to fire (ms) */
+    unsigned mt_flags;		/* MTF_* flags */
+    mx_timer_func_t mt_func;	/* Function to call */
+    void *mt_arg;		/* Opaque argument for mt_func */
+} mx_timer_t;
+
+#define MTF_PENDING	(1<<0)	/* Timer is on the wheel */
+
 struct mx_channel_s;		    /* Forward declaration */
 typedef TAILQ_ENTRY(mx_channel_s) mx_channel_link_t;
 typedef TAILQ_HEAD(mx_channel_list_s, mx_channel_s) mx_channel_list_t;
 
+/*
+ * A netconf channel can have several RPCs written to it before the
+ * first reply comes back.  Replies arrive in the order the RPCs were
+ * sent, so we keep the request IDs in a FIFO and hand each reply to
+ * the request at the head.  We keep IDs, not pointers, since a
+ * request can be freed (its client gone) while its reply is still on
+ * the wire; that reply is read and discarded.
+ */
+#define MX_PIPELINE_MAX	64	/* Upper bound on opt_pipeline_max */
+
 typedef struct mx_channel_s {
     mx_channel_link_t mc_link;	/* List of channels */
     unsigned mc_id;		/* Identifier for this channel */
     unsigned mc_state;		/* Current state (MSS_*) */
     unsigned mc_flags;		/* MCF_* */
     mx_offset_t mc_marker_seen;	/* Number of bytes of end-of-frame seen */
+    mx_offset_t mc_hello_sent;	/* Number of bytes of <hello> written */
     struct mx_sock_session_s *mc_session; /* Session for this channel */
     LIBSSH2_CHANNEL *mc_channel; /* Our libssh2 channel */
     struct mx_request_s *mc_request;	 /* Current request (in progress) */
+    unsigned mc_pipeline[MX_PIPELINE_MAX]; /* IDs of requests sent (FIFO) */
+    unsigned mc_pipe_first;	/* Index of head of mc_pipeline */
+    unsigned mc_pipe_count;	/* Number of entries in mc_pipeline */
+    mx_offset_t mc_next_start;	/* Start of data following end-of-frame */
+    mx_offset_t mc_next_len;	/* Length of data following end-of-frame */
     struct mx_sock_s *mc_client; /* Our client (peer) socket */
     mx_buffer_t *mc_rbufp;	/* Read buffer */
+    unsigned mc_chunk_state;	/* Chunk decoder state (MCH_*) */
+    unsigned long mc_chunk_left; /* Bytes left in the current chunk */
+    unsigned long mc_reads;	/* Number of reads with data */
+    unsigned long mc_read_bytes; /* Bytes read */
+    char mc_upload_frame[32];	/* Upload framing not yet written */
+    unsigned mc_upload_fstart;	/* Bytes of mc_upload_frame written */
+    unsigned mc_upload_flen;	/* Bytes in mc_upload_frame */
+    unsigned long mc_upload_owed; /* Bytes owed to the current chunk */
+    mx_buffer_t *mc_sendq;	/* RPC bytes the channel hasn't taken yet */
+    time_t mc_idle_since;	/* Time the channel was released */
 } mx_channel_t;
 
 #define MCF_HOLD_CHANNEL	(1<<0) /* Hold the channel after rpc complete */
 #define MCF_SEEN_EOFRAME	(1<<1) /* Have seen the end-of-frame marker */
+#define MCF_XML_MODE		(1<<2) /* Use "xml-mode", not the subsystem */
+#define MCF_READ_FULL		(1<<3) /* Last read filled the read buffer */
+#define MCF_CHUNKED		(1<<4) /* Using NETCONF 1.1 chunked framing */
+#define MCF_UPLOAD		(1<<5) /* Streaming an RPC from the client */
+#define MCF_UPLOAD_END		(1<<6) /* Upload's closing framing is staged */
 
 DEFINE_BIT_FUNCTIONS(mcf_is_hold_channel, mcf_set_hold_channel,
 		     mcf_clear_hold_channel, mx_channel_t,
@@ -98,6 +161,26 @@ DEFINE_BIT_FUNCTIONS(mcf_is_seen_eoframe, mcf_set_seen_eoframe,
 		     mcf_clear_seen_eoframe, mx_channel_t,
 		     mc_flags, MCF_SEEN_EOFRAME);
 
+DEFINE_BIT_FUNCTIONS(mcf_is_xml_mode, mcf_set_xml_mode,
+		     mcf_clear_xml_mode, mx_channel_t,
+		     mc_flags, MCF_XML_MODE);
+
+DEFINE_BIT_FUNCTIONS(mcf_is_read_full, mcf_set_read_full,
+		     mcf_clear_read_full, mx_channel_t,
+		     mc_flags, MCF_READ_FULL);
+
+DEFINE_BIT_FUNCTIONS(mcf_is_chunked, mcf_set_chunked,
+		     mcf_clear_chunked, mx_channel_t,
+		     mc_flags, MCF_CHUNKED);
+
+DEFINE_BIT_FUNCTIONS(mcf_is_upload, mcf_set_upload,
+		     mcf_clear_upload, mx_channel_t,
+		     mc_flags, MCF_UPLOAD);
+
+DEFINE_BIT_FUNCTIONS(mcf_is_upload_end, mcf_set_upload_end,
+		     mcf_clear_upload_end, mx_channel_t,
+		     mc_flags, MCF_UPLOAD_END);
+
 struct mx_request_s;
 typedef TAILQ_ENTRY(mx_request_s) mx_request_link_t;
 typedef TAILQ_HEAD(mx_request_list_s, mx_request_s) mx_request_list_t;
@@ -113,6 +196,8 @@ typedef unsigned long mx_muxid_t;
  */
 typedef struct mx_request_s {
     mx_request_link_t mr_link;
+    mx_request_link_t mr_queue_link; /* Session queue (while MRF_QUEUED) */
+    mx_request_link_t mr_follow_link; /* Our leader's mr_followers */
     unsigned mr_id;		/* Request ID (our ID) */
     unsigned mr_state;		/* State of this request */
     mx_muxid_t mr_muxid;	/* Muxer ID (client's ID) */
@@ -121,6 +206,7 @@ typedef struct mx_request_s {
     unsigned mr_auth_websocketid; /* Websocket ID to use for Authentication */
     unsigned mr_authid;		/* Request Auth ID (if different than mr_id) */
     unsigned mr_flags;          /* Flags for this request */
+    unsigned mr_priority;	/* Scheduling class (MRQ_*) */
     char *mr_name;		/* Request name (tag) */
     char *mr_target;		/* Target name (could be alias) */
     char *mr_fulltarget;        /* Full target name (user@host:port) */
@@ -136,11 +222,84 @@ typedef struct mx_request_s {
     struct mx_sock_session_s *mr_session; /* Our SSH session */
     struct mx_channel_s *mr_channel; /* Our SSH channel */
     mx_buffer_t *mr_rpc;	     /* The RPC we're attempting */
+    mx_timer_t mr_timer;	     /* Time limit (opt_request_timeout) */
+    struct z_stream_s *mr_zstream;   /* Deflate state for the reply */
+    struct mx_cache_entry_s *mr_cache; /* Reply being collected (cache.c) */
+    unsigned long long mr_start;     /* When we were created (mx_time_ms) */
+    char *mr_coalesce_key;	     /* Key others can share our reply by */
+    struct mx_request_s *mr_leader;  /* Request whose reply we share */
+    mx_request_list_t mr_followers;  /* Requests sharing our reply */
 } mx_request_t;
 
 /* Flags for mr_flags */
 #define MRF_NOCREATE	    (1<<0)  /* Do not create a new session */
 #define MRF_HTML	    (1<<1)  /* HTML mode */
+#define MRF_QUEUED	    (1<<2)  /* On its session's queue */
+#define MRF_STREAM	    (1<<3)  /* RPC body is still arriving */
+#define MRF_DEFLATE	    (1<<4)  /* Compress the reply */
+#define MRF_INVALIDATE	    (1<<5)  /* Empties the reply cache for its target */
+#define MRF_REPLYING	    (1<<6)  /* Reply has started (too late to join) */
+
+/*
+ * Requests wait on their session's queues until there's a channel
+ * for them.  Interactive requests go before bulk ones; see
+ * mx_request_schedule.
+ */
+#define MRQ_INTERACTIVE	0	/* Default: someone is waiting */
+#define MRQ_BULK	1	/* Large or background work ("priority=bulk") */
+#define MRQ_MAX		2	/* Number of classes */
+
+/*
+ * Registration information kept by the event backend (event.c) for
+ * each socket.  Backends that keep interest registered in the kernel
+ * (epoll) use this to avoid touching sockets whose interest hasn't
+ * changed since the last pass thru the main loop.
+ */
+typedef struct mx_event_reg_s {
+    unsigned mer_flags;		/* MERF_* flags */
+    int mer_fd;			/* File descriptor registered */
+    int mer_src;		/* File descriptor requested by mti_prep */
+    short mer_events;		/* Poll events registered */
+    dev_t mer_dev;		/* Identity of mer_src (with MERF_DUP) */
+    ino_t mer_ino;
+} mx_event_reg_t;
+
+#define MERF_REGISTERED	(1<<0)	/* Registered with the backend */
+#define MERF_DUP	(1<<1)	/* mer_fd is a dup() of mer_src */
+
+/*
+ * A hostname lookup, done by the resolver threads and cached for
+ * opt_dns_ttl seconds.  Sessions hold a reference while they're
+ * connecting, since they walk mre_addrinfo.
+ */
+struct mx_resolve_s;
+typedef TAILQ_ENTRY(mx_resolve_s) mx_resolve_link_t;
+typedef TAILQ_HEAD(mx_resolve_list_s, mx_resolve_s) mx_resolve_list_t;
+
+typedef struct mx_resolve_s {
+    mx_resolve_link_t mre_link;	/* Cache of lookups */
+    mx_resolve_link_t mre_qlink; /* Resolver thread queues */
+    char *mre_hostname;		/* Hostname being looked up */
+    unsigned mre_port;		/* Port being looked up */
+    unsigned mre_state;		/* MRES_* state */
+    unsigned mre_flags;		/* MREF_* flags */
+    unsigned mre_refcount;	/* Number of references */
+    int mre_error;		/* Error from getaddrinfo() */
+    struct addrinfo *mre_addrinfo; /* Results from getaddrinfo() */
+    unsigned long long mre_start; /* Time the lookup started (ms) */
+    unsigned long mre_time;	/* Time the lookup took (ms) */
+    time_t mre_expires;		/* Time the cache entry expires */
+    unsigned long mre_hits;	/* Number of cache hits */
+    struct mx_resolver_notify_s *mre_notify; /* Thread waiting for us */
+} mx_resolve_t;
+
+/* Values for mre_state */
+#define MRES_PENDING	1	/* Lookup in progress */
+#define MRES_DONE	2	/* Lookup succeeded */
+#define MRES_FAILED	3	/* Lookup failed */
+
+/* Flags for mre_flags */
+#define MREF_CACHED	(1<<0)	/* Entry is on the cache list */
 
 typedef struct mx_sock_s {
     mx_sock_link_t ms_link;	/* List of all open sockets */
@@ -152,6 +311,7 @@ typedef struct mx_sock_s {
     struct sockaddr_in ms_sin;	/* Address of peer (AF_INET) */
     struct sockaddr_in6 ms_sin6; /* Address of peer (AF_INET6) */
     struct sockaddr_un ms_sun;	/* Address of peer (AF_UNIX) */
+    mx_event_reg_t ms_event;	/* Event backend registration */
 } mx_sock_t;
 
 typedef struct mx_sock_listener_s {
@@ -176,15 +336,156 @@ typedef struct mx_sock_session_s {
     mx_channel_list_t mss_released; /* Set of channels free to use */
     int mss_pwfail;		    /* Number of password failures */
     int mss_keepalive_next;	    /* Number of seconds til next keepalive */
+    struct mx_request_s *mss_request; /* Request driving session setup */
+    char *mss_hostname;		    /* Hostname we connect to */
+    unsigned mss_port;		    /* Port we connect to */
+    char *mss_user;		    /* User name for authentication */
+    mx_resolve_t *mss_resolve;	    /* Lookup for mss_hostname */
+    struct addrinfo **mss_addrs;    /* Addresses in connect order */
+    unsigned mss_addrcount;	    /* Number of mss_addrs */
+    unsigned mss_addrindex;	    /* Next address to try */
+    unsigned mss_attempts;	    /* Connect attempts in flight */
+    unsigned long long mss_attempt_next; /* Time to start next attempt */
+    unsigned long long mss_setup_start; /* Time current step started (ms) */
+    unsigned long mss_resolve_time; /* Time taken to resolve (ms) */
+    unsigned long mss_connect_time; /* Time taken to connect (ms) */
+    time_t mss_pool_retry;	    /* Don't pre-open channels until then */
+    unsigned long mss_pool_opened;  /* Channels pre-opened for the pool */
+    unsigned long mss_pool_trimmed; /* Idle channels closed */
+    unsigned long mss_cancelled;    /* Channels closed to stop replies */
+    int mss_xml_mode;		    /* No netconf subsystem; use xml-mode */
+    mx_request_list_t mss_queue[MRQ_MAX]; /* Requests waiting for channels */
+    unsigned mss_queued[MRQ_MAX];   /* Number of requests on mss_queue */
+    unsigned mss_rr_last[MRQ_MAX];  /* Client (ms_id) served last */
+    unsigned long mss_sched_waits;  /* Requests that found no room */
+    unsigned long mss_reads;	    /* Channel reads with data */
+    unsigned long mss_read_bytes;   /* Bytes read from channels */
+    mx_timer_t mss_keepalive_timer; /* Time to send a keepalive */
+    mx_timer_t mss_idle_timer;	    /* Time to close an idle session */
+    mx_timer_t mss_pool_timer;	    /* Time to trim the idle pool */
+    time_t mss_deadline;	    /* Deadline for current setup step */
+    unsigned mss_auth_step;	    /* Current authentication step (MSA_*) */
+    unsigned mss_auth_flags;	    /* Authentication flags (MSAF_*) */
+    LIBSSH2_AGENT *mss_agent;	    /* ssh-agent handle (during auth) */
+    struct libssh2_agent_publickey *mss_agent_identity; /* Current identity */
 } mx_sock_session_t;
 
+typedef struct mx_sock_connect_s {
+    mx_sock_t msc_base;
+    struct mx_sock_session_s *msc_session; /* Session we're connecting */
+    struct addrinfo *msc_addr;	    /* Address we're connecting to */
+} mx_sock_connect_t;
+
+/*
+ * When running with worker threads, a websocket remembers which
+ * worker owns each muxid, so follow-on operations (hostkey,
+ * password, data, etc) find their request.
+ */
+typedef struct mx_websocket_route_s {
+    mx_muxid_t mwr_muxid;	   /* Muxer ID */
+    int mwr_worker;		   /* Worker that owns it */
+} mx_websocket_route_t;
+
+/*
+ * Framing state for a websocket whose browser talks to us directly
+ * (RFC 6455), rather than thru lighttpd.  Frames are decoded as they
+ * arrive, so we remember where we are in the current one.
+ */
+typedef struct mx_rfc6455_s {
+    unsigned char mwf_header[14];  /* Frame header, as it arrives */
+    unsigned mwf_hlen;		   /* Bytes of mwf_header we have */
+    unsigned mwf_opcode;	   /* Opcode of the current frame */
+    unsigned long mwf_left;	   /* Payload bytes still to come */
+    unsigned char mwf_mask[4];	   /* Masking key of the current frame */
+    unsigned mwf_maskoff;	   /* Where we are in mwf_mask */
+    unsigned char mwf_control[125]; /* Payload of a control frame */
+    unsigned mwf_clen;		   /* Bytes of mwf_control we have */
+    unsigned mwf_flags;		   /* MWFF_* flags */
+} mx_rfc6455_t;
+
+/* Flags for mwf_flags */
+#define MWFF_PAYLOAD	(1<<0)	/* mwf_header is complete; in the payload */
+#define MWFF_CLOSED	(1<<1)	/* Close frame seen; ignore the rest */
+
 typedef struct mx_sock_websocket_s {
     mx_sock_t msw_base;
     mx_buffer_t *msw_rbufp;	   /* Read buffer */
     unsigned msw_requests_made;	   /* Count of requests */
     unsigned msw_requests_complete; /* Count of requests complete */
+    unsigned msw_flags;		   /* MSWF_* flags */
+    mx_buffer_t *msw_outq;	   /* Output not yet written */
+    unsigned long msw_outq_len;	   /* Bytes in msw_outq */
+    unsigned long msw_blocked;	   /* Times msw_outq hit the high water */
+    mx_websocket_route_t *msw_routes; /* Muxids owned by workers */
+    unsigned msw_nroutes;	   /* Number of routes in use */
+    unsigned msw_maxroutes;	   /* Number of routes allocated */
+    unsigned msw_upload_id;	   /* Request whose body is arriving */
+    unsigned long msw_upload_left; /* Bytes of that body still to come */
+    mx_rfc6455_t msw_rfc6455;	   /* Framing state (MSWF_RFC6455) */
 } mx_sock_websocket_t;
 
+/* Flags for msw_flags */
+#define MSWF_PROXY	(1<<0)	/* Stand-in for a websocket on another thread */
+#define MSWF_BLOCKED	(1<<1)	/* Output over high water; stop reading */
+#define MSWF_UPLOAD_WAIT (1<<2) /* Upload is waiting for room on its channel */
+#define MSWF_HEADER2	(1<<3)	/* Client speaks version 2 headers */
+#define MSWF_DEFLATE	(1<<4)	/* Client wants compressed replies */
+#define MSWF_RFC6455	(1<<5)	/* Client speaks RFC 6455 frames to us */
+
+/*
+ * A browser connecting to us directly starts with an HTTP upgrade
+ * request.  Once we've answered it, the socket becomes a websocket.
+ */
+typedef struct mx_sock_upgrade_s {
+    mx_sock_t msu_base;
+    mx_buffer_t *msu_rbufp;	   /* The request, as it arrives */
+    mx_timer_t msu_timer;	   /* Time limit (opt_connect_timeout) */
+} mx_sock_upgrade_t;
+
+/*
+ * A message passed between event loops.  Frames and closes go from
+ * the main thread to workers; output and completions come back.
+ */
+typedef struct mx_handoff_s {
+    struct mx_handoff_s *mho_next; /* Next in queue */
+    unsigned mho_type;		   /* MHO_* type */
+    unsigned mho_wsid;		   /* Websocket this is for */
+    mx_muxid_t mho_muxid;	   /* Muxer ID (for output and completions) */
+    int mho_worker;		   /* Worker that sent it (or -1) */
+    mx_buffer_t *mho_buffer;	   /* Frame or output data */
+} mx_handoff_t;
+
+/* Values for mho_type */
+#define MHO_FRAME	1	/* Websocket frame for a worker */
+#define MHO_CLOSE	2	/* Websocket has closed */
+#define MHO_OUTPUT	3	/* Data for the websocket */
+#define MHO_COMPLETE	4	/* Request is complete */
+#define MHO_DEFLATE	5	/* Websocket wants compressed replies */
+#define MHO_BLOCK	6	/* Websocket's output is over high water */
+#define MHO_UNBLOCK	7	/* Websocket's output is down to low water */
+
+/*
+ * A lock-free, multiple producer, single consumer queue.  Producers
+ * swap themselves onto the head; the consumer pops from the tail.
+ * The consumer is woken by a byte on a pipe, but only if it hasn't
+ * already been woken since it last looked.
+ */
+typedef struct mx_handoff_queue_s {
+    mx_handoff_t *mhq_head;	   /* Last message pushed */
+    mx_handoff_t *mhq_tail;	   /* Next message to pop (consumer only) */
+    mx_handoff_t mhq_stub;	   /* Placeholder for an empty queue */
+    int mhq_signalled;		   /* Consumer has been woken */
+    int mhq_rfd;		   /* Read end of wakeup pipe */
+    int mhq_wfd;		   /* Write end of wakeup pipe */
+    unsigned long mhq_pushed;	   /* Number of messages pushed */
+    unsigned long mhq_popped;	   /* Number of messages popped */
+} mx_handoff_queue_t;
+
+typedef struct mx_sock_handoff_s {
+    mx_sock_t msh_base;
+    mx_handoff_queue_t *msh_queue; /* Queue we're reading */
+} mx_sock_handoff_t;
+
 typedef struct mx_password_s {
     struct mx_password_s *mp_next; /* Linked list */
     char *mp_target;		   /* Key: Target hostname */
@@ -193,8 +494,14 @@ typedef struct mx_password_s {
     time_t mp_laststamp;	   /* Last time this password was used */
 } mx_password_t;
 
-mx_sock_list_t mx_sock_list;	/* List of all sockets */
-int mx_sock_count;		/* Number of mx_sock_t in mx_sock_list */
+/*
+ * Each event loop (the main thread and any workers) has its own
+ * set of sockets.
+ */
+#define MX_THREAD_LOCAL __thread
+
+extern MX_THREAD_LOCAL mx_sock_list_t mx_sock_list; /* List of all sockets */
+extern MX_THREAD_LOCAL int mx_sock_count; /* Number of sockets in list */
 
 #define MX_TYPE_PRINT_ARGS \
     mx_sock_t *msp UNUSED, int indent UNUSED, const char *prefix UNUSED
@@ -246,6 +553,10 @@ typedef int (*mx_type_get_password_func_t)(MX_TYPE_GET_PASSWORD_ARGS);
     mx_sock_t *msp UNUSED, short flags UNUSED
 typedef int (*mx_type_is_buf_func_t)(MX_TYPE_IS_BUF_ARGS);
 
+#define MX_TYPE_IS_BLOCKED_ARGS \
+    mx_sock_t *msp UNUSED
+typedef int (*mx_type_is_blocked_func_t)(MX_TYPE_IS_BLOCKED_ARGS);
+
 #define MX_TYPE_ERROR_ARGS \
     mx_sock_t *msp UNUSED, mx_request_t *mrp UNUSED, const char *message UNUSED
 typedef void (*mx_type_error_func_t)(MX_TYPE_ERROR_ARGS);
@@ -266,6 +577,7 @@ typedef struct mx_type_info_s {
     mx_type_get_passphrase_func_t mti_get_passphrase; /* Get a passphrase */
     mx_type_get_password_func_t mti_get_password; /* Get a password */
     mx_type_is_buf_func_t mti_is_buf; /* Has buffered i/o */
+    mx_type_is_blocked_func_t mti_is_blocked; /* Won't take more output */
     mx_type_error_func_t mti_error; /* Report error to client */
 } mx_type_info_t;
 
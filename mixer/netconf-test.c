@@ -0,0 +1,266 @@
+/*
+ * $Id$
+ *
+ * Copyright (c) 2012, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ */
+
+/*
+ * Drive the end-of-frame marker matcher (netconf.c) by hand.
+ *
+ * By default, we build random replies, heavy with ']' and '>' so
+ * near-misses and overlapping markers are common, and feed each one
+ * thru mx_netconf_marker_detect in random splits, the way channel
+ * reads would deliver it.  What's left in the buffers must be the
+ * reply up to its first marker, and what follows the marker must be
+ * left for the next reply.  This is what "make check" runs.
+ *
+ * With "-b", we time the matcher instead, over plain XML and over
+ * data that's nothing but near-misses, in read-sized pieces; "-n"
+ * is then the number of megabytes to run thru for each case.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include "local.h"
+#include "netconf.h"
+
+#define TEST_DOC_MAX	4096	/* Largest random reply */
+#define TEST_READ_MAX	(BUFFER_DEFAULT_SIZE) /* Largest random read */
+
+static unsigned long test_failures;
+
+static char
+test_random_char (void)
+{
+    static const char alphabet[] = "]]]]>>>a\n";
+
+    return alphabet[random() % (sizeof(alphabet) - 1)];
+}
+
+/*
+ * Build a random reply, with the marker (and the start of a next
+ * reply) dropped in about half the time.
+ */
+static unsigned long
+test_build (char *doc)
+{
+    unsigned long len = random() % TEST_DOC_MAX, i, at;
+
+    for (i = 0; i < len; i++)
+	doc[i] = test_random_char();
+
+    if (len > mx_netconf_marker_len && (random() & 1)) {
+	at = random() % (len - mx_netconf_marker_len);
+	memcpy(doc + at, mx_netconf_marker, mx_netconf_marker_len);
+    }
+
+    return len;
+}
+
+static unsigned long
+test_split (unsigned long left)
+{
+    unsigned long len;
+
+    /* Mostly tiny reads, so markers land across them */
+    if (random() % 4)
+	len = 1 + random() % 8;
+    else
+	len = 1 + random() % TEST_READ_MAX;
+
+    return (len < left) ? len : left;
+}
+
+static void
+test_fail (unsigned long iter, const char *what)
+{
+    fprintf(stderr, "netconf-test: iteration %lu: %s\n", iter, what);
+    test_failures += 1;
+}
+
+static void
+test_one (unsigned long iter, mx_buffer_t *mbp, char *doc, char *out)
+{
+    unsigned long len = test_build(doc), off = 0, olen = 0, want, n;
+    mx_offset_t seen = 0;
+    const char *hit;
+    long end;
+
+    hit = memmem(doc, len, mx_netconf_marker, mx_netconf_marker_len);
+    want = hit ? (unsigned long) (hit - doc) : len;
+
+    while (off < len) {
+	n = test_split(len - off);
+
+	mbp->mb_start = BUFFER_HEADROOM;
+	memcpy(mbp->mb_data + mbp->mb_start, doc + off, n);
+	mbp->mb_len = n;
+	off += n;
+
+	end = mx_netconf_marker_detect(&seen, mbp);
+
+	memcpy(out + olen, mbp->mb_data + mbp->mb_start, mbp->mb_len);
+	olen += mbp->mb_len;
+
+	if (end < 0)
+	    continue;
+
+	if (hit == NULL) {
+	    test_fail(iter, "found a marker that isn't there");
+	    return;
+	}
+
+	if (olen != want || memcmp(out, doc, want) != 0)
+	    test_fail(iter, "reply before the marker is wrong");
+
+	/* The rest of this read is the next reply's */
+	want += mx_netconf_marker_len;
+	if (BUFFER_HEADROOM + n - end != off - want
+		|| memcmp(mbp->mb_data + end, doc + want, off - want) != 0)
+	    test_fail(iter, "data after the marker is wrong");
+	return;
+    }
+
+    if (hit) {
+	test_fail(iter, "missed the marker");
+	return;
+    }
+
+    /* Whatever was held back must be the start of a marker */
+    if (olen + seen != len || memcmp(out, doc, olen) != 0
+	    || memcmp(doc + olen, mx_netconf_marker, seen) != 0)
+	test_fail(iter, "held back the wrong bytes");
+}
+
+static double
+test_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+test_bench_one (const char *title, const char *data, unsigned long len,
+		unsigned long readsize, unsigned long total)
+{
+    mx_buffer_t *mbp = calloc(1, sizeof(*mbp) + BUFFER_HEADROOM + readsize);
+    unsigned long done = 0, off, n;
+    mx_offset_t seen = 0;
+    double start, secs;
+
+    if (mbp == NULL)
+	return;
+
+    start = test_now();
+
+    while (done < total) {
+	for (off = 0; off < len; off += n) {
+	    n = (len - off < readsize) ? len - off : readsize;
+	    mbp->mb_start = BUFFER_HEADROOM;
+	    memcpy(mbp->mb_data + mbp->mb_start, data + off, n);
+	    mbp->mb_len = n;
+	    mx_netconf_marker_detect(&seen, mbp);
+	}
+	done += len;
+    }
+
+    secs = test_now() - start;
+    printf("%-12s read %6lu: %8.1f MB/s\n", title, readsize,
+	   secs > 0 ? done / secs / (1024 * 1024) : 0.0);
+
+    free(mbp);
+}
+
+static void
+test_bench (unsigned long total)
+{
+    static const char xml[] = "<interface><name>ge-0/0/0</name>"
+	"<admin-status>up</admin-status><![CDATA[a]]></interface>\n";
+    static const unsigned long readsizes[] = { 512, BUFFER_DEFAULT_SIZE,
+					       64 * 1024 };
+    unsigned long len = 1024 * 1024, i;
+    char *plain = malloc(len), *nasty = malloc(len);
+
+    if (plain == NULL || nasty == NULL)
+	return;
+
+    for (i = 0; i < len; i++) {
+	plain[i] = xml[i % (sizeof(xml) - 1)];
+	nasty[i] = "]]>]]"[i % 5];
+    }
+
+    for (i = 0; i < sizeof(readsizes) / sizeof(readsizes[0]); i++) {
+	test_bench_one("plain xml", plain, len, readsizes[i], total);
+	test_bench_one("near-misses", nasty, len, readsizes[i], total);
+    }
+
+    free(plain);
+    free(nasty);
+}
+
+int
+main (int argc, char **argv)
+{
+    unsigned long count = 0, i;
+    unsigned seed = time(NULL);
+    int bench = FALSE, c;
+    mx_buffer_t *mbp;
+    char *doc, *out;
+
+    while ((c = getopt(argc, argv, "bn:s:")) != -1) {
+	switch (c) {
+	case 'b':
+	    bench = TRUE;
+	    break;
+
+	case 'n':
+	    count = strtoul(optarg, NULL, 0);
+	    break;
+
+	case 's':
+	    seed = strtoul(optarg, NULL, 0);
+	    break;
+
+	default:
+	    fprintf(stderr, "usage: netconf-test [-b] [-n count] [-s seed]\n");
+	    return 1;
+	}
+    }
+
+    /* For benchmarks, the count is megabytes per case */
+    if (bench) {
+	test_bench((count ? count : 256) * 1024 * 1024);
+	return 0;
+    }
+
+    if (count == 0)
+	count = 100000;
+
+    srandom(seed);
+
+    mbp = calloc(1, sizeof(*mbp) + BUFFER_HEADROOM + TEST_READ_MAX);
+    doc = malloc(TEST_DOC_MAX);
+    out = malloc(TEST_DOC_MAX);
+    if (mbp == NULL || doc == NULL || out == NULL)
+	return 1;
+
+    for (i = 0; i < count; i++)
+	test_one(i, mbp, doc, out);
+
+    printf("netconf-test: seed %u, %lu iterations, %lu failures\n",
+	   seed, count, test_failures);
+
+    free(mbp);
+    free(doc);
+    free(out);
+
+    return test_failures ? 1 : 0;
+}
@@ -0,0 +1,108 @@
+/*
+ * $Id$
+ *
+ * Copyright (c) 2012, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ */
+
+#include "local.h"
+#include "netconf.h"
+
+/*
+ * NETCONF framing that doesn't need a channel.  It's kept apart so
+ * netconf-test can drive it directly.
+ */
+
+char mx_netconf_marker[] = NETCONF_MARKER; /* Not const; iovecs use it */
+unsigned mx_netconf_marker_len = sizeof(mx_netconf_marker) - 1;
+
+/*
+ * Look for the NETCONF end-of-frame marker in a stream, one buffer at
+ * a time, without looking at any byte twice.  *seenp carries the
+ * number of marker bytes that ended the data we've already seen, so
+ * a marker can be split over any number of reads.  memchr finds the
+ * next ']' for us (libc does that a word or a vector at a time), and
+ * we only step thru bytes by hand once we're inside a possible
+ * marker.  A mismatch falls back by the marker's failure function
+ * (as in Knuth-Morris-Pratt), since "]]>]]>" overlaps itself.
+ *
+ * Returns the offset just past the end of the marker, or -1 if the
+ * marker isn't complete yet.
+ */
+static const unsigned mx_netconf_marker_fail[] = { 0, 1, 0, 1, 2, 3 };
+
+long
+mx_netconf_marker_match (mx_offset_t *seenp, const char *buf,
+			 unsigned long len)
+{
+    mx_offset_t seen = *seenp;
+    const char *cp = buf, *zp = buf + len;
+
+    while (cp < zp) {
+	if (seen == 0) {
+	    cp = memchr(cp, *mx_netconf_marker, zp - cp);
+	    if (cp == NULL)
+		break;
+	}
+
+	while (seen > 0 && *cp != mx_netconf_marker[seen])
+	    seen = mx_netconf_marker_fail[seen - 1];
+	if (*cp == mx_netconf_marker[seen])
+	    seen += 1;
+	cp += 1;
+
+	if (seen == mx_netconf_marker_len) {
+	    *seenp = 0;
+	    return cp - buf;
+	}
+    }
+
+    *seenp = seen;
+    return -1;
+}
+
+
+/*
+ * Scan a buffer of freshly read data for the marker, leaving in the
+ * buffer just the bytes that belong to the reply.
+ *
+ * A read that ends in what might be the start of a marker holds
+ * those bytes back (*seenp counts them), since we can't tell yet.
+ * Whatever they turn out to be, they're just the first few bytes of
+ * the marker, so the next call puts them back in front of the new
+ * data; there's always BUFFER_HEADROOM in front of a read for this.
+ *
+ * Returns the offset (from mb_data) just past the marker, or -1 if
+ * it isn't complete yet.  Anything after the marker is the start of
+ * the next reply, and is left for the caller.
+ */
+long
+mx_netconf_marker_detect (mx_offset_t *seenp, mx_buffer_t *mbp)
+{
+    mx_offset_t held = *seenp;
+    long end;
+
+    end = mx_netconf_marker_match(seenp, mbp->mb_data + mbp->mb_start,
+				  mbp->mb_len);
+
+    if (held) {
+	mbp->mb_start -= held;
+	mbp->mb_len += held;
+	memcpy(mbp->mb_data + mbp->mb_start, mx_netconf_marker, held);
+    }
+
+    if (end >= 0) {
+	end += mbp->mb_start + held; /* Just past the marker */
+	mbp->mb_len = end - mx_netconf_marker_len - mbp->mb_start;
+	return end;
+    }
+
+    /* Hold back what might be the start of a marker */
+    mbp->mb_len -= *seenp;
+
+    return -1;
+}
@@ -10,5 +10,16 @@
  */
 
 #define NETCONF_MARKER "]]>]]>"
-extern const char mx_netconf_marker[];
+#define NETCONF_BASE_1_0 "urn:ietf:params:netconf:base:1.0"
+#define NETCONF_BASE_1_1 "urn:ietf:params:netconf:base:1.1"
+#define NETCONF_CHUNK_END "\n##\n" /* End of a chunked (1.1) message */
+#define NETCONF_CHUNK_MAX 4294967295UL /* Largest chunk-size (RFC 6242) */
+extern char mx_netconf_marker[];
 extern unsigned mx_netconf_marker_len;
+
+long
+mx_netconf_marker_match (mx_offset_t *seenp, const char *buf,
+			 unsigned long len);
+
+long
+mx_netconf_marker_detect (mx_offset_t *seenp, mx_buffer_t *mbp);
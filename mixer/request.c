@@ -19,9 +19,14 @@
 #include "netconf.h"
 #include "websocket.h"
 #include "db.h"
+#include "timer.h"
+#include "deflate.h"
+#include "cache.h"
 
 static unsigned mx_request_id; /* Monotonically increasing ID number */
-static mx_request_list_t mx_request_list; /* List of outstanding requests */
+/* List of outstanding requests (each event loop has its own) */
+static MX_THREAD_LOCAL mx_request_list_t mx_request_list;
+static unsigned long mx_request_coalesced; /* Requests that shared a reply */
 
 char mx_netconf_tag_open_rpc[] = "<rpc>";
 unsigned mx_netconf_tag_open_rpc_len = sizeof(mx_netconf_tag_open_rpc) - 1;
@@ -29,6 +34,7 @@ char mx_html_format_tag[] = " format=\"html\" ";
 unsigned mx_html_format_tag_len = sizeof(mx_html_format_tag) - 1;
 char mx_netconf_tag_close_rpc[] = "</rpc>";
 unsigned  mx_netconf_tag_close_rpc_len = sizeof(mx_netconf_tag_close_rpc) - 1;
+static char mx_netconf_chunk_end[] = NETCONF_CHUNK_END;
 
 /*
  * Create a mixer request using the incoming attributes.
@@ -57,12 +63,14 @@ mx_request_create (mx_sock_websocket_t *mswp, mx_buffer_t *mbp, int len,
     if (mrp == NULL)
 	return NULL;
 
-    mrp->mr_id = ++mx_request_id;
+    mrp->mr_id = mx_next_id(mx_request_id);
 
     mrp->mr_state = MSS_NORMAL;
     mrp->mr_muxid = muxid;
     mrp->mr_name = strdup(tag);
     mrp->mr_client = &mswp->msw_base;
+    mrp->mr_start = mx_time_ms();
+    TAILQ_INIT(&mrp->mr_followers);
 
     /*
      * Look up our target in the db.  It could be an alias.
@@ -92,6 +100,11 @@ mx_request_create (mx_sock_websocket_t *mswp, mx_buffer_t *mbp, int len,
 	mrp->mr_auth_websocketid = atoi(auth_websocketid);
     }
     
+    /* Bulk requests wait behind interactive ones */
+    const char *priority = xml_get_attribute(attrs, "priority");
+    if (priority && streq(priority, "bulk"))
+	mrp->mr_priority = MRQ_BULK;
+
     /* Assume we're seeing 'create=no' */
     if (xml_get_attribute(attrs, "create"))
 	mrp->mr_flags |= MRF_NOCREATE;
@@ -131,111 +144,79 @@ mx_request_create (mx_sock_websocket_t *mswp, mx_buffer_t *mbp, int len,
 }
 
 /*
- * We need to add framing to the front and end of the RPC, but we really
- * want to put all the content into one mx_buffer_t.  So if it fits, that's
- * what we do.  Also insert format="html" attribute into the requested RPC
- * if necessary.
+ * The RPC needs framing on the front and end, and maybe a format="html"
+ * attribute on its top element.  Rather than build a new buffer, we
+ * fill in an iovec with the pieces: the open <rpc> tag, the RPC
+ * (split where the attribute goes), the close </rpc> tag and the
+ * ]]>]]> marker.  The RPC itself is left untouched, so it can be sent
+ * again if the request is restarted.  Returns the number of pieces.
+ *
+ * On a NETCONF 1.1 channel, the whole thing goes out as a single
+ * chunk: the chunk header (built in hbuf) goes in front, and the
+ * end-of-chunks replaces the marker.
  */
-static mx_buffer_t *
-mx_netconf_insert_framing (mx_buffer_t *mbp, mx_boolean_t html)
-{
-    const unsigned close_len
-	= mx_netconf_tag_close_rpc_len + mx_netconf_marker_len;
-    mx_buffer_t *newp = mbp;
-    int fresh = FALSE, blen, len, count, html_len = (html ? mx_html_format_tag_len : 0);
-    mx_boolean_t seen = FALSE;
-    char *cp, *ep;
-
-    if (mbp->mb_next != NULL) {
-	fresh = TRUE;
-    } else if (mbp->mb_start >= mx_netconf_tag_open_rpc_len) {
-	fresh = (mbp->mb_size - (mbp->mb_start + mbp->mb_len) < close_len
-		+ html_len);
-    } else {
-	fresh = (mbp->mb_size - (mbp->mb_start + mbp->mb_len)
-		< close_len + mx_netconf_tag_open_rpc_len + html_len);
-    }
-
-    if (fresh) {
-	blen = mx_netconf_tag_open_rpc_len;
-	blen += mbp->mb_len;
-	blen += mx_netconf_tag_close_rpc_len;
-	blen += mx_netconf_marker_len;
-	blen += mx_html_format_tag_len;
-
-	newp = mx_buffer_create(blen);
-	if (newp == NULL)
-	    return NULL;
-
-	len = mx_netconf_tag_open_rpc_len;
-	memcpy(newp->mb_data, mx_netconf_tag_open_rpc, len);
-	blen = len;
-
-	len = mbp->mb_len;
-	if (html) {
-	    /*
-	     * If we're injecting our format="html" into our rpc, we need to
-	     * handle things like:
-	     *
-	     * <get-software-information/>
-	     * <get-software-information foo="bar"/>
-	     * <get-software-information>xxx</get-software-information>
-	     */
-	    for (cp = mbp->mb_data + mbp->mb_start, count = 0, 
-		    ep = mbp->mb_data + mbp->mb_len; cp < ep && *cp;
-		    cp++, count++) {
-		if ((*cp == ' ' || *cp == '/' || *cp == '>') && !seen) {
-		    seen = TRUE;
-		    memcpy(newp->mb_data + blen + count, mx_html_format_tag,
-			    mx_html_format_tag_len);
-		    blen += mx_html_format_tag_len;
-		}
-		memcpy(newp->mb_data + blen + count, cp, 1);
-	    }
-	} else {
-	    memcpy(newp->mb_data + blen, mbp->mb_data + mbp->mb_start, len);
+#define MX_FRAMING_IOV	7	/* Most pieces mx_netconf_framing makes */
+#define MX_CHUNK_HEADER_LEN 16	/* Room for "\n#<chunk-size>\n" */
+
+static int
+mx_netconf_framing (mx_buffer_t *mbp, mx_boolean_t html, mx_boolean_t chunked,
+		    char *hbuf, struct iovec *iov)
+{
+    char *start = mbp->mb_data + mbp->mb_start;
+    char *cp, *ep = start + mbp->mb_len;
+    unsigned long len = 0;
+    int i, cnt = 0;
+
+    if (chunked)
+	cnt += 1;		/* Leave room for the chunk header */
+
+    iov[cnt].iov_base = mx_netconf_tag_open_rpc;
+    iov[cnt++].iov_len = mx_netconf_tag_open_rpc_len;
+
+    if (html) {
+	/*
+	 * If we're injecting our format="html" into our rpc, it goes
+	 * after the element name, so we need to handle things like:
+	 *
+	 * <get-software-information/>
+	 * <get-software-information foo="bar"/>
+	 * <get-software-information>xxx</get-software-information>
+	 */
+	for (cp = start; cp < ep && *cp; cp++)
+	    if (*cp == ' ' || *cp == '/' || *cp == '>')
+		break;
+
+	if (cp < ep && *cp) {
+	    iov[cnt].iov_base = start;
+	    iov[cnt++].iov_len = cp - start;
+	    iov[cnt].iov_base = mx_html_format_tag;
+	    iov[cnt++].iov_len = mx_html_format_tag_len;
+	    start = cp;
 	}
-	blen += len;
+    }
 
-	len = mx_netconf_tag_close_rpc_len;
-	memcpy(newp->mb_data + blen, mx_netconf_tag_close_rpc, len);
-	blen += len;
+    iov[cnt].iov_base = start;
+    iov[cnt++].iov_len = ep - start;
 
-	len = mx_netconf_marker_len;
-	memcpy(newp->mb_data + blen, mx_netconf_marker, len);
-	blen += len;
+    iov[cnt].iov_base = mx_netconf_tag_close_rpc;
+    iov[cnt++].iov_len = mx_netconf_tag_close_rpc_len;
 
-	newp->mb_len = blen;
+    if (chunked) {
+	for (i = 1; i < cnt; i++)
+	    len += iov[i].iov_len;
 
-	return newp;
-    }
+	iov[0].iov_base = hbuf;
+	iov[0].iov_len = snprintf(hbuf, MX_CHUNK_HEADER_LEN, "\n#%lu\n", len);
+
+	iov[cnt].iov_base = mx_netconf_chunk_end;
+	iov[cnt++].iov_len = sizeof(mx_netconf_chunk_end) - 1;
 
-    /* Find or make room for the open <rpc> tag */
-    if (mbp->mb_start < mx_netconf_tag_open_rpc_len) {
-	memmove(mbp->mb_data + mbp->mb_start,
-		mbp->mb_data + mx_netconf_tag_open_rpc_len,
-		mbp->mb_len);
-	mbp->mb_start = 0;
     } else {
-	mbp->mb_start -= mx_netconf_tag_open_rpc_len;
-	mbp->mb_len += mx_netconf_tag_open_rpc_len;
+	iov[cnt].iov_base = mx_netconf_marker;
+	iov[cnt++].iov_len = mx_netconf_marker_len;
     }
 
-    /* Prepend the open <rpc> tag */
-    memcpy(mbp->mb_data + mbp->mb_start, mx_netconf_tag_open_rpc,
-	   mx_netconf_tag_open_rpc_len);
-
-    /* Append the close </rpc> tag and the ]]>]]> framing marker */
-    memcpy(mbp->mb_data + mbp->mb_start + mbp->mb_len,
-	   mx_netconf_tag_close_rpc,
-	   mx_netconf_tag_close_rpc_len);
-    mbp->mb_len += mx_netconf_tag_close_rpc_len;
-
-    memcpy(mbp->mb_data + mbp->mb_start + mbp->mb_len, mx_netconf_marker,
-	   mx_netconf_marker_len);
-    mbp->mb_len += mx_netconf_marker_len;
-
-    return newp;
+    return cnt;
 }
 
 static int
@@ -248,20 +229,445 @@ mx_request_rpc_send (mx_sock_t *msp, mx_buffer_t *mbp,
 
     ssize_t len;
 
-    mx_buffer_t *newp = mx_netconf_insert_framing(mbp, 
-	    mrp->mr_flags & MRF_HTML);
+    /* Our reply will follow those of RPCs already sent on the channel */
+    if (!mx_channel_pipeline_push(mcp, mrp)) {
+	mx_request_error(mrp, "too many rpcs outstanding on channel");
+	return FALSE;
+    }
 
-    mcp->mc_request = mrp;
-    mcp->mc_state = MSS_RPC_INITIAL;
-    len = mx_channel_write_buffer(mcp, newp);
-    mx_log("R%u S%u/C%u send rpc, len %d",
-	   mrp->mr_id, msp->ms_id, mcp->mc_id, (int) len);
+    /* A new channel sends the RPC when it's finished opening */
+    if (mx_channel_is_opening(mcp)) {
+	mx_log("R%u C%u waiting for channel to open", mrp->mr_id, mcp->mc_id);
+	return FALSE;
+    }
 
-    if (newp != mbp)
-	mx_buffer_free(newp);
+    /* Only the first RPC on the channel starts a reply */
+    if (mcp->mc_pipe_count == 1)
+	mcp->mc_state = MSS_RPC_INITIAL;
 
-    /* save channel for future use */
-    mrp->mr_channel = mcp;
+    /*
+     * A streamed RPC's body is still arriving from the client; we
+     * send the opening framing and the websocket feeds us the rest
+     * via mx_request_upload.
+     */
+    if (mrp->mr_flags & MRF_STREAM) {
+	mx_channel_upload_start(mcp, mx_netconf_tag_open_rpc);
+	mx_log("R%u S%u/C%u streaming rpc, pipeline %u",
+	       mrp->mr_id, msp->ms_id, mcp->mc_id, mcp->mc_pipe_count);
+	return FALSE;
+    }
+
+    struct iovec iov[MX_FRAMING_IOV];
+    char hbuf[MX_CHUNK_HEADER_LEN];
+    int cnt = mx_netconf_framing(mbp, mrp->mr_flags & MRF_HTML,
+				 mcf_is_chunked(mcp), hbuf, iov);
+
+    /* What the channel can't take now stays queued on it */
+    len = mx_channel_writev(mcp, iov, cnt);
+    mx_log("R%u S%u/C%u send rpc, len %d, pipeline %u",
+	   mrp->mr_id, msp->ms_id, mcp->mc_id, (int) len, mcp->mc_pipe_count);
+
+    if (len < 0) {
+	/* The session poller closes the channel */
+	mx_request_channel_failed(mcp, "could not send rpc");
+	mcp->mc_state = MSS_FAILED;
+    }
+
+    return FALSE;
+}
+
+/*
+ * Requests don't grab a channel as soon as they arrive.  Instead
+ * they wait on their session's queue (there's one session per
+ * target, and one queue per priority class) and mx_request_schedule
+ * starts them as channels become available:
+ *
+ * - No more than opt_channels_max channels are in use per session.
+ *   Bulk requests can't take the last one, so interactive requests
+ *   always have a way in.
+ * - A request can always pipeline behind its client's other RPCs,
+ *   since that doesn't take another channel.
+ * - Interactive requests go before bulk ones.
+ * - Within a class, we take turns between clients (by ms_id), so
+ *   one client's big batch doesn't starve everyone else.
+ */
+static void
+mx_request_enqueue (mx_sock_session_t *mssp, mx_request_t *mrp)
+{
+    if (mrp->mr_flags & MRF_QUEUED)
+	return;
+
+    TAILQ_INSERT_TAIL(&mssp->mss_queue[mrp->mr_priority],
+		      mrp, mr_queue_link);
+    mssp->mss_queued[mrp->mr_priority] += 1;
+    mrp->mr_flags |= MRF_QUEUED;
+}
+
+static void
+mx_request_unqueue (mx_request_t *mrp)
+{
+    mx_sock_session_t *mssp = mrp->mr_session;
+
+    if (!(mrp->mr_flags & MRF_QUEUED) || mssp == NULL)
+	return;
+
+    TAILQ_REMOVE(&mssp->mss_queue[mrp->mr_priority], mrp, mr_queue_link);
+    mssp->mss_queued[mrp->mr_priority] -= 1;
+    mrp->mr_flags &= ~MRF_QUEUED;
+}
+
+/*
+ * Can this request start now, without going over the session's
+ * channel limit?
+ */
+static int
+mx_request_can_start (mx_sock_session_t *mssp, mx_request_t *mrp,
+		      unsigned busy)
+{
+    unsigned max = opt_channels_max;
+
+    if (opt_channels_max <= 0)
+	return TRUE;
+
+    if (mrp->mr_priority == MRQ_BULK && max > 1)
+	max -= 1;
+
+    if (busy < max)
+	return TRUE;
+
+    return (mx_channel_pipeline_find(mssp, mrp->mr_client) != NULL);
+}
+
+/*
+ * Pick the next request to start from one of the session's queues.
+ * We take the first request from the client whose ID follows the
+ * client we served last, wrapping around to the lowest.
+ */
+static mx_request_t *
+mx_request_next (mx_sock_session_t *mssp, unsigned prio, unsigned busy)
+{
+    mx_request_t *mrp, *after = NULL, *wrap = NULL;
+    unsigned last = mssp->mss_rr_last[prio], id;
+    unsigned after_id = 0, wrap_id = 0;
+
+    TAILQ_FOREACH(mrp, &mssp->mss_queue[prio], mr_queue_link) {
+	if (!mx_request_can_start(mssp, mrp, busy))
+	    continue;
+
+	id = mrp->mr_client ? mrp->mr_client->ms_id : 0;
+	if (id > last) {
+	    if (after == NULL || id < after_id) {
+		after = mrp;
+		after_id = id;
+	    }
+	} else if (wrap == NULL || id < wrap_id) {
+	    wrap = mrp;
+	    wrap_id = id;
+	}
+    }
+
+    mrp = after ?: wrap;
+    if (mrp)
+	mssp->mss_rr_last[prio] = after ? after_id : wrap_id;
+
+    return mrp;
+}
+
+/*
+ * Give a request a channel and send its RPC.
+ */
+static void
+mx_request_run (mx_request_t *mrp)
+{
+    mx_channel_t *mcp;
+
+    mcp = mx_channel_netconf(mrp->mr_session, mrp->mr_client, FALSE);
+    if (mcp == NULL) {
+	mx_request_error(mrp, "could not open netconf channel");
+	return;
+    }
+
+    mx_log("C%u running R%u '%s' target '%s'",
+	   mcp->mc_id, mrp->mr_id, mrp->mr_name, mrp->mr_target);
+
+    /*
+     * When the RPC stalled (for hostkey or password), we recorded
+     * the RPC contents in mr_rpc.
+     */
+    mx_request_rpc_send(mrp->mr_client, mrp->mr_rpc, mrp, mcp);
+}
+
+/*
+ * Start as many queued requests as the session has room for.
+ */
+void
+mx_request_schedule (mx_sock_session_t *mssp)
+{
+    mx_request_t *mrp;
+    unsigned prio, busy;
+
+    if (mssp->mss_base.ms_state != MSS_ESTABLISHED)
+	return;
+
+    for (prio = 0; prio < MRQ_MAX; prio++) {
+	while (mssp->mss_queued[prio]) {
+	    busy = mx_channel_busy_count(mssp);
+	    mrp = mx_request_next(mssp, prio, busy);
+	    if (mrp == NULL)
+		break;
+
+	    mx_request_unqueue(mrp);
+	    mx_request_run(mrp);
+	}
+    }
+}
+
+/*
+ * Stop work on a request.  A queued request just leaves its queue.
+ * If the RPC has gone to the device, mx_channel_cancel closes the
+ * channel (or arranges for the reply to be discarded).  The request
+ * itself is freed by mx_request_check_health.
+ */
+void
+mx_request_cancel (mx_request_t *mrp)
+{
+    mx_log("R%u cancel (S%u/C%u)", mrp->mr_id,
+	   mrp->mr_session ? mrp->mr_session->mss_base.ms_id : 0,
+	   mrp->mr_channel ? mrp->mr_channel->mc_id : 0);
+
+    mx_request_unqueue(mrp);
+    mrp->mr_state = MSS_FAILED;
+
+    if (mrp->mr_channel) {
+	mx_channel_cancel(mrp->mr_channel, mrp);
+	mrp->mr_channel = NULL;
+    }
+}
+
+/*
+ * A request has run past opt_request_timeout; tell the client and
+ * cancel it.
+ */
+static void
+mx_request_timeout (mx_timer_t *mtp UNUSED, void *arg)
+{
+    mx_request_t *mrp = arg;
+
+    mx_log("R%u timed out", mrp->mr_id);
+
+    if (mrp->mr_client)
+	mx_request_error(mrp, "rpc timed out after %d seconds",
+			 opt_request_timeout);
+    mx_request_cancel(mrp);
+}
+
+/*
+ * Queue a request on its session and start it if there's room.
+ */
+static void
+mx_request_submit (mx_sock_session_t *mssp, mx_request_t *mrp)
+{
+    if (opt_request_timeout > 0 && !mx_timer_pending(&mrp->mr_timer))
+	mx_timer_set(&mrp->mr_timer, opt_request_timeout * 1000UL,
+		     mx_request_timeout, mrp);
+
+    mx_request_enqueue(mssp, mrp);
+    mx_request_schedule(mssp);
+
+    if (mrp->mr_flags & MRF_QUEUED) {
+	mssp->mss_sched_waits += 1;
+	mx_log("R%u waiting for a channel on %s (%u/%u queued)",
+	       mrp->mr_id, mx_sock_title(&mssp->mss_base),
+	       mssp->mss_queued[MRQ_INTERACTIVE], mssp->mss_queued[MRQ_BULK]);
+    }
+}
+
+/*
+ * If a streamed RPC has gone out on a channel, return that channel;
+ * its body can be written there as it arrives.
+ */
+mx_channel_t *
+mx_request_upload_channel (mx_request_t *mrp)
+{
+    mx_channel_t *mcp = mrp->mr_channel;
+
+    if (!(mrp->mr_flags & MRF_STREAM) || mcp == NULL || !mcf_is_upload(mcp))
+	return NULL;
+
+    return mcp;
+}
+
+/*
+ * Write more of a streamed RPC's body.  Returns the number of bytes
+ * taken, or -1 on error.
+ */
+int
+mx_request_upload (mx_request_t *mrp, const char *buf, unsigned long len)
+{
+    mx_channel_t *mcp = mx_request_upload_channel(mrp);
+
+    if (mcp == NULL)
+	return 0;
+
+    return mx_channel_upload(mcp, buf, len);
+}
+
+/*
+ * The body of a streamed RPC is all written; close it off.  Returns
+ * 1 when done, 0 if the channel is full, and -1 on error.
+ */
+int
+mx_request_upload_finish (mx_request_t *mrp)
+{
+    mx_channel_t *mcp = mx_request_upload_channel(mrp);
+    int rc;
+
+    if (mcp == NULL)
+	return 1;
+
+    rc = mx_channel_upload_finish(mcp, mx_netconf_tag_close_rpc);
+    if (rc > 0) {
+	mrp->mr_flags &= ~MRF_STREAM;
+	mx_log("R%u C%u streamed rpc is complete", mrp->mr_id, mcp->mc_id);
+    }
+
+    return rc;
+}
+
+/*
+ * Find a session for a request and send its RPC (or wait for the
+ * session to be ready).
+ */
+static void
+mx_request_lead (mx_request_t *mrp)
+{
+    mx_sock_session_t *mssp = mx_session(mrp);
+    if (mssp == NULL) {
+        mx_request_error(mrp, "no session");
+	return;
+    }
+
+    if (mssp->mss_base.ms_state != MSS_ESTABLISHED)
+	return;
+
+    mx_request_submit(mssp, mrp);
+}
+
+/*
+ * Single flight: when many clients ask a target for the same thing at
+ * once (a popular dashboard, say), the RPC should run only once.  An
+ * eligible request (see mx_coalesce_key) looks for another with the
+ * same key whose reply hasn't started yet, and follows it; the
+ * leader's reply is copied to each follower as it arrives (see
+ * mx_websocket_write).  Once the reply has started, or the leader is
+ * older than opt_coalesce_window, it's too late to join.
+ *
+ * Requests for a target are all handled by the same event loop (see
+ * mx_worker_route), so the leader is always on our own list.
+ */
+static int
+mx_request_coalesce (mx_request_t *mrp)
+{
+    unsigned long long now = mx_time_ms();
+    mx_request_t *leader;
+
+    mrp->mr_coalesce_key = mx_coalesce_key(mrp);
+    if (mrp->mr_coalesce_key == NULL)
+	return FALSE;
+
+    TAILQ_FOREACH(leader, &mx_request_list, mr_link) {
+	if (leader == mrp || leader->mr_leader
+		|| leader->mr_coalesce_key == NULL || leader->mr_client == NULL
+		|| (leader->mr_flags & MRF_REPLYING)
+		|| leader->mr_state == MSS_FAILED
+		|| leader->mr_state == MSS_ERROR
+		|| leader->mr_state == MSS_RPC_COMPLETE
+		|| now - leader->mr_start > (unsigned) opt_coalesce_window)
+	    continue;
+
+	if (streq(leader->mr_coalesce_key, mrp->mr_coalesce_key))
+	    break;
+    }
+
+    if (leader == NULL)
+	return FALSE;
+
+    mrp->mr_leader = leader;
+    TAILQ_INSERT_TAIL(&leader->mr_followers, mrp, mr_follow_link);
+    __sync_add_and_fetch(&mx_request_coalesced, 1);
+
+    mx_log("R%u sharing the reply to R%u (%s)",
+	   mrp->mr_id, leader->mr_id, mrp->mr_fulltarget);
+    return TRUE;
+}
+
+static void
+mx_request_unfollow (mx_request_t *mrp)
+{
+    mx_request_t *leader = mrp->mr_leader;
+
+    if (leader == NULL)
+	return;
+
+    TAILQ_REMOVE(&leader->mr_followers, mrp, mr_follow_link);
+    mrp->mr_leader = NULL;
+}
+
+/*
+ * A leader is going away without finishing its reply (it was
+ * cancelled, or its client left).  If none of the reply has gone
+ * out, the first of its followers takes over and runs the RPC, and
+ * the rest follow that one.  Otherwise each follower has part of a
+ * reply, and all we can do is tell them.  (Followers of a leader
+ * that failed were told by mx_request_error.)
+ */
+static void
+mx_request_orphan (mx_request_t *mrp)
+{
+    mx_request_t *fmrp, *heir = NULL;
+
+    while ((fmrp = TAILQ_FIRST(&mrp->mr_followers)) != NULL) {
+	TAILQ_REMOVE(&mrp->mr_followers, fmrp, mr_follow_link);
+	fmrp->mr_leader = NULL;
+
+	if (fmrp->mr_client == NULL || fmrp->mr_state == MSS_FAILED
+		|| fmrp->mr_state == MSS_ERROR)
+	    continue;
+
+	if (mrp->mr_flags & MRF_REPLYING) {
+	    mx_request_error(fmrp, "shared rpc ended before its reply did");
+
+	} else if (heir == NULL) {
+	    heir = fmrp;
+
+	} else {
+	    fmrp->mr_leader = heir;
+	    TAILQ_INSERT_TAIL(&heir->mr_followers, fmrp, mr_follow_link);
+	}
+    }
+
+    if (heir) {
+	mx_log("R%u takes over from R%u", heir->mr_id, mrp->mr_id);
+	mx_request_lead(heir);
+    }
+}
+
+/*
+ * Would any of the requests sharing this one's reply block on their
+ * clients?  If so, we hold the reply for all of them.
+ */
+int
+mx_request_followers_blocked (mx_request_t *mrp)
+{
+    mx_request_t *fmrp;
+    mx_sock_t *client;
+
+    TAILQ_FOREACH(fmrp, &mrp->mr_followers, mr_follow_link) {
+	client = fmrp->mr_client;
+	if (client && mx_mti(client)->mti_is_blocked
+		&& mx_mti(client)->mti_is_blocked(client))
+	    return TRUE;
+    }
 
     return FALSE;
 }
@@ -273,21 +679,18 @@ mx_request_start_rpc (mx_sock_websocket_t *mswp, mx_request_t *mrp)
 	   mrp->mr_id, mrp->mr_name, mrp->mr_muxid, mrp->mr_auth_muxid,
 	   mswp->msw_base.ms_id, mrp->mr_target);
 
-    mx_sock_session_t *mssp = mx_session(mrp);
-    if (mssp == NULL) {
-        mx_request_error(mrp, "no session");
+    /* A cached reply saves a trip to the device (and maybe a session) */
+    mx_buffer_t *mbp = mx_cache_lookup(mrp, BUFFER_HEADROOM);
+    if (mbp) {
+	mx_websocket_cached_reply(mswp, mrp, mbp);
 	return TRUE;
     }
 
-    if (mssp->mss_base.ms_state != MSS_ESTABLISHED)
+    /* So does someone else's trip, if it's going to the same place */
+    if (mx_request_coalesce(mrp))
 	return TRUE;
 
-    mx_channel_t *mcp = mx_channel_netconf(mssp, &mswp->msw_base, TRUE);
-    if (mcp) {
-	mx_log("C%u running R%u '%s' target '%s'",
-	       mcp->mc_id, mrp->mr_id, mrp->mr_name, mrp->mr_target);
-	mx_request_rpc_send(&mswp->msw_base, mrp->mr_rpc, mrp, mcp);
-    }
+    mx_request_lead(mrp);
 
     return TRUE;
 }
@@ -317,11 +720,10 @@ mx_request_set_state (mx_request_t *mrp, unsigned state)
 	   mrp->mr_id, mrp->mr_state, state,
 	   mrp->mr_session ? mrp->mr_session->mss_base.ms_id : 0);
 
+    /* The session owns its own state; see session.c */
     mrp->mr_state = state;
     if (mrp->mr_client)
 	mrp->mr_client->ms_state = state;
-    if (mrp->mr_session)
-	mrp->mr_session->mss_base.ms_state = state;
 }
 
 void
@@ -331,12 +733,26 @@ mx_request_print (mx_request_t *mrp, int indent, const char *prefix)
 	   indent, "", prefix, mrp->mr_id, mrp->mr_muxid,
 	   mrp->mr_name ?: "", mrp->mr_target ?: "", mrp->mr_user ?: "",
 	   mrp->mr_desthost ?: "", mrp->mr_destport);
-    mx_log("%*s%sclient S%u, session S%u C%u (%x)",
+    mx_log("%*s%sclient S%u, session S%u C%u (%x), %s",
            indent + INDENT, "", prefix,
 	   mrp->mr_client ? mrp->mr_client->ms_id : 0,
 	   mrp->mr_session ? mrp->mr_session->mss_base.ms_id : 0,
 	   mrp->mr_channel ? mrp->mr_channel->mc_id : 0,
-           mrp->mr_flags);
+           mrp->mr_flags,
+	   (mrp->mr_priority == MRQ_BULK) ? "bulk" : "interactive");
+
+    if (mrp->mr_leader) {
+	mx_log("%*s%ssharing the reply to R%u", indent + INDENT, "", prefix,
+	       mrp->mr_leader->mr_id);
+    } else if (!TAILQ_EMPTY(&mrp->mr_followers)) {
+	mx_request_t *fmrp;
+	unsigned count = 0;
+
+	TAILQ_FOREACH(fmrp, &mrp->mr_followers, mr_follow_link)
+	    count += 1;
+	mx_log("%*s%sreply shared with %u other request%s",
+	       indent + INDENT, "", prefix, count, (count == 1) ? "" : "s");
+    }
 }	
 
 void
@@ -351,6 +767,10 @@ mx_request_print_all (int indent, const char *prefix)
     TAILQ_FOREACH(mrp, &mx_request_list, mr_link) {
 	mx_request_print(mrp, indent + INDENT, prefix);
     }
+
+    if (mx_request_coalesced)
+	mx_log("%*s%s%lu requests have shared another's reply",
+	       indent, "", prefix ?: "", mx_request_coalesced);
 }
 
 void
@@ -358,6 +778,19 @@ mx_request_free (mx_request_t *mrp)
 {
     TAILQ_REMOVE(&mx_request_list, mrp, mr_link);
 
+    /* If we were driving session setup, we aren't any more */
+    if (mrp->mr_session && mrp->mr_session->mss_request == mrp)
+	mrp->mr_session->mss_request = NULL;
+
+    /* Any reply still to come on our channel will be discarded */
+    mx_channel_forget_request(mrp->mr_channel, mrp);
+    mx_request_unqueue(mrp);
+    mx_timer_cancel(&mrp->mr_timer);
+    mx_deflate_end(mrp);
+    mx_cache_end(mrp);
+    mx_request_unfollow(mrp);
+    mx_request_orphan(mrp);
+
     if (mrp->mr_name) free(mrp->mr_name);
     if (mrp->mr_target) free(mrp->mr_target);
     if (mrp->mr_fulltarget) free(mrp->mr_fulltarget);
@@ -368,6 +801,7 @@ mx_request_free (mx_request_t *mrp)
     if (mrp->mr_hostkey) free(mrp->mr_hostkey);
     if (mrp->mr_hostkey) free(mrp->mr_hostkey);
     if (mrp->mr_rpc) mx_buffer_free(mrp->mr_rpc);
+    if (mrp->mr_coalesce_key) free(mrp->mr_coalesce_key);
 
     free(mrp);
 }
@@ -398,6 +832,8 @@ mx_request_release_session (mx_sock_session_t *session)
 		mx_request_error(mrp, "session failure");
 	    }
 
+	    mx_channel_forget_request(mrp->mr_channel, mrp);
+	    mx_request_unqueue(mrp);
 	    mrp->mr_state = MSS_FAILED;
 	    mrp->mr_session = NULL;
 	    mrp->mr_channel = NULL;
@@ -419,8 +855,12 @@ mx_request_release_client (mx_sock_t *client)
 	    mx_log("R%u client released S%u, C%u",
 		   mrp->mr_id, mrp->mr_client->ms_id,
 		   mrp->mr_channel ? mrp->mr_channel->mc_id : 0);
+	    if (mrp->mr_session && mrp->mr_session->mss_request == mrp)
+		mrp->mr_session->mss_request = NULL;
+	    mx_channel_forget_request(mrp->mr_channel, mrp);
+	    mx_request_unqueue(mrp);
 	    if (mrp->mr_state == MSS_ESTABLISHED && mrp->mr_channel)
-		mx_channel_release(mrp->mr_channel);
+		mx_channel_detach_client(mrp->mr_channel, client);
 
 	    mrp->mr_state = MSS_FAILED;
 	    mrp->mr_session = NULL;
@@ -430,27 +870,116 @@ mx_request_release_client (mx_sock_t *client)
     }
 }
 
+/*
+ * A session has been established; start the requests that have
+ * been waiting on it.
+ */
 void
-mx_request_restart_rpc (mx_request_t *mrp)
+mx_request_session_ready (mx_sock_session_t *session)
 {
-    mx_channel_t *mcp;
+    mx_request_t *mrp, *next;
 
-    /* If we're not already recorded as established, do it now */
-    mx_request_set_state(mrp, MSS_ESTABLISHED);
+    TAILQ_FOREACH_SAFE(mrp, &mx_request_list, mr_link, next) {
+	if (mrp->mr_session != session || mrp->mr_channel
+		|| mrp->mr_client == NULL || (mrp->mr_flags & MRF_QUEUED))
+	    continue;
 
-    mcp = mx_channel_netconf(mrp->mr_session, mrp->mr_client, TRUE);
-    if (mcp == NULL)
-	return;
+	if (mrp->mr_state == MSS_FAILED || mrp->mr_state == MSS_ERROR
+		|| mrp->mr_state == MSS_RPC_COMPLETE)
+	    continue;
 
-    mx_log("C%u running R%u '%s' target '%s'",
-	   mcp->mc_id, mrp->mr_id, mrp->mr_name, mrp->mr_target);
+	mx_log("R%u session ready S%u", mrp->mr_id, session->mss_base.ms_id);
+	mx_request_restart_rpc(mrp);
+    }
+}
 
-    /*
-     * When the RPC stalled (for hostkey or password), we recorded
-     * the RPC contents in mr_rpc.
-     */
-    mx_buffer_t *mbp = mrp->mr_rpc;
-    mx_request_rpc_send(mrp->mr_client, mbp, mrp, mcp);
+/*
+ * A session could not be established; fail the requests that have
+ * been waiting on it.
+ */
+void
+mx_request_session_failed (mx_sock_session_t *session, const char *message)
+{
+    mx_request_t *mrp;
+
+    TAILQ_FOREACH(mrp, &mx_request_list, mr_link) {
+	if (mrp->mr_session != session)
+	    continue;
+
+	mx_log("R%u session failed S%u: %s",
+	       mrp->mr_id, session->mss_base.ms_id, message);
+
+	mx_channel_forget_request(mrp->mr_channel, mrp);
+	mx_request_unqueue(mrp);
+	mrp->mr_session = NULL;
+	mrp->mr_channel = NULL;
+
+	if (mrp->mr_client)
+	    mx_request_error(mrp, "%s", message);
+	else
+	    mrp->mr_state = MSS_FAILED;
+    }
+}
+
+/*
+ * A channel has finished opening; send the RPCs that have been
+ * waiting for it, in the order they arrived.
+ */
+void
+mx_request_channel_ready (mx_channel_t *mcp)
+{
+    unsigned ids[MX_PIPELINE_MAX], count = 0, i;
+    mx_request_t *mrp;
+
+    while (mcp->mc_pipe_count)
+	ids[count++] = mx_channel_pipeline_shift(mcp);
+
+    for (i = 0; i < count; i++) {
+	mrp = mx_request_find(0, ids[i]);
+	if (mrp == NULL || mrp->mr_client == NULL)
+	    continue;
+
+	mx_log("C%u running R%u '%s' target '%s'",
+	       mcp->mc_id, mrp->mr_id, mrp->mr_name, mrp->mr_target);
+
+	mx_request_rpc_send(mrp->mr_client, mrp->mr_rpc, mrp, mcp);
+    }
+
+    /* If everyone gave up waiting, the channel can go to the pool */
+    if (mcp->mc_pipe_count == 0)
+	mx_channel_release(mcp);
+}
+
+/*
+ * A channel could not be opened; fail the requests waiting for it.
+ */
+void
+mx_request_channel_failed (mx_channel_t *mcp, const char *message)
+{
+    mx_request_t *mrp;
+    unsigned id;
+
+    while ((id = mx_channel_pipeline_shift(mcp)) != 0) {
+	mrp = mx_request_find(0, id);
+	if (mrp == NULL)
+	    continue;
+
+	mrp->mr_channel = NULL;
+
+	if (mrp->mr_client)
+	    mx_request_error(mrp, "%s", message);
+	else
+	    mrp->mr_state = MSS_FAILED;
+    }
+}
+
+void
+mx_request_restart_rpc (mx_request_t *mrp)
+{
+    /* If we're not already recorded as established, do it now */
+    mx_request_set_state(mrp, MSS_ESTABLISHED);
+
+    mx_request_submit(mrp->mr_session, mrp);
 }
 
 void
@@ -473,6 +1002,14 @@ mx_request_error (mx_request_t *mrp, const char *fmt, ...)
     if (client && mx_mti(client)->mti_error)
 	mx_mti(client)->mti_error(client, mrp, bp);
 
+    /* Those sharing our reply share our fate */
+    mx_request_t *fmrp;
+    TAILQ_FOREACH(fmrp, &mrp->mr_followers, mr_follow_link) {
+	client = fmrp->mr_client;
+	if (client && mx_mti(client)->mti_error)
+	    mx_mti(client)->mti_error(client, fmrp, bp);
+    }
+
     va_end(vap);
 }
 
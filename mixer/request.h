@@ -16,6 +16,18 @@ mx_request_create (mx_sock_websocket_t *mswp, mx_buffer_t *mbp, int len,
 int
 mx_request_start_rpc (mx_sock_websocket_t *mswp, mx_request_t *mrp);
 
+int
+mx_request_followers_blocked (mx_request_t *mrp);
+
+mx_channel_t *
+mx_request_upload_channel (mx_request_t *mrp);
+
+int
+mx_request_upload (mx_request_t *mrp, const char *buf, unsigned long len);
+
+int
+mx_request_upload_finish (mx_request_t *mrp);
+
 mx_request_t *
 mx_request_find (mx_muxid_t muxid, unsigned reqid);
 
@@ -34,6 +46,18 @@ mx_request_release_session (mx_sock_session_t *session);
 void
 mx_request_release_client (mx_sock_t *client);
 
+void
+mx_request_session_ready (mx_sock_session_t *session);
+
+void
+mx_request_session_failed (mx_sock_session_t *session, const char *message);
+
+void
+mx_request_channel_ready (mx_channel_t *mcp);
+
+void
+mx_request_channel_failed (mx_channel_t *mcp, const char *message);
+
 void
 mx_request_restart_rpc (mx_request_t *mrp);
 
@@ -51,3 +75,9 @@ mx_request_error (mx_request_t *mrp, const char *fmt, ...);
 
 void
 mx_request_check_health (void);
+
+void
+mx_request_schedule (mx_sock_session_t *mssp);
+
+void
+mx_request_cancel (mx_request_t *mrp);
@@ -0,0 +1,443 @@
+/*
+ * $Id$
+ *
+ * Copyright (c) 2013, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * getaddrinfo() blocks, sometimes for a long time, so hostname
+ * lookups are handed to a small pool of threads.  When a thread
+ * finishes a lookup, it queues the result and writes a byte to a
+ * pipe; the read end of the pipe is an MST_RESOLVER socket, whose
+ * poller hands the results to the sessions waiting on them.
+ *
+ * Results are cached for opt_dns_ttl seconds, so mass reconnects
+ * (like after a mixer restart) don't redo the same lookups.  The
+ * threads never touch anything but their own entry and the queues,
+ * and they never log.
+ *
+ * Each event loop (see worker.c) has its own cache and notification
+ * pipe, and results go back to the loop that asked.  Since sessions
+ * are sharded by target, the caches don't overlap much.
+ */
+
+#include <netdb.h>
+#include <pthread.h>
+
+#include "local.h"
+#include "resolver.h"
+#include "session.h"
+
+#define MX_RESOLVER_THREADS	4 /* Max number of lookup threads */
+#define MX_RESOLVE_NEGATIVE_TTL	5 /* Seconds to cache failed lookups */
+
+/*
+ * Where an event loop's results go.  These are never freed, since a
+ * thread may still be in getaddrinfo() for the loop that owns one.
+ */
+typedef struct mx_resolver_notify_s {
+    mx_resolve_list_t mrn_done;	/* Waiting for the event loop */
+    int mrn_wfd;		/* Write end of notification pipe */
+} mx_resolver_notify_t;
+
+/* These belong to the current event loop */
+static MX_THREAD_LOCAL mx_resolve_list_t mx_resolve_cache;
+static MX_THREAD_LOCAL mx_sock_t *mx_resolver_sock; /* Read end of pipe */
+static MX_THREAD_LOCAL mx_resolver_notify_t *mx_resolver_notify;
+
+/* The rest are protected by mx_resolver_lock */
+static pthread_mutex_t mx_resolver_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mx_resolver_cond = PTHREAD_COND_INITIALIZER;
+static mx_resolve_list_t mx_resolver_pending; /* Waiting for a thread */
+static unsigned mx_resolver_threads; /* Number of threads running */
+
+/* Statistics (per event loop) */
+static MX_THREAD_LOCAL unsigned long mx_resolve_stat_lookups;
+static MX_THREAD_LOCAL unsigned long mx_resolve_stat_hits;
+static MX_THREAD_LOCAL unsigned long mx_resolve_stat_failures;
+
+static void
+mx_resolve_free (mx_resolve_t *mrep)
+{
+    if (mrep->mre_addrinfo)
+	freeaddrinfo(mrep->mre_addrinfo);
+    free(mrep->mre_hostname);
+    free(mrep);
+}
+
+static void
+mx_resolve_uncache (mx_resolve_t *mrep)
+{
+    if (!(mrep->mre_flags & MREF_CACHED))
+	return;
+
+    TAILQ_REMOVE(&mx_resolve_cache, mrep, mre_link);
+    mrep->mre_flags &= ~MREF_CACHED;
+
+    if (mrep->mre_refcount == 0)
+	mx_resolve_free(mrep);
+}
+
+void
+mx_resolve_release (mx_resolve_t *mrep)
+{
+    if (mrep == NULL)
+	return;
+
+    if (mrep->mre_refcount)
+	mrep->mre_refcount -= 1;
+
+    if (mrep->mre_refcount == 0 && !(mrep->mre_flags & MREF_CACHED))
+	mx_resolve_free(mrep);
+}
+
+/*
+ * Drop any cache entries that have outlived their TTL.  Pending
+ * lookups never expire.
+ */
+static void
+mx_resolve_expire (void)
+{
+    mx_resolve_t *mrep, *next;
+    time_t now = time(NULL);
+
+    TAILQ_FOREACH_SAFE(mrep, &mx_resolve_cache, mre_link, next) {
+	if (mrep->mre_state != MRES_PENDING && mrep->mre_expires <= now)
+	    mx_resolve_uncache(mrep);
+    }
+}
+
+static void
+mx_resolve_complete (mx_resolve_t *mrep)
+{
+    unsigned ttl = opt_dns_ttl;
+
+    mrep->mre_time = mx_time_ms() - mrep->mre_start;
+
+    if (mrep->mre_error || mrep->mre_addrinfo == NULL) {
+	mrep->mre_state = MRES_FAILED;
+	mx_resolve_stat_failures += 1;
+	if (ttl > MX_RESOLVE_NEGATIVE_TTL)
+	    ttl = MX_RESOLVE_NEGATIVE_TTL;
+    } else {
+	mrep->mre_state = MRES_DONE;
+    }
+
+    mrep->mre_expires = time(NULL) + ttl;
+
+    mx_log("resolver: %s: %s (%lums)", mrep->mre_hostname,
+	   mrep->mre_error ? gai_strerror(mrep->mre_error) : "resolved",
+	   mrep->mre_time);
+}
+
+static void *
+mx_resolver_thread (void *arg UNUSED)
+{
+    mx_resolve_t *mrep;
+    struct addrinfo hints, *res;
+    char port[16];
+    int rc;
+
+    pthread_mutex_lock(&mx_resolver_lock);
+
+    for (;;) {
+	while ((mrep = TAILQ_FIRST(&mx_resolver_pending)) == NULL)
+	    pthread_cond_wait(&mx_resolver_cond, &mx_resolver_lock);
+	TAILQ_REMOVE(&mx_resolver_pending, mrep, mre_qlink);
+
+	pthread_mutex_unlock(&mx_resolver_lock);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_CANONNAME;
+	snprintf(port, sizeof(port), "%u", mrep->mre_port);
+
+	res = NULL;
+	rc = getaddrinfo(mrep->mre_hostname, port, &hints, &res);
+
+	pthread_mutex_lock(&mx_resolver_lock);
+
+	mrep->mre_error = rc;
+	mrep->mre_addrinfo = rc ? NULL : res;
+	TAILQ_INSERT_TAIL(&mrep->mre_notify->mrn_done, mrep, mre_qlink);
+
+	if (mrep->mre_notify->mrn_wfd >= 0)
+	    (void) write(mrep->mre_notify->mrn_wfd, "", 1);
+    }
+
+    return NULL;
+}
+
+/*
+ * Make this event loop's notification pipe and its socket.  Threads
+ * are started as lookups need them.
+ */
+static int
+mx_resolver_start (void)
+{
+    mx_sock_t *msp;
+    int fds[2];
+
+    if (mx_resolver_sock)
+	return TRUE;
+
+    if (mx_resolver_notify == NULL) {
+	mx_resolver_notify = calloc(1, sizeof(*mx_resolver_notify));
+	if (mx_resolver_notify == NULL)
+	    return FALSE;
+
+	TAILQ_INIT(&mx_resolver_notify->mrn_done);
+	mx_resolver_notify->mrn_wfd = -1;
+    }
+
+    if (pipe(fds) < 0) {
+	mx_log("resolver: pipe: %s", strerror(errno));
+	return FALSE;
+    }
+
+    msp = calloc(1, sizeof(*msp));
+    if (msp == NULL) {
+	close(fds[0]);
+	close(fds[1]);
+	return FALSE;
+    }
+
+    mx_nonblocking(fds[0]);
+    mx_nonblocking(fds[1]);
+
+    msp->ms_id = mx_next_id(mx_sock_id);
+    msp->ms_type = MST_RESOLVER;
+    msp->ms_sock = fds[0];
+
+    TAILQ_INSERT_HEAD(&mx_sock_list, msp, ms_link);
+    mx_sock_count += 1;
+    mx_resolver_sock = msp;
+
+    pthread_mutex_lock(&mx_resolver_lock);
+    mx_resolver_notify->mrn_wfd = fds[1];
+    pthread_mutex_unlock(&mx_resolver_lock);
+
+    MX_LOG("%s new %s, fd %u", mx_sock_title(msp), mx_sock_type(msp),
+	   msp->ms_sock);
+
+    return TRUE;
+}
+
+/*
+ * Queue a lookup for the threads, starting another thread if
+ * everyone's busy.  Returns FALSE if no thread can take it.
+ */
+static int
+mx_resolver_queue (mx_resolve_t *mrep)
+{
+    pthread_t tid;
+    sigset_t all, old;
+    int rc = TRUE;
+
+    if (!mx_resolver_start())
+	return FALSE;
+
+    pthread_mutex_lock(&mx_resolver_lock);
+
+    if (mx_resolver_threads < MX_RESOLVER_THREADS
+	    && (mx_resolver_threads == 0
+		|| !TAILQ_EMPTY(&mx_resolver_pending))) {
+	/* Threads shouldn't see our signals */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	if (pthread_create(&tid, NULL, mx_resolver_thread, NULL) == 0) {
+	    pthread_detach(tid);
+	    mx_resolver_threads += 1;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+    }
+
+    if (mx_resolver_threads == 0) {
+	rc = FALSE;
+    } else {
+	mrep->mre_refcount += 1; /* Reference held by the threads */
+	mrep->mre_notify = mx_resolver_notify;
+	TAILQ_INSERT_TAIL(&mx_resolver_pending, mrep, mre_qlink);
+	pthread_cond_signal(&mx_resolver_cond);
+    }
+
+    pthread_mutex_unlock(&mx_resolver_lock);
+
+    return rc;
+}
+
+/*
+ * Look up a hostname.  The returned entry may still be pending,
+ * in which case mx_session_resolved() is called when the lookup
+ * completes.  The caller must call mx_resolve_release() when done.
+ */
+mx_resolve_t *
+mx_resolve (const char *hostname, unsigned port)
+{
+    mx_resolve_t *mrep;
+    struct addrinfo hints, *res = NULL;
+    char buf[16];
+
+    mx_resolve_expire();
+    mx_resolve_stat_lookups += 1;
+
+    TAILQ_FOREACH(mrep, &mx_resolve_cache, mre_link) {
+	if (mrep->mre_port == port && streq(mrep->mre_hostname, hostname)) {
+	    mrep->mre_hits += 1;
+	    mrep->mre_refcount += 1;
+	    mx_resolve_stat_hits += 1;
+	    return mrep;
+	}
+    }
+
+    mrep = calloc(1, sizeof(*mrep));
+    if (mrep == NULL)
+	return NULL;
+
+    mrep->mre_hostname = strdup(hostname);
+    mrep->mre_port = port;
+    mrep->mre_state = MRES_PENDING;
+    mrep->mre_refcount = 1;
+    mrep->mre_start = mx_time_ms();
+
+    TAILQ_INSERT_HEAD(&mx_resolve_cache, mrep, mre_link);
+    mrep->mre_flags |= MREF_CACHED;
+
+    /* Numeric addresses don't need a thread */
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = PF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST;
+    snprintf(buf, sizeof(buf), "%u", port);
+
+    if (getaddrinfo(hostname, buf, &hints, &res) == 0) {
+	mrep->mre_addrinfo = res;
+	mx_resolve_complete(mrep);
+	return mrep;
+    }
+
+    if (!mx_resolver_queue(mrep)) {
+	mx_log("resolver: no threads; resolving '%s' inline", hostname);
+	hints.ai_flags = AI_CANONNAME;
+	mrep->mre_error = getaddrinfo(hostname, buf, &hints, &res);
+	mrep->mre_addrinfo = mrep->mre_error ? NULL : res;
+	mx_resolve_complete(mrep);
+    }
+
+    return mrep;
+}
+
+static int
+mx_resolver_prep (MX_TYPE_PREP_ARGS)
+{
+    pollp->fd = msp->ms_sock;
+    pollp->events = POLLIN;
+
+    return TRUE;
+}
+
+static int
+mx_resolver_poller (MX_TYPE_POLLER_ARGS)
+{
+    mx_resolve_list_t done;
+    mx_resolve_t *mrep;
+    char buf[BUFSIZ];
+
+    if (pollp == NULL || !(pollp->revents & POLLIN))
+	return FALSE;
+
+    while (read(msp->ms_sock, buf, sizeof(buf)) > 0)
+	continue;
+
+    TAILQ_INIT(&done);
+
+    pthread_mutex_lock(&mx_resolver_lock);
+    while ((mrep = TAILQ_FIRST(&mx_resolver_notify->mrn_done)) != NULL) {
+	TAILQ_REMOVE(&mx_resolver_notify->mrn_done, mrep, mre_qlink);
+	TAILQ_INSERT_TAIL(&done, mrep, mre_qlink);
+    }
+    pthread_mutex_unlock(&mx_resolver_lock);
+
+    while ((mrep = TAILQ_FIRST(&done)) != NULL) {
+	TAILQ_REMOVE(&done, mrep, mre_qlink);
+
+	mx_resolve_complete(mrep);
+	mx_session_resolved(mrep);
+
+	/* Drop the threads' reference */
+	mx_resolve_release(mrep);
+    }
+
+    return FALSE;
+}
+
+static void
+mx_resolver_close (MX_TYPE_CLOSE_ARGS)
+{
+    /*
+     * Threads may still be stuck in getaddrinfo(); they'll find
+     * nowhere to write and their results will simply be dropped.
+     */
+    pthread_mutex_lock(&mx_resolver_lock);
+    if (mx_resolver_notify->mrn_wfd >= 0) {
+	close(mx_resolver_notify->mrn_wfd);
+	mx_resolver_notify->mrn_wfd = -1;
+    }
+    pthread_mutex_unlock(&mx_resolver_lock);
+
+    close(msp->ms_sock);
+    msp->ms_sock = -1;
+    mx_resolver_sock = NULL;
+}
+
+static void
+mx_resolver_print (MX_TYPE_PRINT_ARGS)
+{
+    mx_resolve_t *mrep;
+    time_t now = time(NULL);
+
+    mx_log("%*s%sresolver: threads %u, lookups %lu, hits %lu, failures %lu%s",
+	   indent, "", prefix, mx_resolver_threads, mx_resolve_stat_lookups,
+	   mx_resolve_stat_hits, mx_resolve_stat_failures,
+	   TAILQ_EMPTY(&mx_resolve_cache) ? ", cache empty" : "");
+
+    TAILQ_FOREACH(mrep, &mx_resolve_cache, mre_link) {
+	if (mrep->mre_state == MRES_PENDING) {
+	    mx_log("%*s%s%s:%u pending, refs %u", indent + INDENT, "", prefix,
+		   mrep->mre_hostname, mrep->mre_port, mrep->mre_refcount);
+	    continue;
+	}
+
+	mx_log("%*s%s%s:%u %s (%lums), expires in %lds, hits %lu, refs %u",
+	       indent + INDENT, "", prefix,
+	       mrep->mre_hostname, mrep->mre_port,
+	       (mrep->mre_state == MRES_DONE) ? "resolved" : "failed",
+	       mrep->mre_time, (long) (mrep->mre_expires - now),
+	       mrep->mre_hits, mrep->mre_refcount);
+    }
+}
+
+void
+mx_resolver_init (void)
+{
+    static mx_type_info_t mti = {
+	.mti_type = MST_RESOLVER,
+	.mti_name = "resolver",
+	.mti_letter = "D",
+	.mti_print = mx_resolver_print,
+	.mti_prep = mx_resolver_prep,
+	.mti_poller = mx_resolver_poller,
+	.mti_close = mx_resolver_close,
+    };
+
+    TAILQ_INIT(&mx_resolve_cache);
+    TAILQ_INIT(&mx_resolver_pending);
+
+    mx_type_info_register(MX_TYPE_INFO_VERSION, &mti);
+}
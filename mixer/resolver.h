@@ -0,0 +1,19 @@
+/*
+ * $Id$
+ *
+ * Copyright (c) 2013, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ */
+
+mx_resolve_t *
+mx_resolve (const char *hostname, unsigned port);
+
+void
+mx_resolve_release (mx_resolve_t *mrep);
+
+void
+mx_resolver_init (void);
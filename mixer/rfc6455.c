@@ -0,0 +1,712 @@
+/*
+ * $Id$
+ *
+ * Copyright (c) 2013, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * Websockets spoken directly with a browser (RFC 6455).  Normally
+ * lighttpd's mod_websocket talks to the browser and runs a "mixer
+ * --user" process for each websocket, which copies every byte to and
+ * from our unix socket.  With "--port", browsers can connect to us
+ * instead, saving a process and two copies per websocket.  Since a
+ * TCP port is open to every user on the box (at least), they must
+ * present a token that only our user can read (mx_upgrade_token_ok).
+ *
+ * A new connection is an MST_UPGRADE socket until we've answered its
+ * HTTP upgrade request, then it's handed to a websocket (with
+ * MSWF_RFC6455 set), which uses the framing functions here.  Frames
+ * are just transport for the mixer's own messages, so data frames are
+ * decoded (and unmasked) in place into the websocket's read buffer,
+ * and output goes out as a frame per write (see mx_websocket_sendv).
+ */
+
+#include <stdint.h>
+
+#include "local.h"
+#include "rfc6455.h"
+#include "websocket.h"
+#include "event.h"
+#include "timer.h"
+#include "util.h"
+
+#define MX_UPGRADE_MAX	8192	/* Largest upgrade request we'll take */
+#define MX_RFC6455_KEY_LEN 24	/* Length of Sec-WebSocket-Key */
+#define MX_RFC6455_GUID	"258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define MX_UPGRADE_TOKEN_LEN 32	/* Random bytes in our token */
+
+/* Token every upgrade must carry (hex; see mx_rfc6455_token_init) */
+static char mx_upgrade_token[MX_UPGRADE_TOKEN_LEN * 2 + 1];
+
+/*
+ * SHA-1, which is needed only for the handshake.  It's small enough
+ * that we'd rather not drag in a crypto library for it.
+ */
+#define MX_ROL32(_x, _n) (((_x) << (_n)) | ((_x) >> (32 - (_n))))
+
+static void
+mx_sha1_block (uint32_t *hash, const unsigned char *data)
+{
+    uint32_t w[80], a, b, c, d, e, f, k, t;
+    int i;
+
+    for (i = 0; i < 16; i++, data += 4)
+	w[i] = ((uint32_t) data[0] << 24) | ((uint32_t) data[1] << 16)
+	    | ((uint32_t) data[2] << 8) | data[3];
+    for ( ; i < 80; i++)
+	w[i] = MX_ROL32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    a = hash[0];
+    b = hash[1];
+    c = hash[2];
+    d = hash[3];
+    e = hash[4];
+
+    for (i = 0; i < 80; i++) {
+	if (i < 20) {
+	    f = (b & c) | (~b & d);
+	    k = 0x5a827999;
+	} else if (i < 40) {
+	    f = b ^ c ^ d;
+	    k = 0x6ed9eba1;
+	} else if (i < 60) {
+	    f = (b & c) | (b & d) | (c & d);
+	    k = 0x8f1bbcdc;
+	} else {
+	    f = b ^ c ^ d;
+	    k = 0xca62c1d6;
+	}
+
+	t = MX_ROL32(a, 5) + f + e + k + w[i];
+	e = d;
+	d = c;
+	c = MX_ROL32(b, 30);
+	b = a;
+	a = t;
+    }
+
+    hash[0] += a;
+    hash[1] += b;
+    hash[2] += c;
+    hash[3] += d;
+    hash[4] += e;
+}
+
+static void
+mx_sha1 (const unsigned char *data, unsigned long len, unsigned char *digest)
+{
+    uint32_t hash[5] = {
+	0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+    };
+    uint64_t bits = (uint64_t) len * 8;
+    unsigned char block[64];
+    unsigned i;
+
+    for ( ; len >= sizeof(block); data += sizeof(block), len -= sizeof(block))
+	mx_sha1_block(hash, data);
+
+    /* Pad with a one bit, zeros, and the length in bits */
+    memcpy(block, data, len);
+    block[len++] = 0x80;
+    if (len > 56) {
+	memset(block + len, 0, sizeof(block) - len);
+	mx_sha1_block(hash, block);
+	len = 0;
+    }
+    memset(block + len, 0, 56 - len);
+    for (i = 0; i < 8; i++)
+	block[56 + i] = bits >> (56 - 8 * i);
+    mx_sha1_block(hash, block);
+
+    for (i = 0; i < 20; i++)
+	digest[i] = hash[i / 4] >> (24 - 8 * (i % 4));
+}
+
+/*
+ * Build the header for a frame we're sending.  We send whole
+ * messages, unmasked, as servers do.  buf needs room for
+ * MX_RFC6455_HEADER_MAX bytes.  Returns the length of the header.
+ */
+unsigned
+mx_rfc6455_header (unsigned char *buf, unsigned opcode, unsigned long len)
+{
+    unsigned i;
+
+    buf[0] = 0x80 | opcode;	/* FIN */
+
+    if (len < 126) {
+	buf[1] = len;
+	return 2;
+    }
+
+    if (len <= 0xffff) {
+	buf[1] = 126;
+	buf[2] = len >> 8;
+	buf[3] = len;
+	return 4;
+    }
+
+    buf[1] = 127;
+    for (i = 0; i < 8; i++)
+	buf[2 + i] = (uint64_t) len >> (56 - 8 * i);
+    return 10;
+}
+
+/*
+ * See if we have all of a frame's header.  Returns 1 if we do (and
+ * sets up for the payload), 0 if we need more, or -1 if the browser
+ * is breaking the rules.
+ */
+static int
+mx_rfc6455_parse_header (mx_rfc6455_t *mwfp)
+{
+    unsigned char *hp = mwfp->mwf_header;
+    unsigned need = 2, opcode, i;
+    unsigned long len;
+
+    if (mwfp->mwf_hlen < need)
+	return 0;
+
+    if (!(hp[1] & 0x80))
+	return -1;		/* Browsers must mask what they send */
+
+    len = hp[1] & 0x7f;
+    need += (len == 126) ? 2 : (len == 127) ? 8 : 0;
+    need += sizeof(mwfp->mwf_mask);
+    if (mwfp->mwf_hlen < need)
+	return 0;
+
+    if (hp[0] & 0x70)
+	return -1;		/* We didn't agree to any extensions */
+
+    if (len == 126) {
+	len = (hp[2] << 8) | hp[3];
+    } else if (len == 127) {
+	if (hp[2] & 0x80)
+	    return -1;
+	for (len = 0, i = 2; i < 10; i++)
+	    len = (len << 8) | hp[i];
+    }
+
+    opcode = hp[0] & 0x0f;
+    if (opcode & MX_RFC6455_CONTROL) {
+	if (opcode > MX_RFC6455_PONG || !(hp[0] & 0x80)
+		|| len > sizeof(mwfp->mwf_control))
+	    return -1;
+    } else if (opcode > MX_RFC6455_BINARY) {
+	return -1;
+    }
+
+    memcpy(mwfp->mwf_mask, hp + need - sizeof(mwfp->mwf_mask),
+	   sizeof(mwfp->mwf_mask));
+    mwfp->mwf_opcode = opcode;
+    mwfp->mwf_left = len;
+    mwfp->mwf_maskoff = 0;
+    mwfp->mwf_clen = 0;
+    mwfp->mwf_flags |= MWFF_PAYLOAD;
+
+    return 1;
+}
+
+/*
+ * Decode "*lenp" bytes from a browser, in place.  Only the payload of
+ * data frames is left (and *lenp is set to its length), since our own
+ * headers mark the real boundaries.  Frames can be split anywhere, so
+ * we remember where we are in the current one.  Control frames are
+ * handed to "func".  Returns -1 if the browser breaks the rules.
+ */
+int
+mx_rfc6455_decode (mx_rfc6455_t *mwfp, char *buf, unsigned long *lenp,
+		   mx_rfc6455_control_func_t func, void *arg)
+{
+    unsigned char *in = (unsigned char *) buf, *end = in + *lenp;
+    unsigned char *out = in, *mask = mwfp->mwf_mask;
+    unsigned long n, i;
+    int rc;
+
+    while (in < end && !(mwfp->mwf_flags & MWFF_CLOSED)) {
+	if (!(mwfp->mwf_flags & MWFF_PAYLOAD)) {
+	    mwfp->mwf_header[mwfp->mwf_hlen++] = *in++;
+
+	    rc = mx_rfc6455_parse_header(mwfp);
+	    if (rc < 0)
+		return -1;
+	    if (rc == 0 || mwfp->mwf_left)
+		continue;
+
+	} else {
+	    n = end - in;
+	    if (n > mwfp->mwf_left)
+		n = mwfp->mwf_left;
+
+	    /* Unmasking moves the data down over the frame headers */
+	    if (mwfp->mwf_opcode & MX_RFC6455_CONTROL) {
+		for (i = 0; i < n; i++)
+		    mwfp->mwf_control[mwfp->mwf_clen++]
+			= in[i] ^ mask[(mwfp->mwf_maskoff + i) & 3];
+	    } else {
+		for (i = 0; i < n; i++)
+		    out[i] = in[i] ^ mask[(mwfp->mwf_maskoff + i) & 3];
+		out += n;
+	    }
+
+	    in += n;
+	    mwfp->mwf_maskoff = (mwfp->mwf_maskoff + n) & 3;
+	    mwfp->mwf_left -= n;
+	    if (mwfp->mwf_left)
+		continue;
+	}
+
+	/* That's the end of the frame */
+	if (mwfp->mwf_opcode & MX_RFC6455_CONTROL) {
+	    if (mwfp->mwf_opcode == MX_RFC6455_CLOSE)
+		mwfp->mwf_flags |= MWFF_CLOSED;
+	    func(arg, mwfp->mwf_opcode, mwfp->mwf_control, mwfp->mwf_clen);
+	}
+
+	mwfp->mwf_flags &= ~MWFF_PAYLOAD;
+	mwfp->mwf_hlen = 0;
+    }
+
+    *lenp = out - (unsigned char *) buf;
+    return 0;
+}
+
+/*
+ * Find a header in an HTTP request and copy its value into buf.
+ * Returns TRUE if we found it.
+ */
+static int
+mx_upgrade_header (const char *req, const char *name, char *buf, int bufsiz)
+{
+    int nlen = strlen(name), vlen;
+    const char *cp, *ep;
+
+    for (cp = strstr(req, "\r\n"); cp; cp = strstr(cp, "\r\n")) {
+	cp += 2;
+	if (strncasecmp(cp, name, nlen) != 0 || cp[nlen] != ':')
+	    continue;
+
+	for (cp += nlen + 1; *cp == ' ' || *cp == '\t'; cp++)
+	    continue;
+	ep = strstr(cp, "\r\n");
+	if (ep == NULL)
+	    return FALSE;
+	while (ep > cp && (ep[-1] == ' ' || ep[-1] == '\t'))
+	    ep -= 1;
+
+	vlen = ep - cp;
+	if (vlen >= bufsiz)
+	    return FALSE;
+	memcpy(buf, cp, vlen);
+	buf[vlen] = '\0';
+	return TRUE;
+    }
+
+    return FALSE;
+}
+
+/*
+ * See if a comma-separated header value contains a token
+ */
+static int
+mx_upgrade_has_token (const char *value, const char *token)
+{
+    int tlen = strlen(token);
+    const char *cp;
+
+    for (cp = value; *cp; ) {
+	while (*cp == ' ' || *cp == '\t' || *cp == ',')
+	    cp += 1;
+	if (strncasecmp(cp, token, tlen) == 0
+		&& (cp[tlen] == '\0' || cp[tlen] == ',' || cp[tlen] == ' '))
+	    return TRUE;
+	cp += strcspn(cp, ",");
+    }
+
+    return FALSE;
+}
+
+/* Length of the host part of "host[:port][/path]" (or "[v6]:port") */
+static int
+mx_upgrade_hostlen (const char *cp)
+{
+    if (*cp == '[') {
+	const char *ep = strchr(cp, ']');
+	return ep ? ep - cp + 1 : (int) strlen(cp);
+    }
+
+    return strcspn(cp, ":/");
+}
+
+/*
+ * Find a parameter in the query part of the request-target and copy
+ * its value into buf.  Returns TRUE if we found it.
+ */
+static int
+mx_upgrade_query (const char *req, const char *name, char *buf, int bufsiz)
+{
+    int nlen = strlen(name), vlen;
+    const char *cp, *ep;
+
+    ep = req + strcspn(req, " \r\n");	/* Skip the method */
+    if (*ep != ' ')
+	return FALSE;
+    ep += 1;
+    ep += strcspn(ep, " \r\n");	/* End of the request-target */
+
+    cp = memchr(req, '?', ep - req);
+    while (cp && cp < ep) {
+	cp += 1;
+	vlen = strcspn(cp, "& \r\n");
+	if (vlen > nlen && strncmp(cp, name, nlen) == 0 && cp[nlen] == '=') {
+	    vlen -= nlen + 1;
+	    if (vlen >= bufsiz)
+		return FALSE;
+	    memcpy(buf, cp + nlen + 1, vlen);
+	    buf[vlen] = '\0';
+	    return TRUE;
+	}
+	cp += vlen;
+	if (*cp != '&')
+	    break;
+    }
+
+    return FALSE;
+}
+
+/*
+ * Anyone who can reach --port could otherwise drive our sessions,
+ * with our credentials, so every upgrade must carry the token we
+ * wrote at startup, which only our user can read.  Browsers can't
+ * set headers on a websocket, so they pass "?token=" in the URL;
+ * other clients can use "Authorization: Bearer".  The comparison
+ * takes the same time however much of the token matches.
+ */
+static int
+mx_upgrade_token_ok (const char *req)
+{
+    char value[BUFSIZ];
+    const char *cp = NULL;
+    unsigned char diff = 0;
+    unsigned i, len = sizeof(mx_upgrade_token) - 1;
+
+    if (mx_upgrade_header(req, "Authorization", value, sizeof(value))
+	    && strncasecmp(value, "Bearer ", 7) == 0) {
+	for (cp = value + 7; *cp == ' '; cp++)
+	    continue;
+    } else if (mx_upgrade_query(req, "token", value, sizeof(value)))
+	cp = value;
+
+    if (cp == NULL || mx_upgrade_token[0] == '\0' || strlen(cp) != len)
+	return FALSE;
+
+    for (i = 0; i < len; i++)
+	diff |= cp[i] ^ mx_upgrade_token[i];
+
+    return (diff == 0);
+}
+
+/*
+ * Browsers will open a websocket to anyone, from any page, so we
+ * check where the page came from.  With --origin, it must be that
+ * origin; otherwise it must be this host (on any port), as the
+ * browser named it in the Host header.  Only browsers send Origin,
+ * so other clients get by without one, but mx_upgrade_token_ok has
+ * already had its say by then.
+ */
+static int
+mx_upgrade_origin_ok (const char *req)
+{
+    char origin[BUFSIZ], host[BUFSIZ];
+    const char *cp;
+    int len;
+
+    if (!mx_upgrade_header(req, "Origin", origin, sizeof(origin)))
+	return TRUE;		/* Not a browser, but it has the token */
+
+    if (opt_origin)
+	return (strcasecmp(origin, opt_origin) == 0);
+
+    if (!mx_upgrade_header(req, "Host", host, sizeof(host)))
+	return FALSE;
+
+    cp = strstr(origin, "://");
+    if (cp == NULL)
+	return FALSE;
+    cp += 3;
+
+    len = mx_upgrade_hostlen(cp);
+    return (len == mx_upgrade_hostlen(host) && strncasecmp(cp, host, len) == 0);
+}
+
+/*
+ * Answer the upgrade request.  If it's good, the socket becomes a
+ * websocket.  Either way, we're done with it.
+ */
+static void
+mx_upgrade_answer (mx_sock_upgrade_t *msup)
+{
+    mx_sock_t *msp = &msup->msu_base;
+    const char *req = msup->msu_rbufp->mb_data;
+    const char *error = NULL;
+    char value[BUFSIZ], key[MX_RFC6455_KEY_LEN + 1];
+    char input[MX_RFC6455_KEY_LEN + sizeof(MX_RFC6455_GUID)];
+    char buf[BUFSIZ], accept[32];
+    unsigned char digest[20];
+    mx_sock_websocket_t *mswp;
+    int len;
+
+    msp->ms_state = MSS_FAILED;
+
+    if (strncmp(req, "GET ", 4) != 0)
+	error = "405 Method Not Allowed";
+    else if (!mx_upgrade_header(req, "Upgrade", value, sizeof(value))
+	     || !mx_upgrade_has_token(value, "websocket")
+	     || !mx_upgrade_header(req, "Connection", value, sizeof(value))
+	     || !mx_upgrade_has_token(value, "upgrade")
+	     || !mx_upgrade_header(req, "Sec-WebSocket-Key", key, sizeof(key))
+	     || strlen(key) != MX_RFC6455_KEY_LEN)
+	error = "400 Bad Request";
+    else if (!mx_upgrade_header(req, "Sec-WebSocket-Version",
+				value, sizeof(value))
+	     || !streq(value, "13"))
+	error = "426 Upgrade Required";
+    else if (!mx_upgrade_token_ok(req))
+	error = "401 Unauthorized";
+    else if (!mx_upgrade_origin_ok(req))
+	error = "403 Forbidden";
+
+    if (error) {
+	mx_log("%s websocket upgrade refused: %s", mx_sock_title(msp), error);
+	len = snprintf(buf, sizeof(buf), "HTTP/1.1 %s\r\n"
+		       "Sec-WebSocket-Version: 13\r\n"
+		       "Content-Length: 0\r\n"
+		       "Connection: close\r\n\r\n", error);
+	if (write(msp->ms_sock, buf, len) < 0)
+	    mx_log("%s: write error: %s", mx_sock_title(msp), strerror(errno));
+	return;
+    }
+
+    len = snprintf(input, sizeof(input), "%s%s", key, MX_RFC6455_GUID);
+    mx_sha1((const unsigned char *) input, len, digest);
+    accept[mx_base64_encode(accept, digest, sizeof(digest))] = '\0';
+
+    len = snprintf(buf, sizeof(buf), "HTTP/1.1 101 Switching Protocols\r\n"
+		   "Upgrade: websocket\r\n"
+		   "Connection: Upgrade\r\n"
+		   "Sec-WebSocket-Accept: %s\r\n\r\n", accept);
+    if (write(msp->ms_sock, buf, len) != len) {
+	mx_log("%s: write error: %s", mx_sock_title(msp), strerror(errno));
+	return;
+    }
+
+    mswp = mx_websocket_create(msp->ms_sock, MSWF_RFC6455);
+    if (mswp == NULL)
+	return;
+
+    mswp->msw_base.ms_sin = msp->ms_sin;
+    mswp->msw_base.ms_sin6 = msp->ms_sin6;
+
+    TAILQ_INSERT_HEAD(&mx_sock_list, &mswp->msw_base, ms_link);
+    mx_sock_count += 1;
+
+    MX_LOG("%s new %s from %s, fd %u", mx_sock_title(&mswp->msw_base),
+	   mx_sock_type(&mswp->msw_base), mx_sock_title(msp),
+	   mswp->msw_base.ms_sock);
+
+    /* Hand the socket to the websocket; it's no longer ours */
+    mx_event_forget(msp);
+    msp->ms_sock = -1;
+}
+
+static void
+mx_upgrade_timeout (mx_timer_t *mtp UNUSED, void *arg)
+{
+    mx_sock_upgrade_t *msup = arg;
+
+    mx_log("%s websocket upgrade timed out", mx_sock_title(&msup->msu_base));
+    msup->msu_base.ms_state = MSS_FAILED;
+}
+
+static mx_sock_t *
+mx_upgrade_spawn (MX_TYPE_SPAWN_ARGS)
+{
+    mx_sock_upgrade_t *msup = calloc(1, sizeof(*msup));
+
+    if (msup == NULL)
+	return NULL;
+
+    msup->msu_rbufp = mx_buffer_create(MX_UPGRADE_MAX);
+    if (msup->msu_rbufp == NULL) {
+	free(msup);
+	return NULL;
+    }
+
+    msup->msu_base.ms_id = mx_next_id(mx_sock_id);
+    msup->msu_base.ms_type = MST_UPGRADE;
+    msup->msu_base.ms_sock = sock;
+
+    /* Our listener is a TCP one, so this is really an inet address */
+    if (sun->sun_family == AF_INET && sunlen <= sizeof(msup->msu_base.ms_sin))
+	memcpy(&msup->msu_base.ms_sin, sun, sunlen);
+    else if (sun->sun_family == AF_INET6
+	     && sunlen <= sizeof(msup->msu_base.ms_sin6))
+	memcpy(&msup->msu_base.ms_sin6, sun, sunlen);
+
+    if (opt_connect_timeout > 0)
+	mx_timer_set(&msup->msu_timer, opt_connect_timeout * 1000,
+		     mx_upgrade_timeout, msup);
+
+    return &msup->msu_base;
+}
+
+static int
+mx_upgrade_prep (MX_TYPE_PREP_ARGS)
+{
+    pollp->fd = msp->ms_sock;
+    pollp->events = POLLIN;
+
+    return TRUE;
+}
+
+static int
+mx_upgrade_poller (MX_TYPE_POLLER_ARGS)
+{
+    mx_sock_upgrade_t *msup = mx_sock(msp, MST_UPGRADE);
+    mx_buffer_t *mbp = msup->msu_rbufp;
+    char *end;
+    int len;
+
+    if (pollp == NULL || !(pollp->revents & POLLIN))
+	return FALSE;
+
+    len = recv(msp->ms_sock, mbp->mb_data + mbp->mb_len,
+	       mbp->mb_size - mbp->mb_len - 1, 0);
+    if (len < 0) {
+	if (errno == EWOULDBLOCK || errno == EINTR)
+	    return FALSE;
+	mx_log("%s: read error: %s", mx_sock_title(msp), strerror(errno));
+	return TRUE;
+    }
+
+    if (len == 0) {
+	mx_log("%s: disconnect (%s)", mx_sock_title(msp), mx_sock_name(msp));
+	return TRUE;
+    }
+
+    mbp->mb_len += len;
+    mbp->mb_data[mbp->mb_len] = '\0';
+
+    end = strstr(mbp->mb_data, "\r\n\r\n");
+    if (end == NULL) {
+	if (mbp->mb_len + 1 < mbp->mb_size)
+	    return FALSE;
+
+	mx_log("%s websocket upgrade request is too large",
+	       mx_sock_title(msp));
+	return TRUE;
+    }
+
+    /* Browsers wait for our answer before sending frames */
+    if (end + 4 != mbp->mb_data + mbp->mb_len) {
+	mx_log("%s websocket upgrade request followed by data",
+	       mx_sock_title(msp));
+	return TRUE;
+    }
+
+    mx_upgrade_answer(msup);
+    return FALSE;
+}
+
+static void
+mx_upgrade_close (MX_TYPE_CLOSE_ARGS)
+{
+    mx_sock_upgrade_t *msup = mx_sock(msp, MST_UPGRADE);
+
+    mx_timer_cancel(&msup->msu_timer);
+    mx_buffer_free(msup->msu_rbufp);
+    msup->msu_rbufp = NULL;
+
+    if ((int) msp->ms_sock >= 0) {
+	close(msp->ms_sock);
+	msp->ms_sock = -1;
+    }
+}
+
+static void
+mx_upgrade_print (MX_TYPE_PRINT_ARGS)
+{
+    mx_sock_upgrade_t *msup = mx_sock(msp, MST_UPGRADE);
+
+    mx_log("%*s%swaiting for upgrade request, %lu bytes so far", indent, "",
+	   prefix, (unsigned long) msup->msu_rbufp->mb_len);
+}
+
+/*
+ * Make a fresh token for --port and write it where our clients can
+ * find it (and no one else can read it).  The file is recreated, not
+ * rewritten, so it can't be left with someone else's permissions.
+ */
+int
+mx_rfc6455_token_init (const char *path)
+{
+    unsigned char raw[MX_UPGRADE_TOKEN_LEN];
+    char buf[sizeof(mx_upgrade_token) + 1];
+    unsigned i;
+    int fd, len;
+
+    fd = open("/dev/urandom", O_RDONLY);
+    if (fd < 0) {
+	mx_log("cannot open /dev/urandom: %s", strerror(errno));
+	return FALSE;
+    }
+
+    len = read(fd, raw, sizeof(raw));
+    close(fd);
+    if (len != sizeof(raw)) {
+	mx_log("cannot read /dev/urandom");
+	return FALSE;
+    }
+
+    for (i = 0; i < sizeof(raw); i++)
+	snprintf(mx_upgrade_token + i * 2, 3, "%02x", raw[i]);
+
+    unlink(path);
+    fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+	mx_log("cannot create token file '%s': %s", path, strerror(errno));
+	return FALSE;
+    }
+
+    len = snprintf(buf, sizeof(buf), "%s\n", mx_upgrade_token);
+    if (write(fd, buf, len) != len) {
+	mx_log("cannot write token file '%s': %s", path, strerror(errno));
+	close(fd);
+	return FALSE;
+    }
+
+    close(fd);
+    mx_log("websocket token for --port is in %s", path);
+    return TRUE;
+}
+
+void
+mx_rfc6455_init (void)
+{
+    static mx_type_info_t mti = {
+	.mti_type = MST_UPGRADE,
+	.mti_name = "upgrade",
+	.mti_letter = "H",
+	.mti_print = mx_upgrade_print,
+	.mti_prep = mx_upgrade_prep,
+	.mti_poller = mx_upgrade_poller,
+	.mti_spawn = mx_upgrade_spawn,
+	.mti_close = mx_upgrade_close,
+    };
+
+    mx_type_info_register(MX_TYPE_INFO_VERSION, &mti);
+}
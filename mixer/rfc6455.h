@@ -0,0 +1,37 @@
+/*
+ * $Id$
+ *
+ * Copyright (c) 2013, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ */
+
+/* Frame opcodes */
+#define MX_RFC6455_CONTINUATION	0x0
+#define MX_RFC6455_TEXT		0x1
+#define MX_RFC6455_BINARY	0x2
+#define MX_RFC6455_CONTROL	0x8	/* Bit set in all control opcodes */
+#define MX_RFC6455_CLOSE	0x8
+#define MX_RFC6455_PING		0x9
+#define MX_RFC6455_PONG		0xa
+
+#define MX_RFC6455_HEADER_MAX	10	/* Longest header we send */
+
+typedef void (*mx_rfc6455_control_func_t)(void *arg, unsigned opcode,
+					  unsigned char *data, unsigned len);
+
+unsigned
+mx_rfc6455_header (unsigned char *buf, unsigned opcode, unsigned long len);
+
+int
+mx_rfc6455_decode (mx_rfc6455_t *mwfp, char *buf, unsigned long *lenp,
+		   mx_rfc6455_control_func_t func, void *arg);
+
+int
+mx_rfc6455_token_init (const char *path);
+
+void
+mx_rfc6455_init (void);
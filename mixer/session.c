@@ -7,6 +7,17 @@
  * ../Copyright file. By downloading, installing, copying, or otherwise
  * using the SOFTWARE, you agree to be bound by the terms of that
  * LICENSE.
+ *
+ * Sessions are established as a state machine driven by the main
+ * loop, so a slow or unreachable device doesn't stall everyone else:
+ *
+ *   MSS_RESOLVING -> MSS_CONNECTING -> MSS_HANDSHAKE -> [MSS_HOSTKEY]
+ *       -> MSS_AUTH <-> [MSS_PASSPHRASE/MSS_PASSWORD] -> MSS_ESTABLISHED
+ *
+ * The bracketed states wait for the user to answer a prompt.  The
+ * request that opened the session (mss_request) is used for
+ * prompting; other requests for the same target simply wait on the
+ * session and are started once it's established.
  */
 
 #include <netdb.h>
@@ -18,24 +29,86 @@
 #include "forwarder.h"
 #include "request.h"
 #include "db.h"
+#include "event.h"
+#include "resolver.h"
+#include "connect.h"
+#include "timer.h"
 #include <sys/ioctl.h>
 
 static char *known_hosts;
 
+/* Authentication steps (for mss_auth_step) */
+#define MSA_LIST	0	/* Fetch the list of auth methods */
+#define MSA_AGENT	1	/* Try identities from ssh-agent */
+#define MSA_KEY_EMPTY	2	/* Try keyfile with an empty passphrase */
+#define MSA_KEY_NEW	3	/* Try keyfile with the user's passphrase */
+#define MSA_KEY_DB	4	/* Try keyfile with the saved passphrase */
+#define MSA_KEY_PROMPT	5	/* Ask the user for a passphrase */
+#define MSA_PASSWORD	6	/* Try a password */
+#define MSA_PW_PROMPT	7	/* Ask the user for a password */
+#define MSA_NONE	8	/* Out of methods */
+
+/* Flags for mss_auth_flags */
+#define MSAF_PUBLICKEY	(1<<0)	/* Server allows "publickey" */
+#define MSAF_PASSWORD	(1<<1)	/* Server allows "password" */
+#define MSAF_PW_TRIED	(1<<2)	/* A password has been tried (and failed) */
+
+#define MX_CONNECT_STAGGER 250 /* Milliseconds between connect attempts */
+
+/* Results from mx_session_auth() */
+#define MX_AUTH_AGAIN	0	/* Would block; wait for the socket */
+#define MX_AUTH_DONE	1	/* Authenticated */
+#define MX_AUTH_PROMPT	2	/* Waiting for the user */
+#define MX_AUTH_FAILED	3	/* No more methods to try */
+
+static void
+mx_session_continue (mx_sock_session_t *mssp);
+
+static void
+mx_session_addrs_done (mx_sock_session_t *mssp);
+
+static void
+mx_session_connect_next (mx_sock_session_t *mssp);
+
 static void
 mx_session_print (MX_TYPE_PRINT_ARGS)
 {
     mx_sock_session_t *mssp = mx_sock(msp, MST_SESSION);
     mx_channel_t *mcp;
 
-    mx_log("%*s%starget %s, session %p (%s)", indent, "", prefix,
+    mx_log("%*s%starget %s, session %p (%s), state %u", indent, "", prefix,
 	   mssp->mss_target, mssp->mss_session,
-	   mssp->mss_canonname ?: "???");
+	   mssp->mss_canonname ?: "???", msp->ms_state);
+
+    if (mssp->mss_request)
+	mx_log("%*s%ssetup by R%u", indent, "", prefix,
+	       mssp->mss_request->mr_id);
+
+    mx_log("%*s%saddress %s, resolve %lums, connect %lums%s", indent, "",
+	   prefix, mx_sock_name(msp), mssp->mss_resolve_time,
+	   mssp->mss_connect_time,
+	   (msp->ms_state == MSS_CONNECTING) ? " (connecting)" : "");
+    if (mssp->mss_attempts)
+	mx_log("%*s%sconnect attempts: %u in flight, %u/%u addresses tried",
+	       indent, "", prefix, mssp->mss_attempts,
+	       mssp->mss_addrindex, mssp->mss_addrcount);
 
     if (mssp->mss_keepalive_next)
 	mx_log("%*s%sKeepalive next: %d", indent, "", prefix,
 	       mssp->mss_keepalive_next);
 
+    mx_log("%*s%sidle pool: %lu opened, %lu trimmed; %lu closed by cancel",
+	   indent, "", prefix, mssp->mss_pool_opened, mssp->mss_pool_trimmed,
+	   mssp->mss_cancelled);
+
+    mx_log("%*s%squeued: %u interactive, %u bulk; %lu waited for a channel",
+	   indent, "", prefix, mssp->mss_queued[MRQ_INTERACTIVE],
+	   mssp->mss_queued[MRQ_BULK], mssp->mss_sched_waits);
+
+    mx_log("%*s%sreads: %lu, %lu bytes, %lu bytes/read",
+	   indent, "", prefix, mssp->mss_reads, mssp->mss_read_bytes,
+	   mssp->mss_reads ? mssp->mss_read_bytes / mssp->mss_reads : 0);
+
     mx_log("%*s%sChannels in use:%s", indent, "", prefix,
 	   TAILQ_EMPTY(&mssp->mss_channels) ? " none" : "");
     TAILQ_FOREACH(mcp, &mssp->mss_channels, mc_link) {
@@ -49,44 +122,136 @@ mx_session_print (MX_TYPE_PRINT_ARGS)
     }
 }
 
+/*
+ * Create an unconnected session for a request.  The connection
+ * is made as the session moves thru its states.
+ */
 mx_sock_session_t *
-mx_session_create (LIBSSH2_SESSION *session, int sock,
-		   const char *target, const char *canonname)
+mx_session_create (mx_request_t *mrp)
 {
     mx_sock_session_t *mssp = malloc(sizeof(*mssp));
+    int i;
+
     if (mssp == NULL)
 	return NULL;
 
     bzero(mssp, sizeof(*mssp));
-    mssp->mss_base.ms_id = ++mx_sock_id;
+    mssp->mss_base.ms_id = mx_next_id(mx_sock_id);
     mssp->mss_base.ms_type = MST_SESSION;
-    mssp->mss_base.ms_sock = sock;
-
-    mssp->mss_session = session;
-    mssp->mss_target = strdup(target);
-    if (canonname)
-	mssp->mss_canonname = strdup(canonname);
+    mssp->mss_base.ms_sock = -1;
+    mssp->mss_base.ms_state = MSS_RESOLVING;
+
+    mssp->mss_target = strdup(mrp->mr_fulltarget);
+    mssp->mss_hostname = nstrdup(mrp->mr_hostname);
+    mssp->mss_port = mrp->mr_port;
+    mssp->mss_user = strdup(mrp->mr_user ?: opt_user ?: getlogin());
+    mssp->mss_request = mrp;
     TAILQ_INIT(&mssp->mss_channels);
     TAILQ_INIT(&mssp->mss_released);
+    for (i = 0; i < MRQ_MAX; i++)
+	TAILQ_INIT(&mssp->mss_queue[i]);
 
     TAILQ_INSERT_HEAD(&mx_sock_list, &mssp->mss_base, ms_link);
     mx_sock_count += 1;
 
-    MX_LOG("%s new %s, fd %u, target %s/%s",
+    MX_LOG("%s new %s, target %s",
 	   mx_sock_title(&mssp->mss_base), mx_sock_type(&mssp->mss_base),
-	   mssp->mss_base.ms_sock, mssp->mss_target,
-	   mssp->mss_canonname ?: "");
+	   mssp->mss_target);
 
     return mssp;
 }
 
 static void
-mx_session_establish (mx_sock_session_t *mssp, mx_request_t *mrp)
+mx_session_set_state (mx_sock_session_t *mssp, unsigned state)
+{
+    mx_log("%s state change: %u -> %u", mx_sock_title(&mssp->mss_base),
+	   mssp->mss_base.ms_state, state);
+
+    mssp->mss_base.ms_state = state;
+    mssp->mss_setup_start = mx_time_ms();
+
+    if (state == MSS_RESOLVING || state == MSS_CONNECTING
+	    || state == MSS_HANDSHAKE || state == MSS_AUTH)
+	mssp->mss_deadline = time(NULL) + opt_connect_timeout;
+    else
+	mssp->mss_deadline = 0;
+}
+
+/*
+ * Session setup failed; tell everyone waiting on us and mark the
+ * session as failed so main_loop will close it.
+ */
+void
+mx_session_fail (mx_sock_session_t *mssp, const char *fmt, ...)
 {
-    mx_request_set_state(mrp, MSS_ESTABLISHED);
+    va_list vap;
+    char buf[BUFSIZ];
+
+    va_start(vap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, vap);
+    va_end(vap);
+
+    mx_log("%s session failed: %s", mx_sock_title(&mssp->mss_base), buf);
+
+    mx_session_addrs_done(mssp);
+    mssp->mss_request = NULL;
+    mx_request_session_failed(mssp, buf);
+    mx_session_set_state(mssp, MSS_FAILED);
+}
+
+/*
+ * Time for a keepalive.  libssh2 tells us when the next one is due.
+ */
+static void
+mx_session_keepalive (mx_timer_t *mtp, void *arg)
+{
+    mx_sock_session_t *mssp = arg;
+    int next = 0;
+    int rc = libssh2_keepalive_send(mssp->mss_session, &next);
+
+    if (rc == 0) {
+	mssp->mss_keepalive_next = next;
+	mx_timer_set(mtp, (next ?: 1) * 1000UL, mx_session_keepalive, mssp);
+
+    } else if (rc == LIBSSH2_ERROR_EAGAIN) {
+	mx_timer_set(mtp, 1000, mx_session_keepalive, mssp);
+
+    } else {
+	mx_log("%s keepalive failed: %d", mx_sock_title(&mssp->mss_base), rc);
+	mssp->mss_base.ms_state = MSS_FAILED;
+    }
+}
+
+/*
+ * Nothing has used the session for opt_idle_session_timeout; close it.
+ */
+static void
+mx_session_idle (mx_timer_t *mtp UNUSED, void *arg)
+{
+    mx_sock_session_t *mssp = arg;
+
+    mx_log("%s closing idle session to %s",
+	   mx_sock_title(&mssp->mss_base), mssp->mss_target);
+    mssp->mss_base.ms_state = MSS_FAILED;
+}
+
+static void
+mx_session_established (mx_sock_session_t *mssp)
+{
+    mx_log("%s auth'd session is established to %s",
+	   mx_sock_title(&mssp->mss_base), mssp->mss_target);
+
+    mx_session_set_state(mssp, MSS_ESTABLISHED);
+    mssp->mss_request = NULL;
 
-    if (opt_keepalive)
+    if (opt_keepalive) {
 	libssh2_keepalive_config(mssp->mss_session, 1, opt_keepalive);
+	mx_timer_set(&mssp->mss_keepalive_timer, opt_keepalive * 1000UL,
+		     mx_session_keepalive, mssp);
+    }
+
+    /* Start the requests that have been waiting on us */
+    mx_request_session_ready(mssp);
 }
 
 void
@@ -227,240 +392,633 @@ mx_session_check_hostkey (mx_sock_session_t *mssp, mx_request_t *mrp)
     return FALSE;
 }
 
+/*
+ * Ask the user something on behalf of the session, using the
+ * request that's driving session setup.  Returns TRUE if the
+ * question was asked.
+ */
 static int
-mx_session_check_agent (mx_sock_session_t *session, mx_request_t *mrp UNUSED,
-			const char *user)
+mx_session_prompt (mx_sock_session_t *mssp, unsigned state, const char *info)
 {
-    LIBSSH2_AGENT *agent = NULL;
-    struct libssh2_agent_publickey *identity, *prev_identity = NULL;
-    int rc;
+    mx_request_t *mrp = mssp->mss_request;
+    mx_sock_t *client = mrp ? mrp->mr_client : NULL;
+    int rc = FALSE;
 
-    /* Connect to the ssh-agent */
-    agent = libssh2_agent_init(session->mss_session);
-    if (!agent) {
-	mx_log("failure initializing ssh-agent support");
+    if (client == NULL)
 	return FALSE;
+
+    mx_request_set_state(mrp, state);
+
+    if (state == MSS_PASSPHRASE) {
+	if (mx_mti(client)->mti_get_passphrase)
+	    rc = mx_mti(client)->mti_get_passphrase(client, mrp, info);
+    } else {
+	if (mx_mti(client)->mti_get_password)
+	    rc = mx_mti(client)->mti_get_password(client, mrp, info);
     }
 
-    if (libssh2_agent_connect(agent)) {
-	mx_log("failure connecting to ssh-agent");
+    if (rc)
+	mx_session_set_state(mssp, state);
+
+    return rc;
+}
+
+static int
+mx_session_prompt_passphrase (mx_sock_session_t *mssp)
+{
+    mx_request_t *mrp = mssp->mss_request;
+    char buf[BUFSIZ], *bp = buf, *ep = buf + sizeof(buf);
+
+    if (!exists(keyfile1) || !exists(keyfile2))
 	return FALSE;
+
+    if (mrp && mrp->mr_passphrase)
+	bp += snprintf_safe(bp, ep - bp, "Invalid passphrase\n");
+
+    bp += snprintf_safe(bp, ep - bp,
+			"Enter passphrase for keyfile %s:", keyfile1);
+
+    return mx_session_prompt(mssp, MSS_PASSPHRASE, buf);
+}
+
+static int
+mx_session_prompt_password (mx_sock_session_t *mssp)
+{
+    char buf[BUFSIZ], *bp = buf, *ep = buf + sizeof(buf);
+
+    if (mssp->mss_auth_flags & MSAF_PW_TRIED)
+	bp += snprintf_safe(bp, ep - bp, "Invalid password\n");
+
+    bp += snprintf_safe(bp, ep - bp, "Enter password:");
+
+    return mx_session_prompt(mssp, MSS_PASSWORD, buf);
+}
+
+static void
+mx_session_agent_done (mx_sock_session_t *mssp)
+{
+    if (mssp->mss_agent) {
+	libssh2_agent_disconnect(mssp->mss_agent);
+	libssh2_agent_free(mssp->mss_agent);
+	mssp->mss_agent = NULL;
     }
+    mssp->mss_agent_identity = NULL;
+}
 
-    if (libssh2_agent_list_identities(agent)) {
-	mx_log("failure requesting identities to ssh-agent");
-	return FALSE;
+/*
+ * Walk thru the identities held by the ssh-agent.  Talking to the
+ * agent is local, but each userauth attempt is a round trip to the
+ * device, so we may have to come back here when the socket's ready.
+ */
+static int
+mx_session_auth_agent (mx_sock_session_t *mssp)
+{
+    struct libssh2_agent_publickey *identity;
+    const char *user = mssp->mss_user;
+    int rc;
+
+    if (mssp->mss_agent == NULL) {
+	mssp->mss_agent = libssh2_agent_init(mssp->mss_session);
+	if (mssp->mss_agent == NULL) {
+	    mx_log("failure initializing ssh-agent support");
+	    return MX_AUTH_FAILED;
+	}
+
+	if (libssh2_agent_connect(mssp->mss_agent)) {
+	    mx_log("failure connecting to ssh-agent");
+	    goto failed;
+	}
+
+	if (libssh2_agent_list_identities(mssp->mss_agent)) {
+	    mx_log("failure requesting identities to ssh-agent");
+	    goto failed;
+	}
+
+	rc = libssh2_agent_get_identity(mssp->mss_agent, &identity, NULL);
+	if (rc != 0)		/* 1 -> end of list of identities */
+	    goto failed;
+	mssp->mss_agent_identity = identity;
     }
 
     for (;;) {
-	rc = libssh2_agent_get_identity(agent, &identity, prev_identity);
-	if (rc == 1)	/* 1 -> end of list of identities */
-	    break;
+	identity = mssp->mss_agent_identity;
 
-	if (rc < 0) {
-	    mx_log("Failure obtaining identity from ssh-agent");
-	    break;
-	}
+	rc = libssh2_agent_userauth(mssp->mss_agent, user, identity);
+	if (rc == LIBSSH2_ERROR_EAGAIN)
+	    return MX_AUTH_AGAIN;
 
-	if (libssh2_agent_userauth(agent, user, identity) == 0) {
+	if (rc == 0) {
 	    mx_log("%s ssh auth username %s, public key %s succeeded",
-		   mx_sock_title(&session->mss_base), user, identity->comment);
+		   mx_sock_title(&mssp->mss_base), user, identity->comment);
 	    /* Rah!!  We're authenticated now */
-	    return TRUE;
+	    mx_session_agent_done(mssp);
+	    return MX_AUTH_DONE;
 	}
 
 	mx_log("%s ssh auth username %s, public key %s failed",
-	       mx_sock_title(&session->mss_base), user, identity->comment);
+	       mx_sock_title(&mssp->mss_base), user, identity->comment);
+
+	rc = libssh2_agent_get_identity(mssp->mss_agent, &identity, identity);
+	if (rc == 1)		/* 1 -> end of list of identities */
+	    break;
 
-	prev_identity = identity;
+	if (rc < 0) {
+	    mx_log("Failure obtaining identity from ssh-agent");
+	    break;
+	}
+
+	mssp->mss_agent_identity = identity;
     }
 
-    return FALSE;
+ failed:
+    mx_session_agent_done(mssp);
+    return MX_AUTH_FAILED;
 }
 
+/*
+ * Try a public key from our keyfiles.  libssh2 wants the identical
+ * call repeated after LIBSSH2_ERROR_EAGAIN, which works out since
+ * the passphrase can't change while we're waiting.
+ */
 static int
-mx_session_check_keyfile (mx_sock_session_t *mssp, mx_request_t *mrp,
-			  const char *user)
+mx_session_auth_keyfile (mx_sock_session_t *mssp, const char *passphrase,
+			 const char *what)
 {
-    mx_sock_t *msp = mrp->mr_client;
-    const char *passphrase = mrp->mr_passphrase;
-    const char *db_passphrase = mx_db_get_passphrase();
+    int rc;
 
-    if (passphrase && *passphrase == '\0') {
-	mx_log("R%u null passphrase", mrp->mr_id);
-	mx_request_set_state(mrp, MSS_PASSWORD);
-	return FALSE;
-    }
+    rc = libssh2_userauth_publickey_fromfile(mssp->mss_session,
+					     mssp->mss_user,
+					     keyfile1, keyfile2, passphrase);
+    if (rc == LIBSSH2_ERROR_EAGAIN)
+	return MX_AUTH_AGAIN;
 
-    if (db_passphrase == NULL && passphrase == NULL) {
-	/*
-	 * We got here with no passphrase; must be the initial attempt.
-	 * Try to decrypt with no (empty) passphrase.
-	 */
-	if (libssh2_userauth_publickey_fromfile(mssp->mss_session, user,
-						keyfile1, keyfile2, NULL)) {
-	    /* Ignore failure */
-	} else {
-	    mx_log("R%u Authentication by empty public key succeeded",
-		   mrp->mr_id);
-	    goto success;
+    mx_log("%s authentication by %s public key %s",
+	   mx_sock_title(&mssp->mss_base), what, rc ? "failed" : "succeeded");
+
+    return rc ? MX_AUTH_FAILED : MX_AUTH_DONE;
+}
+
+/*
+ * Run the authentication steps until we're done, need to wait for
+ * the device, or need to wait for the user.  The order of attempts
+ * is: ssh-agent, public key files (with an empty, user-supplied, or
+ * saved passphrase), and then password.
+ */
+static int
+mx_session_auth (mx_sock_session_t *mssp)
+{
+    mx_request_t *mrp = mssp->mss_request;
+    LIBSSH2_SESSION *session = mssp->mss_session;
+    const char *user = mssp->mss_user;
+    const char *passphrase, *password;
+    char *userauthlist;
+    int rc;
+
+    for (;;) {
+	switch (mssp->mss_auth_step) {
+	case MSA_LIST:
+	    /* check what authentication methods are available */
+	    userauthlist = libssh2_userauth_list(session, user, strlen(user));
+	    if (userauthlist == NULL) {
+		if (libssh2_session_last_errno(session)
+		        == LIBSSH2_ERROR_EAGAIN)
+		    return MX_AUTH_AGAIN;
+
+		/* The server might have accepted "none" */
+		if (libssh2_userauth_authenticated(session))
+		    return MX_AUTH_DONE;
+	    }
+
+	    mx_log("Authentication methods: %s", userauthlist ?: "(empty)");
+
+	    if (userauthlist) {
+		if (strstr(userauthlist, "password"))
+		    mssp->mss_auth_flags |= MSAF_PASSWORD;
+		if (strstr(userauthlist, "publickey"))
+		    mssp->mss_auth_flags |= MSAF_PUBLICKEY;
+	    }
+
+	    if (!(mssp->mss_auth_flags & MSAF_PUBLICKEY))
+		mssp->mss_auth_step = MSA_PASSWORD;
+	    else if (opt_no_agent)
+		mssp->mss_auth_step = MSA_KEY_EMPTY;
+	    else
+		mssp->mss_auth_step = MSA_AGENT;
+	    break;
+
+	case MSA_AGENT:
+	    rc = mx_session_auth_agent(mssp);
+	    if (rc != MX_AUTH_FAILED)
+		return rc;
+
+	    mssp->mss_auth_step = MSA_KEY_EMPTY;
+	    break;
+
+	case MSA_KEY_EMPTY:
+	    passphrase = mrp ? mrp->mr_passphrase : NULL;
+	    if (passphrase && *passphrase == '\0') {
+		mx_log("R%u null passphrase", mrp->mr_id);
+		mssp->mss_auth_step = MSA_PASSWORD;
+		break;
+	    }
+
+	    /*
+	     * With no passphrase in hand, this must be the initial
+	     * attempt.  Try to decrypt with no (empty) passphrase.
+	     */
+	    if (passphrase == NULL && mx_db_get_passphrase() == NULL) {
+		rc = mx_session_auth_keyfile(mssp, NULL, "empty");
+		if (rc != MX_AUTH_FAILED)
+		    return rc;
+	    }
+
+	    mssp->mss_auth_step = MSA_KEY_NEW;
+	    break;
+
+	case MSA_KEY_NEW:
+	    passphrase = mrp ? mrp->mr_passphrase : NULL;
+	    if (passphrase && *passphrase == '\0') {
+		mx_log("R%u null passphrase", mrp->mr_id);
+		mssp->mss_auth_step = MSA_PASSWORD;
+		break;
+	    }
+
+	    if (passphrase) {
+		rc = mx_session_auth_keyfile(mssp, passphrase, "new");
+		if (rc == MX_AUTH_DONE)
+		    mx_db_save_passphrase(passphrase);
+		if (rc != MX_AUTH_FAILED)
+		    return rc;
+	    }
+
+	    mssp->mss_auth_step = MSA_KEY_DB;
+	    break;
+
+	case MSA_KEY_DB:
+	    passphrase = mx_db_get_passphrase();
+	    if (passphrase) {
+		rc = mx_session_auth_keyfile(mssp, passphrase, "existing");
+		if (rc != MX_AUTH_FAILED)
+		    return rc;
+	    }
+
+	    mssp->mss_auth_step = MSA_KEY_PROMPT;
+	    break;
+
+	case MSA_KEY_PROMPT:
+	    if (mx_session_prompt_passphrase(mssp)) {
+		/* Pick up with the user's answer */
+		mssp->mss_auth_step = MSA_KEY_NEW;
+		return MX_AUTH_PROMPT;
+	    }
+
+	    mssp->mss_auth_step = MSA_PASSWORD;
+	    break;
+
+	case MSA_PASSWORD:
+	    if (!(mssp->mss_auth_flags & MSAF_PASSWORD)) {
+		mssp->mss_auth_step = MSA_NONE;
+		break;
+	    }
+
+	    password = mrp ? mrp->mr_password : NULL;
+	    if (password == NULL || *password == '\0')
+		password = mx_password(mssp->mss_target, user);
+
+	    if (password && *password) {
+		rc = libssh2_userauth_password(session, user, password);
+		if (rc == LIBSSH2_ERROR_EAGAIN)
+		    return MX_AUTH_AGAIN;
+
+		if (rc == 0) {
+		    mx_log("%s ssh auth username %s, password succeeded",
+			   mx_sock_title(&mssp->mss_base), user);
+
+		    /* Save to in-memory cache as well as db */
+		    mx_password_save(mssp->mss_target, user, password);
+		    if (mrp)
+			mx_db_save_password(mrp, password);
+
+		    return MX_AUTH_DONE;
+		}
+
+		mssp->mss_pwfail += 1;
+		mssp->mss_auth_flags |= MSAF_PW_TRIED;
+		mx_log("%s authentication by password failed (%u)",
+		       mx_sock_title(&mssp->mss_base), mssp->mss_pwfail);
+		if (mssp->mss_pwfail > MAX_PWFAIL) {
+		    mssp->mss_auth_step = MSA_NONE;
+		    break;
+		}
+	    }
+
+	    mssp->mss_auth_step = MSA_PW_PROMPT;
+	    break;
+
+	case MSA_PW_PROMPT:
+	    if (mx_session_prompt_password(mssp)) {
+		/* Pick up with the user's answer */
+		mssp->mss_auth_step = MSA_PASSWORD;
+		return MX_AUTH_PROMPT;
+	    }
+
+	    mssp->mss_auth_step = MSA_NONE;
+	    break;
+
+	case MSA_NONE:
+	default:
+	    mx_log("%s no supported authentication methods found",
+		   mx_sock_title(&mssp->mss_base));
+	    return MX_AUTH_FAILED;
 	}
     }
+}
 
-    if (passphrase && *passphrase) {
-	if (libssh2_userauth_publickey_fromfile(mssp->mss_session, user,
-						keyfile1, keyfile2,
-						passphrase)) {
-	    mx_log("R%u Authentication by new public key failed", mrp->mr_id);
-	} else {
-	    mx_log("R%u Authentication by new public key succeeded",
-		   mrp->mr_id);
-	    mx_db_save_passphrase(passphrase);
-	    goto success;
-	}
+/*
+ * Put the addresses in the order we'll try them: alternate address
+ * families, starting with whichever getaddrinfo() liked best (RFC
+ * 8305 section 4).
+ */
+static int
+mx_session_order_addrs (mx_sock_session_t *mssp, struct addrinfo *res)
+{
+    struct addrinfo *aip, **addrs, **first, **other;
+    unsigned count = 0, nfirst = 0, nother = 0, i, j;
+    int family = res->ai_family;
+
+    for (aip = res; aip; aip = aip->ai_next)
+	count += 1;
+
+    addrs = calloc(count * 3, sizeof(*addrs));
+    if (addrs == NULL)
+	return FALSE;
+
+    first = addrs + count;
+    other = first + count;
+
+    for (aip = res; aip; aip = aip->ai_next) {
+	if (aip->ai_family == family)
+	    first[nfirst++] = aip;
+	else
+	    other[nother++] = aip;
     }
 
-    if (db_passphrase) {
-	if (libssh2_userauth_publickey_fromfile(mssp->mss_session, user,
-						keyfile1, keyfile2,
-						db_passphrase)) {
-	    mx_log("R%u Authentication by existing public key failed",
-		   mrp->mr_id);
-	} else {
-	    mx_log("R%u Authentication by existing public key succeeded",
-		   mrp->mr_id);
-	    goto success;
-	}
+    for (i = j = 0; i < nfirst || i < nother; i++) {
+	if (i < nfirst)
+	    addrs[j++] = first[i];
+	if (i < nother)
+	    addrs[j++] = other[i];
     }
 
-    if (exists(keyfile1) && exists(keyfile2)) {
-	char buf[BUFSIZ], *bp = buf, *ep = buf + sizeof(buf);
+    mssp->mss_addrs = addrs;
+    mssp->mss_addrcount = count;
+    mssp->mss_addrindex = 0;
+
+    return TRUE;
+}
 
-	if (passphrase)
-	    bp += snprintf_safe(bp, ep - bp, "Invalid passphrase\n");
+static void
+mx_session_resolve_done (mx_sock_session_t *mssp)
+{
+    mx_resolve_t *mrep = mssp->mss_resolve;
 
-	bp += snprintf_safe(bp, ep - bp,
-		 "Enter passphrase for keyfile %s:", keyfile1);
+    mssp->mss_resolve_time = mx_time_ms() - mssp->mss_setup_start;
 
-	mx_request_set_state(mrp, MSS_PASSPHRASE);
-	if (mx_mti(msp)->mti_get_passphrase
-	        && mx_mti(msp)->mti_get_passphrase(msp, mrp, buf)) {
-	    return TRUE;
-	}
+    if (mrep->mre_state != MRES_DONE) {
+	mx_log("%s invalid hostname: '%s': %s", mx_sock_title(&mssp->mss_base),
+	       mssp->mss_hostname, gai_strerror(mrep->mre_error));
+	mx_session_fail(mssp, "invalid hostname: %s", mssp->mss_hostname);
+	return;
     }
 
-    return FALSE;
+    if (mrep->mre_addrinfo->ai_canonname && mssp->mss_canonname == NULL)
+	mssp->mss_canonname = strdup(mrep->mre_addrinfo->ai_canonname);
 
- success:
-    mx_session_establish(mssp, mrp);
+    if (!mx_session_order_addrs(mssp, mrep->mre_addrinfo)) {
+	mx_session_fail(mssp, "out of memory");
+	return;
+    }
 
-    return FALSE;
+    mx_session_set_state(mssp, MSS_CONNECTING);
+    mx_session_connect_next(mssp);
 }
 
-static int
-mx_session_check_password (mx_sock_session_t *mssp, mx_request_t *mrp,
-			  const char *user)
+/*
+ * Find the addresses for our target.  The lookup is done by the
+ * resolver threads (or its cache), so we may have to wait for
+ * mx_session_resolved().
+ */
+static void
+mx_session_resolve (mx_sock_session_t *mssp)
 {
-    mx_sock_t *msp = mrp->mr_client;
-    const char *password = mrp->mr_password;
+    mx_log("%s session open to %s", mx_sock_title(&mssp->mss_base),
+	   mssp->mss_hostname);
 
-    if (password == NULL)
-	password = mx_password(mssp->mss_target, user);
+    mx_session_set_state(mssp, MSS_RESOLVING);
 
-    if (password && *password) {
-        if (libssh2_userauth_password(mssp->mss_session, user, password)) {
-	    mssp->mss_pwfail += 1;
-            mx_log("%s authentication by password failed (%u)",
-		   mx_sock_title(&mssp->mss_base), mssp->mss_pwfail);
-	    if (mssp->mss_pwfail > MAX_PWFAIL)
-		return FALSE;
-        } else {
-	    mx_log("%s ssh auth username %s, password succeeded",
-		   mx_sock_title(&mssp->mss_base), user);
-	    /* We're authenticated now */
-            mx_session_establish(mssp, mrp);
+    mssp->mss_resolve = mx_resolve(mssp->mss_hostname, mssp->mss_port);
+    if (mssp->mss_resolve == NULL) {
+	mx_session_fail(mssp, "could not resolve hostname: %s",
+			mssp->mss_hostname);
+	return;
+    }
 
-	    /* Save to in-memory cache as well as db */
-	    mx_password_save(mrp->mr_target, user, password);
-	    mx_db_save_password(mrp, password);
+    if (mssp->mss_resolve->mre_state != MRES_PENDING)
+	mx_session_resolve_done(mssp);
+}
 
-	    return FALSE;
-	}
+/*
+ * A lookup has finished; wake up the sessions waiting on it.
+ */
+void
+mx_session_resolved (mx_resolve_t *mrep)
+{
+    mx_sock_t *msp;
+    mx_sock_session_t *mssp;
+
+    TAILQ_FOREACH(msp, &mx_sock_list, ms_link) {
+	if (msp->ms_type != MST_SESSION || msp->ms_state != MSS_RESOLVING)
+	    continue;
+
+	mssp = mx_sock(msp, MST_SESSION);
+	if (mssp->mss_resolve == mrep)
+	    mx_session_resolve_done(mssp);
     }
+}
 
-    char buf[BUFSIZ], *bp = buf, *ep = buf + sizeof(buf);
+/*
+ * We're done with the addresses, one way or another.
+ */
+static void
+mx_session_addrs_done (mx_sock_session_t *mssp)
+{
+    mx_connect_cancel(mssp);
 
-    if (password && *password)
-	bp += snprintf_safe(bp, ep - bp, "Invalid password\n");
+    if (mssp->mss_addrs) {
+	free(mssp->mss_addrs);
+	mssp->mss_addrs = NULL;
+	mssp->mss_addrcount = mssp->mss_addrindex = 0;
+    }
 
-    bp += snprintf_safe(bp, ep - bp, "Enter password:");
+    if (mssp->mss_resolve) {
+	mx_resolve_release(mssp->mss_resolve);
+	mssp->mss_resolve = NULL;
+    }
+}
 
-    mx_request_set_state(mrp, MSS_PASSWORD);
+/*
+ * Start a connection attempt to the next address.  Attempts are
+ * staggered, so a slow (or black-holed) address doesn't hold up the
+ * rest.  If we've run out of addresses and attempts, we've failed.
+ */
+static void
+mx_session_connect_next (mx_sock_session_t *mssp)
+{
+    struct addrinfo *aip;
 
-    if (mx_mti(msp)->mti_get_password
-	    && mx_mti(msp)->mti_get_password(msp, mrp, buf))
-	return TRUE;
+    while (mssp->mss_addrindex < mssp->mss_addrcount) {
+	aip = mssp->mss_addrs[mssp->mss_addrindex++];
+	if (mx_connect_start(mssp, aip)) {
+	    mssp->mss_attempt_next = mx_time_ms() + MX_CONNECT_STAGGER;
+	    return;
+	}
+    }
 
-    return FALSE;
+    if (mssp->mss_attempts == 0) {
+	mx_log("%s could not open SSH session connection",
+	       mx_sock_title(&mssp->mss_base));
+	mx_session_addrs_done(mssp);
+	mx_session_fail(mssp, "could not open connection: %s",
+			mssp->mss_hostname);
+    }
 }
 
-int
-mx_session_check_auth (mx_sock_session_t *mssp, mx_request_t *mrp)
+/*
+ * A connection attempt failed; don't wait for the stagger timer.
+ */
+void
+mx_session_connect_failed (mx_sock_session_t *mssp)
 {
-    const char *user = mrp->mr_user ?: opt_user ?: getlogin();
-    const char *password = mrp->mr_password;
-    int auth_publickey = FALSE, auth_password = FALSE;
-    char *userauthlist;
+    if (mssp->mss_attempts)
+	mssp->mss_attempts -= 1;
+
+    if (mssp->mss_base.ms_state == MSS_CONNECTING)
+	mx_session_connect_next(mssp);
+}
+
+/*
+ * A connection attempt won the race.  We take over its socket and
+ * start the SSH handshake.
+ */
+void
+mx_session_connected (mx_sock_session_t *mssp, int sock, struct addrinfo *aip)
+{
+    if (mssp->mss_attempts)
+	mssp->mss_attempts -= 1;
 
-    /* check what authentication methods are available */
-    userauthlist = libssh2_userauth_list(mssp->mss_session,
-					 user, strlen(user));
-    mx_log("Authentication methods: %s", userauthlist ?: "(empty)");
+    /*
+     * aip belongs to the resolver's entry, which mx_session_addrs_done
+     * may free, so take our copy of the address first.
+     */
+    switch (aip->ai_family) {
+    case AF_INET:
+	if (aip->ai_addrlen <= sizeof(mssp->mss_base.ms_sin))
+	    memcpy(&mssp->mss_base.ms_sin, aip->ai_addr, aip->ai_addrlen);
+	break;
 
-    if (userauthlist) {
-	if (strstr(userauthlist, "password"))
-	    auth_password = TRUE;
-	if (strstr(userauthlist, "publickey"))
-	    auth_publickey = TRUE;
+    case AF_INET6:
+	if (aip->ai_addrlen <= sizeof(mssp->mss_base.ms_sin6))
+	    memcpy(&mssp->mss_base.ms_sin6, aip->ai_addr, aip->ai_addrlen);
+	break;
     }
 
-    mx_request_set_state(mrp, MSS_PASSWORD);
+    mx_session_addrs_done(mssp);
 
-    if (auth_publickey) {
-	if (!opt_no_agent && mx_session_check_agent(mssp, mrp, user))
-	    goto success;
+    mssp->mss_base.ms_sock = sock;
+    mssp->mss_connect_time = mx_time_ms() - mssp->mss_setup_start;
 
-	if (mx_session_check_keyfile(mssp, mrp, user))
-	    return TRUE;
+    mx_log("%s connected to %s (%s) in %lums",
+	   mx_sock_title(&mssp->mss_base), mssp->mss_hostname,
+	   mx_sock_name(&mssp->mss_base), mssp->mss_connect_time);
 
-	if (mrp->mr_state == MSS_ESTABLISHED)
-	    goto success;
+    /* Create a session instance */
+    mssp->mss_session = libssh2_session_init();
+    if (mssp->mss_session == NULL) {
+	mx_log("could not initialize SSH session");
+	mx_session_fail(mssp, "could not initialize SSH session");
+	return;
     }
 
-    if (auth_password && (mrp->mr_state != MSS_ESTABLISHED)) {
-	if (password == NULL || *password == '\0')
-	    password = mx_password(mssp->mss_target, user);
+    libssh2_session_set_blocking(mssp->mss_session, 0);
+    mx_session_set_state(mssp, MSS_HANDSHAKE);
+    mx_session_continue(mssp);
+}
 
-	mx_request_set_state(mrp, MSS_PASSWORD);
-	if (mx_session_check_password(mssp, mrp, user))
-	    return TRUE;
+/*
+ * Push the session as far along as it will go without blocking.
+ */
+static void
+mx_session_continue (mx_sock_session_t *mssp)
+{
+    int rc;
 
-	if (mrp->mr_state == MSS_ESTABLISHED)
-	    goto success;
-    }
+    switch (mssp->mss_base.ms_state) {
+    case MSS_HANDSHAKE:
+	/*
+	 * This will trade welcome banners, exchange keys, and
+	 * setup crypto, compression, and MAC layers
+	 */
+	rc = libssh2_session_handshake(mssp->mss_session,
+				       mssp->mss_base.ms_sock);
+	if (rc == LIBSSH2_ERROR_EAGAIN)
+	    return;
+
+	if (rc) {
+	    mx_log("error when starting up SSH session: %d", rc);
+	    mx_session_fail(mssp, "could not start SSH session: %s",
+			    mssp->mss_hostname);
+	    return;
+	}
+
+	/*
+	 * If there's no one to ask about the hostkey, we wait
+	 * until a request comes along and adopts us.
+	 */
+	if (mssp->mss_request == NULL) {
+	    mx_session_set_state(mssp, MSS_HOSTKEY);
+	    return;
+	}
 
-    mx_log("%s no supported authentication methods found",
-	   mx_sock_title(&mssp->mss_base));
+	if (mx_session_check_hostkey(mssp, mssp->mss_request)) {
+	    mx_request_set_state(mssp->mss_request, MSS_HOSTKEY);
+	    mx_session_set_state(mssp, MSS_HOSTKEY);
+	    mx_log("%s R%u waiting for hostkey check",
+		   mx_sock_title(&mssp->mss_base), mssp->mss_request->mr_id);
+	    return;
+	}
 
-    mx_request_set_state(mrp, MSS_FAILED);
-    return TRUE;
+	mssp->mss_auth_step = MSA_LIST;
+	mx_session_set_state(mssp, MSS_AUTH);
+	/* fallthru */
 
- success:
-    mx_log("R%u auth'd session is established; S%u",
-	   mrp->mr_id, mssp->mss_base.ms_id);
-    mx_session_establish(mssp, mrp);
+    case MSS_AUTH:
+	switch (mx_session_auth(mssp)) {
+	case MX_AUTH_DONE:
+	    mx_session_established(mssp);
+	    break;
 
-    return FALSE;
+	case MX_AUTH_FAILED:
+	    mx_session_fail(mssp, "authentication failed: %s",
+			    mssp->mss_target);
+	    break;
+
+	case MX_AUTH_PROMPT:
+	    mx_log("%s R%u waiting for auth",
+		   mx_sock_title(&mssp->mss_base), mssp->mss_request->mr_id);
+	    break;
+	}
+	break;
+    }
 }
 
 int
@@ -476,133 +1034,102 @@ mx_session_approve_hostkey (mx_sock_session_t *mssp, mx_request_t *mrp)
     return FALSE;
 }
 
-mx_sock_session_t *
-mx_session_open (mx_request_t *mrp)
+/*
+ * The user has answered a question (hostkey, passphrase, password),
+ * so we can pick up where we left off.
+ */
+void
+mx_session_resume (mx_sock_session_t *mssp, mx_request_t *mrp)
 {
-    int rc, sock = -1;
-    mx_sock_session_t *mssp;
-    LIBSSH2_SESSION *session;
-    struct addrinfo hints, *res, *aip;
-    char buf[BUFSIZ];
-    
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = PF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_CANONNAME;
+    if (mssp->mss_request != mrp) {
+	mx_log("%s R%u is not setting up this session (ignored)",
+	       mx_sock_title(&mssp->mss_base), mrp->mr_id);
+	return;
+    }
 
-    snprintf(buf, sizeof(buf), "%d", mrp->mr_port);
+    switch (mssp->mss_base.ms_state) {
+    case MSS_HOSTKEY:
+	mssp->mss_auth_step = MSA_LIST;
+	/* fallthru */
 
-    mx_log("R%u session open to %s", mrp->mr_id, mrp->mr_hostname);
+    case MSS_PASSPHRASE:
+    case MSS_PASSWORD:
+	mx_request_set_state(mrp, MSS_AUTH);
+	mx_session_set_state(mssp, MSS_AUTH);
+	mx_session_continue(mssp);
+	break;
 
-    rc = getaddrinfo(mrp->mr_hostname, buf, &hints, &res);
-    if (rc) {
-	mx_log("R%u invalid hostname: '%s': %s", mrp->mr_id, mrp->mr_hostname,
-	       gai_strerror(rc));
-	mx_request_error(mrp, "invalid hostname: %s", mrp->mr_hostname);
-	return NULL;
+    default:
+	mx_log("%s R%u resume in wrong state (%u)",
+	       mx_sock_title(&mssp->mss_base), mrp->mr_id,
+	       mssp->mss_base.ms_state);
     }
+}
 
-    for (aip = res; aip; aip = aip->ai_next) {
-	char hn[NI_MAXHOST], sn[NI_MAXSERV];
-	if (getnameinfo(aip->ai_addr, aip->ai_addrlen, hn, sizeof(hn),
-		sn, sizeof(sn), NI_NUMERICHOST | NI_NUMERICSERV) == 0) {
-	    mx_log("R%u connecting to '%s': %s%s%s%s", mrp->mr_id, hn, sn,
-		   aip->ai_canonname ? " (" :"",
-		   aip->ai_canonname ?: "", aip->ai_canonname ? ")" : "");
-	} else {
-	    strncpy(hn, mrp->mr_hostname, sizeof(hn));
-	    strncpy(sn, buf, sizeof(sn));
-	}
-
-	/* Connect to SSH server */
-	sock = socket(aip->ai_family, aip->ai_socktype, aip->ai_protocol);
-	if (sock < 0)
-	    continue;
-
-	if (connect(sock, aip->ai_addr, aip->ai_addrlen)) {
-	    mx_log("R%u failed to connect to target '%s' '%s'",
-		   mrp->mr_id, hn, sn);
-	} else
-	    break;
+/*
+ * A request is joining a session that's still being set up.  If
+ * the session is stuck waiting for a user whose request has gone
+ * away, this request takes over and asks its own user.
+ */
+static void
+mx_session_adopt (mx_sock_session_t *mssp, mx_request_t *mrp)
+{
+    mrp->mr_session = mssp;
 
-	close(sock);
-    }
+    if (mssp->mss_request)
+	return;
+
+    switch (mssp->mss_base.ms_state) {
+    case MSS_HOSTKEY:
+	mx_log("%s adopted by R%u", mx_sock_title(&mssp->mss_base),
+	       mrp->mr_id);
+	mssp->mss_request = mrp;
+	if (mx_session_check_hostkey(mssp, mrp)) {
+	    mx_request_set_state(mrp, MSS_HOSTKEY);
+	    return;
+	}
 
-    if (aip == NULL) {
-        mx_log("R%u could not open SSH session connection", mrp->mr_id);
-	mx_request_error(mrp, "could not open connection: %s",
-		mrp->mr_hostname);
-	freeaddrinfo(res);
-        return NULL;
-    }
+	mssp->mss_auth_step = MSA_LIST;
+	mx_session_set_state(mssp, MSS_AUTH);
+	mx_session_continue(mssp);
+	break;
 
-    mx_log("R%u connected to %s", mrp->mr_id, mrp->mr_hostname);
+    case MSS_PASSPHRASE:
+    case MSS_PASSWORD:
+	mx_log("%s adopted by R%u", mx_sock_title(&mssp->mss_base),
+	       mrp->mr_id);
+	mssp->mss_request = mrp;
+	mssp->mss_auth_step = (mssp->mss_base.ms_state == MSS_PASSPHRASE)
+	    ? MSA_KEY_PROMPT : MSA_PW_PROMPT;
+	mx_session_set_state(mssp, MSS_AUTH);
+	mx_session_continue(mssp);
+	break;
 
-    /* Create a session instance */
-    session = libssh2_session_init();
-    if (!session) {
-        mx_log("could not initialize SSH session");
-	freeaddrinfo(res);
-        return NULL;
+    default:
+	/* Still making progress on its own; just wait */
+	break;
     }
+}
 
-    /* ... start it up. This will trade welcome banners, exchange keys,
-     * and setup crypto, compression, and MAC layers
-     */
-    rc = libssh2_session_handshake(session, sock);
-    if (rc) {
-        mx_log("error when starting up SSH session: %d", rc);
-	freeaddrinfo(res);
-        return NULL;
-    }
+mx_sock_session_t *
+mx_session_open (mx_request_t *mrp)
+{
+    mx_sock_session_t *mssp;
 
     /*
      * We allocate the mx_sock_session_t now, knowing that we may
      * still have problems.  If we don't make it thru, we use the
      * ms_state to record our current state.
      */
-    mssp = mx_session_create(session, sock, mrp->mr_fulltarget,
-	    aip->ai_canonname);
+    mssp = mx_session_create(mrp);
     if (mssp == NULL) {
 	mx_log("mx session failed");
-	freeaddrinfo(res);
 	return NULL;
     }
 
-    switch (aip->ai_family) {
-    case AF_INET:
-	if (aip->ai_addrlen <= sizeof(mssp->mss_base.ms_sin))
-	    memcpy(&mssp->mss_base.ms_sin, aip->ai_addr, aip->ai_addrlen);
-	break;
-
-    case AF_INET6:
-	if (aip->ai_addrlen <= sizeof(mssp->mss_base.ms_sin6))
-	    memcpy(&mssp->mss_base.ms_sin6, aip->ai_addr, aip->ai_addrlen);
-	break;
-
-    default:
-	break;
-    }
-
-    freeaddrinfo(res);
-
     mrp->mr_session = mssp;
 
-    if (mx_session_check_hostkey(mssp, mrp)) {
-	mx_request_set_state(mrp, MSS_HOSTKEY);
-	mx_log("%s R%u waiting for hostkey check; client S%u",
-	       mx_sock_title(&mssp->mss_base), mrp->mr_id,
-               mrp->mr_client->ms_id);
-	return mssp;
-    }
-
-    if (mx_session_check_auth(mssp, mrp)) {
-	mx_log("%s R%u waiting for auth; client S%u",
-	       mx_sock_title(&mssp->mss_base), mrp->mr_id,
-               mrp->mr_client->ms_id);
-    } else {
-	mx_session_establish(mssp, mrp);
-    }
+    mx_session_resolve(mssp);
 
     return mssp;
 }
@@ -618,6 +1145,8 @@ mx_session_find (const char *target)
 	    continue;
 
 	mssp = mx_sock(msp, MST_SESSION);
+	if (msp->ms_state == MSS_FAILED)
+	    continue;
 	if (streq(target, mssp->mss_target))
 	    return mssp;
 	if (mssp->mss_canonname && streq(target, mssp->mss_canonname))
@@ -627,6 +1156,11 @@ mx_session_find (const char *target)
     return NULL;
 }
 
+/*
+ * Find or create the session for a request.  The session may still
+ * be in the process of being established, in which case the request
+ * is recorded as waiting on it.
+ */
 mx_sock_session_t *
 mx_session (mx_request_t *mrp)
 {
@@ -635,8 +1169,13 @@ mx_session (mx_request_t *mrp)
     if (session == NULL && (mrp->mr_flags & MRF_NOCREATE))
         return NULL;
 
-    if (session == NULL || session->mss_base.ms_state != MSS_ESTABLISHED)
-	session = mx_session_open(mrp);
+    if (session == NULL)
+	return mx_session_open(mrp);
+
+    if (session->mss_base.ms_state == MSS_ESTABLISHED)
+	mrp->mr_session = session;
+    else
+	mx_session_adopt(session, mrp);
 
     return session;
 }
@@ -650,6 +1189,10 @@ mx_session_close (mx_sock_t *msp)
 
     mx_request_release_session(mssp);
 
+    mx_timer_cancel(&mssp->mss_keepalive_timer);
+    mx_timer_cancel(&mssp->mss_idle_timer);
+    mx_timer_cancel(&mssp->mss_pool_timer);
+
     for (;;) {
 	mcp = TAILQ_FIRST(&mssp->mss_channels);
 	if (mcp == NULL)
@@ -658,12 +1201,92 @@ mx_session_close (mx_sock_t *msp)
 	mx_channel_close(mcp);
     }
 
-    libssh2_session_disconnect(session, "Client disconnecting");
-    libssh2_session_free(session);
-    mssp->mss_session = NULL;
+    for (;;) {
+	mcp = TAILQ_FIRST(&mssp->mss_released);
+	if (mcp == NULL)
+	    break;
+	TAILQ_REMOVE(&mssp->mss_released, mcp, mc_link);
+	mx_channel_close(mcp);
+    }
+
+    mx_session_agent_done(mssp);
+
+    if (session) {
+	libssh2_session_disconnect(session, "Client disconnecting");
+	libssh2_session_free(session);
+	mssp->mss_session = NULL;
+    }
+
+    if ((int) msp->ms_sock >= 0) {
+	close(msp->ms_sock);
+	msp->ms_sock = -1;
+    }
+
+    mx_session_addrs_done(mssp);
 
     free(mssp->mss_target);
     free(mssp->mss_canonname);
+    free(mssp->mss_hostname);
+    free(mssp->mss_user);
+}
+
+/*
+ * Prep a session that's still being set up.  We wait for whatever
+ * the current step needs, but never past the step's deadline.
+ */
+static int
+mx_session_prep_setup (mx_sock_session_t *mssp, struct pollfd *pollp,
+		       int *timeout)
+{
+    int dirs, rc = TRUE;
+    long left;
+
+    switch (mssp->mss_base.ms_state) {
+    case MSS_CONNECTING:
+	/* Wake up in time to start the next attempt */
+	if (mssp->mss_addrindex < mssp->mss_addrcount) {
+	    left = mssp->mss_attempt_next - mx_time_ms();
+	    if (left < 0)
+		left = 0;
+	    if (*timeout > left)
+		*timeout = left;
+	}
+	/* fallthru */
+
+    case MSS_RESOLVING:
+	/* The resolver and our connect attempts do the polling */
+	rc = FALSE;
+	break;
+
+    case MSS_HANDSHAKE:
+    case MSS_AUTH:
+	dirs = libssh2_session_block_directions(mssp->mss_session);
+	pollp->fd = mssp->mss_base.ms_sock;
+	pollp->events = 0;
+	if (dirs & LIBSSH2_SESSION_BLOCK_INBOUND)
+	    pollp->events |= POLLIN;
+	if (dirs & LIBSSH2_SESSION_BLOCK_OUTBOUND)
+	    pollp->events |= POLLOUT;
+	if (pollp->events == 0)
+	    pollp->events = POLLIN;
+	break;
+
+    default:
+	/* Waiting on the user (or failed); nothing to poll */
+	return FALSE;
+    }
+
+    /* Out of time; let the poller deal with it */
+    left = (mssp->mss_deadline - time(NULL)) * 1000;
+    if (left <= 0) {
+	*timeout = 0;
+	return FALSE;
+    }
+
+    if (*timeout > left)
+	*timeout = left;
+
+    return rc;
 }
 
 static int
@@ -672,15 +1295,56 @@ mx_session_prep (MX_TYPE_PREP_ARGS)
     mx_sock_session_t *mssp = mx_sock(msp, MST_SESSION);
     mx_channel_t *mcp;
     unsigned long read_avail = 0;
-    int buf_input = FALSE, buf_output = FALSE;
+    int buf_input = FALSE, buf_output = FALSE, opening = FALSE;
+    int sending = FALSE, readers = FALSE, blocked = FALSE;
+
+    if (msp->ms_state != MSS_ESTABLISHED)
+	return mx_session_prep_setup(mssp, pollp, timeout);
+
+    /* Start queued requests on channels freed since the last pass */
+    mx_request_schedule(mssp);
+    mx_channel_pool_check(mssp);
+
+    /* The idle timer runs while nothing is using the session */
+    if (opt_idle_session_timeout > 0) {
+	if (mx_channel_busy_count(mssp) != 0
+		|| mssp->mss_queued[MRQ_INTERACTIVE]
+		|| mssp->mss_queued[MRQ_BULK])
+	    mx_timer_cancel(&mssp->mss_idle_timer);
+	else if (!mx_timer_pending(&mssp->mss_idle_timer))
+	    mx_timer_set(&mssp->mss_idle_timer,
+			 opt_idle_session_timeout * 1000UL,
+			 mx_session_idle, mssp);
+    }
 
     DBG_POLL("%s prep: readable %s",
 	     mx_sock_title(msp),
              mx_sock_isreadable(msp->ms_sock) ? "yes" : "no");
 
     TAILQ_FOREACH(mcp, &mssp->mss_channels, mc_link) {
+	/*
+	 * Channels that are opening are waiting on the session's
+	 * socket; a partial <hello> in the buffer isn't work to do.
+	 */
+	if (mx_channel_is_opening(mcp)) {
+	    opening = TRUE;
+	    continue;
+	}
+
+	/* Unsent RPC bytes go out when the socket (or window) opens */
+	if (mcp->mc_sendq)
+	    sending = TRUE;
+
+	/* Until its client drains, a blocked channel's input can wait */
+	if (mx_channel_is_blocked(mcp)) {
+	    blocked = TRUE;
+	    continue;
+	}
+
+	readers = TRUE;
+
 	if (!buf_input) {
-	    if (mcp->mc_rbufp->mb_len) {
+	    if (mx_channel_has_buffered(mcp)) {
 		read_avail = mcp->mc_rbufp->mb_len;
 		DBG_POLL("C%u buffer len %lu", mcp->mc_id, read_avail);
 		buf_input = TRUE;
@@ -717,20 +1381,24 @@ mx_session_prep (MX_TYPE_PREP_ARGS)
     pollp->fd = msp->ms_sock;
     pollp->events = (buf_input ? 0 : POLLIN) | (buf_output ? POLLOUT : 0);
 
-    if (opt_keepalive) {
-	int next = 0;
-	int rc = libssh2_keepalive_send(mssp->mss_session, &next);
-	if (rc == 0) {
-	    mssp->mss_keepalive_next = next;
-	    next *= 1000;
-	    if (0 && *timeout > next)
-		*timeout = next;
-	} else {
-	    mx_log("%s keepalive failed: %d", mx_sock_title(msp), rc);
-	    mssp->mss_base.ms_state = MSS_FAILED;
-	}
+    /*
+     * Only a channel that isn't blocked reads, and reading is what
+     * pulls data off the socket.  If every channel is blocked, no
+     * one would read it and the socket would poll readable forever,
+     * so we stop asking until a client drains; its websocket clears
+     * MSWF_BLOCKED and the next pass here asks again.
+     */
+    if (blocked && !readers && !opening
+	    && TAILQ_EMPTY(&mssp->mss_released)) {
+	DBG_POLL("%s all channels blocked", mx_sock_title(msp));
+	pollp->events &= ~POLLIN;
     }
 
+    if ((opening || sending)
+	    && (libssh2_session_block_directions(mssp->mss_session)
+		& LIBSSH2_SESSION_BLOCK_OUTBOUND))
+	pollp->events |= POLLOUT;
+
     return TRUE;
 }
 
@@ -762,14 +1430,51 @@ mx_sock_bytes_outstanding (mx_sock_t *msp UNUSED)
 #endif /* FIONREAD */
 }
 
+/*
+ * Move a session that's being set up along.  The poll backend calls
+ * us every pass, so we can't assume the socket is ready.
+ */
+static int
+mx_session_poller_setup (mx_sock_session_t *mssp, struct pollfd *pollp)
+{
+    mx_sock_t *msp = &mssp->mss_base;
+
+    if (mssp->mss_deadline && time(NULL) >= mssp->mss_deadline) {
+	mx_session_fail(mssp, "timed out %s: %s",
+			(msp->ms_state == MSS_RESOLVING) ? "resolving"
+			: (msp->ms_state == MSS_CONNECTING) ? "connecting"
+			: "setting up session", mssp->mss_target);
+	return FALSE;
+    }
+
+    switch (msp->ms_state) {
+    case MSS_CONNECTING:
+	if (mssp->mss_addrindex < mssp->mss_addrcount
+		&& mx_time_ms() >= mssp->mss_attempt_next)
+	    mx_session_connect_next(mssp);
+	break;
+
+    case MSS_HANDSHAKE:
+    case MSS_AUTH:
+	if (pollp && pollp->revents)
+	    mx_session_continue(mssp);
+	break;
+    }
+
+    return FALSE;
+}
+
 static int
 mx_session_poller (MX_TYPE_POLLER_ARGS)
 {
     mx_sock_session_t *mssp = mx_sock(msp, MST_SESSION);
-    mx_channel_t *mcp;
+    mx_channel_t *mcp, *next;
     mx_channel_t *dead = NULL;
     int rc;
 
+    if (msp->ms_state != MSS_ESTABLISHED)
+	return mx_session_poller_setup(mssp, pollp);
+
     DBG_POLL("%s processing (%p/0x%x) readable %s, channels %d, release %d, "
              "outstanding: %d",
 	     mx_sock_title(msp), pollp, pollp ? pollp->revents : 0,
@@ -789,7 +1494,19 @@ mx_session_poller (MX_TYPE_POLLER_ARGS)
 	return TRUE;
     }
 
-    TAILQ_FOREACH(mcp, &mssp->mss_channels, mc_link) {
+    TAILQ_FOREACH_SAFE(mcp, &mssp->mss_channels, mc_link, next) {
+	/* Channels that are opening resume where they left off */
+	if (mx_channel_is_opening(mcp)) {
+	    mx_channel_netconf_continue(mcp);
+	    continue;
+	}
+
+	/* Finish any RPC the channel couldn't take in one go */
+	if (mcp->mc_sendq && mx_channel_send_flush(mcp) < 0) {
+	    mx_request_channel_failed(mcp, "could not send rpc");
+	    mcp->mc_state = MSS_FAILED;
+	}
+
 	for (;;) {
             rc = mx_channel_handle_input(mcp);
             DBG_POLL("C%u: handle input returns %d", mcp->mc_id, rc);
@@ -797,6 +1514,13 @@ mx_session_poller (MX_TYPE_POLLER_ARGS)
 		break;
 	}
 
+	/* A channel that's lost its framing can't be used again */
+	if (mcp->mc_state == MSS_FAILED) {
+	    TAILQ_REMOVE(&mssp->mss_channels, mcp, mc_link);
+	    mx_channel_close(mcp);
+	    continue;
+	}
+
 	if (libssh2_channel_eof(mcp->mc_channel)) {
 	    mx_log("C%u: disconnect, eof", mcp->mc_id);
 	    return TRUE;
@@ -826,6 +1550,8 @@ mx_session_poller (MX_TYPE_POLLER_ARGS)
         if (rc < 0)
             mx_log("C%u: handle input returns %d for released channel",
                    mcp->mc_id, rc);
+	if (mcp->mc_state == MSS_FAILED)
+	    dead = mcp;
     }
 
     if (dead) {
@@ -10,8 +10,7 @@
  */
 
 mx_sock_session_t *
-mx_session_create (LIBSSH2_SESSION *session, int sock, const char *target,
-		   const char *canonname);
+mx_session_create (mx_request_t *mrp);
 
 void
 mx_session_release_client (mx_sock_t *client);
@@ -19,8 +18,20 @@ mx_session_release_client (mx_sock_t *client);
 int
 mx_session_check_hostkey (mx_sock_session_t *mssp, mx_request_t *mrp);
 
-int
-mx_session_check_auth (mx_sock_session_t *mssp, mx_request_t *mrp);
+void
+mx_session_resume (mx_sock_session_t *mssp, mx_request_t *mrp);
+
+void
+mx_session_resolved (mx_resolve_t *mrep);
+
+void
+mx_session_connect_failed (mx_sock_session_t *mssp);
+
+void
+mx_session_connected (mx_sock_session_t *mssp, int sock, struct addrinfo *aip);
+
+void
+mx_session_fail (mx_sock_session_t *mssp, const char *fmt, ...);
 
 mx_sock_session_t *
 mx_session_open (mx_request_t *mrp);
@@ -0,0 +1,176 @@
+/*
+ * $Id$
+ *
+ * Copyright (c) 2013, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * Timers, kept on a hashed timing wheel.  Each slot covers
+ * MX_TIMER_TICK milliseconds, and a timer sits in the slot for its
+ * expiry time (modulo the size of the wheel), so setting and
+ * cancelling are cheap.  A timer more than a turn away just waits
+ * for a later pass over its slot.
+ *
+ * main_loop asks mx_timer_next how long it can sleep, and calls
+ * mx_timer_run when it wakes to fire whatever has expired.  Each
+ * thread has its own wheel, like it has its own sockets.
+ */
+
+#include "local.h"
+#include "timer.h"
+
+#define MX_TIMER_TICK	100	/* Milliseconds per slot */
+#define MX_TIMER_SLOTS	512	/* Slots on the wheel (one turn is ~51s) */
+
+static MX_THREAD_LOCAL mx_timer_list_t mx_timer_wheel[MX_TIMER_SLOTS];
+static MX_THREAD_LOCAL unsigned long long mx_timer_tick; /* Last tick run */
+static MX_THREAD_LOCAL unsigned mx_timer_count; /* Timers on the wheel */
+static MX_THREAD_LOCAL unsigned long mx_timer_fired; /* Timers fired */
+static MX_THREAD_LOCAL int mx_timer_ready; /* Wheel is initialized */
+
+static void
+mx_timer_setup (void)
+{
+    int i;
+
+    for (i = 0; i < MX_TIMER_SLOTS; i++)
+	TAILQ_INIT(&mx_timer_wheel[i]);
+
+    mx_timer_tick = mx_time_ms() / MX_TIMER_TICK;
+    mx_timer_ready = TRUE;
+}
+
+static inline mx_timer_list_t *
+mx_timer_slot (unsigned long long when)
+{
+    return &mx_timer_wheel[(when / MX_TIMER_TICK) % MX_TIMER_SLOTS];
+}
+
+/*
+ * Arrange for func(mtp, arg) to be called in msecs milliseconds.
+ * If the timer is already pending, it's moved.  A zero-length timer
+ * fires on the next pass thru main_loop.
+ */
+void
+mx_timer_set (mx_timer_t *mtp, unsigned long msecs,
+	      mx_timer_func_t func, void *arg)
+{
+    if (!mx_timer_ready)
+	mx_timer_setup();
+
+    mx_timer_cancel(mtp);
+
+    mtp->mt_expires = mx_time_ms() + (msecs ?: 1);
+    mtp->mt_func = func;
+    mtp->mt_arg = arg;
+    mtp->mt_flags |= MTF_PENDING;
+
+    TAILQ_INSERT_TAIL(mx_timer_slot(mtp->mt_expires), mtp, mt_link);
+    mx_timer_count += 1;
+}
+
+void
+mx_timer_cancel (mx_timer_t *mtp)
+{
+    if (!(mtp->mt_flags & MTF_PENDING))
+	return;
+
+    TAILQ_REMOVE(mx_timer_slot(mtp->mt_expires), mtp, mt_link);
+    mtp->mt_flags &= ~MTF_PENDING;
+    mx_timer_count -= 1;
+}
+
+/*
+ * Shorten the poll timeout to wake for the next timer.  We only look
+ * as far ahead as the timeout we've been given.
+ */
+void
+mx_timer_next (int *timeout)
+{
+    unsigned long long now, tick, best;
+    unsigned i, slots;
+    mx_timer_t *mtp;
+
+    if (!mx_timer_ready || mx_timer_count == 0)
+	return;
+
+    now = mx_time_ms();
+    tick = now / MX_TIMER_TICK;
+
+    slots = MX_TIMER_SLOTS;
+    if (*timeout >= 0 && *timeout / MX_TIMER_TICK + 1 < MX_TIMER_SLOTS)
+	slots = *timeout / MX_TIMER_TICK + 1;
+
+    for (i = 0; i < slots; i++) {
+	best = 0;
+
+	TAILQ_FOREACH(mtp, &mx_timer_wheel[(tick + i) % MX_TIMER_SLOTS],
+		      mt_link) {
+	    if (mtp->mt_expires / MX_TIMER_TICK > tick + i)
+		continue;	/* Not this turn of the wheel */
+	    if (best == 0 || mtp->mt_expires < best)
+		best = mtp->mt_expires;
+	}
+
+	if (best) {
+	    best = (best > now) ? best - now : 0;
+	    if (*timeout < 0 || (unsigned long long) *timeout > best)
+		*timeout = best;
+	    return;
+	}
+    }
+}
+
+/*
+ * Fire the timers that have expired.  A timer function can set or
+ * cancel any timer, including its own, so we start over on the slot
+ * after each call.
+ */
+void
+mx_timer_run (void)
+{
+    unsigned long long now, tick, last;
+    mx_timer_list_t *slot;
+    mx_timer_t *mtp;
+
+    if (!mx_timer_ready)
+	return;
+
+    now = mx_time_ms();
+    last = now / MX_TIMER_TICK;
+    tick = mx_timer_tick;
+
+    if (mx_timer_count == 0)
+	tick = last;
+    else if (last - tick >= MX_TIMER_SLOTS)
+	tick = last - MX_TIMER_SLOTS + 1; /* Each slot once is enough */
+
+    for ( ; tick <= last && mx_timer_count; tick++) {
+	slot = &mx_timer_wheel[tick % MX_TIMER_SLOTS];
+
+	for (;;) {
+	    TAILQ_FOREACH(mtp, slot, mt_link) {
+		if (mtp->mt_expires <= now)
+		    break;
+	    }
+	    if (mtp == NULL)
+		break;
+
+	    mx_timer_cancel(mtp);
+	    mx_timer_fired += 1;
+	    mtp->mt_func(mtp, mtp->mt_arg);
+	}
+    }
+
+    mx_timer_tick = last;
+}
+
+void
+mx_timer_print (int indent, const char *prefix)
+{
+    mx_log("%*s%stimers: %u pending, %lu fired", indent, "", prefix,
+	   mx_timer_count, mx_timer_fired);
+}
@@ -0,0 +1,32 @@
+/*
+ * $Id$
+ *
+ * Copyright (c) 2013, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ */
+
+void
+mx_timer_set (mx_timer_t *mtp, unsigned long msecs,
+	      mx_timer_func_t func, void *arg);
+
+void
+mx_timer_cancel (mx_timer_t *mtp);
+
+static inline int
+mx_timer_pending (mx_timer_t *mtp)
+{
+    return (mtp->mt_flags & MTF_PENDING) ? TRUE : FALSE;
+}
+
+void
+mx_timer_next (int *timeout);
+
+void
+mx_timer_run (void);
+
+void
+mx_timer_print (int indent, const char *prefix);
@@ -26,3 +26,37 @@ exists (const char *filename)
 
     return TRUE;
 }
+
+static const char mx_base64_chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/*
+ * Encode len bytes of data into buf, which must have room for
+ * ((len + 2) / 3) * 4 bytes.  Returns the encoded length.
+ */
+unsigned long
+mx_base64_encode (char *buf, const unsigned char *data, unsigned long len)
+{
+    char *cp = buf;
+    unsigned long value;
+
+    for ( ; len >= 3; data += 3, len -= 3) {
+	value = (data[0] << 16) | (data[1] << 8) | data[2];
+	*cp++ = mx_base64_chars[(value >> 18) & 0x3f];
+	*cp++ = mx_base64_chars[(value >> 12) & 0x3f];
+	*cp++ = mx_base64_chars[(value >> 6) & 0x3f];
+	*cp++ = mx_base64_chars[value & 0x3f];
+    }
+
+    if (len) {
+	value = data[0] << 16;
+	if (len > 1)
+	    value |= data[1] << 8;
+	*cp++ = mx_base64_chars[(value >> 18) & 0x3f];
+	*cp++ = mx_base64_chars[(value >> 12) & 0x3f];
+	*cp++ = (len > 1) ? mx_base64_chars[(value >> 6) & 0x3f] : '=';
+	*cp++ = '=';
+    }
+
+    return cp - buf;
+}
@@ -11,3 +11,6 @@
 
 int
 exists (const char *filename);
+
+unsigned long
+mx_base64_encode (char *buf, const unsigned char *data, unsigned long len);
@@ -36,6 +36,32 @@
  * For example:
  *
  * #01.00000140.rpc     .00000001.host="router" user="test"\n
+ *
+ * Version "02" is a binary header, for clients that aren't javascript
+ * and would rather not format and parse ascii.  After the leader and
+ * version come an operation code (MX_OPC_*), then the total length,
+ * muxer ID, and request ID as 32-bit numbers, and the flags (MX_HF_*)
+ * and the length of the attributes as 16-bit ones, all in network
+ * byte order.  The attributes are as above, but end with a NUL rather
+ * than a newline, and the payload follows them.  With the request ID
+ * in the header, most messages have no attributes, and need no
+ * parsing at all.
+ *
+ * A websocket replies in the version its client last spoke, so a
+ * client opts into version 2 by sending it.
+ *
+ * A client that puts compress="deflate" on its authinit gets its
+ * replies deflated and base64 encoded (see deflate.c).  Such replies
+ * carry encoding="deflate" (or MX_HF_DEFLATE in version 2).
+ *
+ * A browser can also connect to us directly (with "--port"), in which
+ * case we speak RFC 6455 ourselves (see rfc6455.c).  Frames are only
+ * transport: each write goes out as a binary frame of its own, so a
+ * reply spans a frame per chunk, and the payloads of the frames
+ * coming in (continuations included) are strung together as they're
+ * read.  Either way, messages are found by the length in our header,
+ * never by frame, and the rest of this file sees the same stream of
+ * messages as on the unix socket.
  */
 
 #include "local.h"
@@ -43,6 +69,10 @@
 #include "request.h"
 #include "session.h"
 #include "channel.h"
+#include "worker.h"
+#include "deflate.h"
+#include "cache.h"
+#include "rfc6455.h"
 
 typedef struct mx_header_s {
     char mh_pound;		/* Leader: pound sign */
@@ -57,8 +87,27 @@ typedef struct mx_header_s {
     char mh_trailer[];
 } mx_header_t;
 
+typedef struct mx_header2_s {
+    char mh2_pound;		/* Leader: pound sign */
+    char mh2_version[2];	/* MX_HEADER_VERSION (2) */
+    unsigned char mh2_op;	/* Operation code (MX_OPC_*) */
+    unsigned char mh2_len[4];	/* Total data length (including header) */
+    unsigned char mh2_muxid[4];	/* Muxer ID */
+    unsigned char mh2_reqid[4];	/* Request ID (or zero) */
+    unsigned char mh2_flags[2];	/* Flags (MX_HF_*) */
+    unsigned char mh2_alen[2];	/* Length of attributes (including NUL) */
+} mx_header2_t;
+
 #define MX_HEADER_VERSION_0 '0'
 #define MX_HEADER_VERSION_1 '1'
+#define MX_HEADER_VERSION_2 '2'
+
+#define MX_HEADER_LEN	(sizeof(mx_header_t) + 1) /* Header plus newline */
+#define MX_HEADER2_LEN	sizeof(mx_header2_t)
+#define MX_ATTR_DEFLATE	"encoding=\"deflate\"" /* MX_HF_DEFLATE in version 1 */
+#define MX_HEADER_MAX	(MX_HEADER_LEN + sizeof(MX_ATTR_DEFLATE)) /* Longest */
+#define MX_OP_NAME_MAX	8	/* Longest operation name */
+#define MX_WEBSOCKET_IOV 16	/* Most buffers handed to one writev */
 
 /* Forward declaration */
 static void
@@ -76,6 +125,686 @@ strntoul (const char *buf, size_t bufsiz)
     return val;
 }
 
+static inline int
+mx_websocket_is_proxy (mx_sock_websocket_t *mswp)
+{
+    return (mswp->msw_flags & MSWF_PROXY) ? TRUE : FALSE;
+}
+
+/*
+ * Output the websocket won't take yet waits on msw_outq, and is
+ * written when the socket polls writable.  Once opt_output_high_water
+ * bytes are queued, the websocket is "blocked": channels replying to
+ * it stop reading (see mx_channel_is_blocked) until the queue drains
+ * to opt_output_low_water.  So a slow client backs up into the SSH
+ * window, not into our memory or our CPU.
+ *
+ * With workers, the channels are on other threads, reading for the
+ * websocket's proxies, so each change is passed along to them.
+ */
+static void
+mx_websocket_set_blocked (mx_sock_websocket_t *mswp, int blocked)
+{
+    if (blocked) {
+	DBG_POLL("%s blocked, %lu bytes queued",
+		 mx_sock_title(&mswp->msw_base), mswp->msw_outq_len);
+	mswp->msw_flags |= MSWF_BLOCKED;
+	mswp->msw_blocked += 1;
+    } else {
+	DBG_POLL("%s unblocked, %lu bytes queued",
+		 mx_sock_title(&mswp->msw_base), mswp->msw_outq_len);
+	mswp->msw_flags &= ~MSWF_BLOCKED;
+    }
+
+    if (opt_workers > 0 && !mx_websocket_is_proxy(mswp))
+	mx_worker_handoff(-1, blocked ? MHO_BLOCK : MHO_UNBLOCK,
+			  mswp->msw_base.ms_id, NULL);
+}
+
+static void
+mx_websocket_enqueue (mx_sock_websocket_t *mswp, mx_buffer_t *mbp)
+{
+    mx_buffer_t **mbpp;
+
+    for (mbpp = &mswp->msw_outq; *mbpp; mbpp = &(*mbpp)->mb_next)
+	continue;
+    *mbpp = mbp;
+
+    for ( ; mbp; mbp = mbp->mb_next)
+	mswp->msw_outq_len += mbp->mb_len;
+
+    if (!(mswp->msw_flags & MSWF_BLOCKED)
+	    && mswp->msw_outq_len >= (unsigned long) opt_output_high_water)
+	mx_websocket_set_blocked(mswp, TRUE);
+}
+
+static int
+mx_websocket_is_blocked (MX_TYPE_IS_BLOCKED_ARGS)
+{
+    mx_sock_websocket_t *mswp = mx_sock(msp, MST_WEBSOCKET);
+
+    return (mswp->msw_flags & MSWF_BLOCKED) ? TRUE : FALSE;
+}
+
+/*
+ * Copy data into a buffer and queue it for a websocket.  A proxy
+ * hands it to the main thread, which writes it to the real websocket
+ * (see worker.c).
+ */
+static int
+mx_websocket_queue (mx_sock_t *msp, mx_muxid_t muxid,
+		    const struct iovec *iov, int iovcnt)
+{
+    mx_sock_websocket_t *mswp = mx_sock(msp, MST_WEBSOCKET);
+    mx_buffer_t *mbp;
+    int i, len = 0;
+
+    for (i = 0; i < iovcnt; i++)
+	len += iov[i].iov_len;
+
+    mbp = mx_buffer_create(len);
+    if (mbp == NULL)
+	return -1;
+
+    for (i = 0; i < iovcnt; i++) {
+	memcpy(mbp->mb_data + mbp->mb_len, iov[i].iov_base, iov[i].iov_len);
+	mbp->mb_len += iov[i].iov_len;
+    }
+
+    if (mx_websocket_is_proxy(mswp))
+	mx_worker_reply(MHO_OUTPUT, msp->ms_id, muxid, mbp);
+    else
+	mx_websocket_enqueue(mswp, mbp);
+
+    return len;
+}
+
+/*
+ * Write data to a websocket, gathered from one or more pieces.  If
+ * output is already queued, we queue behind it, so frames don't get
+ * interleaved, and whatever the socket won't take now is queued.
+ * Returns the number of bytes written or queued (which is all of
+ * them), or -1 on error.
+ */
+static int
+mx_websocket_writev (mx_sock_t *msp, mx_muxid_t muxid,
+		     const struct iovec *iov, int iovcnt)
+{
+    mx_sock_websocket_t *mswp = mx_sock(msp, MST_WEBSOCKET);
+    struct iovec rest[iovcnt];
+    int i, rc, len = 0, cnt = 0;
+
+    if (mx_websocket_is_proxy(mswp) || mswp->msw_outq)
+	return mx_websocket_queue(msp, muxid, iov, iovcnt);
+
+    for (i = 0; i < iovcnt; i++)
+	len += iov[i].iov_len;
+
+    rc = writev(msp->ms_sock, iov, iovcnt);
+    if (rc < 0) {
+	if (errno != EWOULDBLOCK && errno != EINTR)
+	    return rc;
+	rc = 0;
+    }
+
+    if (rc == len)
+	return len;
+
+    /* Queue the pieces (and the part of a piece) that didn't make it */
+    for (i = 0; i < iovcnt; i++) {
+	if ((unsigned) rc >= iov[i].iov_len) {
+	    rc -= iov[i].iov_len;
+	    continue;
+	}
+
+	rest[cnt].iov_base = (char *) iov[i].iov_base + rc;
+	rest[cnt++].iov_len = iov[i].iov_len - rc;
+	rc = 0;
+    }
+
+    if (mx_websocket_queue(msp, muxid, rest, cnt) < 0)
+	return -1;
+
+    return len;
+}
+
+/*
+ * Write output to a websocket.  A browser that connected to us
+ * directly gets each write in a frame of its own; a proxy's output
+ * is framed by the main thread (see mx_websocket_proxy_output).
+ *
+ * Frames are not message boundaries.  A reply goes out a chunk at a
+ * time, as it's read from the device, and each chunk (behind its own
+ * header) gets its own frame, so one reply spans many frames.  The
+ * reply ends with the "complete" message, not with a frame; clients
+ * put replies back together from our headers, as they do on the
+ * unix socket.
+ */
+static int
+mx_websocket_sendv (mx_sock_t *msp, mx_muxid_t muxid,
+		    const struct iovec *iov, int iovcnt)
+{
+    mx_sock_websocket_t *mswp = mx_sock(msp, MST_WEBSOCKET);
+    unsigned char hbuf[MX_RFC6455_HEADER_MAX];
+    struct iovec fiov[iovcnt + 1];
+    unsigned long len = 0;
+    int i, hlen, rc;
+
+    if (!(mswp->msw_flags & MSWF_RFC6455) || mx_websocket_is_proxy(mswp))
+	return mx_websocket_writev(msp, muxid, iov, iovcnt);
+
+    for (i = 0; i < iovcnt; i++) {
+	len += iov[i].iov_len;
+	fiov[i + 1] = iov[i];
+    }
+
+    hlen = mx_rfc6455_header(hbuf, MX_RFC6455_BINARY, len);
+    fiov[0].iov_base = hbuf;
+    fiov[0].iov_len = hlen;
+
+    rc = mx_websocket_writev(msp, muxid, fiov, iovcnt + 1);
+    return (rc < 0) ? rc : rc - hlen;
+}
+
+static int
+mx_websocket_send (mx_sock_t *msp, mx_muxid_t muxid, char *buf, int len)
+{
+    struct iovec iov = { buf, len };
+
+    return mx_websocket_sendv(msp, muxid, &iov, 1);
+}
+
+static mx_websocket_route_t *
+mx_websocket_route_find (mx_sock_websocket_t *mswp, mx_muxid_t muxid)
+{
+    unsigned i;
+
+    for (i = 0; i < mswp->msw_nroutes; i++)
+	if (mswp->msw_routes[i].mwr_muxid == muxid)
+	    return &mswp->msw_routes[i];
+
+    return NULL;
+}
+
+static void
+mx_websocket_route_set (mx_sock_websocket_t *mswp, mx_muxid_t muxid,
+			int worker)
+{
+    mx_websocket_route_t *mwrp = mx_websocket_route_find(mswp, muxid);
+
+    if (mwrp == NULL) {
+	if (worker < 0)
+	    return;
+
+	if (mswp->msw_nroutes >= mswp->msw_maxroutes) {
+	    unsigned size = mswp->msw_maxroutes ? mswp->msw_maxroutes * 2 : 16;
+	    mwrp = realloc(mswp->msw_routes, size * sizeof(*mwrp));
+	    if (mwrp == NULL)
+		return;
+	    mswp->msw_routes = mwrp;
+	    mswp->msw_maxroutes = size;
+	}
+
+	mwrp = &mswp->msw_routes[mswp->msw_nroutes++];
+	mwrp->mwr_muxid = muxid;
+
+    } else if (worker < 0) {
+	/* Going back to the main thread; drop the route */
+	*mwrp = mswp->msw_routes[--mswp->msw_nroutes];
+	return;
+    }
+
+    mwrp->mwr_worker = worker;
+}
+
+/*
+ * Decide where a frame should be handled: by a worker (returns its
+ * index) or right here (returns -1).  Requests go to the worker that
+ * owns their target; follow-on operations go wherever their muxid
+ * went.
+ */
+static int
+mx_websocket_route (mx_sock_websocket_t *mswp, const char *operation,
+		    mx_muxid_t muxid, const char **attrs)
+{
+    mx_websocket_route_t *mwrp;
+
+    if (streq(operation, MX_OP_RPC) || streq(operation, MX_OP_HTMLRPC)) {
+	int worker = mx_worker_route(xml_get_attribute(attrs, "target"));
+	mx_websocket_route_set(mswp, muxid, worker);
+	return worker;
+    }
+
+    if (streq(operation, MX_OP_AUTHINIT))
+	return -1;
+
+    mwrp = mx_websocket_route_find(mswp, muxid);
+    return mwrp ? mwrp->mwr_worker : -1;
+}
+
+/*
+ * Write as much of the output queue as the socket will take.  We
+ * hand several buffers to each writev, and a partial write just moves
+ * mb_start along.
+ */
+static void
+mx_websocket_flush (mx_sock_websocket_t *mswp)
+{
+    mx_sock_t *msp = &mswp->msw_base;
+    struct iovec iov[MX_WEBSOCKET_IOV];
+    mx_buffer_t *mbp;
+    int cnt, rc, total, full;
+
+    while (mswp->msw_outq) {
+	total = 0;
+	for (cnt = 0, mbp = mswp->msw_outq; mbp && cnt < MX_WEBSOCKET_IOV;
+	     cnt++, mbp = mbp->mb_next) {
+	    iov[cnt].iov_base = mbp->mb_data + mbp->mb_start;
+	    iov[cnt].iov_len = mbp->mb_len;
+	    total += mbp->mb_len;
+	}
+
+	rc = writev(msp->ms_sock, iov, cnt);
+	if (rc < 0) {
+	    if (errno == EWOULDBLOCK || errno == EINTR)
+		return;
+
+	    mx_log("%s: write error: %s", mx_sock_title(msp), strerror(errno));
+	    msp->ms_state = MSS_FAILED;
+	    return;
+	}
+
+	full = (rc < total);
+	mswp->msw_outq_len -= rc;
+
+	while ((mbp = mswp->msw_outq) != NULL
+	       && (unsigned) rc >= mbp->mb_len) {
+	    rc -= mbp->mb_len;
+	    mswp->msw_outq = mbp->mb_next;
+	    mbp->mb_next = NULL;
+	    mx_buffer_free(mbp);
+	}
+
+	if (mbp) {
+	    mbp->mb_start += rc;
+	    mbp->mb_len -= rc;
+	}
+
+	if (full)
+	    break;		/* Socket won't take any more */
+    }
+
+    /* Sessions stopped polling for their blocked channels resume */
+    if ((mswp->msw_flags & MSWF_BLOCKED)
+	    && mswp->msw_outq_len <= (unsigned long) opt_output_low_water)
+	mx_websocket_set_blocked(mswp, FALSE);
+
+    if (mswp->msw_outq)
+	return;
+
+    if (msp->ms_state == MSS_READ_EOF
+	    && mswp->msw_requests_complete >= mswp->msw_requests_made) {
+	mx_log("%s eof and complete", mx_sock_title(msp));
+	msp->ms_state = MSS_FAILED;
+    }
+}
+
+static mx_sock_websocket_t *
+mx_websocket_find (unsigned wsid)
+{
+    mx_sock_t *msp;
+
+    TAILQ_FOREACH(msp, &mx_sock_list, ms_link) {
+	if (msp->ms_id == wsid && msp->ms_type == MST_WEBSOCKET)
+	    return mx_sock(msp, MST_WEBSOCKET);
+    }
+
+    return NULL;
+}
+
+/*
+ * Find (or make) a worker's proxy for a websocket.  The proxy has
+ * the same ID as the real thing, but no file descriptor.
+ */
+static mx_sock_websocket_t *
+mx_websocket_proxy (unsigned wsid)
+{
+    mx_sock_websocket_t *mswp = mx_websocket_find(wsid);
+
+    if (mswp)
+	return mswp;
+
+    mswp = calloc(1, sizeof(*mswp));
+    if (mswp == NULL)
+	return NULL;
+
+    mswp->msw_base.ms_id = wsid;
+    mswp->msw_base.ms_type = MST_WEBSOCKET;
+    mswp->msw_base.ms_sock = -1;
+    mswp->msw_flags |= MSWF_PROXY;
+
+    TAILQ_INSERT_HEAD(&mx_sock_list, &mswp->msw_base, ms_link);
+    mx_sock_count += 1;
+
+    MX_LOG("%s new %s proxy in worker %d", mx_sock_title(&mswp->msw_base),
+	   mx_sock_type(&mswp->msw_base), mx_worker_self());
+
+    return mswp;
+}
+
+/*
+ * A worker has been handed a frame from a websocket
+ */
+void
+mx_websocket_proxy_input (unsigned wsid, mx_buffer_t *mbp)
+{
+    mx_sock_websocket_t *mswp = mx_websocket_proxy(wsid);
+
+    if (mswp)
+	mx_websocket_handle_request(mswp, mbp);
+
+    mx_buffer_free(mbp);
+}
+
+/*
+ * A websocket has closed; a worker drops its proxy
+ */
+void
+mx_websocket_proxy_close (unsigned wsid)
+{
+    mx_sock_websocket_t *mswp = mx_websocket_find(wsid);
+
+    if (mswp && mx_websocket_is_proxy(mswp))
+	mswp->msw_base.ms_state = MSS_FAILED;
+}
+
+/*
+ * The main thread has been handed output from a worker's proxy.  We
+ * write what we can and queue the rest.  The queue's water marks
+ * apply as usual, and the workers hear when they're crossed (see
+ * mx_websocket_set_blocked).
+ */
+void
+mx_websocket_proxy_output (unsigned wsid, mx_muxid_t muxid, int worker,
+			   mx_buffer_t *mbp)
+{
+    mx_sock_websocket_t *mswp = mx_websocket_find(wsid);
+
+    if (mswp == NULL || mswp->msw_base.ms_state == MSS_FAILED) {
+	MX_LOG("W%u gone; dropping %lu bytes from worker %d",
+	       wsid, mbp->mb_len, worker);
+	mx_buffer_free(mbp);
+	return;
+    }
+
+    /* Replies to prompts need to find their way back to the worker */
+    if (muxid)
+	mx_websocket_route_set(mswp, muxid, worker);
+
+    /* Each piece of output gets a frame (not a message; see sendv) */
+    if (mswp->msw_flags & MSWF_RFC6455) {
+	mx_buffer_t *hbp = mx_buffer_create(MX_RFC6455_HEADER_MAX);
+
+	if (hbp == NULL) {
+	    mx_buffer_free(mbp);
+	    mswp->msw_base.ms_state = MSS_FAILED;
+	    return;
+	}
+
+	hbp->mb_len = mx_rfc6455_header((unsigned char *) hbp->mb_data,
+					MX_RFC6455_BINARY, mbp->mb_len);
+	hbp->mb_next = mbp;
+	mbp = hbp;
+    }
+
+    mx_websocket_enqueue(mswp, mbp);
+    mx_websocket_flush(mswp);
+}
+
+/*
+ * A worker has finished a request for one of our websockets
+ */
+void
+mx_websocket_proxy_complete (unsigned wsid, mx_muxid_t muxid)
+{
+    mx_sock_websocket_t *mswp = mx_websocket_find(wsid);
+
+    if (mswp == NULL)
+	return;
+
+    mswp->msw_requests_complete += 1;
+    mx_websocket_route_set(mswp, muxid, -1);
+
+    if (mswp->msw_outq == NULL && mswp->msw_base.ms_state == MSS_READ_EOF
+	    && mswp->msw_requests_complete >= mswp->msw_requests_made) {
+	mx_log("%s eof and complete", mx_sock_title(&mswp->msw_base));
+	mswp->msw_base.ms_state = MSS_FAILED;
+    }
+}
+
+/*
+ * A websocket's queue has crossed a water mark; its proxy follows
+ * suit, so the worker's channels stop (or resume) reading for it.
+ * Output already in flight lands on the queue as usual.
+ */
+void
+mx_websocket_proxy_block (unsigned wsid, int blocked)
+{
+    mx_sock_websocket_t *mswp = mx_websocket_find(wsid);
+
+    if (mswp == NULL || !mx_websocket_is_proxy(mswp))
+	return;
+
+    if (blocked)
+	mswp->msw_flags |= MSWF_BLOCKED;
+    else
+	mswp->msw_flags &= ~MSWF_BLOCKED;
+}
+
+/*
+ * A websocket's client wants compressed replies, including from the
+ * requests its workers handle.  This reaches the worker before any
+ * frame that follows the authinit.
+ */
+void
+mx_websocket_proxy_deflate (unsigned wsid)
+{
+    mx_sock_websocket_t *mswp = mx_websocket_proxy(wsid);
+
+    if (mswp)
+	mswp->msw_flags |= MSWF_DEFLATE;
+}
+
+/*
+ * What we learn from a message header, in either version
+ */
+typedef struct mx_header_info_s {
+    unsigned long mhi_len;	/* Total length (including header) */
+    unsigned long mhi_hlen;	/* Length of header and attributes */
+    mx_muxid_t mhi_muxid;	/* Muxer ID */
+    unsigned mhi_reqid;		/* Request ID (version 2 only) */
+    char *mhi_attrs;		/* Attributes */
+    char *mhi_attrs_end;	/* End of attributes (newline or NUL) */
+    char mhi_operation[MX_OP_NAME_MAX + 1]; /* Operation name */
+    int mhi_version;		/* Header version (1 or 2) */
+} mx_header_info_t;
+
+static const char *mx_websocket_opnames[MX_OPC_MAX] = {
+    [MX_OPC_COMPLETE] = MX_OP_COMPLETE,
+    [MX_OPC_ERROR] = MX_OP_ERROR,
+    [MX_OPC_HOSTKEY] = MX_OP_HOSTKEY,
+    [MX_OPC_PASSPHRASE] = MX_OP_PASSPHRASE,
+    [MX_OPC_PASSWORD] = MX_OP_PASSWORD,
+    [MX_OPC_REPLY] = MX_OP_REPLY,
+    [MX_OPC_RPC] = MX_OP_RPC,
+    [MX_OPC_AUTHINIT] = MX_OP_AUTHINIT,
+    [MX_OPC_DATA] = MX_OP_DATA,
+    [MX_OPC_CANCEL] = MX_OP_CANCEL,
+};
+
+static unsigned
+mx_websocket_opcode (const char *operation)
+{
+    unsigned i;
+
+    for (i = 1; i < MX_OPC_MAX; i++)
+	if (mx_websocket_opnames[i] && streq(mx_websocket_opnames[i], operation))
+	    return i;
+
+    return 0;
+}
+
+static inline unsigned long
+mx_get32 (const unsigned char *cp)
+{
+    return ((unsigned long) cp[0] << 24) | (cp[1] << 16) | (cp[2] << 8) | cp[3];
+}
+
+static inline unsigned
+mx_get16 (const unsigned char *cp)
+{
+    return (cp[0] << 8) | cp[1];
+}
+
+static inline void
+mx_put32 (unsigned char *cp, unsigned long value)
+{
+    cp[0] = value >> 24;
+    cp[1] = value >> 16;
+    cp[2] = value >> 8;
+    cp[3] = value;
+}
+
+static inline void
+mx_put16 (unsigned char *cp, unsigned value)
+{
+    cp[0] = value >> 8;
+    cp[1] = value;
+}
+
+/*
+ * Parse the header at the front of the buffer, without touching it
+ * (since a worker may want a clean copy).  Returns 1 when we have the
+ * whole header, 0 (with *wantp set) if we need more data, and -1 if
+ * it's garbage.
+ */
+static int
+mx_websocket_header_parse (mx_sock_websocket_t *mswp, mx_buffer_t *mbp,
+			   mx_header_info_t *mhip, unsigned long *wantp)
+{
+    char *cp = mbp->mb_data + mbp->mb_start;
+    char *ep = cp + mbp->mb_len;
+
+    bzero(mhip, sizeof(*mhip));
+
+    if (mbp->mb_len < MX_HEADER2_LEN) { /* The shorter of the two */
+	*wantp = MX_HEADER2_LEN;
+	return 0;
+    }
+
+    if (cp[0] != '#' || cp[1] != MX_HEADER_VERSION_0)
+	goto bad;
+
+    if (cp[2] == MX_HEADER_VERSION_2) {
+	mx_header2_t *mh2p = (mx_header2_t *) cp;
+	unsigned op, alen;
+
+	mhip->mhi_version = 2;
+	mhip->mhi_len = mx_get32(mh2p->mh2_len);
+	mhip->mhi_muxid = mx_get32(mh2p->mh2_muxid);
+	mhip->mhi_reqid = mx_get32(mh2p->mh2_reqid);
+
+	op = mh2p->mh2_op;
+	if (op == MX_OPC_RPC && (mx_get16(mh2p->mh2_flags) & MX_HF_HTML))
+	    strlcpy(mhip->mhi_operation, MX_OP_HTMLRPC,
+		    sizeof(mhip->mhi_operation));
+	else if (op < MX_OPC_MAX && mx_websocket_opnames[op])
+	    strlcpy(mhip->mhi_operation, mx_websocket_opnames[op],
+		    sizeof(mhip->mhi_operation));
+	else
+	    snprintf(mhip->mhi_operation, sizeof(mhip->mhi_operation),
+		     "#%u", op);
+
+	alen = mx_get16(mh2p->mh2_alen);
+	mhip->mhi_hlen = MX_HEADER2_LEN + alen;
+	if (mhip->mhi_hlen > mhip->mhi_len)
+	    goto bad;
+
+	if (mbp->mb_len < mhip->mhi_hlen) {
+	    *wantp = mhip->mhi_hlen;
+	    return 0;
+	}
+
+	if (alen) {
+	    mhip->mhi_attrs = cp + MX_HEADER2_LEN;
+	    mhip->mhi_attrs_end = cp + mhip->mhi_hlen - 1;
+	    if (*mhip->mhi_attrs_end != '\0')
+		goto bad;
+	}
+
+	return 1;
+    }
+
+    mx_header_t *mhp = (mx_header_t *) cp;
+
+    if (cp[2] != MX_HEADER_VERSION_1)
+	goto bad;
+
+    if (mbp->mb_len <= sizeof(*mhp)) {
+	*wantp = MX_HEADER_LEN;
+	return 0;
+    }
+
+    if (mhp->mh_dot1 != '.' || mhp->mh_dot2 != '.'
+	    || mhp->mh_dot3 != '.' || mhp->mh_dot4 != '.')
+	goto bad;
+
+    mhip->mhi_version = 1;
+    mhip->mhi_len = strntoul(mhp->mh_len, sizeof(mhp->mh_len));
+    mhip->mhi_muxid = strntoul(mhp->mh_muxid, sizeof(mhp->mh_muxid));
+
+    char *operation = mhip->mhi_operation;
+    memcpy(operation, mhp->mh_operation, sizeof(mhp->mh_operation));
+    for (cp = operation + sizeof(mhp->mh_operation) - 1;
+	    cp >= operation; cp--)
+	if (*cp != ' ')
+	    break;
+    *++cp = '\0';
+
+    /* A header can arrive over any number of reads */
+    for (cp = mhp->mh_trailer; cp < ep; cp++) {
+	if (*cp == '\n')
+	    break;
+    }
+
+    if (cp >= ep) {
+	*wantp = cp - (char *) mhp + 1;
+	if (*wantp > mhip->mhi_len || *wantp > (unsigned long) opt_frame_max) {
+	    mx_log("%s request header is too long (%lu/%lu)",
+		   mx_sock_title(&mswp->msw_base), *wantp, mhip->mhi_len);
+	    return -1;
+	}
+	return 0;
+    }
+
+    /* The header runs thru the newline */
+    mhip->mhi_attrs = mhp->mh_trailer;
+    mhip->mhi_attrs_end = cp;
+    mhip->mhi_hlen = cp + 1 - (char *) mhp;
+    if (mhip->mhi_hlen > mhip->mhi_len) {
+	mx_log("%s request header longer than frame (%lu/%lu)",
+	       mx_sock_title(&mswp->msw_base), mhip->mhi_hlen, mhip->mhi_len);
+	return -1;
+    }
+
+    return 1;
+
+ bad:
+    mx_log("%s parse request fails (%c)",
+	   mx_sock_title(&mswp->msw_base), mbp->mb_data[mbp->mb_start]);
+    return -1;
+}
+
 static int
 mx_websocket_test_hostkey (mx_sock_session_t *mssp,
 			      mx_request_t *mrp, mx_buffer_t *mbp)
@@ -90,10 +819,188 @@ mx_websocket_test_hostkey (mx_sock_session_t *mssp,
 	rc = FALSE;
     }
 
-    if (rc)
-	mx_session_approve_hostkey(mssp, mrp);
+    if (rc)
+	mx_session_approve_hostkey(mssp, mrp);
+
+    return rc;
+}
+
+/*
+ * Make sure the read buffer can take more input: room for a frame of
+ * "want" bytes, or failing that, for at least one more byte.  What
+ * we have is moved to the front, and into a bigger buffer if need
+ * be.  Once it's empty, a grown buffer goes back to the usual size.
+ */
+static int
+mx_websocket_fit_buffer (mx_sock_websocket_t *mswp, unsigned long want)
+{
+    mx_buffer_t *mbp = mswp->msw_rbufp, *newp;
+    unsigned long size;
+
+    if (mbp->mb_len == 0) {
+	mbp->mb_start = 0;
+	want = BUFFER_DEFAULT_SIZE;
+	if (mbp->mb_size == want)
+	    return TRUE;
+
+    } else if (want <= mbp->mb_size) {
+	if (want < mbp->mb_len + 1)
+	    want = mbp->mb_len + 1;
+	if (mbp->mb_start && mbp->mb_start + want > mbp->mb_size) {
+	    memmove(mbp->mb_data, mbp->mb_data + mbp->mb_start, mbp->mb_len);
+	    mbp->mb_start = 0;
+	}
+	return TRUE;
+    }
+
+    size = want;
+    if (mbp->mb_len && size < mbp->mb_size * 2)
+	size = MIN(mbp->mb_size * 2, (unsigned long) opt_frame_max);
+    if (size < want)
+	size = want;
+
+    newp = mx_buffer_create(size);
+    if (newp == NULL)
+	return (mbp->mb_len == 0); /* Keep what we've got, if we can */
+
+    DBG_POLL("%s read buffer %lu -> %lu", mx_sock_title(&mswp->msw_base),
+	     mbp->mb_size, newp->mb_size);
+
+    memcpy(newp->mb_data, mbp->mb_data + mbp->mb_start, mbp->mb_len);
+    newp->mb_len = mbp->mb_len;
+    mx_buffer_free(mbp);
+    mswp->msw_rbufp = newp;
+
+    return TRUE;
+}
+
+/*
+ * Return the request whose body is arriving, if it's still wanted.
+ */
+static mx_request_t *
+mx_websocket_upload_request (mx_sock_websocket_t *mswp)
+{
+    mx_request_t *mrp = mx_request_find(0, mswp->msw_upload_id);
+
+    if (mrp == NULL || mrp->mr_state == MSS_FAILED
+	    || mrp->mr_state == MSS_ERROR)
+	return NULL;
+
+    return mrp;
+}
+
+/*
+ * Start on an RPC whose frame is too big to wait for.  The request
+ * is made now, with an empty body, and mx_websocket_upload feeds it
+ * the body as it arrives.
+ */
+static mx_request_t *
+mx_websocket_upload_begin (mx_sock_websocket_t *mswp, mx_buffer_t *mbp,
+			   unsigned long len, mx_muxid_t muxid,
+			   const char *operation, const char **attrs)
+{
+    mx_request_t *mrp = mx_request_create(mswp, mbp, 0, muxid,
+					  operation, attrs);
+    if (mrp == NULL)
+	return NULL;
+
+    mx_log("%s R%u streaming %lu byte rpc", mx_sock_title(&mswp->msw_base),
+	   mrp->mr_id, len);
+
+    mrp->mr_flags |= MRF_STREAM;
+    mswp->msw_upload_id = mrp->mr_id;
+    mswp->msw_upload_left = len;
+    mswp->msw_requests_made += 1;
+
+    mx_request_start_rpc(mswp, mrp);
+    return mrp;
+}
+
+/*
+ * Feed the body of a streamed RPC to its request.  Until the RPC goes
+ * out on a channel, the body collects in our buffer.  If the session
+ * is up, that's just a wait for a channel, so we stop reading when
+ * the buffer fills.  Otherwise the client may have a hostkey or
+ * password prompt to answer, and that answer is behind the body, so
+ * we hold the whole thing (up to opt_frame_max).  Once the RPC has
+ * gone out, we write what we have to the channel and read more, so
+ * the buffer never needs to hold more than a read's worth.
+ *
+ * Returns TRUE if we can carry on, and FALSE (with *wantp set to the
+ * room we need) when we have to wait.
+ */
+static int
+mx_websocket_upload (mx_sock_websocket_t *mswp, mx_buffer_t *mbp,
+		     unsigned long *wantp)
+{
+    mx_request_t *mrp = mx_websocket_upload_request(mswp);
+    mx_channel_t *mcp = mrp ? mx_request_upload_channel(mrp) : NULL;
+    unsigned long left = mswp->msw_upload_left;
+    unsigned long len = MIN(mbp->mb_len, left);
+    int rc;
+
+    mswp->msw_flags &= ~MSWF_UPLOAD_WAIT;
+    *wantp = 0;
+
+    if (mrp == NULL) {
+	rc = len;		/* No one wants it; drop it */
+
+    } else if (mcp) {
+	rc = mx_request_upload(mrp, mbp->mb_data + mbp->mb_start, len);
+	if (rc < 0)
+	    goto failed;
+
+    } else if (mbp->mb_len < left) {
+	mx_sock_session_t *mssp = mrp->mr_session;
+
+	if (mssp && mssp->mss_base.ms_state == MSS_ESTABLISHED)
+	    return FALSE;
+
+	if (left > (unsigned long) opt_frame_max) {
+	    mx_request_error(mrp, "rpc is too large (%lu bytes) to hold while"
+			     " the session is set up", left);
+	    mx_request_cancel(mrp);
+	    return FALSE;
+	}
+
+	*wantp = left;
+	return FALSE;
+
+    } else {
+	/* It all arrived before it could be sent; send it as usual */
+	mx_buffer_free(mrp->mr_rpc);
+	mrp->mr_rpc = mx_buffer_copy(mbp, left);
+	mrp->mr_flags &= ~MRF_STREAM;
+	rc = left;
+    }
+
+    mbp->mb_start += rc;
+    mbp->mb_len -= rc;
+    mswp->msw_upload_left -= rc;
+
+    if (mswp->msw_upload_left) {
+	if (mbp->mb_len)
+	    mswp->msw_flags |= MSWF_UPLOAD_WAIT;
+	return FALSE;
+    }
+
+    if (mcp) {
+	rc = mx_request_upload_finish(mrp);
+	if (rc < 0)
+	    goto failed;
+	if (rc == 0) {
+	    mswp->msw_flags |= MSWF_UPLOAD_WAIT;
+	    return FALSE;
+	}
+    }
+
+    mswp->msw_upload_id = 0;
+    return TRUE;
 
-    return rc;
+ failed:
+    mx_request_error(mrp, "could not send rpc to device");
+    mx_request_cancel(mrp);
+    return TRUE;
 }
 
 static int
@@ -102,38 +1009,130 @@ mx_websocket_prep (MX_TYPE_PREP_ARGS)
     mx_sock_websocket_t *mswp = mx_sock(msp, MST_WEBSOCKET);
     mx_buffer_t *mbp = mswp->msw_rbufp;
 
+    /* A proxy has nothing to poll; its input comes from a handoff */
+    if (mx_websocket_is_proxy(mswp))
+	return FALSE;
+
     if (msp->ms_state == MSS_READ_EOF)
 	return FALSE;
 
+    if (mswp->msw_outq) {
+	pollp->fd = msp->ms_sock;
+	pollp->events = POLLOUT;
+	if (mbp == NULL || mbp->mb_len == 0)
+	    pollp->events |= POLLIN;
+	return TRUE;
+    }
+
     /*
-     * If we have buffered data, we need to poll for output on
-     * the channels' session.
+     * An upload waiting for room on its channel polls for output on
+     * the channel's session, like a forwarder does.  One that can
+     * move without more input (its RPC just went out, or no one
+     * wants it any more) is run on this pass.
      */
-    if (mbp && mbp->mb_len) {
-	DBG_POLL("%s websocket has data; state %u",
-		 mx_sock_title(msp), msp->ms_state);
-	if (msp->ms_state == MSS_RPC_WRITE_RPC
-	        || msp->ms_state == MSS_RPC_READ_REPLY)
+    if (mswp->msw_upload_id) {
+	mx_request_t *mrp = mx_websocket_upload_request(mswp);
+	mx_channel_t *mcp = mrp ? mx_request_upload_channel(mrp) : NULL;
+
+	if (mcp && (mswp->msw_flags & MSWF_UPLOAD_WAIT)) {
+	    pollp->fd = mx_channel_sock(mcp);
+	    pollp->events = POLLOUT;
+	    DBG_POLL("%s blocking pollout for fd %d (upload)",
+		     mx_sock_title(msp), pollp->fd);
+	    return TRUE;
+	}
+
+	if ((mrp == NULL || mcp)
+		&& (mbp->mb_len || mswp->msw_upload_left == 0)) {
+	    *timeout = 0;
 	    return FALSE;
-	return TRUE;
+	}
+    }
 
-    } else {
-	pollp->fd = msp->ms_sock;
-	pollp->events = POLLIN;
-	DBG_POLL("%s blocking pollin for fd %d",
-                 mx_sock_title(msp), pollp->fd);
+    /*
+     * Anything buffered is a partial frame, so read more if there's
+     * room.  A full buffer means an upload is waiting for a channel.
+     */
+    if (mbp->mb_start + mbp->mb_len >= mbp->mb_size) {
+	DBG_POLL("%s websocket buffer is full; state %u",
+		 mx_sock_title(msp), msp->ms_state);
+	return FALSE;
     }
 
+    pollp->fd = msp->ms_sock;
+    pollp->events = POLLIN;
+    DBG_POLL("%s blocking pollin for fd %d", mx_sock_title(msp), pollp->fd);
+
     return TRUE;
 }
 
+/*
+ * Our client is done sending.  We finish what it's asked for before
+ * closing.
+ */
+static void
+mx_websocket_eof (mx_sock_websocket_t *mswp)
+{
+    mx_sock_t *msp = &mswp->msw_base;
+
+    mx_log("%s: disconnect (%s) (%u/%u)",
+	   mx_sock_title(msp), mx_sock_name(msp),
+	   mswp->msw_requests_made, mswp->msw_requests_complete);
+    if (mswp->msw_requests_made < mswp->msw_requests_complete)
+	msp->ms_state = MSS_READ_EOF;
+    else
+	msp->ms_state = MSS_FAILED;
+}
+
+/*
+ * Handle a control frame from a browser: we answer a ping with a pong
+ * and a close with a close, sent ahead of anything queued for it.
+ */
+static void
+mx_websocket_control (void *arg, unsigned opcode,
+		      unsigned char *data, unsigned len)
+{
+    mx_sock_websocket_t *mswp = arg;
+    unsigned char hbuf[MX_RFC6455_HEADER_MAX];
+    struct iovec iov[2];
+
+    if (opcode == MX_RFC6455_PONG)
+	return;
+
+    if (opcode == MX_RFC6455_CLOSE && len > 2)
+	len = 2;		/* Echo the status code, but not the reason */
+
+    iov[0].iov_base = hbuf;
+    iov[0].iov_len = mx_rfc6455_header(hbuf, (opcode == MX_RFC6455_PING)
+				       ? MX_RFC6455_PONG : MX_RFC6455_CLOSE,
+				       len);
+    iov[1].iov_base = data;
+    iov[1].iov_len = len;
+
+    if (mx_websocket_writev(&mswp->msw_base, 0, iov, 2) < 0)
+	mx_log("%s: write error: %s", mx_sock_title(&mswp->msw_base),
+	       strerror(errno));
+
+    if (opcode == MX_RFC6455_CLOSE)
+	mx_websocket_eof(mswp);
+}
+
 static int
 mx_websocket_poller (MX_TYPE_POLLER_ARGS)
 {
     mx_sock_websocket_t *mswp = mx_sock(msp, MST_WEBSOCKET);
-    mx_buffer_t *mbp = mswp->msw_rbufp;
+    mx_buffer_t *mbp;
     int len;
 
+    if (mswp->msw_outq && (pollp == NULL || pollp->revents & POLLOUT))
+	mx_websocket_flush(mswp);
+
+    /* Give an upload a chance to move along */
+    if (mswp->msw_upload_id && (pollp == NULL || pollp->revents & POLLOUT))
+	mx_websocket_handle_request(mswp, mswp->msw_rbufp);
+
+    mbp = mswp->msw_rbufp;	/* Might have been resized */
+
     if (pollp && pollp->revents & POLLIN) {
 	if (mbp->mb_len == 0)	/* If it's empty, start at the beginning */
 	    mbp->mb_start = 0;
@@ -144,7 +1143,11 @@ mx_websocket_poller (MX_TYPE_POLLER_ARGS)
 	}
 
 	int size = mbp->mb_size - (mbp->mb_start + mbp->mb_len);
-	len = recv(msp->ms_sock, mbp->mb_data + mbp->mb_start, size, 0);
+	if (size <= 0)
+	    return FALSE;
+
+	len = recv(msp->ms_sock, mbp->mb_data + mbp->mb_start + mbp->mb_len,
+		   size, 0);
 	if (len < 0) {
 	    if (errno == EWOULDBLOCK || errno == EINTR)
 		return FALSE;
@@ -155,19 +1158,29 @@ mx_websocket_poller (MX_TYPE_POLLER_ARGS)
 	}
 
 	if (len == 0) {
-	    mx_log("%s: disconnect (%s) (%u/%u)",
-                   mx_sock_title(msp), mx_sock_name(msp),
-		   mswp->msw_requests_made, mswp->msw_requests_complete);
-	    if (mswp->msw_requests_made < mswp->msw_requests_complete)
-		msp->ms_state = MSS_READ_EOF;
-	    else
-		msp->ms_state = MSS_FAILED;
+	    mx_websocket_eof(mswp);
 	    return FALSE;
 	}
 
-	mbp->mb_len = len;
 	if (opt_debug & DBG_FLAG_DUMP)
-	    slaxMemDump("wsread: ", mbp->mb_data, mbp->mb_len, ">", 0);
+	    slaxMemDump("wsread: ", mbp->mb_data + mbp->mb_start + mbp->mb_len,
+			len, ">", 0);
+
+	/* Strip the frames off, leaving just the messages */
+	if (mswp->msw_flags & MSWF_RFC6455) {
+	    unsigned long dlen = len;
+
+	    if (mx_rfc6455_decode(&mswp->msw_rfc6455,
+				  mbp->mb_data + mbp->mb_start + mbp->mb_len,
+				  &dlen, mx_websocket_control, mswp) < 0) {
+		mx_log("%s: bad websocket frame", mx_sock_title(msp));
+		msp->ms_state = MSS_FAILED;
+		return FALSE;
+	    }
+	    len = dlen;
+	}
+
+	mbp->mb_len += len;
 
 	mx_websocket_handle_request(mswp, mbp);
     }
@@ -175,8 +1188,12 @@ mx_websocket_poller (MX_TYPE_POLLER_ARGS)
     return FALSE;
 }
 
-static mx_sock_t *
-mx_websocket_spawn (MX_TYPE_SPAWN_ARGS)
+/*
+ * Make a websocket for a connected socket.  The caller fills in the
+ * peer's address.
+ */
+mx_sock_websocket_t *
+mx_websocket_create (int sock, unsigned flags)
 {
     mx_sock_websocket_t *mswp = malloc(sizeof(*mswp));
 
@@ -184,13 +1201,26 @@ mx_websocket_spawn (MX_TYPE_SPAWN_ARGS)
 	return NULL;
 
     bzero(mswp, sizeof(*mswp));
-    mswp->msw_base.ms_id = ++mx_sock_id;
+    mswp->msw_base.ms_id = mx_next_id(mx_sock_id);
     mswp->msw_base.ms_type = MST_WEBSOCKET;
     mswp->msw_base.ms_sock = sock;
-    mswp->msw_base.ms_sun = *sun;
+    mswp->msw_flags = flags;
 
     mswp->msw_rbufp = mx_buffer_create(0);
 
+    return mswp;
+}
+
+static mx_sock_t *
+mx_websocket_spawn (MX_TYPE_SPAWN_ARGS)
+{
+    mx_sock_websocket_t *mswp = mx_websocket_create(sock, 0);
+
+    if (mswp == NULL)
+	return NULL;
+
+    mswp->msw_base.ms_sun = *sun;
+
     return &mswp->msw_base;
 }
 
@@ -232,6 +1262,61 @@ mx_websocket_header_build (mx_header_t *mhp, int len, const char *operation,
 				   sizeof(mhp->mh_muxid), muxid);
 }
 
+static int
+mx_websocket_header_len (mx_sock_t *msp, unsigned flags)
+{
+    mx_sock_websocket_t *mswp = mx_sock(msp, MST_WEBSOCKET);
+
+    if (mswp->msw_flags & MSWF_HEADER2)
+	return MX_HEADER2_LEN;
+
+    if (flags & MX_HF_DEFLATE)
+	return MX_HEADER_LEN + sizeof(MX_ATTR_DEFLATE) - 1;
+
+    return MX_HEADER_LEN;
+}
+
+/*
+ * Build the header for a message with "dlen" bytes of payload, in the
+ * version our client speaks.  buf needs room for MX_HEADER_MAX bytes.
+ * Returns the length of the header.
+ */
+static int
+mx_websocket_header_format (mx_sock_t *msp, char *buf, unsigned long dlen,
+			    const char *operation, mx_muxid_t muxid,
+			    unsigned reqid, unsigned flags)
+{
+    mx_sock_websocket_t *mswp = mx_sock(msp, MST_WEBSOCKET);
+
+    if (mswp->msw_flags & MSWF_HEADER2) {
+	mx_header2_t *mh2p = (mx_header2_t *) buf;
+
+	mh2p->mh2_pound = '#';
+	mh2p->mh2_version[0] = MX_HEADER_VERSION_0;
+	mh2p->mh2_version[1] = MX_HEADER_VERSION_2;
+	mh2p->mh2_op = mx_websocket_opcode(operation);
+	mx_put32(mh2p->mh2_len, dlen + MX_HEADER2_LEN);
+	mx_put32(mh2p->mh2_muxid, muxid);
+	mx_put32(mh2p->mh2_reqid, reqid);
+	mx_put16(mh2p->mh2_flags, flags);
+	mx_put16(mh2p->mh2_alen, 0);
+	return MX_HEADER2_LEN;
+    }
+
+    /* Version 1 has no flags, so they become attributes */
+    int hlen = mx_websocket_header_len(msp, flags);
+    char *cp = buf + sizeof(mx_header_t);
+
+    mx_websocket_header_build((mx_header_t *) buf, dlen + hlen,
+			      operation, muxid);
+    if (flags & MX_HF_DEFLATE) {
+	memcpy(cp, MX_ATTR_DEFLATE, sizeof(MX_ATTR_DEFLATE) - 1);
+	cp += sizeof(MX_ATTR_DEFLATE) - 1;
+    }
+    *cp = '\n';
+    return hlen;
+}
+
 /*
  * We need to allow one websocket to send a message to another websocket if
  * mr_auth_websocketid is set in the request.  This is due to mod_juise
@@ -248,14 +1333,16 @@ mx_websocket_send_simple (mx_sock_t *client,
     mx_muxid_t muxid = use_auth_muxid ? mrp->mr_auth_muxid : mrp->mr_muxid;
 
     if (mrp->mr_auth_websocketid && use_auth_muxid) {
-	mx_sock_t *msp;
+	mx_sock_websocket_t *mswp;
+
+	/* A worker talks to the other websocket thru its own proxy */
+	if (mx_websocket_is_proxy(mx_sock(client, MST_WEBSOCKET)))
+	    mswp = mx_websocket_proxy(mrp->mr_auth_websocketid);
+	else
+	    mswp = mx_websocket_find(mrp->mr_auth_websocketid);
+	if (mswp)
+	    auth_client = &mswp->msw_base;
 
-	TAILQ_FOREACH(msp, &mx_sock_list, ms_link) {
-	    if (msp->ms_id == mrp->mr_auth_websocketid) {
-		auth_client = msp;
-		break;
-	    }
-	}
 	if (auth_client == client) {
 	    mx_log("%s could not find websocket %d for auth!",
 		    mx_sock_title(client), mrp->mr_auth_websocketid);
@@ -266,15 +1353,14 @@ mx_websocket_send_simple (mx_sock_t *client,
 	    mx_sock_title(auth_client), muxid, title, info);
 
     int ilen = strlen(info);
-    int len = sizeof(mx_header_t) + 1 + ilen;
-    char buf[len + 1];
+    char buf[MX_HEADER_MAX + ilen + 1];
 
-    mx_header_t *mhp = (mx_header_t *) buf;
-    mx_websocket_header_build(mhp, len, opname, muxid);
-    buf[sizeof(*mhp)] = '\n';
-    memcpy(buf + sizeof(*mhp) + 1, info, ilen + 1);
+    int len = mx_websocket_header_format(auth_client, buf, ilen, opname,
+					 muxid, mrp->mr_id, 0);
+    memcpy(buf + len, info, ilen + 1);
+    len += ilen;
 
-    int rc = write(auth_client->ms_sock, buf, len);
+    int rc = mx_websocket_send(auth_client, muxid, buf, len);
     if (rc > 0) {
 	if (rc != len)
 	    mx_log("%s (auth: %s) complete very short write (%d/%d)",
@@ -292,7 +1378,7 @@ mx_websocket_send_simple (mx_sock_t *client,
 static char *
 mx_json_escape (const char *str)
 {
-    static char buf[BUFSIZ*2];
+    static MX_THREAD_LOCAL char buf[BUFSIZ*2];
     const char *cp = str;
     char *dp = buf;
 
@@ -340,7 +1426,7 @@ mx_json_escape (const char *str)
 static char *
 mx_auth_json_rsp (mx_request_t *mrp, const char *info)
 {
-    static char response[BUFSIZ*2];
+    static MX_THREAD_LOCAL char response[BUFSIZ*2];
     char buf[BUFSIZ*2], *bp = buf, *ep = buf + sizeof(buf);
 
     bp += snprintf_safe(bp, ep - bp, "{\"prompt\":\"%s\"", mx_json_escape(info));
@@ -383,90 +1469,190 @@ mx_websocket_get_password (MX_TYPE_GET_PASSWORD_ARGS)
 				    MX_OP_PASSWORD, "get password", TRUE);
 }
 
+/*
+ * If we can't compress a reply, we tell the client and send the rest
+ * of it plain.  The client drops the muxid on the error, so it will
+ * ignore that too.  Only this request's client is told, even if
+ * others share its reply.
+ */
+static void
+mx_websocket_deflate_failed (mx_sock_t *msp, mx_request_t *mrp)
+{
+    mrp->mr_flags &= ~MRF_DEFLATE;
+    mx_deflate_end(mrp);
+    mx_websocket_error(msp, mrp, "could not compress reply");
+}
+
+/*
+ * Write a chunk of reply to the websocket.  The first chunk after
+ * each write gets a header.  Channel reads leave BUFFER_HEADROOM in
+ * front of the data, so the header is normally built in place and
+ * the whole thing goes out in one write; otherwise the header and
+ * data are gathered by writev.  Either way, the data isn't copied
+ * unless the socket won't take it all, in which case the rest is
+ * queued (see mx_websocket_enqueue).  A compressed chunk is the
+ * exception: it's written from a buffer of its own (see deflate.c).
+ */
+static void
+mx_websocket_reply (mx_sock_t *msp, mx_request_t *mrp, mx_buffer_t *mbp,
+		    int header)
+{
+    mx_muxid_t muxid = mrp ? mrp->mr_muxid : 0;
+    mx_buffer_t *zbp = NULL;
+    char hbuf[MX_HEADER_MAX], *hp;
+    struct iovec iov[2];
+    unsigned flags = 0;
+    int rc, cnt = 0;
+
+    if (mrp && (mrp->mr_flags & MRF_DEFLATE)) {
+	zbp = mx_deflate(mrp, mbp->mb_data + mbp->mb_start, mbp->mb_len,
+			 FALSE, MX_HEADER_MAX);
+	mx_buffer_reset(mbp);
+	if (zbp == NULL) {
+	    mx_websocket_deflate_failed(msp, mrp);
+	    return;
+	}
+
+	mbp = zbp;
+	flags |= MX_HF_DEFLATE;
+    }
+
+    if (zbp || header) {
+	unsigned long dlen = mbp->mb_len;
+	unsigned hlen = mx_websocket_header_len(msp, flags);
+
+	if (mbp->mb_start >= hlen) {
+	    mbp->mb_start -= hlen;
+	    mbp->mb_len += hlen;
+	    hp = mbp->mb_data + mbp->mb_start;
+	} else {
+	    hp = hbuf;
+	    iov[cnt].iov_base = hbuf;
+	    iov[cnt++].iov_len = hlen;
+	}
+
+	mx_websocket_header_format(msp, hp, dlen, MX_OP_REPLY, muxid,
+				   mrp ? mrp->mr_id : 0, flags);
+    }
+
+    iov[cnt].iov_base = mbp->mb_data + mbp->mb_start;
+    iov[cnt++].iov_len = mbp->mb_len;
+
+    rc = mx_websocket_sendv(msp, muxid, iov, cnt);
+    if (rc < 0 && errno != EPIPE)
+	mx_log("%s: write error: %s", mx_sock_title(msp), strerror(errno));
+
+    /* It's all written or queued (or our client is gone) */
+    mx_buffer_reset(mbp);
+
+    if (zbp)
+	mx_buffer_free(zbp);
+}
+
+/*
+ * Copy a chunk of reply to the requests sharing it (see
+ * mx_request_coalesce).  Each needs its own buffer, since the
+ * leader's is reused, and each is compressed (or not) on its own.
+ */
+static void
+mx_websocket_fanout (mx_request_t *mrp, mx_buffer_t *mbp, int header)
+{
+    mx_request_t *fmrp;
+    mx_buffer_t *copy;
+
+    TAILQ_FOREACH(fmrp, &mrp->mr_followers, mr_follow_link) {
+	if (fmrp->mr_client == NULL || fmrp->mr_state == MSS_FAILED
+		|| fmrp->mr_state == MSS_ERROR)
+	    continue;
+
+	copy = mx_buffer_create(BUFFER_HEADROOM + mbp->mb_len);
+	if (copy == NULL) {
+	    mx_websocket_error(fmrp->mr_client, fmrp, "out of memory");
+	    continue;
+	}
+
+	copy->mb_start = BUFFER_HEADROOM;
+	copy->mb_len = mbp->mb_len;
+	memcpy(copy->mb_data + copy->mb_start, mbp->mb_data + mbp->mb_start,
+	       mbp->mb_len);
+
+	mx_websocket_reply(fmrp->mr_client, fmrp, copy, header);
+	mx_buffer_free(copy);
+    }
+}
+
 static int
 mx_websocket_write (MX_TYPE_WRITE_ARGS)
 {
     mx_log("%s write rb %lu/%lu",
            mx_sock_title(msp), mbp->mb_start, mbp->mb_len);
-    int len = mbp->mb_len;
-    char *buf = mbp->mb_data + mbp->mb_start;
-    char *mbuf = NULL;
-    int header_len = sizeof(mx_header_t) + 1;
-
-    if (mcp && (mcp->mc_state == MSS_RPC_INITIAL
-		|| mcp->mc_state == MSS_RPC_IDLE)) {
-	len += header_len;
-
-	if (mbp->mb_start < (unsigned) header_len) {
-	    mbuf = malloc(len);
-	    if (mbuf == NULL)
-		return TRUE;
-	    memcpy(mbuf + header_len, buf, mbp->mb_len);
-	    buf = mbuf;
-	} else {
-	    mbp->mb_start -= header_len;
-	    mbp->mb_len += header_len;
-	    buf -= header_len;
-	}
+    mx_request_t *mrp = mcp->mc_request;
+    int header = (mcp->mc_state == MSS_RPC_INITIAL
+		  || mcp->mc_state == MSS_RPC_IDLE);
 
-	mx_muxid_t muxid = mcp->mc_request ? mcp->mc_request->mr_muxid : 0;
-	mx_header_t *mhp = (mx_header_t *) buf;
-	mx_websocket_header_build(mhp, len, MX_OP_REPLY, muxid);
-	buf[sizeof(*mhp)] = '\n';
+    if (mrp) {
+	/* No one else can join us now */
+	mrp->mr_flags |= MRF_REPLYING;
 
-	mcp->mc_state = MSS_RPC_READ_REPLY;
-    }
+	/* The reply cache sees it before it's compressed */
+	if (mrp->mr_cache)
+	    mx_cache_collect(mrp, mbp->mb_data + mbp->mb_start, mbp->mb_len);
 
-    int rc = write(msp->ms_sock, buf, len);
-    if (rc < 0) {
-	if (errno == EPIPE)
-	    goto move_along;
-
-    } else if (rc > 0) {
-	if (rc == len) {
-	    mx_buffer_reset(mbp);
-	    mcp->mc_state = MSS_RPC_IDLE;
-	} else if (rc < header_len) {
-	    mx_log("%s very short write (%d/%d/%lu)",
-		   mx_sock_title(msp), rc, len, mbp->mb_len);
-	} else {
-	    /*
-	     * If we didn't used a malloc buffer, we want header_len
-	     * to count as part of the length.
-	     */
-	move_along:
-	    if (mbuf)
-		rc -= header_len;
-	    mbp->mb_start += rc;
-	    mbp->mb_len -= rc;
-	}
+	if (!TAILQ_EMPTY(&mrp->mr_followers))
+	    mx_websocket_fanout(mrp, mbp, header);
     }
 
-    if (mbuf)
-	free(mbuf);
+    mx_websocket_reply(msp, mrp, mbp, header);
+    mcp->mc_state = MSS_RPC_IDLE;
 
     return FALSE;
 }
 
+/*
+ * End a request's compressed stream, so the client sees the end of
+ * it before the "complete".
+ */
+static void
+mx_websocket_deflate_finish (mx_sock_t *msp, mx_request_t *mrp)
+{
+    mx_buffer_t *zbp = mx_deflate(mrp, NULL, 0, TRUE, MX_HEADER_MAX);
+    unsigned hlen = mx_websocket_header_len(msp, MX_HF_DEFLATE);
+
+    if (zbp == NULL) {
+	mx_websocket_deflate_failed(msp, mrp);
+	return;
+    }
+
+    zbp->mb_start -= hlen;
+    zbp->mb_len += hlen;
+    mx_websocket_header_format(msp, zbp->mb_data + zbp->mb_start,
+			       zbp->mb_len - hlen, MX_OP_REPLY,
+			       mrp->mr_muxid, mrp->mr_id, MX_HF_DEFLATE);
+
+    mx_websocket_send(msp, mrp->mr_muxid, zbp->mb_data + zbp->mb_start,
+		      zbp->mb_len);
+    mx_buffer_free(zbp);
+}
+
+/*
+ * Send the "complete" that ends a reply.  Returns the state our
+ * socket was in, since releasing the request may change it.
+ */
 static int
-mx_websocket_write_complete (MX_TYPE_WRITE_COMPLETE_ARGS)
+mx_websocket_reply_complete (mx_sock_t *msp, mx_request_t *mrp)
 {
     mx_sock_websocket_t *mswp = mx_sock(msp, MST_WEBSOCKET);
-    mx_log("%s write complete", mx_sock_title(msp));
 
-    if (mcp->mc_state == MSS_RPC_READ_REPLY) {
-	/* XXX Do something */
-    }
+    if (mrp && (mrp->mr_flags & MRF_DEFLATE) && mx_deflate_started(mrp))
+	mx_websocket_deflate_finish(msp, mrp);
 
-    int len = sizeof(mx_header_t) + 1;
-    char buf[len];
+    char buf[MX_HEADER_MAX];
 
-    mx_muxid_t muxid = mcp->mc_request ? mcp->mc_request->mr_muxid : 0;
-    mx_header_t *mhp = (mx_header_t *) buf;
-    mx_websocket_header_build(mhp, len, MX_OP_COMPLETE, muxid);
-    buf[sizeof(*mhp)] = '\n';
-	
-    int rc = write(msp->ms_sock, buf, len);
+    mx_muxid_t muxid = mrp ? mrp->mr_muxid : 0;
+    int len = mx_websocket_header_format(msp, buf, 0, MX_OP_COMPLETE, muxid,
+					 mrp ? mrp->mr_id : 0, 0);
+
+    int rc = mx_websocket_send(msp, muxid, buf, len);
     if (rc > 0) {
 	if (rc != len)
 	    mx_log("%s complete very short write (%d/%d)",
@@ -477,9 +1663,63 @@ mx_websocket_write_complete (MX_TYPE_WRITE_COMPLETE_ARGS)
 
     mswp->msw_requests_complete += 1;
 
-    if (mcp->mc_request) {
-	mx_log("C%u complete R%u", mcp->mc_id, mcp->mc_request->mr_id);
-	mx_request_release(mcp->mc_request);
+    /* Let the real websocket know (after the complete frame) */
+    if (mx_websocket_is_proxy(mswp))
+	mx_worker_reply(MHO_COMPLETE, msp->ms_id, muxid, NULL);
+
+    return state;
+}
+
+/*
+ * Finish the replies of the requests sharing this one's, and free
+ * them; they never had sessions or channels of their own.
+ */
+static void
+mx_websocket_fanout_complete (mx_request_t *mrp)
+{
+    mx_request_t *fmrp;
+    mx_sock_t *fmsp;
+
+    while ((fmrp = TAILQ_FIRST(&mrp->mr_followers)) != NULL) {
+	TAILQ_REMOVE(&mrp->mr_followers, fmrp, mr_follow_link);
+	fmrp->mr_leader = NULL;
+
+	fmsp = fmrp->mr_client;
+	if (fmsp && fmrp->mr_state != MSS_FAILED
+		&& fmrp->mr_state != MSS_ERROR) {
+	    if (mx_websocket_reply_complete(fmsp, fmrp) == MSS_READ_EOF) {
+		mx_log("%s eof and complete", mx_sock_title(fmsp));
+		fmsp->ms_state = MSS_FAILED;
+	    }
+
+	    mx_log("%s complete R%u (shared with R%u)",
+		   mx_sock_title(fmsp), fmrp->mr_id, mrp->mr_id);
+	}
+
+	mx_request_free(fmrp);
+    }
+}
+
+static int
+mx_websocket_write_complete (MX_TYPE_WRITE_COMPLETE_ARGS)
+{
+    mx_log("%s write complete", mx_sock_title(msp));
+
+    if (mcp->mc_state == MSS_RPC_READ_REPLY) {
+	/* XXX Do something */
+    }
+
+    mx_request_t *mrp = mcp->mc_request;
+    if (mrp) {
+	mx_cache_store(mrp);
+	mx_websocket_fanout_complete(mrp);
+    }
+
+    int state = mx_websocket_reply_complete(msp, mrp);
+
+    if (mrp) {
+	mx_log("C%u complete R%u", mcp->mc_id, mrp->mr_id);
+	mx_request_release(mrp);
     }
 
     if (state == MSS_READ_EOF) {
@@ -491,6 +1731,26 @@ mx_websocket_write_complete (MX_TYPE_WRITE_COMPLETE_ARGS)
     return FALSE;
 }
 
+/*
+ * Answer a request from the reply cache.  The request never had a
+ * session or channel, so we free it here, leaving our socket's state
+ * alone.
+ */
+void
+mx_websocket_cached_reply (mx_sock_websocket_t *mswp, mx_request_t *mrp,
+			   mx_buffer_t *mbp)
+{
+    mx_sock_t *msp = &mswp->msw_base;
+
+    mx_websocket_reply(msp, mrp, mbp, TRUE);
+    mx_buffer_free(mbp);
+
+    mx_websocket_reply_complete(msp, mrp);
+
+    mx_log("%s complete R%u from cache", mx_sock_title(msp), mrp->mr_id);
+    mx_request_free(mrp);
+}
+
 static void
 mx_websocket_error (MX_TYPE_ERROR_ARGS)
 {
@@ -509,69 +1769,103 @@ mx_websocket_close (MX_TYPE_CLOSE_ARGS)
     mx_request_release_client(msp);
     mx_session_release_client(msp);
 
+    /* Workers may have proxies for us */
+    if (!mx_websocket_is_proxy(mswp))
+	mx_worker_handoff(-1, MHO_CLOSE, msp->ms_id, NULL);
+
     if (mswp->msw_rbufp)
 	mx_buffer_free(mswp->msw_rbufp);
+    mx_buffer_free(mswp->msw_outq);
+    mswp->msw_outq = NULL;
+    mswp->msw_outq_len = 0;
+    free(mswp->msw_routes);
 
-    close(msp->ms_sock);
+    if ((int) msp->ms_sock >= 0)
+	close(msp->ms_sock);
     msp->ms_sock = -1;
 }
 
 void
 mx_websocket_handle_request (mx_sock_websocket_t *mswp, mx_buffer_t *mbp)
 {
-    char *trailer;
-    mx_header_t *mhp;
+    mx_header_info_t mhi;
+    char *trailer, empty[] = "";
     const char *tmp;
-    int reqid = 0;
-
-    while (mbp->mb_len > sizeof(*mhp)) {
-	char *cp = mbp->mb_data + mbp->mb_start;
-	char *ep = mbp->mb_data + mbp->mb_start + mbp->mb_len;
-	mhp = (mx_header_t *) cp;
-
-	if (mhp->mh_pound != '#' || mhp->mh_version[0] != MX_HEADER_VERSION_0
-		|| mhp->mh_version[1] != MX_HEADER_VERSION_1
-		|| mhp->mh_dot1 != '.' || mhp->mh_dot2 != '.'
-		|| mhp->mh_dot3 != '.' || mhp->mh_dot4 != '.') {
-	    mx_log("%s parse request fails (%c)",
-		    mx_sock_title(&mswp->msw_base), *cp);
-	    goto fatal;
+    int rc, reqid = 0;
+    mx_buffer_t *frame = NULL;
+    unsigned long want = 0;	/* Room needed to make progress */
+    unsigned long rest;
+
+    for (;;) {
+	/* The body of a streamed RPC goes straight to its request */
+	if (mswp->msw_upload_id) {
+	    if (!mx_websocket_upload(mswp, mbp, &want))
+		break;
+	    continue;
 	}
 
-	unsigned long len = strntoul(mhp->mh_len, sizeof(mhp->mh_len));
-	mx_muxid_t muxid = strntoul(mhp->mh_muxid, sizeof(mhp->mh_muxid));
-	char *operation = mhp->mh_operation;
-	for (cp = operation + sizeof(mhp->mh_operation) - 1;
-		cp >= operation; cp--)
-	    if (*cp != ' ')
-		break;
-	*++cp = '\0';
-	mx_log("%s incoming request '%s', muxid %lu, len %lu", 
-		mx_sock_title(&mswp->msw_base), operation, muxid, len);
+	rc = mx_websocket_header_parse(mswp, mbp, &mhi, &want);
+	if (rc < 0)
+	    goto fatal;
+	if (rc == 0)
+	    break;
+
+	unsigned long len = mhi.mhi_len;
+	mx_muxid_t muxid = mhi.mhi_muxid;
+	const char *operation = mhi.mhi_operation;
 
+	int stream = FALSE;
 	if (mbp->mb_len < len) {
-	    mx_log("%s short read (%lu/%lu)", mx_sock_title(&mswp->msw_base),
-		    len, mbp->mb_len);
-	    goto fatal;
-	}
+	    /*
+	     * Big RPCs don't wait for the whole frame; their bodies
+	     * are written to the device as they arrive.  With workers,
+	     * the frame is handed over whole, so there we wait.
+	     */
+	    if (opt_workers == 0 && opt_upload_stream_min > 0
+		    && len > (unsigned long) opt_upload_stream_min
+		    && streq(operation, MX_OP_RPC)) {
+		stream = TRUE;
+
+	    } else if (len > (unsigned long) opt_frame_max) {
+		mx_log("%s request too large (%lu bytes)",
+		       mx_sock_title(&mswp->msw_base), len);
+		goto fatal;
 
-	trailer = cp = mhp->mh_trailer;
-	for (; cp < ep; cp++) {
-	    if (*cp == '\n')
+	    } else {
+		DBG_POLL("%s partial request (%lu/%lu)",
+			 mx_sock_title(&mswp->msw_base), mbp->mb_len, len);
+		want = len;
 		break;
+	    }
 	}
-	if (cp >= ep)
-	    goto fatal;
-	*cp++ = '\0';		/* Skip over '\n' */
+
+	mx_log("%s incoming request '%s', muxid %lu, len %lu", 
+		mx_sock_title(&mswp->msw_base), operation, muxid, len);
+
+	/*
+	 * Parsing scribbles on the header, so if workers are running,
+	 * keep a clean copy in case the frame belongs to one of them.
+	 */
+	if (opt_workers > 0 && !mx_websocket_is_proxy(mswp))
+	    frame = mx_buffer_copy(mbp, len);
+
+	/* Replies go back in the version the client is speaking */
+	if (mhi.mhi_version == 2)
+	    mswp->msw_flags |= MSWF_HEADER2;
+	else
+	    mswp->msw_flags &= ~MSWF_HEADER2;
+
+	trailer = mhi.mhi_attrs ?: empty;
+	if (mhi.mhi_attrs_end)
+	    *mhi.mhi_attrs_end = '\0'; /* Trim the newline */
 
 	/*
 	 * Mark the header data as consumed.  The rest of the payload
 	 * may be used during the request.
 	 */
-	int delta = cp - (mbp->mb_data + mbp->mb_start);
-	mbp->mb_start += delta; 
-	mbp->mb_len -= delta;
-	len -= delta;
+	mbp->mb_start += mhi.mhi_hlen;
+	mbp->mb_len -= mhi.mhi_hlen;
+	len -= mhi.mhi_hlen;
 
 	mx_log("%s websocket request op '%s', rest '%s', muxid: %lu",
 		mx_sock_title(&mswp->msw_base), operation, trailer, muxid);
@@ -589,21 +1883,70 @@ mx_websocket_handle_request (mx_sock_websocket_t *mswp, mx_buffer_t *mbp)
 	 * Get our passed in request id.  If no request id is passed in, then
 	 * use the muxid to find the request
 	 */
+	reqid = mhi.mhi_reqid;
 	tmp = xml_get_attribute(attrs, "reqid");
 	if (tmp) {
 	    reqid = strtol(tmp, NULL, 10);
 	}
 
+	if (stream) {
+	    if (mx_websocket_upload_begin(mswp, mbp, len, muxid,
+					  operation, attrs) == NULL)
+		goto fatal;
+	    continue;
+	}
+
+	if (frame) {
+	    int worker = mx_websocket_route(mswp, operation, muxid, attrs);
+
+	    if (worker >= 0) {
+		mx_log("%s handing '%s' muxid %lu to worker %d",
+		       mx_sock_title(&mswp->msw_base), operation, muxid, worker);
+		if (streq(operation, MX_OP_RPC)
+			|| streq(operation, MX_OP_HTMLRPC))
+		    mswp->msw_requests_made += 1;
+
+		mx_worker_handoff(worker, MHO_FRAME, mswp->msw_base.ms_id,
+				  frame);
+		frame = NULL;
+
+		mbp->mb_start += len;
+		mbp->mb_len -= len;
+		continue;
+	    }
+
+	    mx_buffer_free(frame);
+	    frame = NULL;
+	}
+
+	/* Handlers see only this frame's payload */
+	rest = mbp->mb_len - len;
+	mbp->mb_len = len;
+
 	if (streq(operation, MX_OP_ERROR)) {
 	    mx_request_t *mrp = mx_request_find(muxid, reqid);
 	    if (mrp) {
-		mx_request_release(mrp);
-		mx_sock_close(&mrp->mr_session->mss_base);
+		mx_sock_session_t *mssp = mrp->mr_session;
+
+		/* An error during setup (a refused hostkey) ends the session */
+		if (mssp && mssp->mss_base.ms_state != MSS_ESTABLISHED)
+		    mssp->mss_base.ms_state = MSS_FAILED;
+
+		mx_request_cancel(mrp);
 	    } else {
 		mx_log("%s websocket error ignored",
 			mx_sock_title(&mswp->msw_base));
 	    }
 
+	} else if (streq(operation, MX_OP_CANCEL)) {
+	    mx_request_t *mrp = mx_request_find(muxid, reqid);
+	    if (mrp) {
+		mx_request_cancel(mrp);
+	    } else {
+		mx_log("%s websocket cancel for muxid %lu ignored",
+			mx_sock_title(&mswp->msw_base), muxid);
+	    }
+
 	} else if (streq(operation, MX_OP_RPC)
 		|| streq(operation, MX_OP_HTMLRPC)) {
 	    
@@ -616,6 +1959,8 @@ mx_websocket_handle_request (mx_sock_websocket_t *mswp, mx_buffer_t *mbp)
 	    if (streq(operation, MX_OP_HTMLRPC)) {
 		mrp->mr_flags |= MRF_HTML;
 	    }
+	    if (mswp->msw_flags & MSWF_DEFLATE)
+		mrp->mr_flags |= MRF_DEFLATE;
 
 	    mswp->msw_requests_made += 1;
 	    mx_request_start_rpc(mswp, mrp);
@@ -623,21 +1968,17 @@ mx_websocket_handle_request (mx_sock_websocket_t *mswp, mx_buffer_t *mbp)
 	} else if (streq(operation, MX_OP_HOSTKEY)) {
 	    mx_request_t *mrp = mx_request_find(muxid, reqid);
 	    if (mrp) {
-		if (mrp->mr_state != MSS_HOSTKEY) {
+		mx_sock_session_t *mssp = mrp->mr_session;
+
+		if (mrp->mr_state != MSS_HOSTKEY || mssp == NULL) {
 		    mx_log("R%u in wrong state", mrp->mr_id);
-		} else if (!mx_websocket_test_hostkey(mrp->mr_session,
-			    mrp, mbp)) {
+		} else if (!mx_websocket_test_hostkey(mssp, mrp, mbp)) {
 		    mx_log("R%u hostkey was declined; closing request",
 			    mrp->mr_id);
-		    mx_websocket_error(mrp->mr_client, mrp,
-			    "host key was declined");
-		    mx_request_release(mrp);
-		    mx_sock_close(&mrp->mr_session->mss_base);
-
-		} else if (mx_session_check_auth(mrp->mr_session, mrp)) {
-		    mx_log("R%u waiting for check auth", mrp->mr_id);
+		    /* Fails every request waiting on the session */
+		    mx_session_fail(mssp, "host key was declined");
 		} else {
-		    mx_request_restart_rpc(mrp);
+		    mx_session_resume(mssp, mrp);
 		}
 
 	    } else {
@@ -652,14 +1993,13 @@ mx_websocket_handle_request (mx_sock_websocket_t *mswp, mx_buffer_t *mbp)
 		    mx_log("R%u in wrong state (%u)",
 			    mrp->mr_id, mrp->mr_state);
 		} else {
+		    if (mrp->mr_passphrase)
+			free(mrp->mr_passphrase);
 		    mrp->mr_passphrase = strndup(mbp->mb_data + mbp->mb_start,
 			    mbp->mb_len);
 
-		    if (mx_session_check_auth(mrp->mr_session, mrp)) {
-			mx_log("R%u waiting for check auth", mrp->mr_id);
-		    } else {
-			mx_request_restart_rpc(mrp);
-		    }
+		    if (mrp->mr_session)
+			mx_session_resume(mrp->mr_session, mrp);
 		}
 	    } else {
 		mx_log("%s muxid %lu not found (ignored)",
@@ -672,14 +2012,13 @@ mx_websocket_handle_request (mx_sock_websocket_t *mswp, mx_buffer_t *mbp)
 		if (mrp->mr_state != MSS_PASSWORD) {
 		    mx_log("R%u in wrong state (%u)", mrp->mr_id, mrp->mr_state);
 		} else {
+		    if (mrp->mr_password)
+			free(mrp->mr_password);
 		    mrp->mr_password = strndup(mbp->mb_data + mbp->mb_start,
 			    mbp->mb_len);
 
-		    if (mx_session_check_auth(mrp->mr_session, mrp)) {
-			mx_log("R%u waiting for check auth", mrp->mr_id);
-		    } else {
-			mx_request_restart_rpc(mrp);
-		    }
+		    if (mrp->mr_session)
+			mx_session_resume(mrp->mr_session, mrp);
 		}
 	    } else {
 		mx_log("%s muxid %lu not found (ignored)",
@@ -702,6 +2041,16 @@ mx_websocket_handle_request (mx_sock_websocket_t *mswp, mx_buffer_t *mbp)
 	    /* Mark this socket as containing a AUTH MUXID */
 	    mswp->msw_base.ms_auth = TRUE;
 
+	    /* The client can ask for compressed replies */
+	    tmp = xml_get_attribute(attrs, "compress");
+	    if (tmp && streq(tmp, "deflate") && opt_compress_level > 0
+		    && !(mswp->msw_flags & MSWF_DEFLATE)) {
+		mx_log("%s replies will be compressed",
+		       mx_sock_title(&mswp->msw_base));
+		mswp->msw_flags |= MSWF_DEFLATE;
+		mx_worker_handoff(-1, MHO_DEFLATE, mswp->msw_base.ms_id, NULL);
+	    }
+
 #if 0
 	} else if (streq(operation, "command")) {
 	} else if (streq(operation, "password")) {
@@ -716,14 +2065,19 @@ mx_websocket_handle_request (mx_sock_websocket_t *mswp, mx_buffer_t *mbp)
 	    mx_sock_session_t *mssp = mx_session(mrp);
 	    if (mssp == NULL) {
 		mx_request_error(mrp, "no session");
-		return;
+		goto next;
 	    }
 	    mx_channel_t *mcp;
 	    if (mrp->mr_channel) {
 		mcp = mrp->mr_channel;
 	    } else {
 		mx_request_error(mrp, "no previous rpc channel");
-		return;
+		goto next;
+	    }
+
+	    if (mx_channel_is_opening(mcp)) {
+		mx_request_error(mrp, "rpc channel is not open yet");
+		goto next;
 	    }
 
 	    mx_buffer_t *newp = mx_buffer_copy(mbp, mbp->mb_len);
@@ -739,17 +2093,27 @@ mx_websocket_handle_request (mx_sock_websocket_t *mswp, mx_buffer_t *mbp)
 		    mx_sock_title(&mswp->msw_base), operation);
 	}
 
+    next:
 	/* Move past this message and look at the next one */
 	mbp->mb_start += len;
-	mbp->mb_len -= len;
+	mbp->mb_len = rest;
     }
 
-    /* If the buffer is empty, reset the start */
-    if (mbp->mb_len == 0)
-	mbp->mb_start = 0;
+    /* Make room for the rest of a partial frame */
+    if (mbp != mswp->msw_rbufp) {
+	if (mbp->mb_len)
+	    mx_log("%s dropping %lu bytes of partial request",
+		   mx_sock_title(&mswp->msw_base), mbp->mb_len);
+    } else if (!mx_websocket_fit_buffer(mswp, want)) {
+	mx_log("%s no room for request (%lu bytes)",
+	       mx_sock_title(&mswp->msw_base), want);
+	goto fatal;
+    }
     return;
 
 fatal:
+    if (frame)
+	mx_buffer_free(frame);
     mx_log("%s fatal error parsing request", mx_sock_title(&mswp->msw_base));
     mswp->msw_base.ms_state = MSS_FAILED;
     mx_buffer_reset(mbp);
@@ -761,9 +2125,26 @@ mx_websocket_print (MX_TYPE_PRINT_ARGS)
     mx_sock_websocket_t *mswp = mx_sock(msp, MST_WEBSOCKET);
     mx_buffer_t *mbp = mswp->msw_rbufp;
 
-    mx_log("%*s%srb %lu/%lu", indent, "", prefix, mbp->mb_start, mbp->mb_len);
+    if (mx_websocket_is_proxy(mswp))
+	mx_log("%*s%sproxy in worker %d", indent, "", prefix, mx_worker_self());
+    if (mswp->msw_flags & MSWF_RFC6455)
+	mx_log("%*s%sbrowser connected directly (rfc6455)", indent, "", prefix);
+    if (mbp)
+	mx_log("%*s%srb %lu/%lu/%lu", indent, "", prefix,
+	       mbp->mb_start, mbp->mb_len, mbp->mb_size);
     mx_log("%*s%srequests: made %u, complete %u", indent, "", prefix,
 	   mswp->msw_requests_made, mswp->msw_requests_complete);
+    if (mswp->msw_upload_id)
+	mx_log("%*s%supload for R%u, %lu bytes to come%s", indent, "", prefix,
+	       mswp->msw_upload_id, mswp->msw_upload_left,
+	       (mswp->msw_flags & MSWF_UPLOAD_WAIT) ? " (waiting)" : "");
+    if (mswp->msw_flags & MSWF_DEFLATE)
+	mx_log("%*s%sreplies are compressed", indent, "", prefix);
+    if (mswp->msw_nroutes || mswp->msw_outq || mswp->msw_blocked)
+	mx_log("%*s%sworker routes %u, output queued %lu%s, blocked %lu times",
+	       indent, "", prefix, mswp->msw_nroutes, mswp->msw_outq_len,
+	       (mswp->msw_flags & MSWF_BLOCKED) ? " (blocked)" : "",
+	       mswp->msw_blocked);
 }
 
 
@@ -782,6 +2163,7 @@ mx_websocket_init (void)
 	.mti_get_passphrase = mx_websocket_get_passphrase,
 	.mti_get_password = mx_websocket_get_password,
 	.mti_write = mx_websocket_write,
+	.mti_is_blocked = mx_websocket_is_blocked,
 	.mti_write_complete = mx_websocket_write_complete,
 	.mti_error = mx_websocket_error,
 	.mti_close = mx_websocket_close,
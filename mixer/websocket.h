@@ -19,9 +19,53 @@
 #define MX_OP_HTMLRPC	"htmlrpc"
 #define MX_OP_AUTHINIT	"authinit"
 #define MX_OP_DATA	"data"
+#define MX_OP_CANCEL	"cancel"
+
+/* Operation codes, in place of the names, in version 2 headers */
+#define MX_OPC_COMPLETE	1
+#define MX_OPC_ERROR	2
+#define MX_OPC_HOSTKEY	3
+#define MX_OPC_PASSPHRASE 4
+#define MX_OPC_PASSWORD	5
+#define MX_OPC_REPLY	6
+#define MX_OPC_RPC	7
+#define MX_OPC_AUTHINIT	8
+#define MX_OPC_DATA	9
+#define MX_OPC_CANCEL	10
+#define MX_OPC_MAX	11	/* Number of codes (plus one) */
+
+/* Flags for version 2 headers */
+#define MX_HF_HTML	(1<<0)	/* An rpc wants an html reply ("htmlrpc") */
+#define MX_HF_DEFLATE	(1<<1)	/* Payload is deflated and base64 encoded */
+
+mx_sock_websocket_t *
+mx_websocket_create (int sock, unsigned flags);
 
 void
 mx_websocket_handle_request (mx_sock_websocket_t *mswp, mx_buffer_t *mbp);
 
+void
+mx_websocket_proxy_input (unsigned wsid, mx_buffer_t *mbp);
+
+void
+mx_websocket_proxy_close (unsigned wsid);
+
+void
+mx_websocket_proxy_output (unsigned wsid, mx_muxid_t muxid, int worker,
+			   mx_buffer_t *mbp);
+
+void
+mx_websocket_proxy_complete (unsigned wsid, mx_muxid_t muxid);
+
+void
+mx_websocket_proxy_block (unsigned wsid, int blocked);
+
+void
+mx_websocket_proxy_deflate (unsigned wsid);
+
+void
+mx_websocket_cached_reply (mx_sock_websocket_t *mswp, mx_request_t *mrp,
+			   mx_buffer_t *mbp);
+
 void
 mx_websocket_init (void);
@@ -0,0 +1,455 @@
+/*
+ * $Id$
+ *
+ * Copyright (c) 2013, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * Worker threads.  With "--workers <n>", SSH sessions (and their
+ * channels and requests) are sharded across <n> threads by target,
+ * each running its own copy of mx_main_loop over its own sockets.
+ * libssh2 sessions never leave the thread that opened them.
+ *
+ * The main thread keeps the listeners, consoles, forwarders, and
+ * websockets.  When a websocket frame arrives for a target owned
+ * by a worker, the frame is handed to that worker, which feeds it
+ * to a proxy websocket (see websocket.c).  Anything the proxy
+ * writes is handed back to the main thread, which writes it to
+ * the real websocket.
+ *
+ * Handoffs go thru lock-free queues (mx_handoff_queue_t), one per
+ * worker plus one for the main thread.  Each queue's consumer sees
+ * it as an MST_HANDOFF socket, whose fd is the read end of a pipe
+ * used to wake it.
+ */
+
+#include <pthread.h>
+
+#include "local.h"
+#include "worker.h"
+#include "event.h"
+#include "request.h"
+#include "websocket.h"
+
+typedef struct mx_worker_s {
+    int mw_index;		/* Our index in mx_workers */
+    pthread_t mw_thread;	/* Thread running our event loop */
+    const char *mw_backend;	/* Event backend name (or NULL) */
+    mx_handoff_queue_t mw_queue; /* Messages from the main thread */
+} mx_worker_t;
+
+static mx_worker_t *mx_workers;	/* Array of workers */
+static int mx_worker_count;	/* Number of workers running */
+static mx_handoff_queue_t mx_worker_main_queue; /* For the main thread */
+
+/* Index of the worker we're running in (-1 for the main thread) */
+static MX_THREAD_LOCAL int mx_worker_index = -1;
+
+static int
+mx_handoff_queue_init (mx_handoff_queue_t *mhqp)
+{
+    int fds[2];
+
+    bzero(mhqp, sizeof(*mhqp));
+
+    if (pipe(fds) < 0) {
+	mx_log("worker: pipe: %s", strerror(errno));
+	return FALSE;
+    }
+
+    mx_nonblocking(fds[0]);
+    mx_nonblocking(fds[1]);
+
+    mhqp->mhq_rfd = fds[0];
+    mhqp->mhq_wfd = fds[1];
+    mhqp->mhq_head = mhqp->mhq_tail = &mhqp->mhq_stub;
+
+    return TRUE;
+}
+
+static void
+mx_handoff_push (mx_handoff_queue_t *mhqp, mx_handoff_t *mhop)
+{
+    mx_handoff_t *prev;
+
+    mhop->mho_next = NULL;
+    prev = __atomic_exchange_n(&mhqp->mhq_head, mhop, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->mho_next, mhop, __ATOMIC_RELEASE);
+}
+
+/*
+ * Queue a message and wake the consumer.  Only the first message
+ * since the consumer last looked needs to write to the pipe.
+ */
+static void
+mx_handoff_send (mx_handoff_queue_t *mhqp, mx_handoff_t *mhop)
+{
+    mx_handoff_push(mhqp, mhop);
+    __atomic_add_fetch(&mhqp->mhq_pushed, 1, __ATOMIC_RELAXED);
+
+    if (!__atomic_exchange_n(&mhqp->mhq_signalled, 1, __ATOMIC_ACQ_REL))
+	(void) write(mhqp->mhq_wfd, "", 1);
+}
+
+/*
+ * Pop the oldest message, or NULL if there's none.  If a producer
+ * is between its swap and its store, we return NULL; its wakeup
+ * will bring us back.  Only the consumer calls this.
+ */
+static mx_handoff_t *
+mx_handoff_pop (mx_handoff_queue_t *mhqp)
+{
+    mx_handoff_t *tail = mhqp->mhq_tail;
+    mx_handoff_t *next = __atomic_load_n(&tail->mho_next, __ATOMIC_ACQUIRE);
+
+    if (tail == &mhqp->mhq_stub) {
+	if (next == NULL)
+	    return NULL;
+	mhqp->mhq_tail = tail = next;
+	next = __atomic_load_n(&tail->mho_next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next) {
+	mhqp->mhq_tail = next;
+	return tail;
+    }
+
+    if (tail != __atomic_load_n(&mhqp->mhq_head, __ATOMIC_ACQUIRE))
+	return NULL;
+
+    /* tail is the last message; put the stub behind it */
+    mx_handoff_push(mhqp, &mhqp->mhq_stub);
+
+    next = __atomic_load_n(&tail->mho_next, __ATOMIC_ACQUIRE);
+    if (next) {
+	mhqp->mhq_tail = next;
+	return tail;
+    }
+
+    return NULL;
+}
+
+static mx_handoff_t *
+mx_handoff_create (unsigned type, unsigned wsid, mx_muxid_t muxid,
+		   mx_buffer_t *mbp)
+{
+    mx_handoff_t *mhop = calloc(1, sizeof(*mhop));
+
+    if (mhop == NULL) {
+	mx_log("worker: cannot allocate handoff (type %u, W%u)", type, wsid);
+	if (mbp)
+	    mx_buffer_free(mbp);
+	return NULL;
+    }
+
+    mhop->mho_type = type;
+    mhop->mho_wsid = wsid;
+    mhop->mho_muxid = muxid;
+    mhop->mho_worker = mx_worker_index;
+    mhop->mho_buffer = mbp;
+
+    return mhop;
+}
+
+/*
+ * Hand a message to a worker, or to all workers if worker is -1.
+ * The buffer (which must be NULL for broadcasts) becomes theirs.
+ */
+void
+mx_worker_handoff (int worker, unsigned type, unsigned wsid,
+		   mx_buffer_t *mbp)
+{
+    mx_handoff_t *mhop;
+    int i;
+
+    for (i = 0; i < mx_worker_count; i++) {
+	if (worker >= 0 && worker != i)
+	    continue;
+
+	mhop = mx_handoff_create(type, wsid, 0, mbp);
+	if (mhop)
+	    mx_handoff_send(&mx_workers[i].mw_queue, mhop);
+    }
+}
+
+/*
+ * Hand a message back to the main thread.  The buffer becomes theirs.
+ */
+void
+mx_worker_reply (unsigned type, unsigned wsid, mx_muxid_t muxid,
+		 mx_buffer_t *mbp)
+{
+    mx_handoff_t *mhop = mx_handoff_create(type, wsid, muxid, mbp);
+
+    if (mhop)
+	mx_handoff_send(&mx_worker_main_queue, mhop);
+}
+
+int
+mx_worker_self (void)
+{
+    return mx_worker_index;
+}
+
+/*
+ * Pick the worker that owns a target, or -1 if the main thread
+ * should handle it.  A target always lands on the same worker, so
+ * its sessions can be shared by every request for it.
+ */
+int
+mx_worker_route (const char *target)
+{
+    unsigned hash = 2166136261U; /* FNV-1a */
+    const unsigned char *cp;
+
+    if (mx_worker_count == 0 || target == NULL)
+	return -1;
+
+    for (cp = (const unsigned char *) target; *cp; cp++) {
+	hash ^= *cp;
+	hash *= 16777619U;
+    }
+
+    return hash % mx_worker_count;
+}
+
+static void
+mx_handoff_dispatch (mx_handoff_t *mhop)
+{
+    switch (mhop->mho_type) {
+    case MHO_FRAME:
+	mx_websocket_proxy_input(mhop->mho_wsid, mhop->mho_buffer);
+	break;
+
+    case MHO_CLOSE:
+	mx_websocket_proxy_close(mhop->mho_wsid);
+	break;
+
+    case MHO_OUTPUT:
+	mx_websocket_proxy_output(mhop->mho_wsid, mhop->mho_muxid,
+				  mhop->mho_worker, mhop->mho_buffer);
+	break;
+
+    case MHO_COMPLETE:
+	mx_websocket_proxy_complete(mhop->mho_wsid, mhop->mho_muxid);
+	break;
+
+    case MHO_DEFLATE:
+	mx_websocket_proxy_deflate(mhop->mho_wsid);
+	break;
+
+    case MHO_BLOCK:
+    case MHO_UNBLOCK:
+	mx_websocket_proxy_block(mhop->mho_wsid,
+				 (mhop->mho_type == MHO_BLOCK));
+	break;
+
+    default:
+	mx_log("worker: unknown handoff type %u", mhop->mho_type);
+	if (mhop->mho_buffer)
+	    mx_buffer_free(mhop->mho_buffer);
+    }
+}
+
+static mx_sock_t *
+mx_handoff_sock (mx_handoff_queue_t *mhqp)
+{
+    mx_sock_handoff_t *mshp = calloc(1, sizeof(*mshp));
+
+    if (mshp == NULL)
+	return NULL;
+
+    mshp->msh_base.ms_id = mx_next_id(mx_sock_id);
+    mshp->msh_base.ms_type = MST_HANDOFF;
+    mshp->msh_base.ms_sock = mhqp->mhq_rfd;
+    mshp->msh_queue = mhqp;
+
+    TAILQ_INSERT_HEAD(&mx_sock_list, &mshp->msh_base, ms_link);
+    mx_sock_count += 1;
+
+    MX_LOG("%s new %s, fd %u", mx_sock_title(&mshp->msh_base),
+	   mx_sock_type(&mshp->msh_base), mshp->msh_base.ms_sock);
+
+    return &mshp->msh_base;
+}
+
+static int
+mx_handoff_prep (MX_TYPE_PREP_ARGS)
+{
+    pollp->fd = msp->ms_sock;
+    pollp->events = POLLIN;
+
+    return TRUE;
+}
+
+static int
+mx_handoff_poller (MX_TYPE_POLLER_ARGS)
+{
+    mx_sock_handoff_t *mshp = mx_sock(msp, MST_HANDOFF);
+    mx_handoff_queue_t *mhqp = mshp->msh_queue;
+    mx_handoff_t *mhop;
+    char buf[BUFSIZ];
+
+    if (pollp == NULL || !(pollp->revents & POLLIN))
+	return FALSE;
+
+    while (read(msp->ms_sock, buf, sizeof(buf)) > 0)
+	continue;
+
+    /* Clear before popping, so later pushes will wake us again */
+    __atomic_exchange_n(&mhqp->mhq_signalled, 0, __ATOMIC_SEQ_CST);
+
+    while ((mhop = mx_handoff_pop(mhqp)) != NULL) {
+	__atomic_add_fetch(&mhqp->mhq_popped, 1, __ATOMIC_RELAXED);
+	mx_handoff_dispatch(mhop);
+	free(mhop);
+    }
+
+    return FALSE;
+}
+
+static void
+mx_handoff_close (MX_TYPE_CLOSE_ARGS)
+{
+    /*
+     * Producers may still write to the pipe, so we leave the write
+     * end (and the queue) alone.
+     */
+    close(msp->ms_sock);
+    msp->ms_sock = -1;
+}
+
+static void
+mx_handoff_print (MX_TYPE_PRINT_ARGS)
+{
+    mx_sock_handoff_t *mshp = mx_sock(msp, MST_HANDOFF);
+
+    mx_log("%*s%shandoff queue: pushed %lu, popped %lu", indent, "", prefix,
+	   __atomic_load_n(&mshp->msh_queue->mhq_pushed, __ATOMIC_RELAXED),
+	   mshp->msh_queue->mhq_popped);
+}
+
+static void *
+mx_worker_main (void *arg)
+{
+    mx_worker_t *mwp = arg;
+
+    mx_worker_index = mwp->mw_index;
+    TAILQ_INIT(&mx_sock_list);
+    mx_request_init();
+
+    if (!mx_event_init(mwp->mw_backend)) {
+	mx_log("worker %d: event backend initialization failed",
+	       mwp->mw_index);
+	return NULL;
+    }
+
+    if (mx_handoff_sock(&mwp->mw_queue) == NULL) {
+	mx_log("worker %d: cannot create handoff socket", mwp->mw_index);
+	mx_event_cleanup();
+	return NULL;
+    }
+
+    mx_log("worker %d: running", mwp->mw_index);
+
+    mx_main_loop();
+
+    mx_event_cleanup();
+    mx_log("worker %d: exiting", mwp->mw_index);
+
+    return NULL;
+}
+
+/*
+ * Start the worker threads.  Called from the main thread, once the
+ * rest of the world is initialized.
+ */
+int
+mx_worker_start (int count, const char *backend)
+{
+    sigset_t all, old;
+    int i, rc = TRUE;
+
+    if (!mx_handoff_queue_init(&mx_worker_main_queue)
+	    || mx_handoff_sock(&mx_worker_main_queue) == NULL)
+	return FALSE;
+
+    mx_workers = calloc(count, sizeof(*mx_workers));
+    if (mx_workers == NULL)
+	return FALSE;
+
+    /* Workers shouldn't see our signals */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    for (i = 0; i < count; i++) {
+	mx_worker_t *mwp = &mx_workers[i];
+
+	mwp->mw_index = i;
+	mwp->mw_backend = backend;
+
+	if (!mx_handoff_queue_init(&mwp->mw_queue)) {
+	    rc = FALSE;
+	    break;
+	}
+
+	if (pthread_create(&mwp->mw_thread, NULL, mx_worker_main, mwp) != 0) {
+	    mx_log("worker %d: pthread_create: %s", i, strerror(errno));
+	    rc = FALSE;
+	    break;
+	}
+
+	pthread_detach(mwp->mw_thread);
+	mx_worker_count += 1;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    mx_log("worker: %d worker thread%s started", mx_worker_count,
+	   (mx_worker_count == 1) ? "" : "s");
+
+    return rc;
+}
+
+void
+mx_worker_print (int indent, const char *prefix)
+{
+    int i;
+
+    if (mx_worker_count == 0)
+	return;
+
+    mx_log("%*s%sworkers: %d, main queue: pushed %lu, popped %lu",
+	   indent, "", prefix, mx_worker_count,
+	   __atomic_load_n(&mx_worker_main_queue.mhq_pushed,
+			   __ATOMIC_RELAXED),
+	   mx_worker_main_queue.mhq_popped);
+
+    for (i = 0; i < mx_worker_count; i++) {
+	mx_handoff_queue_t *mhqp = &mx_workers[i].mw_queue;
+
+	mx_log("%*s%sworker %d: pushed %lu, popped %lu",
+	       indent + INDENT, "", prefix, i,
+	       __atomic_load_n(&mhqp->mhq_pushed, __ATOMIC_RELAXED),
+	       __atomic_load_n(&mhqp->mhq_popped, __ATOMIC_RELAXED));
+    }
+}
+
+void
+mx_worker_init (void)
+{
+    static mx_type_info_t mti = {
+	.mti_type = MST_HANDOFF,
+	.mti_name = "handoff",
+	.mti_letter = "Q",
+	.mti_print = mx_handoff_print,
+	.mti_prep = mx_handoff_prep,
+	.mti_poller = mx_handoff_poller,
+	.mti_close = mx_handoff_close,
+    };
+
+    mx_type_info_register(MX_TYPE_INFO_VERSION, &mti);
+}
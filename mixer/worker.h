@@ -0,0 +1,33 @@
+/*
+ * $Id$
+ *
+ * Copyright (c) 2013, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ */
+
+int
+mx_worker_start (int count, const char *backend);
+
+int
+mx_worker_self (void);
+
+int
+mx_worker_route (const char *target);
+
+void
+mx_worker_handoff (int worker, unsigned type, unsigned wsid,
+		   mx_buffer_t *mbp);
+
+void
+mx_worker_reply (unsigned type, unsigned wsid, mx_muxid_t muxid,
+		 mx_buffer_t *mbp);
+
+void
+mx_worker_print (int indent, const char *prefix);
+
+void
+mx_worker_init (void);
@@ -291,6 +291,7 @@ jQuery(function ($) {
 
         muxer = $.Muxer({
             url: $.clira.prefs.mixer,
+            token: $.clira.prefs.mixer_token,
             onopen: function (event) {
                 $.dbgpr("clira: WebSocket has opened");
             },
@@ -17,6 +17,7 @@ jQuery(function ($) {
     var MX_HEADER_SIZE1 = 32;
     var MX_DUMP_SIZE = 200;
     var MX_HEADER_FIELD = 8;
+    var MX_ATTR_DEFLATE = 'encoding="deflate"';
 
     function pad (val, width, lfill, rfill) {
         var str = '' + val;
@@ -51,10 +52,19 @@ jQuery(function ($) {
         muxer.opening = true;
         muxer.opened = false;
 
-        muxer.ws = new WebSocket(muxer.url);
+        // A mixer we talk to directly (--port) wants its token, and
+        // sends binary frames
+        var url = muxer.url;
+        if (muxer.token)
+            url += (url.indexOf("?") < 0 ? "?" : "&")
+                + "token=" + encodeURIComponent(muxer.token);
+
+        muxer.ws = new WebSocket(url);
+        muxer.ws.binaryType = "arraybuffer";
         muxer.ws.onopen = function (event) {
             $.dbgpr("muxer: WebSocket is now open");
             muxer.opened = true;
+            muxer.decoder = new TextDecoder();
             
             if (muxer.pendingMessages) {
                 $.dbgpr("muxer: sending pending messages ("
@@ -76,20 +86,24 @@ jQuery(function ($) {
         }
 
         muxer.ws.onmessage = function (event) {
+            var data = event.data;
+            if (typeof data !== "string")
+                data = muxer.decoder.decode(data, { stream: true });
+
             $.dbgpr("muxer: ws.onmessage (" + muxer.reading
-                    + ") [" + event.data.length + "] ["
-                    + escape(event.data.substring(1, MX_HEADER_SIZE1)) + "]");
+                    + ") [" + data.length + "] ["
+                    + escape(data.substring(1, MX_HEADER_SIZE1)) + "]");
 
             if (muxer.reading > 0) {
-                muxer.data += event.data;
-                muxer.reading -= event.data.length;
+                muxer.data += data;
+                muxer.reading -= data.length;
                 if (muxer.reading > 0) {
                     $.dbgpr("muxer: still reading: " + muxer.reading);
                     return;
                 }
                 $.dbgpr("muxer: done reading");
             } else {
-                muxer.data = event.data;
+                muxer.data = data;
             }
 
             muxer.onmessage();
@@ -103,7 +117,11 @@ jQuery(function ($) {
         // Now that the WebSocket connection to mixer is set up, send over a
         // authinit message to let mixer know to use this connection for
         // future auth requests
-        muxer.sendMessage(makeMessage("authinit", this.authmuxid));
+        // We also ask for compressed replies, if we can inflate them
+        var attrs = undefined;
+        if (muxer.compress !== false && window.DecompressionStream)
+            attrs = "compress=\"deflate\"";
+        muxer.sendMessage(makeMessage("authinit", this.authmuxid, attrs));
         $.dbgpr("muxer: auth muxid for this Muxer is " + this.authmuxid);
         muxer.muxMap[this.authmuxid] = {
             muxid: this.authmuxid,
@@ -216,10 +234,17 @@ jQuery(function ($) {
             var mux = this.muxMap[muxid];
             if (mux) {
                 var tag = "on" + op;
-                if (mux[tag]) {
-                    mux[tag].call(mux, rest, attr);
-                } else {
+                var handler = mux[tag];
+                if (op == "reply" && attr.indexOf(MX_ATTR_DEFLATE) >= 0) {
+                    inflateReply(mux, rest);
+                } else if (handler == undefined) {
                     $.dbgpr("muxer: unhandled message: [" + tag + "]");
+                } else if (mux.inflater
+                           && (op == "complete" || op == "error")) {
+                    // Hold these until the compressed reply is delivered
+                    inflateEnd(mux, handler.bind(mux, rest, attr));
+                } else {
+                    handler.call(mux, rest, attr);
                 }
 
                 // "complete" is the last state, so we release the rpc
@@ -239,6 +264,60 @@ jQuery(function ($) {
     }
 
 
+    //
+    // Compressed replies (see mixer/deflate.c) are deflated and base64
+    // encoded, with one zlib stream per reply.  We inflate them in
+    // order, handing the text to onreply as it comes out.
+    //
+    function inflateStart (mux) {
+        var stream = new DecompressionStream("deflate");
+        var reader = stream.readable.getReader();
+        var decoder = new TextDecoder();
+        var inflater = { writer: stream.writable.getWriter() };
+
+        function pump () {
+            return reader.read().then(function (res) {
+                var text = res.done ? decoder.decode()
+                    : decoder.decode(res.value, { stream: true });
+                if (text.length && mux.onreply)
+                    mux.onreply.call(mux, text, "");
+                if (!res.done)
+                    return pump();
+            });
+        }
+
+        inflater.done = pump();
+        mux.inflater = inflater;
+        return inflater;
+    }
+
+    function inflateReply (mux, data) {
+        var inflater = mux.inflater || inflateStart(mux);
+        var bin = atob(data);
+        var bytes = new Uint8Array(bin.length);
+
+        for (var i = 0; i < bin.length; i++)
+            bytes[i] = bin.charCodeAt(i);
+
+        inflater.writer.write(bytes).catch(function (err) {
+            $.dbgpr("muxer: inflate failed: " + err);
+        });
+    }
+
+    //
+    // Call func once the compressed reply has all been delivered
+    //
+    function inflateEnd (mux, func) {
+        var inflater = mux.inflater;
+
+        mux.inflater = undefined;
+        inflater.writer.close().catch(function () { });
+        inflater.done.then(func, function (err) {
+            $.dbgpr("muxer: inflate failed: " + err);
+            func();
+        });
+    }
+
     function makeMessage (op, muxid, attrs, payload) {
         if (attrs == undefined)
             attrs = "";
@@ -280,6 +359,8 @@ jQuery(function ($) {
             payload = "<command>" + options.command + "</command>";
         if (options.create == "no")
             attrs += " create=\"no\"";
+        if (options.priority == "bulk")
+            attrs += " priority=\"bulk\"";
         if (muxer.authmuxid) {
             attrs += " authmuxid=\"" + this.authmuxid + "\"";
         }
@@ -384,6 +465,18 @@ jQuery(function ($) {
     	this.sendMessage(makeMessage("data", muxid, "", message));
     }
 
+    //
+    // Cancel an RPC.  The mixer stops the device from sending the
+    // rest of the reply; anything already on its way is ignored.
+    //
+    function muxerCancel (options) {
+        if (options.muxid == undefined || this.muxMap[options.muxid] == undefined)
+            return;
+
+        this.muxMap[options.muxid] = undefined;
+        this.sendMessage(makeMessage("cancel", options.muxid));
+    }
+
     function muxerSendMessage (message) {
         $.dbgpr("wssend: " + message.length
                 + ":: " + message.substring(0, message.length));
@@ -435,7 +528,8 @@ jQuery(function ($) {
     // methods include:
     // - rpc: invoke an rpc, handle data as it comes back
     // options include:
-    // 
+    // - compress: false to turn off compressed replies
+    // - token: the mixer's --port token, passed as "?token=" on the url
     //
     var MuxerOptions = { }
     function Muxer (options) {
@@ -450,6 +544,7 @@ jQuery(function ($) {
 
     $.extend(Muxer.prototype, {
         rpc: muxerRpc,
+        cancel: muxerCancel,
         slax: muxerSlax,
         open: muxerOpen,
         close:  muxerClose,
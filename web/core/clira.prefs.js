@@ -81,6 +81,15 @@ jQuery(function ($) {
             title: "Mixer Location11",
             change: $.clira.prefsChangeMuxer
         },
+        {
+            name: "mixer_token",
+            def: "",
+            type: "string",
+            label: "Token for a mixer run with --port "
+                + "(the mixer.USER.token file in its dot-dir)",
+            title: "Mixer Token",
+            change: $.clira.prefsChangeMuxer
+        },
     ];
 
     var prefs_options = {